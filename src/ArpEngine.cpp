@@ -2,143 +2,512 @@
 #include "MIDI.h"
 #include "ArpEngine.h"
 
+#define ARP_TEMPLATE template <class MidiInPort, class MidiOutPort, class SyncPort, class DebugPort>
+#define ARP_ENGINE BasicArpEngine<MidiInPort, MidiOutPort, SyncPort, DebugPort>
 
-ArpEngine::ArpEngine(
-  HardwareSerial* midiPort,
-  HardwareSerial* syncPort,
-  HardwareSerial* debugPort)
+
+ARP_TEMPLATE ARP_ENGINE::BasicArpEngine(
+  MidiInPort* midiInPort,
+  MidiOutPort* midiOutPort,
+  SyncPort* syncPort,
+  DebugPort* debugPort)
 {
-  _midiPort = midiPort;
+  _midiInPort = midiInPort;
+  _midiOutPort = midiOutPort;
   _syncPort = syncPort;
   _debugPort = debugPort;
   _now = millis(); // initial value, then supplied through run()
+  for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+    _lanes[channel].channel = channel;
+  }
+  UpdateVelocity(_configs[0]);
+  for (int i = 1; i < CONFIG_COPIES; i++) _configs[i] = _configs[0];
 }
 
 
 ///////// NOTE DATA LIST PROCESSING
 
-void ArpEngine::FillGap(byte index, byte* list) {
-  for (byte p = index; p < _noteCount-1; p++) {
+ARP_TEMPLATE void ARP_ENGINE::FillGap(Lane& lane, byte index, byte* list) {
+  for (byte p = index; p < lane.noteCount-1; p++) {
     list[p] = list[p+1];
   }
 }
 
-void ArpEngine::MakeGap(byte index, byte* list) {
-  for (byte p = _noteCount; p > index; p--) {
+ARP_TEMPLATE void ARP_ENGINE::MakeGap(Lane& lane, byte index, byte* list) {
+  for (byte p = lane.noteCount; p > index; p--) {
     list[p] = list[p-1];
   }
 }
 
 // returns MAX_NOTES if not found
-byte ArpEngine::FindInList(byte value, byte* list) {
-  byte i = 0;
-  while (i < MAX_NOTES && list[i] != value) i++;
-  return i;
+// (only searches the part of the list in use)
+ARP_TEMPLATE byte ARP_ENGINE::FindInList(Lane& lane, byte value, byte* list) {
+  for (byte i = 0; i < lane.noteCount; i++) {
+    if (list[i] == value) return i;
+  }
+  return MAX_NOTES;
 }
 
 // Adds the specified note+vel to the list of notes
 // currently playing and updates noteCount
-void ArpEngine::AddNote(byte noteNumber, byte noteVelocity)
+ARP_TEMPLATE void ARP_ENGINE::AddNote(Lane& lane, byte noteNumber, byte noteVelocity)
 {
   Print("AddNote: "); Print(noteNumber); Print(", "); PrintLn(noteVelocity);
 
-  if (_noteCount == MAX_NOTES) return; // list is full
+  if (lane.noteCount == MAX_NOTES) return; // list is full
     
   // Insert in sorted list (also checks that it
   // doesn't already exist; possible if hold enabled)
   byte index = 0;
-  while (index < _noteCount && _noteNumbersSorted[index] < noteNumber) index++;
-  if (index < _noteCount && _noteNumbersSorted[index] == noteNumber)
+  while (index < lane.noteCount && lane.noteNumbersSorted[index] < noteNumber) index++;
+  if (index < lane.noteCount && lane.noteNumbersSorted[index] == noteNumber)
   {
     PrintLn("  already in list:");
-    PrintNoteList();
+    PrintNoteList(lane);
     return; // already in list
   }
    
+  // Keep the arpeggio's position on the same note (the new
+  // note is then played when the arpeggio gets to it)
+  if (lane.noteCount > 0) {
+    if (index <= lane.currentNoteIndex) lane.currentNoteIndex++;
+    if (index <= lane.lastNoteIndex) lane.lastNoteIndex++;
+  }
+
   // Insert in sorted list
-  MakeGap(index, _noteNumbersSorted);
-  MakeGap(index, _noteVelocitiesSorted);
-  _noteNumbersSorted[index] = noteNumber;
-  _noteVelocitiesSorted[index] = noteVelocity;
+  MakeGap(lane, index, lane.noteNumbersSorted);
+  MakeGap(lane, index, lane.noteVelocitiesSorted);
+  lane.noteNumbersSorted[index] = noteNumber;
+  lane.noteVelocitiesSorted[index] = noteVelocity;
   
   // Insert in ordered list
-  _noteNumbers[_noteCount] = noteNumber;
-  _noteVelocities[_noteCount] = noteVelocity;
+  lane.noteNumbers[lane.noteCount] = noteNumber;
+  lane.noteVelocities[lane.noteCount] = noteVelocity;
 
-  _noteCount++;
-  PrintNoteList();
+  lane.noteCount++;
+  PrintNoteList(lane);
 }
 
 // Removes the specified note from the list of notes
 // currently playing and updates noteCount
-void ArpEngine::RemoveNote(byte noteNumber)
+ARP_TEMPLATE void ARP_ENGINE::RemoveNote(Lane& lane, byte noteNumber)
 {
   Print("RemoveNote: "); PrintLn(noteNumber);
-  if (_noteCount == 0) return; // nothing to remove
+  if (lane.noteCount == 0) return; // nothing to remove
  
   // Remove from ordered list
-  byte index = FindInList(noteNumber, _noteNumbers);
-  if (index < MAX_NOTES) {
-    FillGap(index, _noteNumbers);
-    FillGap(index, _noteVelocities);
-  }
+  byte index = FindInList(lane, noteNumber, lane.noteNumbers);
+  if (index == MAX_NOTES) return; // not in list (e.g. stray note-off)
+  FillGap(lane, index, lane.noteNumbers);
+  FillGap(lane, index, lane.noteVelocities);
   
   // Remove from sorted list
-  index = FindInList(noteNumber, _noteNumbersSorted);
+  index = FindInList(lane, noteNumber, lane.noteNumbersSorted);
   if (index < MAX_NOTES) {
-    FillGap(index, _noteNumbersSorted);
-    FillGap(index, _noteVelocitiesSorted);
+    FillGap(lane, index, lane.noteNumbersSorted);
+    FillGap(lane, index, lane.noteVelocitiesSorted);
+
+    // Keep the arpeggio's position. If the current note itself
+    // is removed, the position moves to just before the note that
+    // would have been next (in the current direction), so that
+    // the next step plays that note.
+    const LaneConfig& laneConfig = ConfigOf(lane).lanes[lane.channel];
+    bool goingUp = laneConfig.mode == MODE_UP ||
+      (laneConfig.mode == MODE_UP_DOWN && lane.currentDirection == DIR_UP);
+    if (index < lane.currentNoteIndex || (index == lane.currentNoteIndex && goingUp)) {
+      lane.currentNoteIndex--;
+    }
+    if (index < lane.lastNoteIndex) lane.lastNoteIndex--;
   }  
   
-  _noteCount--;
-  PrintNoteList();
+  lane.noteCount--;
+  PrintNoteList(lane);
 }
 
 
 
 ///////// MIDI OUTPUT
 
-// TODO: Use running status when sending
+ARP_TEMPLATE void ARP_ENGINE::WriteMidiOut(byte data) {
+  if (data & MidiStatusByteMask) {
+    if (data < MidiStartOfExclusive) {
+      // channel message
+      if (_runningStatus && data == _midiOutStatus) return;
+      _midiOutStatus = data;
+    }
+    else if (data < MidiTimingClock) {
+      _midiOutStatus = 0; // (system common and exclusive cancel running status)
+    }
+  }
+  if (_capture != NULL) {
+    _capture->record(MidiCapture::SOURCE_MIDI_OUT, data, _now);
+    _runActive = true;
+  }
+  if (!_midiOutBatch) {
+    _midiOutPort->MidiOutPort::write(data);
+    return;
+  }
+  if (_midiOutLength == MIDI_OUT_BUFFER_SIZE) FlushMidiOut();
+  _midiOutBuffer[_midiOutLength++] = data;
+}
+
+// Called at the end of each message (event) sent
+ARP_TEMPLATE void ARP_ENGINE::EndMidiOut() {
+  if (_midiOutBatch) _midiOutEnded = true;
+  else if (onMidiOut != NULL) onMidiOut();
+}
+
+// Writes the output collected so far
+ARP_TEMPLATE void ARP_ENGINE::FlushMidiOut() {
+  if (_midiOutLength > 0) {
+    _midiOutPort->MidiOutPort::write(_midiOutBuffer, _midiOutLength);
+    _midiOutLength = 0;
+  }
+}
+
+// Our own messages can't be sent in the middle of a SysEx message
+// that's being passed through. If that happens, the SysEx is ended
+// early (and the rest of it is dropped).
+ARP_TEMPLATE void ARP_ENGINE::InterruptSysEx() {
+  if (_midiState == MIDI_IN_SYSEX && _sysExForward && !_sysExInterrupted) {
+    WriteMidiOut(MidiEndOfExclusive);
+    _sysExInterrupted = true;
+  }
+}
 
-void ArpEngine::SendNoteOn(byte noteNumber, byte noteVelocity) {
-  _midiPort->write(0x90 + _midiChannel);
-  _midiPort->write(noteNumber);
-  _midiPort->write(noteVelocity);
+ARP_TEMPLATE void ARP_ENGINE::SendNoteOn(byte channel, byte noteNumber, byte noteVelocity) {
+  InterruptSysEx();
+  WriteMidiOut(0x90 + channel);
+  WriteMidiOut(noteNumber);
+  WriteMidiOut(noteVelocity);
+  SetSounding(channel, noteNumber, true);
   //Print("SendNoteOn: "); PrintLn(noteNumber);
-  if (onMidiOut != NULL) onMidiOut();
+  EndMidiOut();
 }
 
-void ArpEngine::SendNoteOff(byte noteNumber) {
-  _midiPort->write(0x90 + _midiChannel);
-  _midiPort->write(noteNumber);
-  _midiPort->write((uint8_t)0); // velocity 0 = note off
+ARP_TEMPLATE void ARP_ENGINE::SendNoteOff(byte channel, byte noteNumber) {
+  InterruptSysEx();
+  WriteMidiOut(0x90 + channel);
+  WriteMidiOut(noteNumber);
+  WriteMidiOut((uint8_t)0); // velocity 0 = note off
+  SetSounding(channel, noteNumber, false);
   //Print("SendNoteOff: "); PrintLn(noteNumber);
-  if (onMidiOut != NULL) onMidiOut();
+  EndMidiOut();
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SendControlChange(byte channel, byte controller, byte value) {
+  InterruptSysEx();
+  WriteMidiOut(MidiStatusControlChange + channel);
+  WriteMidiOut(controller);
+  WriteMidiOut(value);
+  EndMidiOut();
+}
+
+ARP_TEMPLATE void ARP_ENGINE::ForwardMidiData(byte data) {
+  WriteMidiOut(data);
+  EndMidiOut();
+}
+
+ARP_TEMPLATE void ARP_ENGINE::ForwardMidiData2Byte() {
+  WriteMidiOut(_midiStatus + _midiChannel);
+  WriteMidiOut(_midiData1);
+  EndMidiOut();
+}
+
+ARP_TEMPLATE void ARP_ENGINE::ForwardMidiData3Byte() {
+  WriteMidiOut(_midiStatus + _midiChannel);
+  WriteMidiOut(_midiData1);
+  WriteMidiOut(_midiData2);
+  EndMidiOut();
+}
+
+
+
+///////// ACTIVE NOTE TRACKING
+
+// Every note sent (or passed through) is tracked until its note-off,
+// so notes can always be ended, whatever happened in between.
+
+ARP_TEMPLATE void ARP_ENGINE::SetSounding(byte channel, byte noteNumber, bool sounding) {
+  uint32_t mask = (uint32_t)1 << (noteNumber & 31);
+  if (sounding) _soundingNotes[channel][noteNumber >> 5] |= mask;
+  else _soundingNotes[channel][noteNumber >> 5] &= ~mask;
+}
+
+ARP_TEMPLATE bool ARP_ENGINE::IsSounding(byte channel, byte noteNumber) {
+  return _soundingNotes[channel][noteNumber >> 5] & ((uint32_t)1 << (noteNumber & 31));
+}
+
+// Sends note-off for all notes sounding on the specified channel
+// (and drops its queued ratchet repeats)
+ARP_TEMPLATE void ARP_ENGINE::ReleaseChannel(byte channel) {
+  _events.cancel(channel);
+  for (byte word = 0; word < 4; word++) {
+    while (_soundingNotes[channel][word] != 0) {
+      byte noteNumber = (word << 5) + __builtin_ctz(_soundingNotes[channel][word]);
+      SendNoteOff(channel, noteNumber); // (also clears the bit)
+    }
+  }
+}
+
+
+
+///////// SYSEX CONFIGURATION
+
+// SysEx data byte. The header (manufacturer and device ID) is held
+// back until it's known whether the message is ours: if not, it's
+// passed through from there on, and if so, the rest is collected
+// for HandleSysExMessage.
+ARP_TEMPLATE void ARP_ENGINE::HandleSysExData(byte data) {
+  if (!_sysExForward && _sysExLength < SYSEX_HEADER_LENGTH) {
+    byte expected = _sysExLength == 0 ? SYSEX_MANUFACTURER_ID : SYSEX_DEVICE_ID;
+    if (data != expected) PassSysExThrough();
+  }
+  if (_sysExForward) {
+    if (!_sysExInterrupted) ForwardMidiData(data);
+    return;
+  }
+  int index = _sysExLength - SYSEX_HEADER_LENGTH;
+  if (index >= 0 && index < SYSEX_DATA_SIZE) _sysExData[index] = data;
+  if (_sysExLength < 0xff) _sysExLength++; // (anything that long isn't valid anyway)
+}
+
+// End of SysEx (complete: ended by EOX, rather than cut short
+// by another status byte)
+ARP_TEMPLATE void ARP_ENGINE::EndSysEx(bool complete) {
+  if (!_sysExForward && _sysExLength < SYSEX_HEADER_LENGTH) {
+    PassSysExThrough(); // (too short to be ours)
+  }
+  if (_sysExForward) {
+    if (!_sysExInterrupted) ForwardMidiData(MidiEndOfExclusive);
+  }
+  else if (complete) HandleSysExMessage();
 }
 
-void ArpEngine::ForwardMidiData(byte data) {
-  _midiPort->write(data);
-  if (onMidiOut != NULL) onMidiOut();
+// Passes the SysEx through, starting with what was held back
+ARP_TEMPLATE void ARP_ENGINE::PassSysExThrough() {
+  _sysExForward = true;
+  ForwardMidiData(MidiStartOfExclusive);
+  if (_sysExLength > 0) ForwardMidiData(SYSEX_MANUFACTURER_ID);
+  if (_sysExLength > 1) ForwardMidiData(SYSEX_DEVICE_ID);
 }
 
-void ArpEngine::ForwardMidiData2Byte() {
-  _midiPort->write(_midiStatus + _midiChannel);
-  _midiPort->write(_midiData1);
-  if (onMidiOut != NULL) onMidiOut();
+ARP_TEMPLATE void ARP_ENGINE::HandleSysExMessage() {
+  int length = _sysExLength - SYSEX_HEADER_LENGTH - 1; // (after the command)
+  if (length < 0 || length >= SYSEX_DATA_SIZE) return;
+  byte command = _sysExData[0];
+  byte* data = _sysExData + 1;
+
+  // Checksum: data bytes (including the checksum) add up to 0 (7-bit)
+  byte sum = 0;
+  for (int i = 0; i < length; i++) sum += data[i];
+  bool sumOk = (sum & 0x7f) == 0;
+
+  Parameters parameters;
+  byte encoded[PARAMETER_BYTES];
+  switch (command) {
+    case SYSEX_PARAMETERS:
+      if (length == PARAMETER_BYTES + 1 && sumOk && DecodeParameters(data, parameters)) {
+        QueueParameters(parameters);
+      }
+      break;
+    case SYSEX_REQUEST_PARAMETERS:
+      // (including any not yet applied)
+      if (_parametersPending) parameters = _pendingParameters;
+      else GetParameters(parameters);
+      EncodeParameters(parameters, encoded);
+      SendSysEx(SYSEX_PARAMETERS, -1, encoded);
+      break;
+    case SYSEX_PRESET:
+      if (length == PARAMETER_BYTES + 2 && sumOk && DecodeParameters(data + 1, parameters) &&
+        onStorePreset != NULL) {
+        onStorePreset(data[0], data + 1);
+      }
+      break;
+    case SYSEX_REQUEST_PRESET:
+      if (length == 1 && onLoadPreset != NULL && onLoadPreset(data[0], encoded)) {
+        SendSysEx(SYSEX_PRESET, data[0], encoded);
+      }
+      break;
+    case SYSEX_RECALL_PRESET:
+      if (length == 1 && onLoadPreset != NULL && onLoadPreset(data[0], encoded) &&
+        DecodeParameters(encoded, parameters)) {
+        QueueParameters(parameters);
+      }
+      break;
+    case SYSEX_STORE_PRESET:
+      if (length == 1 && onStorePreset != NULL) {
+        if (_parametersPending) parameters = _pendingParameters;
+        else GetParameters(parameters);
+        EncodeParameters(parameters, encoded);
+        onStorePreset(data[0], encoded);
+      }
+      break;
+    case SYSEX_MAP_CC:
+      if (length == 3) MapCC(data[1], data[2], data[0] == 0x7f ? ALL_CHANNELS : data[0]);
+      break;
+    case SYSEX_LEARN_CC:
+      if (length == 1) LearnCC(data[0]);
+      break;
+    case SYSEX_PATTERN:
+      if (length >= 2 && length == data[1] + 2) {
+        int offset = data[0] == PATTERN_OCTAVE || data[0] == PATTERN_VELOCITY ? 0x40 : 0; // (signed)
+        for (int step = 0; step < data[1]; step++) SetPatternStep(data[0], step, data[2 + step] - offset);
+        SetPatternLength(data[0], data[1]);
+      }
+      break;
+  }
+}
+
+// Sends a parameters (preset < 0) or preset message
+ARP_TEMPLATE void ARP_ENGINE::SendSysEx(byte command, int preset, const byte* parameters) {
+  InterruptSysEx();
+  WriteMidiOut(MidiStartOfExclusive);
+  WriteMidiOut(SYSEX_MANUFACTURER_ID);
+  WriteMidiOut(SYSEX_DEVICE_ID);
+  WriteMidiOut(command);
+  byte sum = 0;
+  if (preset >= 0) {
+    WriteMidiOut(preset);
+    sum += preset;
+  }
+  for (int i = 0; i < PARAMETER_BYTES; i++) {
+    WriteMidiOut(parameters[i]);
+    sum += parameters[i];
+  }
+  WriteMidiOut(-sum & 0x7f);
+  WriteMidiOut(MidiEndOfExclusive);
+  EndMidiOut();
+}
+
+ARP_TEMPLATE void ARP_ENGINE::QueueParameters(const Parameters& parameters) {
+  _pendingParameters = parameters;
+  _parametersPending = true;
+  _parametersReceivedAt = _now;
+  PrintLn("SysEx: parameters received");
 }
 
-void ArpEngine::ForwardMidiData3Byte() {
-  _midiPort->write(_midiStatus + _midiChannel);
-  _midiPort->write(_midiData1);
-  _midiPort->write(_midiData2);
-  if (onMidiOut != NULL) onMidiOut();
+// Parameters are applied together, when the next step of a lane
+// playing one is due (just before it's played), or right away if
+// none is: all of them at the step boundary, including the sync, hold
+// and enabled modes (which other settings changes don't wait for)
+ARP_TEMPLATE bool ARP_ENGINE::ParametersDue() {
+  bool playing = false;
+  for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+    Lane& lane = _lanes[channel];
+    if (!InStep(lane)) continue;
+    playing = true;
+    if (_midiSync ? _tick >= lane.nextOnEventAtTick : _now >= lane.nextOnEventAt) return true;
+  }
+  return !playing;
+}
+
+ARP_TEMPLATE void ARP_ENGINE::ApplyPendingParameters() {
+  _parametersPending = false;
+  SetParameters(_pendingParameters);
+  Print("SysEx: parameters applied after ");
+  Print(_now - _parametersReceivedAt);
+  PrintLn(" ms");
+  if (onParameters != NULL) onParameters();
+}
+
+
+
+///////// ARPEGGIO SETTINGS
+
+// Settings are changed in the shadow config (a setter makes a
+// change, and posts it with ConfigChanged)
+ARP_TEMPLATE typename ARP_ENGINE::Config& ARP_ENGINE::ShadowConfig() {
+  return *_shadow;
+}
+
+ARP_TEMPLATE void ARP_ENGINE::ConfigChanged() {
+  // (the count is only stored here, by the setters: no read-modify-write needed)
+  uint32_t count = _postedCount.load(std::memory_order_relaxed);
+  _postedCount.store(count + 1, std::memory_order_relaxed); // (odd: being copied)
+  std::atomic_thread_fence(std::memory_order_release); // (odd before any of the copy)
+  CopyConfig(_posted, _shadow);
+  _postedCount.store(count + 2, std::memory_order_release); // (even: complete)
+  if (_configUpdate == CONFIG_IMMEDIATE) PublishConfig(true);
+}
+
+// true if a change has been posted but not yet published
+ARP_TEMPLATE bool ARP_ENGINE::ConfigPending() {
+  return _postedCount.load(std::memory_order_relaxed) != _publishedCount;
+}
+
+// Copies a config a word at a time, with (relaxed) atomic loads and
+// stores, as it may be copied to and from on two cores at once
+ARP_TEMPLATE void ARP_ENGINE::CopyConfig(Config* to, const Config* from) {
+  typedef uint32_t __attribute__((may_alias)) Word;
+  static_assert(sizeof(Config) % sizeof(Word) == 0, "Config isn't a whole number of words");
+  const Word* source = (const Word*)from;
+  Word* target = (Word*)to;
+  for (unsigned int i = 0; i < sizeof(Config) / sizeof(Word); i++) {
+    __atomic_store_n(&target[i], __atomic_load_n(&source[i], __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+  }
+}
+
+// The latest (posted) value of a setting, e.g. to change the one it's
+// set together with (from Run(): a setter may be posting meanwhile)
+ARP_TEMPLATE template <class T> T ARP_ENGINE::LatestSetting(T Config::* setting) {
+  return __atomic_load_n(&(_posted->*setting), __ATOMIC_RELAXED);
+}
+
+// Makes a copy of the shadow config the active one. Lanes in a step
+// keep the settings they started it with, and take these up at their
+// next step (all lanes do right away if allLanes, e.g. when the
+// arpeggios start over). Returns false if the changes have to wait:
+// for a setter still making one, or for a lane still in a step
+// started before the last publish (at most a step).
+ARP_TEMPLATE bool ARP_ENGINE::PublishConfig(bool allLanes) {
+  uint32_t count = _postedCount.load(std::memory_order_acquire);
+  if (count == _publishedCount) return true;
+  if ((count & 1) != 0 || (!allLanes && RetiredConfigInUse())) return false;
+  CopyConfig(_spare, _posted);
+  std::atomic_thread_fence(std::memory_order_acquire); // (the copy before the count, below)
+  if (_postedCount.load(std::memory_order_relaxed) != count) return false; // (changed meanwhile: torn)
+  Config* published = _spare;
+  _spare = _retired;
+  _retired = _config;
+  _config = published;
+  _publishedCount = count;
+  for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+    Lane& lane = _lanes[channel];
+    if (allLanes || !InStep(lane)) lane.config = _config - _configs;
+  }
+  // (clock output follows the step length actually played)
+  if (_clockOut != NULL) _clockOut->setQuarterNoteLength(_config->delayMs * 4 * 1000);
+  return true;
+}
+
+// true if a lane is still in a step started with the settings
+// published before the active ones
+ARP_TEMPLATE bool ARP_ENGINE::RetiredConfigInUse() {
+  for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+    Lane& lane = _lanes[channel];
+    if (InStep(lane) && &_configs[lane.config] == _retired) return true;
+  }
+  return false;
+}
+
+// true if the lane is playing a step (or waiting for its first one),
+// with the settings it started it with
+ARP_TEMPLATE bool ARP_ENGINE::InStep(Lane& lane) {
+  if (!_isEnabled || !IsArpeggiating(lane)) return false;
+  return !_midiSync || _transport == TRANSPORT_RUNNING; // (paused: not)
+}
+
+// The settings the lane's current step is played with
+ARP_TEMPLATE const typename ARP_ENGINE::Config& ARP_ENGINE::ConfigOf(Lane& lane) {
+  return _configs[lane.config];
 }
 
 
 
 ///////// MIDI INPUT
 
-void ArpEngine::HandleNoteOn()
+ARP_TEMPLATE void ARP_ENGINE::HandleNoteOn()
 {
   if (_midiData2 == 0) // actually note off
   {
@@ -146,85 +515,202 @@ void ArpEngine::HandleNoteOn()
     return;
   }
   
-  _keyCount++;
+  Lane& lane = _lanes[_midiChannel];
+  if (lane.keyCount < INT8_MAX) lane.keyCount++;
 
   // special case: first key down cancels a
   // held arpeggio
-  if (_hold && _keyCount == 1) {
-    SendNoteOff(_currentNoteNumber);
-    _noteCount = 0;
+  if (_hold && lane.keyCount == 1) {
+    ReleaseChannel(lane.channel);
+    lane.noteCount = 0;
+    lane.chordPending = false;
   }
 
   int noteNumber = _midiData1;
   int noteVelocity = _midiData2;
-  AddNote(noteNumber, noteVelocity);
+  int previousCount = lane.noteCount;
+  AddNote(lane, noteNumber, noteVelocity);
 
-  if (_isEnabled)
+  if (_isEnabled && _chords)
+  {
+    if (lane.noteCount == 1 && previousCount == 0) {
+      // A single key plays as it is, right away (no arpeggio)
+      ForwardMidiData3Byte();
+      SetSounding(_midiChannel, noteNumber, true);
+      lane.chordAt = _now + _chordWindowMs;
+    }
+    else if (lane.noteCount == 2 && previousCount == 1) {
+      // It's a chord: the keys landing within the window (from its
+      // first key, or from this one if that was held for longer) are
+      // captured with it, then it's arpeggiated (see Run). Only the
+      // first key sounds meanwhile.
+      if ((long)(lane.chordAt - _now) < 0) lane.chordAt = _now + _chordWindowMs;
+      lane.chordPending = true;
+    }
+  }
+  else if (_isEnabled)
   {
-    if (_noteCount == 1) // first note
+    if (lane.noteCount == 1) // first note
     {
-      InitArpeggio();
+      InitArpeggio(lane);
     }
   }
   else
   {
     ForwardMidiData3Byte(); // pass note-on through
+    SetSounding(_midiChannel, noteNumber, true);
   }
-  _maxVelocity = max(noteVelocity, _maxVelocity);  
+  if (noteVelocity > lane.maxVelocity) lane.maxVelocity = noteVelocity;
 }
 
-void ArpEngine::HandleNoteOff()
+ARP_TEMPLATE void ARP_ENGINE::HandleNoteOff()
 {
+  Lane& lane = _lanes[_midiChannel];
   int noteNumber = _midiData1;
+  bool arpeggiating = IsArpeggiating(lane);
+  bool listed = !_isEnabled || !_hold; // (the note list is the keys down)
   
-  if (!_isEnabled || (_isEnabled && !_hold))
+  if (listed)
   {
-    RemoveNote(noteNumber);
+    RemoveNote(lane, noteNumber);
   }
-  _keyCount--;
+  if (lane.keyCount > 0) lane.keyCount--; // (ignore stray note-offs)
+  if (listed && lane.noteCount == 0) lane.keyCount = 0; // (and repeated note-ons)
 
   if (_isEnabled)
   {
-    if (_keyCount == 0 && !_hold) // last note - stop arpeggiator (unless hold)
+    if (lane.keyCount == 0 && !_hold) // last note - stop arpeggiator (unless hold)
     {
       PrintLn("Arpeggio ended.");
-      SendNoteOff(_currentNoteNumber);
+      ReleaseChannel(lane.channel);
+      lane.chordPending = false;
+    }
+    else if (_chords && !_hold && !arpeggiating) // (single key, or chord being captured)
+    {
+      if (IsSounding(lane.channel, noteNumber)) SendNoteOff(lane.channel, noteNumber);
+      if (lane.noteCount < 2) PlayHeldNotes(lane);
+    }
+    else if (_chords && !_hold && lane.noteCount < 2) // chord let go of, down to a single key
+    {
+      // (it plays as it is, unless it's let go of too within the window)
+      ReleaseChannel(lane.channel);
+      lane.chordPending = true;
+      lane.chordAt = _now + _chordWindowMs;
     }
   }
   else
   {
     ForwardMidiData3Byte(); // pass note-off through
+    SetSounding(_midiChannel, noteNumber, false);
   }
 }
 
+ARP_TEMPLATE void ARP_ENGINE::HandleControlChange()
+{
+  if (_ccLearning) {
+    _ccLearning = false;
+    _ccMappings[_midiChannel][_midiData1] = _ccLearnMapping;
+    Print("CC learned: "); PrintLn(_midiData1);
+  }
+  byte mapping = _ccMappings[_midiChannel][_midiData1];
+  if (!(mapping & CC_CONSUME)) ForwardMidiData3Byte(); // pass-through
+  if ((mapping & ~CC_CONSUME) != CC_NONE) {
+    SetControlledParameter(mapping & ~CC_CONSUME, _midiChannel, _midiData2);
+  }
+}
+
+// Sets a parameter from a (0..127) controller value
+ARP_TEMPLATE void ARP_ENGINE::SetControlledParameter(int parameter, byte channel, byte value)
+{
+  switch (parameter) {
+    case CC_TEMPO:
+      SetTempo(MIN_TEMPO + value * (MAX_TEMPO - MIN_TEMPO) / 127);
+      break;
+    case CC_GATE:
+      SetGate(MIN_GATE + value * (MAX_GATE - MIN_GATE) / 127);
+      break;
+    case CC_MODE:
+      SetMode(value * MODE_COUNT / 128, channel);
+      break;
+    case CC_RANGE:
+      SetRange(value * (MAX_RANGE + 1) / 128, channel);
+      break;
+    case CC_HOLD:
+      if ((value >= 64) != _hold) SetHold(value >= 64);
+      break;
+    case CC_VELOCITY_MODE:
+      SetVelocityMode(value * VEL_COUNT / 128, channel);
+      break;
+    case CC_VELOCITY_CURVE:
+      SetVelocityCurve(value * VEL_CURVE_COUNT / 128, LatestSetting(&Config::fixedVelocity));
+      break;
+    case CC_FIXED_VELOCITY:
+      SetVelocityCurve(LatestSetting(&Config::velocityCurve), value);
+      break;
+    case CC_VELOCITY_SHAPE:
+      SetVelocityShape(value * VEL_SHAPE_COUNT / 128, LatestSetting(&Config::velocityDepth));
+      break;
+    case CC_VELOCITY_DEPTH:
+      SetVelocityShape(LatestSetting(&Config::velocityShape), value * 100 / 127);
+      break;
+    case CC_ACCENT:
+      SetAccent(value * ACCENT_COUNT / 128, LatestSetting(&Config::accentAmount));
+      break;
+    case CC_ACCENT_AMOUNT:
+      SetAccent(LatestSetting(&Config::accent), value / 2);
+      break;
+    case CC_CHORD_WINDOW:
+      SetChordWindow(value * MAX_CHORD_WINDOW_MS / 127);
+      break;
+    default:
+      return;
+  }
+  if (onParameters != NULL) onParameters();
+}
+
 
 
 ///////// ARPEGGIATOR LOGIC
 
-void ArpEngine::HandleMidiData(byte data)
+ARP_TEMPLATE void ARP_ENGINE::HandleMidiData(byte data)
 {
-  if (_midiState == MIDI_IN_SYSEX) {
-    ForwardMidiData(data);
-    if (data == MidiEndOfExclusive) {
-      // end of SysEx
-      _midiState = MIDI_WAITING_FOR_STATUS_OR_DATA1;
-      _midiStatus = 0;
+  if (_midiState == MIDI_IN_SYSEX && data < MidiTimingClock) {
+    if (!(data & MidiStatusByteMask)) {
+      HandleSysExData(data);
+      return;
     }
-    return;
+    // end of SysEx (any status byte other than EOX also ends
+    // it, and is then handled as usual below)
+    EndSysEx(data == MidiEndOfExclusive);
+    _midiState = MIDI_WAITING_FOR_STATUS_OR_DATA1;
+    _midiStatus = 0;
+    if (data == MidiEndOfExclusive) return;
   }
   
   if (data & MidiStatusByteMask) {
     // status byte
     if (data == MidiStartOfExclusive) {
-      // start of SysEx
-      ForwardMidiData(data);
+      // start of SysEx (held back until it's known not to be ours)
+      _sysExLength = 0;
+      _sysExForward = false;
+      _sysExInterrupted = false;
       _midiState = MIDI_IN_SYSEX;
     }
+    else if (data >= MidiTimingClock) {
+      // System Real Time: pass through (except clock and transport
+      // when sending our own). These may appear anywhere (even
+      // mid-message), so parser state is kept.
+      bool ownClock = _clockOut != NULL && !_midiSync &&
+        data >= MidiTimingClock && data <= MidiStop;
+      if (!ownClock) ForwardMidiData(data);
+      if (data == MidiSystemReset) Panic();
+    }
     else if ((data & MidiStatusMask) == MidiStatusSystemMessage) {
       // Other system message: pass through
       // (these are only relevant on the sync port)
       ForwardMidiData(data);
       _midiStatus = 0;
+      _midiState = MIDI_WAITING_FOR_STATUS_OR_DATA1;
     } else {
       // channel message
       _midiStatus = data & MidiStatusMask;
@@ -259,6 +745,9 @@ void ArpEngine::HandleMidiData(byte data)
           case MidiStatusNoteOn:
             HandleNoteOn();
             break;
+          case MidiStatusControlChange:
+            HandleControlChange();
+            break;
           default: // other
             ForwardMidiData3Byte(); // pass-through
             break;
@@ -269,71 +758,564 @@ void ArpEngine::HandleMidiData(byte data)
   }
 }
 
-void ArpEngine::HandleSyncData(byte data)
+ARP_TEMPLATE void ARP_ENGINE::HandleSyncData(byte data)
+{
+  if (data >= MidiTimingClock) {
+    // System Real Time: may appear anywhere, even between data bytes
+    switch (data) {
+      case MidiTimingClock:
+        HandleClockPulse();
+        break;
+      case MidiStart:
+        // Restart from the top. The first clock after Start is pulse 0.
+        SetSongPosition(0);
+        _transport = TRANSPORT_ARMED;
+        _clockFreewheel = false;
+        _clockStopped = false;
+        break;
+      case MidiContinue:
+        // Resume from the current (or last located) position
+        _transport = TRANSPORT_ARMED;
+        _clockFreewheel = false;
+        _clockStopped = false;
+        break;
+      case MidiStop:
+        _transport = TRANSPORT_STOPPED;
+        _clockFreewheel = false;
+        _clockStopped = false;
+        PauseArpeggio();
+        break;
+    }
+    return;
+  }
+
+  if (data & MidiStatusByteMask) {
+    // Any other status byte cancels a pending message
+    _syncState = (data == MidiSongPositionPointer) ?
+      SYNC_WAITING_FOR_SPP_LSB : SYNC_WAITING_FOR_STATUS;
+    return;
+  }
+
+  // data byte
+  switch (_syncState) {
+    case SYNC_WAITING_FOR_SPP_LSB:
+      _syncData1 = data;
+      _syncState = SYNC_WAITING_FOR_SPP_MSB;
+      break;
+    case SYNC_WAITING_FOR_SPP_MSB:
+    {
+      // Song position is in MIDI beats (16th notes = 6 pulses)
+      ulong midiBeats = ((ulong)data << 7) | _syncData1;
+      SetSongPosition(midiBeats * 6);
+      _syncState = SYNC_WAITING_FOR_STATUS;
+      break;
+    }
+    default: break; // ignore
+  }
+}
+
+ARP_TEMPLATE void ARP_ENGINE::HandleClockPulse()
 {
-  if (data == MidiTimingClock) {
+  ulong sinceLastPulse = _now - _lastPulseAt;
+  _lastPulseAt = _now;
+  if (_transport == TRANSPORT_STOPPED) return; // position held while stopped
+
+  if (_clockFreewheel || _clockStopped) {
+    // Clock is back: continue from the pulse it's at, counted from the
+    // last one received at the measured period (the device went on
+    // counting), so there's no phase jump. If freewheeling ran ahead
+    // of it, the count goes back, and the steps already played wait
+    // for the clock to catch up (none is repeated).
+    _pulseCounter = _freewheelFromPulse + (ulong)
+      ((((uint64_t)sinceLastPulse << 8) + _pulsePeriodX256/2) / _pulsePeriodX256);
+    if (_clockStopped) {
+      // (the steps missed while stopped are skipped: each lane goes
+      // on from the next step on the grid)
+      ulong gridTick = NextGridTick(_pulseCounter * TICKS_PER_PULSE);
+      for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+        Lane& lane = _lanes[channel];
+        if ((long)(lane.nextOnEventAtTick - lane.grooveOffset - gridTick) < 0) {
+          lane.nextOnEventAtTick = GrooveStepAt(lane, gridTick / _config->noteIntervalTicks, gridTick);
+        }
+      }
+    }
+    _clockFreewheel = false;
+    _clockStopped = false;
+    _pulsePeriodX256 = 0; // re-measure (tempo may have changed, or estimate was off)
+    PrintLn("Clock restored");
+  }
+  else if (_holdNextPulse) {
+    _holdNextPulse = false; // this pulse *is* the new position
+  }
+  else {
+    if (_transport == TRANSPORT_RUNNING && sinceLastPulse <= MAX_PULSE_PERIOD_MS) {
+      // Update tempo estimate (moving average, 1/8 weight)
+      ulong periodX256 = sinceLastPulse << 8;
+      if (_pulsePeriodX256 == 0) _pulsePeriodX256 = periodX256;
+      else _pulsePeriodX256 = _pulsePeriodX256 - _pulsePeriodX256/8 + periodX256/8;
+    }
     _pulseCounter++;
-    _lastPulseAt = _now;
   }
-  else if (data == MidiStart) {
-    // Reset pulse counter etc so snap-to-beat/quantization works
-    _pulseCounter = 0;
-    _nextOnEventAtPulse = 0;
-    _nextOffEventAtPulse = 0;
-    _nextBeatEventAtPulse = 0;
+  _transport = TRANSPORT_RUNNING;
+}
+
+// Detects external clock dropouts (no pulse for a few measured
+// pulse periods), and then either keeps the arpeggio going at the
+// last measured tempo or stops it, depending on _clockLossMode.
+ARP_TEMPLATE void ARP_ENGINE::RunClockWatchdog()
+{
+  if (_transport != TRANSPORT_RUNNING || _pulsePeriodX256 == 0) return;
+  uint64_t sinceLastPulseX256 = (uint64_t)(_now - _lastPulseAt) << 8;
+
+  if (!_clockFreewheel) {
+    if (sinceLastPulseX256 < (uint64_t)_pulsePeriodX256 * CLOCK_DROPOUT_PULSES) return;
+    if (_clockLossMode == CLOCK_LOSS_STOP) {
+      // resume on next clock pulse
+      PrintLn("Clock lost: stopping");
+      _transport = TRANSPORT_ARMED;
+      _clockStopped = true;
+      _freewheelFromPulse = _pulseCounter;
+      PauseArpeggio();
+      return;
+    }
+    PrintLn("Clock lost: freewheeling");
+    _clockFreewheel = true;
+    _freewheelFromPulse = _pulseCounter;
+  }
+
+  // Generate pulses from the estimated tempo
+  _pulseCounter = _freewheelFromPulse + (ulong)(sinceLastPulseX256 / _pulsePeriodX256);
+}
+
+// Sends MIDI Start, and restarts the clock output so that its
+// pulse 0 lands on the specified time (the arpeggio's first note)
+ARP_TEMPLATE void ARP_ENGINE::StartClockOutput(ulong firstPulseAt)
+{
+  WriteMidiOut(MidiStart);
+  _clockOut->start((long)(firstPulseAt - _now) > 0 ? (firstPulseAt - _now) * 1000 : 0);
+  _clockOutStarted = true;
+  RunClockOutput(); // (pulse 0 goes out ahead of a note due now)
+}
+
+// Sends the MIDI clock pulses that are due, and Stop once
+// no arpeggio is playing
+ARP_TEMPLATE void ARP_ENGINE::RunClockOutput()
+{
+  unsigned long dueAtUs; // (micros() time)
+  while (_clockOut->takePulse(dueAtUs)) {
+    if (_clockOutTiming != NULL) _clockOutTiming->record((long)(micros() - dueAtUs) / 1000);
+    WriteMidiOut(MidiTimingClock);
+  }
+  if (_clockOutStarted) {
+    bool playing = false;
+    for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+      if (IsArpeggiating(_lanes[channel])) playing = true;
+    }
+    if (!_isEnabled || _midiSync || !playing) {
+      WriteMidiOut(MidiStop);
+      _clockOutStarted = false;
+    }
+  }
+}
+
+// Silences the arpeggio while the external transport is not running.
+// The schedule is kept, so it picks up where it left off.
+ARP_TEMPLATE void ARP_ENGINE::PauseArpeggio()
+{
+  if (!_midiSync || !_isEnabled) return;
+  for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+    Lane& lane = _lanes[channel];
+    bool ratcheting = _events.cancel(lane.channel);
+    if (IsArpeggiating(lane) && !lane.firstNotePending &&
+      (lane.nextOffEventAtTick > 0 || lane.tied || ratcheting)) { // (a note still sounding)
+      SendNoteOff(lane.channel, lane.currentNoteNumber);
+      lane.nextOffEventAtTick = 0;
+      lane.tied = false;
+    }
+  }
+}
+
+// Moves the pulse counter to the specified position (e.g. after
+// Start or Song Position Pointer). The next clock pulse received
+// lands exactly on that position, and pending events are moved to
+// the first grid position at or after it.
+ARP_TEMPLATE void ARP_ENGINE::SetSongPosition(ulong pulse)
+{
+  _pulseCounter = pulse;
+  _tick = pulse * TICKS_PER_PULSE;
+  _holdNextPulse = true;
+  _nextBeatEventAtTick = NextGridTick(_tick);
+  for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+    Lane& lane = _lanes[channel];
+    lane.config = _config - _configs; // (the schedule starts over)
+    ulong gridTick = NextGridTick(_tick);
+    lane.nextOnEventAtTick = GrooveStepAt(lane, gridTick / _config->noteIntervalTicks, gridTick);
+    bool ratcheting = _events.cancel(lane.channel);
+    if (IsArpeggiating(lane) && (lane.nextOffEventAtTick > 0 || lane.tied || ratcheting)) {
+      // a note is still sounding (locate while running): end it now
+      SendNoteOff(lane.channel, lane.currentNoteNumber);
+      lane.nextOffEventAtTick = 0;
+      lane.tied = false;
+    }
+  }
+  Print("Song position: "); PrintLn(pulse);
+}
+
+// Returns the current position in ticks. Between clock pulses, the
+// position is interpolated from the measured clock period, but
+// never past the next pulse, so it stays locked to the host clock.
+ARP_TEMPLATE ulong ARP_ENGINE::CurrentTick()
+{
+  ulong pulseTick = _pulseCounter * TICKS_PER_PULSE;
+  if (_transport != TRANSPORT_RUNNING || _holdNextPulse || _pulsePeriodX256 == 0) return pulseTick;
+  uint64_t sinceLastPulseX256 = (uint64_t)(_now - _lastPulseAt) << 8;
+  if (_clockFreewheel) {
+    // no clock to lock to: extrapolate from the last received pulse
+    return _freewheelFromPulse * TICKS_PER_PULSE +
+      (ulong)(sinceLastPulseX256 * TICKS_PER_PULSE / _pulsePeriodX256);
+  }
+  ulong ticks = (ulong)(sinceLastPulseX256 * TICKS_PER_PULSE / _pulsePeriodX256);
+  return pulseTick + MIN(ticks, TICKS_PER_PULSE - 1);
+}
+
+// Returns the first multiple of the note interval at or after the
+// specified tick (or the tick itself if not snapping to beat)
+ARP_TEMPLATE ulong ARP_ENGINE::NextGridTick(ulong tick)
+{
+  if (!_snapToBeat) return tick;
+  ulong remainder = tick % _config->noteIntervalTicks;
+  return remainder == 0 ? tick : tick + _config->noteIntervalTicks - remainder;
+}
+
+// Returns the time at which the specified tick was (or will be)
+// due, from the last received pulse and the measured clock period
+ARP_TEMPLATE ulong ARP_ENGINE::TickTime(ulong tick)
+{
+  ulong fromPulse = _clockFreewheel ? _freewheelFromPulse : _pulseCounter;
+  long ticks = (long)(tick - fromPulse * TICKS_PER_PULSE);
+  return _lastPulseAt + (long)((int64_t)ticks * (int64_t)_pulsePeriodX256 / (256 * (int64_t)TICKS_PER_PULSE));
+}
+
+// Fits a new arpeggio into a running grid of steps (every interval,
+// through nextStep, which is at most a step behind position), so
+// that chord changes played in time don't disturb the rhythm.
+// Returns the step the first note belongs to, in steps from
+// nextStep: the last step if it was up to half a step ago (the
+// note should be played right away), or the next one.
+ARP_TEMPLATE int ARP_ENGINE::JoinGrid(ulong position, ulong interval, ulong nextStep)
+{
+  int steps = 0;
+  if ((long)(position - nextStep) >= 0) steps = 1; // (missed a step)
+  ulong following = nextStep + steps * interval;
+  if (following - position <= interval/2) return steps; // early: wait for it
+  return steps - 1; // late (or on time): play now
+}
+
+// Precomputes the groove offset of each step (see Config).
+// Called whenever the swing, template or step length changes.
+ARP_TEMPLATE void ARP_ENGINE::UpdateGroove(Config& config)
+{
+  // Groove templates: timing (% of a step) and velocity offsets.
+  // Step 0 is never moved (so it can't land before the song start).
+  static const int8_t timing[GROOVE_COUNT][GROOVE_STEPS] = {
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // straight
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, // accent
+    { 0, 6, 2, 10, 0, 6, 2, 10, 0, 6, 2, 10, 0, 6, 2, 10 }, // laid back
+    { 0, 3, -2, 4, -3, 1, 2, -4, 1, -2, 3, 0, -3, 2, -1, 4 }, // humanize
+  };
+  static const int8_t velocity[GROOVE_COUNT][GROOVE_STEPS] = {
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 20, -10, 0, -10, 10, -10, 0, -10, 15, -10, 0, -10, 10, -10, 0, -10 },
+    { 0, -12, -4, -12, 0, -12, -4, -12, 0, -12, -4, -12, 0, -12, -4, -12 },
+    { 6, -4, 2, -8, 4, -2, -6, 3, 8, -5, 0, -3, 5, -7, 2, -1 },
+  };
+
+  static const uint16_t accents[ACCENT_COUNT] = { // (1 bit per step, step 0 first)
+    0x0000, // none
+    0x1111, // beats
+    0x4444, // off-beats
+    0x4949, // clave (3+3+2)
+  };
+
+  long interval = _midiSync ? config.noteIntervalTicks : config.delayMs;
+  for (int step = 0; step < GROOVE_STEPS; step++) {
+    int percent = timing[config.groove][step];
+    if (step & 1) percent += (config.swing - MIN_SWING) * 2; // swing: delay every other step
+    percent = constrain(percent, -45, 45); // (steps stay in order)
+    config.grooveOffsets[step] = interval * percent / 100;
+    config.grooveVelocities[step] = velocity[config.groove][step] +
+      ((accents[config.accent] >> step) & 1) * config.accentAmount;
+  }
+}
+
+// Precomputes the velocity tables (see Config). Called whenever
+// the curve or shape depth changes.
+ARP_TEMPLATE void ARP_ENGINE::UpdateVelocity(Config& config)
+{
+  for (int velocity = 0; velocity < 128; velocity++) {
+    int shaped;
+    switch (config.velocityCurve) {
+      case VEL_CURVE_SOFT: shaped = sqrt(velocity * 127) + 0.5; break;
+      case VEL_CURVE_HARD: shaped = (velocity * velocity + 63) / 127; break;
+      case VEL_CURVE_FIXED: shaped = config.fixedVelocity; break;
+      default: shaped = velocity; break;
+    }
+    config.velocityCurveTable[velocity] = constrain(shaped, 1, 127);
+  }
+  // Gains: from 1 to 1-depth (decay) or back (ramp), in 1/128ths
+  for (int step = 0; step < VEL_SHAPE_STEPS; step++) {
+    int taken = 128 * config.velocityDepth * step / (100 * (VEL_SHAPE_STEPS - 1));
+    config.velocityGains[VEL_SHAPE_FLAT][step] = 128;
+    config.velocityGains[VEL_SHAPE_DECAY][step] = 128 - taken;
+    config.velocityGains[VEL_SHAPE_RAMP][VEL_SHAPE_STEPS - 1 - step] = 128 - taken;
   }
 }
 
-void ArpEngine::InitArpeggio()
+// Velocity of the lane's current step, from the velocity picked
+// by the mode: through the curve, then the shape and the pattern
+ARP_TEMPLATE byte ARP_ENGINE::ShapeVelocity(Lane& lane, byte velocity)
+{
+  const Config& config = ConfigOf(lane);
+  int shape = config.lanes[lane.channel].velMode == VEL_DECR ? VEL_SHAPE_DECAY : config.velocityShape;
+  int shaped = (config.velocityCurveTable[velocity & 0x7f] * config.velocityGains[shape][lane.velocityStep]) >> 7;
+  shaped += PatternValue(lane, PATTERN_VELOCITY);
+  return constrain(shaped, 1, 127); // (0 means note off)
+}
+
+// Value of the pattern at the lane's current step (0 when it's off)
+ARP_TEMPLATE int ARP_ENGINE::PatternValue(Lane& lane, int pattern)
+{
+  const Config& config = ConfigOf(lane);
+  if (config.patternLengths[pattern] == 0) return 0;
+  return config.patterns[pattern][lane.patternSteps[pattern]];
+}
+
+ARP_TEMPLATE int ARP_ENGINE::NextPatternValue(Lane& lane, int pattern)
+{
+  int length = ConfigOf(lane).patternLengths[pattern];
+  if (length == 0) return 0;
+  int step = lane.patternSteps[pattern] + 1;
+  return ConfigOf(lane).patterns[pattern][step >= length ? 0 : step];
+}
+
+// Moves each pattern on by a step (wrapping at its own length)
+ARP_TEMPLATE void ARP_ENGINE::AdvancePatterns(Lane& lane)
+{
+  for (int pattern = 0; pattern < PATTERN_COUNT; pattern++) {
+    if (++lane.patternSteps[pattern] >= ConfigOf(lane).patternLengths[pattern]) lane.patternSteps[pattern] = 0;
+  }
+}
+
+// Note to play for the lane's current step: moved by the octave
+// pattern (kept in the MIDI range)
+ARP_TEMPLATE byte ARP_ENGINE::PatternNote(Lane& lane, int noteNumber)
+{
+  noteNumber += 12 * PatternValue(lane, PATTERN_OCTAVE);
+  while (noteNumber > 127) noteNumber -= 12; // to prevent MIDI overflow
+  while (noteNumber < 0) noteNumber += 12;
+  return noteNumber;
+}
+
+// Sets the lane's next step (number) and returns its time: the
+// specified grid position plus the step's groove offset
+ARP_TEMPLATE ulong ARP_ENGINE::GrooveStepAt(Lane& lane, int step, ulong position)
+{
+  lane.grooveStep = step % GROOVE_STEPS;
+  lane.grooveOffset = ConfigOf(lane).grooveOffsets[lane.grooveStep];
+  return position + lane.grooveOffset;
+}
+
+// Applies the velocity offset of the lane's next step
+ARP_TEMPLATE byte ARP_ENGINE::GrooveVelocity(Lane& lane, byte velocity)
+{
+  return constrain(velocity + ConfigOf(lane).grooveVelocities[lane.grooveStep], 1, 127);
+}
+
+// Splits the step that just started (at start, up to nextOn) into
+// the lane's ratchet notes, evenly spaced: the note just sent (with
+// the specified velocity) is the first one, and the repeats, each
+// softer by the decay, are queued. Returns the first note's off time
+// (0 if there's none: the step rests, or ties into the next one, or
+// the off is queued along with the repeats).
+ARP_TEMPLATE ulong ARP_ENGINE::ScheduleRatchets(Lane& lane, ulong start, ulong nextOn, ulong gateLength, byte velocity)
+{
+  if (lane.trigger == TRIGGER_REST) return 0;
+  lane.tied = NextPatternValue(lane, PATTERN_TRIGGER) == TRIGGER_TIE;
+  if (lane.tied) return 0;
+
+  const LaneConfig& laneConfig = ConfigOf(lane).lanes[lane.channel];
+  int gate = PatternValue(lane, PATTERN_GATE);
+  if (gate == 0) gate = ConfigOf(lane).gate;
+  else if ((long)(nextOn - start) > 0) gateLength = MAX((nextOn - start) * gate / 100, 1UL);
+  ulong spacing = (long)(nextOn - start) > 0 ? (nextOn - start) / laneConfig.ratchet : 0;
+  if (laneConfig.ratchet <= 1 || spacing == 0 || lane.trigger == TRIGGER_TIE) {
+    return MIN(start + gateLength, nextOn);
+  }
+  ulong noteLength = MAX(spacing * gate / 100, 1UL);
+  // The first note's off is queued too: at a full gate it's due with
+  // the first repeat, and the queue sends it ahead of that note-on
+  _events.push({ start + noteLength, lane.channel, lane.currentNoteNumber, 0 });
+  lane.lastOctave = lane.currentOctave; // (as the lane's off event would)
+  lane.lastNoteIndex = lane.currentNoteIndex;
+  for (int repeat = 1; repeat < laneConfig.ratchet; repeat++) {
+    velocity = MAX(velocity * ConfigOf(lane).ratchetDecay / 100, 1U);
+    ulong onAt = start + repeat * spacing;
+    _events.push({ onAt, lane.channel, lane.currentNoteNumber, velocity });
+    _events.push({ onAt + noteLength, lane.channel, lane.currentNoteNumber, 0 });
+  }
+  return 0;
+}
+
+ARP_TEMPLATE void ARP_ENGINE::InitArpeggio(Lane& lane)
 {
   PrintLn("InitArpeggio()");
-  SendNoteOn(_noteNumbers[0], _noteVelocities[0]);
-  _currentNoteNumber = _noteNumbers[0];
-  _currentNoteIndex = 0;
-  _currentOctave = 0;
-  _currentVelocity = _noteVelocities[0];
-  switch (_mode) {
+  lane.config = _config - _configs; // (from the latest settings)
+  const Config& config = ConfigOf(lane);
+  memset(lane.patternSteps, 0, sizeof(lane.patternSteps));
+  lane.tied = false;
+  lane.chordPending = false;
+  lane.trigger = PatternValue(lane, PATTERN_TRIGGER) == TRIGGER_PLAY ? TRIGGER_PLAY : TRIGGER_REST;
+
+  // Start on the lowest note (there may be more than one: a chord
+  // captured in chords mode, or held when the arpeggiator is enabled)
+  lane.maxVelocity = 0;
+  for (int i = 0; i < lane.noteCount; i++) lane.maxVelocity = MAX(lane.maxVelocity, lane.noteVelocities[i]);
+  int velMode = config.lanes[lane.channel].velMode;
+  byte velocity = velMode == VEL_EACH || velMode == VEL_SAME ? lane.noteVelocitiesSorted[0] : lane.maxVelocity;
+  lane.currentNoteNumber = PatternNote(lane, lane.noteNumbersSorted[0]);
+  lane.currentNoteIndex = 0;
+  lane.currentOctave = 0;
+  lane.velocityStep = 0;
+  lane.currentVelocity = ShapeVelocity(lane, velocity);
+  switch (config.lanes[lane.channel].mode) {
     case MODE_DOWN:
-      _currentDirection = DIR_DOWN; break;
+      lane.currentDirection = DIR_DOWN; break;
     default:
-      _currentDirection = DIR_UP; break;
+      lane.currentDirection = DIR_UP; break;
+  }
+
+  if (_midiSync && _transport != TRANSPORT_RUNNING) {
+    // With external transport stopped, the first note is held back
+    // until the host resumes
+    lane.firstNotePending = true;
+    ulong gridTick = NextGridTick(_tick);
+    lane.nextOnEventAtTick = GrooveStepAt(lane, gridTick / config.noteIntervalTicks, gridTick);
+    lane.nextOffEventAtTick = 0;
+    lane.scheduled = true;
+    PrintEventSchedule(lane);
+    return;
+  }
+
+  // Continue the lane's rhythm (or the beat, when snapping to it)
+  ulong position = _midiSync ? _tick : _now;
+  ulong interval = _midiSync ? config.noteIntervalTicks : config.delayMs;
+  ulong gateLength = _midiSync ? config.gateLengthTicks : config.delayMsGate;
+  ulong nextStep; // (on the straight grid)
+  int nextGrooveStep;
+  bool hasGrid;
+  if (_midiSync && _snapToBeat) {
+    nextStep = NextGridTick(_tick);
+    nextGrooveStep = nextStep / interval; // (groove follows the song position)
+    hasGrid = true;
+  }
+  else {
+    nextStep = (_midiSync ? lane.nextOnEventAtTick : lane.nextOnEventAt) - lane.grooveOffset;
+    nextGrooveStep = lane.grooveStep;
+    hasGrid = lane.scheduled; // (never played: there's no grid, not one at 0)
+  }
+  ulong firstStep = position; // (lane's grid is stale: start a new one)
+  int firstGrooveStep = 0;
+  if (hasGrid && (long)(position - nextStep) < (long)interval) {
+    int steps = JoinGrid(position, interval, nextStep);
+    firstStep = nextStep + steps * (long)interval;
+    firstGrooveStep = nextGrooveStep + GROOVE_STEPS + steps;
   }
 
+  ulong nextOn, nextOff;
+  ulong firstOn = GrooveStepAt(lane, firstGrooveStep, firstStep);
+  if (_clockOut != NULL && !_midiSync && !_clockOutStarted) StartClockOutput(firstStep);
+  lane.firstNotePending = (long)(firstOn - position) > 0;
+  if (lane.firstNotePending) {
+    nextOn = firstOn;
+    nextOff = 0;
+  }
+  else {
+    byte velocity = GrooveVelocity(lane, lane.currentVelocity);
+    if (lane.trigger == TRIGGER_PLAY) SendNoteOn(lane.channel, lane.currentNoteNumber, velocity);
+    nextOn = GrooveStepAt(lane, firstGrooveStep + 1, firstStep + interval);
+    nextOff = ScheduleRatchets(lane, position, nextOn, gateLength, velocity);
+  }
   if (_midiSync) {
-    _nextOnEventAtPulse = _pulseCounter + _noteIntervalPulses;
-    _nextOffEventAtPulse = _pulseCounter + _gateLengthPulses;
+    lane.nextOnEventAtTick = nextOn;
+    lane.nextOffEventAtTick = nextOff;
   }
   else {
-    _nextOnEventAt = _now + _delayMs;
-    _nextOffEventAt = _now + _delayMsGate;
+    lane.nextOnEventAt = nextOn;
+    lane.nextOffEventAt = nextOff;
   }
+  lane.scheduled = true;
   
-  PrintEventSchedule();
-  _maxVelocity = _noteVelocities[0];
+  PrintEventSchedule(lane);
+}
+
+// Whether the lane's notes are arpeggiated: in chords mode, only a
+// chord is (not a single key, or keys still settling)
+ARP_TEMPLATE bool ARP_ENGINE::IsArpeggiating(Lane& lane)
+{
+  if (lane.noteCount == 0) return false;
+  return !_chords || (lane.noteCount >= 2 && !lane.chordPending);
 }
 
-void ArpEngine::HandleArpeggiatorOffEvent()
+// Chords mode: plays the lane's keys as they are (those not sounding
+// yet), when it's down to a single key
+ARP_TEMPLATE void ARP_ENGINE::PlayHeldNotes(Lane& lane)
 {
-  SendNoteOff(_currentNoteNumber);
-  _lastOctave = _currentOctave;
-  _lastNoteIndex = _currentNoteIndex; 
+  lane.chordPending = false;
+  for (int i = 0; i < lane.noteCount; i++) {
+    if (!IsSounding(lane.channel, lane.noteNumbers[i])) {
+      SendNoteOn(lane.channel, lane.noteNumbers[i], lane.noteVelocities[i]);
+    }
+  }
 }
 
-void ArpEngine::HandleArpeggiatorOnEvent()
+ARP_TEMPLATE void ARP_ENGINE::HandleArpeggiatorOffEvent(Lane& lane)
 {
+  SendNoteOff(lane.channel, lane.currentNoteNumber);
+  lane.lastOctave = lane.currentOctave;
+  lane.lastNoteIndex = lane.currentNoteIndex; 
+}
+
+ARP_TEMPLATE void ARP_ENGINE::HandleArpeggiatorOnEvent(Lane& lane)
+{
+  const LaneConfig& laneConfig = ConfigOf(lane).lanes[lane.channel];
   bool restartVelocity = false;
+
+  // The patterns step along with the notes, each at its own length
+  AdvancePatterns(lane);
+  int trigger = PatternValue(lane, PATTERN_TRIGGER);
+  if (lane.tied && trigger != TRIGGER_TIE) {
+    // (the tie was taken back by a pattern change)
+    SendNoteOff(lane.channel, lane.currentNoteNumber);
+  }
+  if (trigger == TRIGGER_TIE && !lane.tied) trigger = TRIGGER_REST; // (nothing to tie)
+  lane.trigger = trigger;
+  lane.tied = false;
+
+  // The range may have shrunk since the last step (chord changes
+  // keep the position, see AddNote/RemoveNote)
+  if (lane.currentOctave > laneConfig.range) lane.currentOctave = laneConfig.range;
   
   // Advance one step (this is mode dependent)
-  switch (_mode) {
+  switch (laneConfig.mode) {
     case MODE_UP:
     //case MODE_ORDER:
     {
-      _currentNoteIndex++;
-      if (_currentNoteIndex >= _noteCount) {
-        _currentNoteIndex = 0;
-        _currentOctave++;
-        if (_currentOctave > _range) {
-          _currentOctave = 0;
+      lane.currentNoteIndex++;
+      if (lane.currentNoteIndex >= lane.noteCount) {
+        lane.currentNoteIndex = 0;
+        lane.currentOctave++;
+        if (lane.currentOctave > laneConfig.range) {
+          lane.currentOctave = 0;
           restartVelocity = true;
         }
       }
@@ -341,12 +1323,12 @@ void ArpEngine::HandleArpeggiatorOnEvent()
     }
     case MODE_DOWN:
     {
-      _currentNoteIndex--;
-      if (_currentNoteIndex < 0) {
-         _currentNoteIndex = _noteCount-1;
-         _currentOctave--;
-         if (_currentOctave < 0) {
-            _currentOctave = _range;
+      lane.currentNoteIndex--;
+      if (lane.currentNoteIndex < 0) {
+         lane.currentNoteIndex = lane.noteCount-1;
+         lane.currentOctave--;
+         if (lane.currentOctave < 0) {
+            lane.currentOctave = laneConfig.range;
             restartVelocity = true;
          }
       }
@@ -354,31 +1336,31 @@ void ArpEngine::HandleArpeggiatorOnEvent()
     }
     case MODE_UP_DOWN:
     {
-      if (_noteCount < 2 && _range == 0) break; // single note
-      if (_currentDirection == DIR_UP) {
-         _currentNoteIndex++;
-         if (_currentNoteIndex >= (_noteCount-1) && _currentOctave == _range) {
+      if (lane.noteCount < 2 && laneConfig.range == 0) break; // single note
+      if (lane.currentDirection == DIR_UP) {
+         lane.currentNoteIndex++;
+         if (lane.currentNoteIndex >= (lane.noteCount-1) && lane.currentOctave == laneConfig.range) {
            // reached the top. turn around!
-           _currentNoteIndex = _noteCount-1;
-           _currentDirection = DIR_DOWN;      
-         } else if (_currentNoteIndex >= _noteCount) {
+           lane.currentNoteIndex = lane.noteCount-1;
+           lane.currentDirection = DIR_DOWN;      
+         } else if (lane.currentNoteIndex >= lane.noteCount) {
            // run next octave up
-           _currentNoteIndex = 0;
-           _currentOctave++;
+           lane.currentNoteIndex = 0;
+           lane.currentOctave++;
          } 
       }
       else // currentDirection == DIR_DOWN
       {
-         _currentNoteIndex--;
-         if (_currentNoteIndex <= 0 && _currentOctave == 0) {
+         lane.currentNoteIndex--;
+         if (lane.currentNoteIndex <= 0 && lane.currentOctave == 0) {
            // reached the bottom. turn around!
-           _currentNoteIndex = 0;
-           _currentDirection = DIR_UP;
+           lane.currentNoteIndex = 0;
+           lane.currentDirection = DIR_UP;
            restartVelocity = true;
-         } else if (_currentNoteIndex < 0) {
+         } else if (lane.currentNoteIndex < 0) {
            // run next octave down
-           _currentNoteIndex = _noteCount-1;
-           _currentOctave--;
+           lane.currentNoteIndex = lane.noteCount-1;
+           lane.currentOctave--;
          }
       }
       break;
@@ -386,86 +1368,89 @@ void ArpEngine::HandleArpeggiatorOnEvent()
     //case MODE_RANDOM1:
     case MODE_RANDOM:
     {
-      if (_noteCount < 2 && _range == 0) break; // single note
+      if (lane.noteCount < 2 && laneConfig.range == 0) break; // single note
       
+      // (the velocity shape restarts after as many steps as there are notes)
+      if (lane.velocityStep + 1 >= lane.noteCount * (laneConfig.range + 1)) restartVelocity = true;
+
       // Avoid playing the same note twice in a row:
-      while (_currentNoteIndex == _lastNoteIndex && _currentOctave == _lastOctave)
+      while (lane.currentNoteIndex == lane.lastNoteIndex && lane.currentOctave == lane.lastOctave)
       {
          // TODO: Replace rand by 8-bit LFSR?
-         _currentNoteIndex = random(_noteCount);
-         _currentOctave = random(_range+1);
+         lane.currentNoteIndex = random(lane.noteCount);
+         lane.currentOctave = random(laneConfig.range+1);
       }
       break;
     }
     // TODO: Enable
     // case MODE_RANDOM2:
     // {
-    //   if (_noteCount < 2 && _range == 0) break; // single note
+    //   if (lane.noteCount < 2 && laneConfig.range == 0) break; // single note
       
     //   // Try to pick both a different note and octave than last time
-    //   if (_noteCount > 1) while (_currentNoteIndex == _lastNoteIndex)
-    //     _currentNoteIndex = random(_noteCount);
-    //   if (_range > 0) while (_currentOctave == _lastOctave)
-    //     _currentOctave = random(_range+1);
+    //   if (lane.noteCount > 1) while (lane.currentNoteIndex == lane.lastNoteIndex)
+    //     lane.currentNoteIndex = random(lane.noteCount);
+    //   if (laneConfig.range > 0) while (lane.currentOctave == lane.lastOctave)
+    //     lane.currentOctave = random(laneConfig.range+1);
     //   break;
     // }
     default: break;
   }
+  // (after a chord change, the position can be just outside the chord)
+  lane.currentNoteIndex = constrain(lane.currentNoteIndex, 0, lane.noteCount-1);
   
   // Find next note
   
-  byte* noteNumberList = _noteNumbersSorted;
-  byte* noteVelocityList = _noteVelocitiesSorted;
-  // if (_mode == MODE_ORDER) {
+  byte* noteNumberList = lane.noteNumbersSorted;
+  byte* noteVelocityList = lane.noteVelocitiesSorted;
+  // if (laneConfig.mode == MODE_ORDER) {
   //   // use ordered list instead of sorted
-  //   noteNumberList = _noteNumbers;
-  //   noteVelocityList = _noteVelocities;
+  //   noteNumberList = lane.noteNumbers;
+  //   noteVelocityList = lane.noteVelocities;
   // }
-  byte noteNumber = noteNumberList[_currentNoteIndex] + 12 * _currentOctave;
+  byte noteNumber = PatternNote(lane, noteNumberList[lane.currentNoteIndex] + 12 * lane.currentOctave);
   
   // Find what velocity value to use
 
-  //byte noteVelocity;
-  switch (_velMode)
+  byte velocity;
+  switch (laneConfig.velMode)
   {
     case VEL_EACH:
-      _currentVelocity = noteVelocityList[_currentNoteIndex];
+      velocity = noteVelocityList[lane.currentNoteIndex];
       break;
     case VEL_SAME:
-      _currentVelocity = noteVelocityList[0];
-      break;
-    case VEL_MAX:
-      _currentVelocity = _maxVelocity;
+      velocity = noteVelocityList[0];
       break;
-    case VEL_DECR:
-      //noteVelocity = currentVelocity;
-      _currentVelocity = ((unsigned int)_currentVelocity * 250) >> 8;
-      if (restartVelocity) _currentVelocity = _maxVelocity;
+    default: // VEL_MAX, VEL_DECR
+      velocity = lane.maxVelocity;
       break;
   }
+  if (restartVelocity) lane.velocityStep = 0;
+  else if (lane.velocityStep < VEL_SHAPE_STEPS - 1) lane.velocityStep++;
+  lane.currentVelocity = ShapeVelocity(lane, velocity);
  
-  // Send note on  
-  while (noteNumber > 127) noteNumber -= 12; // to prevent MIDI overflow
-  SendNoteOn(noteNumber, _currentVelocity);
-  _currentNoteNumber = noteNumber;
+  // Send note on (a tied note sounds on instead)
+  if (lane.trigger == TRIGGER_TIE) return;
+  if (lane.trigger == TRIGGER_PLAY) SendNoteOn(lane.channel, noteNumber, GrooveVelocity(lane, lane.currentVelocity));
+  lane.currentNoteNumber = noteNumber;
 }
 
 
 ///////// DEBUG
 
-template <class T> void ArpEngine::Print(T t) {
-  if (_debugPort) _debugPort->print(t);
+ARP_TEMPLATE template <class T> void ARP_ENGINE::Print(T t) {
+  if (_debugPort) _debugPort->DebugPort::print(t);
 }
-template <class T> void ArpEngine::Print(T t, int format) {
-  if (_debugPort) _debugPort->print(t, format);
+ARP_TEMPLATE template <class T> void ARP_ENGINE::Print(T t, int format) {
+  if (_debugPort) _debugPort->DebugPort::print(t, format);
 }
-template <class T> void ArpEngine::PrintLn(T t) {
-  if (_debugPort) _debugPort->println(t);
+ARP_TEMPLATE template <class T> void ARP_ENGINE::PrintLn(T t) {
+  if (_debugPort) _debugPort->DebugPort::println(t);
 }
-template <class T> void ArpEngine::PrintLn(T t, int format) {
-  if (_debugPort) _debugPort->println(t, format);
+ARP_TEMPLATE template <class T> void ARP_ENGINE::PrintLn(T t, int format) {
+  if (_debugPort) _debugPort->DebugPort::println(t, format);
 }
-void ArpEngine::PrintList(byte* list, int length) {
+ARP_TEMPLATE void ARP_ENGINE::PrintList(byte* list, int length) {
   Print('[');
   for (int i = 0; i < length; i++) {
     if (i > 0) Print(',');
@@ -473,187 +1458,371 @@ void ArpEngine::PrintList(byte* list, int length) {
   }
   Print(']');
 }
-void ArpEngine::PrintNoteList() {
-  Print("  "); PrintList(_noteNumbersSorted, _noteCount);
-  Print("  _noteCount: "); Print(_noteCount);
+ARP_TEMPLATE void ARP_ENGINE::PrintNoteList(Lane& lane) {
+  Print("  "); PrintList(lane.noteNumbersSorted, lane.noteCount);
+  Print("  ch: "); Print(lane.channel + 1);
+  Print("  _noteCount: "); Print(lane.noteCount);
   PrintLn("");
 }
-void ArpEngine::PrintEventSchedule() {
-  Print("Now: "); Print(_midiSync ? _pulseCounter : _now);
+ARP_TEMPLATE void ARP_ENGINE::PrintEventSchedule(Lane& lane) {
+  Print("Now: "); Print(_midiSync ? _tick : _now);
   Print("  Next event on/off: ");
-  Print(_midiSync ? _nextOnEventAtPulse : _nextOnEventAt);
+  Print(_midiSync ? lane.nextOnEventAtTick : lane.nextOnEventAt);
   Print(" ");
-  Print(_midiSync ? _nextOffEventAtPulse : _nextOffEventAt);
+  Print(_midiSync ? lane.nextOffEventAtTick : lane.nextOffEventAt);
   PrintLn("");
 }
 
 
 ///////// PUBLIC
 
-void ArpEngine::Run(ulong now)
+// Sends the queued events (ratchet repeats) that are due. Run
+// before the lanes, so a repeat's note-off goes out before a
+// step starting at the same time.
+ARP_TEMPLATE void ARP_ENGINE::RunEventQueue()
 {
-  _now = now;
+  if (_midiSync && _transport != TRANSPORT_RUNNING) return; // (held, like the lanes)
+  EventQueue::Event event;
+  while (_events.pop(_midiSync ? _tick : _now, event)) {
+    TimingStats* timing = event.velocity > 0 ? _noteOnTiming : _noteOffTiming;
+    if (timing != NULL) timing->record(_now - (_midiSync ? TickTime(event.time) : event.time));
+    if (event.velocity > 0) SendNoteOn(event.channel, event.noteNumber, event.velocity);
+    else SendNoteOff(event.channel, event.noteNumber);
+  }
+}
 
-  // Run events
-  if (_isEnabled && _noteCount > 0)
+ARP_TEMPLATE void ARP_ENGINE::RunLane(Lane& lane)
+{
+  if (_midiSync)
   {
-    if (_midiSync)
-    {
-      if (_pulseCounter >= _nextOffEventAtPulse && _nextOffEventAtPulse > 0) {
-        HandleArpeggiatorOffEvent();
-        _nextOffEventAtPulse = 0;
-        PrintEventSchedule();
+    // (schedule is held while external transport is stopped)
+    if (_transport == TRANSPORT_RUNNING) {
+      if (_tick >= lane.nextOffEventAtTick && lane.nextOffEventAtTick > 0) {
+        if (_noteOffTiming != NULL) _noteOffTiming->record(_now - TickTime(lane.nextOffEventAtTick));
+        HandleArpeggiatorOffEvent(lane);
+        lane.nextOffEventAtTick = 0;
+        PrintEventSchedule(lane);
       }
-      if (_pulseCounter >= _nextOnEventAtPulse) {
-        HandleArpeggiatorOnEvent();
-        _nextOnEventAtPulse = _pulseCounter + _noteIntervalPulses;
+      if (_tick >= lane.nextOnEventAtTick) {
+        if (_noteOnTiming != NULL) _noteOnTiming->record(_now - TickTime(lane.nextOnEventAtTick));
+        lane.config = _config - _configs; // (a new step: with the latest settings)
+        const Config& config = ConfigOf(lane);
+        if (lane.firstNotePending) {
+          // arpeggio was started while stopped: play its first note now
+          if (lane.trigger == TRIGGER_PLAY) {
+            SendNoteOn(lane.channel, lane.currentNoteNumber, GrooveVelocity(lane, lane.currentVelocity));
+          }
+          lane.firstNotePending = false;
+        }
+        else {
+          HandleArpeggiatorOnEvent(lane);
+        }
+        byte velocity = GrooveVelocity(lane, lane.currentVelocity); // (as sent)
+        // (from the straight grid position of this step)
+        ulong nextTick = _tick - lane.grooveOffset + config.noteIntervalTicks;
+        int nextGrooveStep = lane.grooveStep + 1;
         if (_snapToBeat) {
           // Snap next event to nearest multiple of the note interval
-          _nextOnEventAtPulse += _noteIntervalPulses/2; // add half interval...
-          _nextOnEventAtPulse -= _nextOnEventAtPulse % _noteIntervalPulses; // ... then truncate (round down)
+          nextTick += config.noteIntervalTicks/2; // add half interval...
+          nextTick -= nextTick % config.noteIntervalTicks; // ... then truncate (round down)
+          nextGrooveStep = nextTick / config.noteIntervalTicks; // (groove follows the song position)
         }
-        _nextOffEventAtPulse = MIN(
-          _pulseCounter + _gateLengthPulses, _nextOnEventAtPulse);
-        
-        PrintEventSchedule();
+        lane.nextOnEventAtTick = GrooveStepAt(lane, nextGrooveStep, nextTick);
+        lane.nextOffEventAtTick = ScheduleRatchets(
+          lane, _tick, lane.nextOnEventAtTick, config.gateLengthTicks, velocity);
+      
+        PrintEventSchedule(lane);
       }
     }
-    else
-    {
-      if (_now >= _nextOffEventAt && _nextOffEventAt > 0) {
-        HandleArpeggiatorOffEvent();
-        _nextOffEventAt = 0;
-        PrintEventSchedule();
+  }
+  else
+  {
+    if (_now >= lane.nextOffEventAt && lane.nextOffEventAt > 0) {
+      if (_noteOffTiming != NULL) _noteOffTiming->record(_now - lane.nextOffEventAt);
+      HandleArpeggiatorOffEvent(lane);
+      lane.nextOffEventAt = 0;
+      PrintEventSchedule(lane);
+    }
+    if (_now >= lane.nextOnEventAt) {
+      if (_noteOnTiming != NULL) _noteOnTiming->record(_now - lane.nextOnEventAt);
+      lane.config = _config - _configs; // (a new step: with the latest settings)
+      const Config& config = ConfigOf(lane);
+      if (lane.firstNotePending) {
+        // arpeggio was started just ahead of this step: play its first note now
+        if (lane.trigger == TRIGGER_PLAY) {
+          SendNoteOn(lane.channel, lane.currentNoteNumber, GrooveVelocity(lane, lane.currentVelocity));
+        }
+        lane.firstNotePending = false;
       }
-      if (_now >= _nextOnEventAt) {
-        HandleArpeggiatorOnEvent();
-        _nextOnEventAt = _now + _delayMs;
-        _nextOffEventAt = _now + _delayMsGate;
-        PrintEventSchedule();
+      else {
+        HandleArpeggiatorOnEvent(lane);
       }
+      byte velocity = GrooveVelocity(lane, lane.currentVelocity); // (as sent)
+      // Schedule from the grid (not from now), so that
+      // lateness doesn't accumulate, unless we're more than
+      // a step behind (e.g. after a tempo change)
+      ulong onAt = lane.nextOnEventAt;
+      ulong stepAt = onAt - lane.grooveOffset; // (on the straight grid)
+      if ((long)(_now - stepAt) >= (long)config.delayMs) onAt = stepAt = _now;
+      lane.nextOnEventAt = GrooveStepAt(lane, lane.grooveStep + 1, stepAt + config.delayMs);
+      lane.nextOffEventAt = ScheduleRatchets(
+        lane, onAt, lane.nextOnEventAt, config.delayMsGate, velocity);
+      PrintEventSchedule(lane);
+    }
+  }
+}
+
+ARP_TEMPLATE void ARP_ENGINE::Run(ulong now)
+{
+  _runSkippedMs = (long)(now - _now) > 1 ? now - _now - 1 : 0;
+  bool repeated = now == _now && _runActive; // (may act on what the last one did)
+  _now = now;
+  _midiOutBatch = true;
+  _runRecorded = false;
+  _runActive = false;
+  if (_capture != NULL && (_runSkippedMs > 0 || _settingRecorded || repeated)) RecordRun();
+
+  if (_midiSync) RunClockWatchdog();
+
+  // Handle sync data (before running events, so that notes
+  // due on a received clock pulse go out right away)
+  while (_syncPort != NULL && _syncPort->SyncPort::available() > 0) {
+    byte data = _syncPort->SyncPort::read();
+    if (_capture != NULL) {
+      RecordRun();
+      _capture->record(MidiCapture::SOURCE_SYNC_IN, data, _now);
+      _runActive = true;
+    }
+    HandleSyncData(data);
+  }
+  if (_midiSync) _tick = CurrentTick();
+
+  // Settings changes and parameters received by SysEx (before
+  // the notes due now)
+  if (_parametersPending && ParametersDue()) {
+    ApplyPendingParameters();
+    if (_midiSync) _tick = CurrentTick(); // (sync may have changed)
+  }
+  if (ConfigPending()) PublishConfig();
+
+  // MIDI clock output (ahead of the notes due now)
+  if (_clockOut != NULL) RunClockOutput();
+
+  // Run events (all lanes share the same clock)
+  if (_isEnabled)
+  {
+    RunEventQueue();
+    for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+      Lane& lane = _lanes[channel];
+      if (lane.chordPending && (long)(_now - lane.chordAt) >= 0) {
+        // Keys settled: a chord is arpeggiated (from its full
+        // voicing), a single key plays as it is
+        ReleaseChannel(lane.channel); // (a chord's first key, played as is)
+        if (lane.noteCount >= 2) InitArpeggio(lane);
+        else PlayHeldNotes(lane);
+      }
+      if (IsArpeggiating(lane)) RunLane(lane);
     }
   }
 
   // Handle new MIDI data
-  while (_midiPort->available() > 0) {
-    byte data = _midiPort->read();
+  while (_midiInPort->MidiInPort::available() > 0) {
+    byte data = _midiInPort->MidiInPort::read();
+    if (_capture != NULL) {
+      RecordRun();
+      _capture->record(MidiCapture::SOURCE_MIDI_IN, data, _now);
+      _runActive = true;
+    }
     HandleMidiData(data);
     if (onMidiIn != NULL) onMidiIn();
   }
-  // Handle sync data
-  while (_syncPort->available() > 0) {
-    byte data = _syncPort->read();
-    HandleSyncData(data);
-  }
 
   // onBeat event
   if (_midiSync) {
-    if (_pulseCounter >= _nextBeatEventAtPulse) {
-      _nextBeatEventAtPulse = _pulseCounter + _noteIntervalPulses;
+    if (_tick >= _nextBeatEventAtTick) {
+      _nextBeatEventAtTick = _tick + _config->noteIntervalTicks;
       if (onBeat != NULL) onBeat();
     }
   }
   else {
     if (_now >= _nextBeatEventAt) {
-      _nextBeatEventAt = _now + _delayMs;
+      _nextBeatEventAt = _now + _config->delayMs;
       if (onBeat != NULL) onBeat();
     }
   }
+
+  // Send this pass's output
+  FlushMidiOut();
+  _midiOutBatch = false;
+  if (_midiOutEnded) {
+    _midiOutEnded = false;
+    if (onMidiOut != NULL) onMidiOut();
+  }
 }
 
-void ArpEngine::SetEnabled(bool enabled)
+ARP_TEMPLATE void ARP_ENGINE::SetEnabled(bool enabled)
 {
+  RecordSetting(SETTING_ENABLED, 0, enabled);
   _isEnabled = enabled;
-  if (_isEnabled)
-  {
-    if (_noteCount > 0) // convert current chord to arpeggio
+  if (_isEnabled) PublishConfig(true); // (arpeggios start over: with the latest settings)
+  for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+    Lane& lane = _lanes[channel];
+    lane.chordPending = false;
+    if (lane.noteCount == 0) continue;
+    if (_isEnabled && _chords && lane.noteCount < 2) continue; // (a single key plays on as it is)
+    if (_isEnabled) // convert current chord to arpeggio
     {
-      for (byte i = 0; i < _noteCount; i++) {
-        SendNoteOff(_noteNumbers[i]);
-      }  
-      InitArpeggio();
+      ReleaseChannel(lane.channel);
+      InitArpeggio(lane);
     }
-  }
-  else
-  {
-    if (_noteCount > 0) // convert current arpeggio to chord
+    else // convert current arpeggio to chord
     {
-      SendNoteOff(_currentNoteNumber);
+      ReleaseChannel(lane.channel);
       if (!_hold) {
-        for (byte i = 0; i < _noteCount; i++) {
-          SendNoteOn(_noteNumbers[i], _noteVelocities[i]);
+        for (byte i = 0; i < lane.noteCount; i++) {
+          SendNoteOn(lane.channel, lane.noteNumbers[i], lane.noteVelocities[i]);
         }
       }
     }
   }
 }
 
-void ArpEngine::SetHold(bool hold)
+ARP_TEMPLATE void ARP_ENGINE::SetHold(bool hold)
 {
+  RecordSetting(SETTING_HOLD, 0, hold);
   _hold = hold;
   if (!_hold) {
-    SendNoteOff(_currentNoteNumber);
-    _noteCount = 0;
+    for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+      Lane& lane = _lanes[channel];
+      if (lane.noteCount == 0) continue;
+      ReleaseChannel(lane.channel); // (when disabled: the notes passed through)
+      lane.noteCount = 0;
+      lane.chordPending = false;
+    }
   }
 }
 
-void ArpEngine::SetTempo(int tempo)
+// Chords mode: only chords (2 or more keys) are arpeggiated, single
+// keys play as they are. The keys of a chord are captured for a short
+// window (see SetChordWindow), so its arpeggio starts on the full chord.
+ARP_TEMPLATE void ARP_ENGINE::SetChords(bool chords)
 {
-  _tempo = tempo;
-  _delayMs = ((ulong)60000/4)/tempo;
-  _delayMsGate = _delayMs * _gate / 100;
-
-  // Set note interval in pulses (for MIDI sync mode)
-  int lengthMode = (tempo-MIN_TEMPO)*LENGTH_COUNT/(MAX_TEMPO-MIN_TEMPO);
-  switch (lengthMode) {
-    // 6 pulses per 1/16 note
-    case LENGTH_WHOLE: _noteIntervalPulses = 96; break;
-    case LENGTH_HALF: _noteIntervalPulses = 48; break;
-    case LENGTH_THIRD: _noteIntervalPulses = 36; break;
-    case LENGTH_QUARTER: _noteIntervalPulses = 24; break;
-    case LENGTH_SIXTH: _noteIntervalPulses = 18; break;
-    case LENGTH_EIGHTH: _noteIntervalPulses = 12; break;
-    case LENGTH_TWELVTH: _noteIntervalPulses = 8; break;
-    case LENGTH_SIXTEENTH: _noteIntervalPulses = 6; break;
-    case LENGTH_TWENTYFOURTH: _noteIntervalPulses = 4; break;
-    case LENGTH_THIRTYSECOND: default: _noteIntervalPulses = 3; break;
+  RecordSetting(SETTING_CHORDS, 0, chords);
+  if (chords == _chords) return;
+  _chords = chords;
+  if (!_isEnabled) return;
+  for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+    Lane& lane = _lanes[channel];
+    if (lane.noteCount != 1 && !lane.chordPending) continue; // (chords are arpeggiated either way)
+    ReleaseChannel(lane.channel);
+    if (_chords) PlayHeldNotes(lane);
+    else InitArpeggio(lane);
   }
-  _gateLengthPulses = _noteIntervalPulses; // TODO: compute actual gate length
+}
 
-  Print("Tempo: "); Print(_tempo);
-  Print(", _delayMs: "); Print(_delayMs);
-  Print(", _delayMsGate: "); PrintLn(_delayMsGate);
+ARP_TEMPLATE void ARP_ENGINE::SetChordWindow(int ms)
+{
+  RecordSetting(SETTING_CHORD_WINDOW, 0, ms);
+  _chordWindowMs = constrain(ms, 0, MAX_CHORD_WINDOW_MS);
 }
 
-void ArpEngine::SetGate(int gateLength) // 0..100 (%)
+ARP_TEMPLATE void ARP_ENGINE::SetTempo(int tempo)
 {
-  _gate = gateLength;
-  _delayMsGate = _delayMs * _gate / 100;
+  RecordSetting(SETTING_TEMPO, 0, tempo);
+  Config& config = ShadowConfig();
+  config.tempo = tempo;
+  config.delayMs = ((ulong)60000/4)/tempo;
+  config.delayMsGate = config.delayMs * config.gate / 100;
+
+  // Set note interval (for MIDI sync mode)
+  static const ulong divisionTicks[DIVISION_COUNT] = {
+    // in ticks: 24 pulses per 1/4 note
+    96 * TICKS_PER_PULSE, // 1/1
+    72 * TICKS_PER_PULSE, // 1/2 dotted
+    48 * TICKS_PER_PULSE, // 1/2
+    36 * TICKS_PER_PULSE, // 1/4 dotted
+    32 * TICKS_PER_PULSE, // 1/2 triplet
+    24 * TICKS_PER_PULSE, // 1/4
+    18 * TICKS_PER_PULSE, // 1/8 dotted
+    16 * TICKS_PER_PULSE, // 1/4 triplet
+    12 * TICKS_PER_PULSE, // 1/8
+    9 * TICKS_PER_PULSE, // 1/16 dotted
+    8 * TICKS_PER_PULSE, // 1/8 triplet
+    6 * TICKS_PER_PULSE, // 1/16
+    24 * TICKS_PER_PULSE / 5, // 1/16 quintuplet
+    9 * TICKS_PER_PULSE / 2, // 1/32 dotted
+    4 * TICKS_PER_PULSE, // 1/16 triplet
+    3 * TICKS_PER_PULSE, // 1/32
+    12 * TICKS_PER_PULSE / 5, // 1/32 quintuplet
+    2 * TICKS_PER_PULSE, // 1/32 triplet
+    3 * TICKS_PER_PULSE / 2, // 1/64
+    1 * TICKS_PER_PULSE, // 1/64 triplet
+  };
+  int division = (tempo-MIN_TEMPO)*DIVISION_COUNT/(MAX_TEMPO-MIN_TEMPO);
+  config.noteIntervalTicks = divisionTicks[constrain(division, 0, DIVISION_COUNT-1)];
+  config.gateLengthTicks = MAX(config.noteIntervalTicks * config.gate / 100, 1UL); // (0 = no event)
+  UpdateGroove(config);
+  ConfigChanged();
 
-  Print("Gate: "); Print(_gate);
-  Print(", _delayMs: "); Print(_delayMs);
-  Print(", _delayMsGate: "); PrintLn(_delayMsGate);
+  Print("Tempo: "); Print(config.tempo);
+  Print(", delayMs: "); Print(config.delayMs);
+  Print(", delayMsGate: "); PrintLn(config.delayMsGate);
 }
 
-void ArpEngine::SetMidiSync(bool midiSyncEnabled)
+ARP_TEMPLATE void ARP_ENGINE::SetGate(int gateLength) // 0..100 (%)
+{
+  RecordSetting(SETTING_GATE, 0, gateLength);
+  Config& config = ShadowConfig();
+  config.gate = gateLength;
+  config.delayMsGate = config.delayMs * config.gate / 100;
+  config.gateLengthTicks = MAX(config.noteIntervalTicks * config.gate / 100, 1UL); // (0 = no event)
+  ConfigChanged();
+
+  Print("Gate: "); Print(config.gate);
+  Print(", delayMs: "); Print(config.delayMs);
+  Print(", delayMsGate: "); PrintLn(config.delayMsGate);
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetMidiSync(bool midiSyncEnabled)
 {
   // NOTE: To ensure everything is set up correctly,
   // we temporarily turn the arpeggiator off
   // if running
+  RecordSetting(SETTING_MIDI_SYNC, 0, midiSyncEnabled);
+  _settingNested = true;
   bool wasEnabled = _isEnabled;
   if (_isEnabled) SetEnabled(false);
   _midiSync = midiSyncEnabled;
+  _events.clear(); // (times are in the old scheduler's units)
+  for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+    _lanes[channel].scheduled = false; // (and so are the lanes' grids)
+  }
+  if (_clockOut != NULL) {
+    RunClockOutput(); // (Stop, if started)
+    if (_midiSync) _clockOut->stop();
+    else if (!_clockOut->isRunning()) _clockOut->start(0);
+  }
+  // (groove offsets are in the scheduler's units: these change now)
+  UpdateGroove(ShadowConfig());
+  ConfigChanged();
+  PublishConfig(true);
   if (wasEnabled) SetEnabled(true);
+  _settingNested = false;
   Print("MIDI Sync: ");
   Print(midiSyncEnabled ? "on" : "off");
 }
 
-void ArpEngine::SetMode(int mode)
+ARP_TEMPLATE void ARP_ENGINE::SetMode(int mode, int channel)
 {
-  _mode = mode;
+  RecordSetting(SETTING_MODE, channel, mode);
+  Config& config = ShadowConfig();
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    if (channel == ALL_CHANNELS || channel == c) config.lanes[c].mode = mode;
+  }
+  ConfigChanged();
   
   Print("Mode: ");
-  switch (_mode)
+  switch (mode)
   {
     case MODE_UP: PrintLn("Up"); break;
     case MODE_DOWN: PrintLn("Down"); break;
@@ -666,18 +1835,484 @@ void ArpEngine::SetMode(int mode)
   }
 }
 
-void ArpEngine::SetVelocityMode(int velocityMode)
+ARP_TEMPLATE void ARP_ENGINE::SetVelocityMode(int velocityMode, int channel)
 {
-  _velMode = velocityMode;
+  RecordSetting(SETTING_VELOCITY_MODE, channel, velocityMode);
+  Config& config = ShadowConfig();
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    if (channel == ALL_CHANNELS || channel == c) config.lanes[c].velMode = velocityMode;
+  }
+  ConfigChanged();
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetRange(int extraOctaves, int channel)
+{
+  RecordSetting(SETTING_RANGE, channel, extraOctaves);
+  Config& config = ShadowConfig();
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    if (channel == ALL_CHANNELS || channel == c) config.lanes[c].range = extraOctaves;
+  }
+  ConfigChanged();
 }
 
-void ArpEngine::SetRange(int extraOctaves)
+ARP_TEMPLATE void ARP_ENGINE::SetClockLossMode(int clockLossMode)
 {
-  _range = extraOctaves;
+  RecordSetting(SETTING_CLOCK_LOSS_MODE, 0, clockLossMode);
+  _clockLossMode = clockLossMode;
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetSwing(int swing) // 50..75 (%)
+{
+  RecordSetting(SETTING_SWING, 0, swing);
+  Config& config = ShadowConfig();
+  config.swing = constrain(swing, MIN_SWING, MAX_SWING);
+  UpdateGroove(config);
+  ConfigChanged();
+  Print("Swing: "); PrintLn(config.swing);
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetGroove(int groove)
+{
+  if (groove < 0 || groove >= GROOVE_COUNT) return;
+  RecordSetting(SETTING_GROOVE, 0, groove);
+  Config& config = ShadowConfig();
+  config.groove = groove;
+  UpdateGroove(config);
+  ConfigChanged();
+  Print("Groove: "); PrintLn(config.groove);
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetRatchet(int notesPerStep, int channel)
+{
+  RecordSetting(SETTING_RATCHET, channel, notesPerStep);
+  Config& config = ShadowConfig();
+  notesPerStep = constrain(notesPerStep, MIN_RATCHET, MAX_RATCHET);
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    if (channel == ALL_CHANNELS || channel == c) config.lanes[c].ratchet = notesPerStep;
+  }
+  ConfigChanged();
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetRatchetDecay(int percent) // 0..100 (%)
+{
+  RecordSetting(SETTING_RATCHET_DECAY, 0, percent);
+  ShadowConfig().ratchetDecay = constrain(percent, 0, 100);
+  ConfigChanged();
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetVelocityCurve(int curve, int fixedVelocity)
+{
+  if (curve < 0 || curve >= VEL_CURVE_COUNT) return;
+  RecordSetting(SETTING_VELOCITY_CURVE, constrain(fixedVelocity, 1, 127), curve);
+  Config& config = ShadowConfig();
+  config.velocityCurve = curve;
+  config.fixedVelocity = constrain(fixedVelocity, 1, 127);
+  UpdateVelocity(config);
+  ConfigChanged();
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetVelocityShape(int shape, int depth)
+{
+  if (shape < 0 || shape >= VEL_SHAPE_COUNT) return;
+  RecordSetting(SETTING_VELOCITY_SHAPE, constrain(depth, 0, 100), shape);
+  Config& config = ShadowConfig();
+  config.velocityShape = shape;
+  config.velocityDepth = constrain(depth, 0, 100);
+  UpdateVelocity(config);
+  ConfigChanged();
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetAccent(int pattern, int amount)
+{
+  if (pattern < 0 || pattern >= ACCENT_COUNT) return;
+  RecordSetting(SETTING_ACCENT, constrain(amount, 0, MAX_ACCENT), pattern);
+  Config& config = ShadowConfig();
+  config.accent = pattern;
+  config.accentAmount = constrain(amount, 0, MAX_ACCENT);
+  UpdateGroove(config);
+  ConfigChanged();
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetPatternStep(int pattern, int step, int value)
+{
+  static const int8_t limits[PATTERN_COUNT][2] = { // (min, max)
+    { -MAX_PATTERN_OCTAVES, MAX_PATTERN_OCTAVES },
+    { -MAX_PATTERN_VELOCITY, MAX_PATTERN_VELOCITY },
+    { 0, MAX_GATE },
+    { TRIGGER_PLAY, TRIGGER_COUNT - 1 },
+  };
+  if (pattern < 0 || pattern >= PATTERN_COUNT || step < 0 || step >= PATTERN_STEPS) return;
+  RecordSetting(SETTING_PATTERN_STEP, pattern * PATTERN_STEPS + step, value);
+  ShadowConfig().patterns[pattern][step] = constrain(value, limits[pattern][0], limits[pattern][1]);
+  ConfigChanged();
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetPatternLength(int pattern, int length)
+{
+  if (pattern < 0 || pattern >= PATTERN_COUNT || length < 0 || length > PATTERN_STEPS) return;
+  RecordSetting(SETTING_PATTERN_LENGTH, pattern, length);
+  ShadowConfig().patternLengths[pattern] = length;
+  ConfigChanged();
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetConfigUpdate(int update)
+{
+  RecordSetting(SETTING_CONFIG_UPDATE, 0, update);
+  _configUpdate = update;
+  if (_configUpdate == CONFIG_IMMEDIATE) PublishConfig(true);
+}
+
+ARP_TEMPLATE void ARP_ENGINE::MapCC(int controller, int mapping, int channel)
+{
+  if (controller < 0 || controller > 127) return;
+  if (mapping < 0 || (mapping & ~CC_CONSUME) >= CC_PARAMETER_COUNT) return;
+  RecordSetting(SETTING_MAP_CC, channel, controller | (mapping << 8));
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    if (channel == ALL_CHANNELS || channel == c) _ccMappings[c][controller] = mapping;
+  }
+}
+
+ARP_TEMPLATE void ARP_ENGINE::LearnCC(int mapping)
+{
+  if (mapping < 0 || (mapping & ~CC_CONSUME) >= CC_PARAMETER_COUNT) return;
+  RecordSetting(SETTING_LEARN_CC, 0, mapping);
+  _ccLearnMapping = mapping;
+  _ccLearning = true;
+  PrintLn("CC learn: waiting for CC");
+}
+
+ARP_TEMPLATE void ARP_ENGINE::GetParameters(Parameters& parameters)
+{
+  parameters.sync = _midiSync;
+  parameters.enabled = _isEnabled;
+  parameters.hold = _hold;
+  // (the latest settings, even if not yet in effect)
+  const Config& config = *_shadow;
+  parameters.mode = config.lanes[0].mode;
+  parameters.range = config.lanes[0].range;
+  parameters.velocityMode = config.lanes[0].velMode;
+  parameters.tempo = config.tempo;
+  parameters.gate = config.gate;
+  parameters.swing = config.swing;
+  parameters.groove = config.groove;
+  parameters.ratchet = config.lanes[0].ratchet;
+  parameters.ratchetDecay = config.ratchetDecay;
+  parameters.clockLossMode = _clockLossMode;
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetParameters(const Parameters& parameters)
+{
+  if (parameters.sync != _midiSync) SetMidiSync(parameters.sync);
+  SetTempo(parameters.tempo);
+  SetGate(parameters.gate);
+  SetMode(parameters.mode);
+  SetRange(parameters.range);
+  SetVelocityMode(parameters.velocityMode);
+  SetSwing(parameters.swing);
+  SetGroove(parameters.groove);
+  SetRatchet(parameters.ratchet);
+  SetRatchetDecay(parameters.ratchetDecay);
+  SetClockLossMode(parameters.clockLossMode);
+  if (parameters.hold != _hold) SetHold(parameters.hold);
+  if (parameters.enabled != _isEnabled) SetEnabled(parameters.enabled);
+}
+
+// Encoded parameters:
+// 0: flags (bit 0: sync, 1: enabled, 2: hold, 3: stop on clock loss)
+// 1: mode, 2: range, 3: velocity mode, 4-5: tempo (msb, lsb),
+// 6: gate, 7: swing, 8: groove, 9: ratchet, 10: ratchet decay
+ARP_TEMPLATE void ARP_ENGINE::EncodeParameters(const Parameters& parameters, byte* data)
+{
+  data[0] = (parameters.sync ? 0x01 : 0) | (parameters.enabled ? 0x02 : 0) |
+    (parameters.hold ? 0x04 : 0) | (parameters.clockLossMode == CLOCK_LOSS_STOP ? 0x08 : 0);
+  data[1] = parameters.mode;
+  data[2] = parameters.range;
+  data[3] = parameters.velocityMode;
+  data[4] = parameters.tempo >> 7;
+  data[5] = parameters.tempo & 0x7f;
+  data[6] = parameters.gate;
+  data[7] = parameters.swing;
+  data[8] = parameters.groove;
+  data[9] = parameters.ratchet;
+  data[10] = parameters.ratchetDecay;
+}
+
+ARP_TEMPLATE bool ARP_ENGINE::DecodeParameters(const byte* data, Parameters& parameters)
+{
+  if (data[0] > 0x0f) return false;
+  parameters.sync = data[0] & 0x01;
+  parameters.enabled = data[0] & 0x02;
+  parameters.hold = data[0] & 0x04;
+  parameters.clockLossMode = (data[0] & 0x08) ? CLOCK_LOSS_STOP : CLOCK_LOSS_FREEWHEEL;
+  parameters.mode = data[1];
+  parameters.range = data[2];
+  parameters.velocityMode = data[3];
+  parameters.tempo = (data[4] << 7) | (data[5] & 0x7f);
+  parameters.gate = data[6];
+  parameters.swing = data[7];
+  parameters.groove = data[8];
+  parameters.ratchet = data[9];
+  parameters.ratchetDecay = data[10];
+  return parameters.mode < MODE_COUNT &&
+    parameters.range <= MAX_RANGE &&
+    parameters.velocityMode < VEL_COUNT &&
+    parameters.tempo >= MIN_TEMPO && parameters.tempo <= MAX_TEMPO &&
+    parameters.gate <= MAX_GATE &&
+    parameters.swing >= MIN_SWING && parameters.swing <= MAX_SWING &&
+    parameters.groove < GROOVE_COUNT &&
+    parameters.ratchet >= MIN_RATCHET && parameters.ratchet <= MAX_RATCHET &&
+    parameters.ratchetDecay <= 100;
+}
+
+ARP_TEMPLATE void ARP_ENGINE::Panic()
+{
+  PrintLn("Panic!");
+  RecordSetting(SETTING_PANIC, 0, 0);
+  // Called from Run() (e.g. on a received System Reset), the output
+  // collected so far goes out first, as it must come before the
+  // panic's note-offs; the panic is then sent right away, not held
+  // until the end of the pass
+  bool batch = _midiOutBatch;
+  FlushMidiOut();
+  _midiOutBatch = false;
+  for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+    Lane& lane = _lanes[channel];
+    lane.noteCount = 0;
+    lane.keyCount = 0;
+    lane.firstNotePending = false;
+    lane.chordPending = false;
+    lane.tied = false;
+    lane.nextOffEventAt = 0;
+    lane.nextOffEventAtTick = 0;
+  }
+  // Note-offs first (only for notes known to be sounding), then
+  // All Notes/Sound Off for anything else that's out there
+  for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+    ReleaseChannel(channel);
+  }
+  for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+    SendControlChange(channel, MidiCCAllNotesOff, 0);
+    SendControlChange(channel, MidiCCAllSoundOff, 0);
+  }
+  _midiOutBatch = batch;
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetCapture(MidiCapture* capture)
+{
+  _capture = capture;
+}
+
+// Records a settings change made between Run() calls (the ones made
+// by Run() itself, e.g. by SysEx or CC, are replayed from its input)
+ARP_TEMPLATE void ARP_ENGINE::RecordSetting(int setting, int index, int value)
+{
+  if (_capture == NULL || _midiOutBatch || _settingNested) return;
+  _capture->recordSetting(setting, (uint8_t)index, value, _now);
+  _settingRecorded = true; // (so the next Run() is recorded, too)
+}
+
+// Records this Run() call (once): one that reads input, or follows a
+// settings change or skipped ms, or repeats the ms of one that read
+// input or sent output (every other one is one per ms)
+ARP_TEMPLATE void ARP_ENGINE::RecordRun()
+{
+  if (_runRecorded) return;
+  _capture->recordRun(_runSkippedMs, _now);
+  _runRecorded = true;
+  _settingRecorded = false;
+}
+
+ARP_TEMPLATE void ARP_ENGINE::StartCapture()
+{
+  if (_capture == NULL) return;
+  _capture->start(_now);
+  _midiOutStatus = 0; // (the next message goes out with its status, as on a fresh engine)
+
+  // All settings, in an order that sets them up on a fresh engine
+  // (as SetParameters does: sync first, enabled last)
+  const Config& config = *_shadow;
+  RecordSetting(SETTING_CONFIG_UPDATE, 0, _configUpdate);
+  RecordSetting(SETTING_RUNNING_STATUS, 0, _runningStatus);
+  RecordSetting(SETTING_MIDI_SYNC, 0, _midiSync);
+  RecordSetting(SETTING_CLOCK_LOSS_MODE, 0, _clockLossMode);
+  RecordSetting(SETTING_CLOCK_OUTPUT, 0, _clockOut != NULL);
+  RecordSetting(SETTING_TEMPO, 0, config.tempo);
+  RecordSetting(SETTING_GATE, 0, config.gate);
+  RecordSetting(SETTING_SWING, 0, config.swing);
+  RecordSetting(SETTING_GROOVE, 0, config.groove);
+  RecordSetting(SETTING_RATCHET_DECAY, 0, config.ratchetDecay);
+  RecordSetting(SETTING_VELOCITY_CURVE, config.fixedVelocity, config.velocityCurve);
+  RecordSetting(SETTING_VELOCITY_SHAPE, config.velocityDepth, config.velocityShape);
+  RecordSetting(SETTING_ACCENT, config.accentAmount, config.accent);
+  for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+    // (all channels as channel 0, then the ones that differ)
+    const LaneConfig& lane = config.lanes[channel];
+    const LaneConfig& first = config.lanes[0];
+    int index = channel == 0 ? ALL_CHANNELS : channel;
+    if (channel == 0 || lane.mode != first.mode) RecordSetting(SETTING_MODE, index, lane.mode);
+    if (channel == 0 || lane.velMode != first.velMode) RecordSetting(SETTING_VELOCITY_MODE, index, lane.velMode);
+    if (channel == 0 || lane.range != first.range) RecordSetting(SETTING_RANGE, index, lane.range);
+    if (channel == 0 || lane.ratchet != first.ratchet) RecordSetting(SETTING_RATCHET, index, lane.ratchet);
+  }
+  for (int pattern = 0; pattern < PATTERN_COUNT; pattern++) {
+    for (int step = 0; step < PATTERN_STEPS; step++) {
+      int value = config.patterns[pattern][step];
+      if (value != 0) RecordSetting(SETTING_PATTERN_STEP, pattern * PATTERN_STEPS + step, value);
+    }
+    RecordSetting(SETTING_PATTERN_LENGTH, pattern, config.patternLengths[pattern]);
+  }
+  for (int controller = 0; controller < 128; controller++) {
+    // (all channels as channel 0, then the ones that differ)
+    byte mapping = _ccMappings[0][controller];
+    if (mapping != CC_NONE) RecordSetting(SETTING_MAP_CC, ALL_CHANNELS, controller | (mapping << 8));
+    for (int channel = 1; channel < CHANNEL_COUNT; channel++) {
+      byte channelMapping = _ccMappings[channel][controller];
+      if (channelMapping != mapping) RecordSetting(SETTING_MAP_CC, channel, controller | (channelMapping << 8));
+    }
+  }
+  if (_ccLearning) RecordSetting(SETTING_LEARN_CC, 0, _ccLearnMapping);
+  RecordSetting(SETTING_CHORD_WINDOW, 0, _chordWindowMs);
+  RecordSetting(SETTING_CHORDS, 0, _chords);
+  RecordSetting(SETTING_HOLD, 0, _hold);
+  RecordSetting(SETTING_ENABLED, 0, _isEnabled);
+}
+
+ARP_TEMPLATE void ARP_ENGINE::ReplaySetting(int setting, int index, int value, ClockGenerator* clockGenerator)
+{
+  int channel = index == 0xff ? ALL_CHANNELS : index;
+  switch (setting) {
+    case SETTING_ENABLED: SetEnabled(value); break;
+    case SETTING_HOLD: SetHold(value); break;
+    case SETTING_CHORDS: SetChords(value); break;
+    case SETTING_CHORD_WINDOW: SetChordWindow(value); break;
+    case SETTING_TEMPO: SetTempo(value); break;
+    case SETTING_MIDI_SYNC: SetMidiSync(value); break;
+    case SETTING_GATE: SetGate(value); break;
+    case SETTING_MODE: SetMode(value, channel); break;
+    case SETTING_VELOCITY_MODE: SetVelocityMode(value, channel); break;
+    case SETTING_RANGE: SetRange(value, channel); break;
+    case SETTING_CLOCK_LOSS_MODE: SetClockLossMode(value); break;
+    case SETTING_SWING: SetSwing(value); break;
+    case SETTING_GROOVE: SetGroove(value); break;
+    case SETTING_RATCHET: SetRatchet(value, channel); break;
+    case SETTING_RATCHET_DECAY: SetRatchetDecay(value); break;
+    case SETTING_VELOCITY_CURVE: SetVelocityCurve(value, index); break;
+    case SETTING_VELOCITY_SHAPE: SetVelocityShape(value, index); break;
+    case SETTING_ACCENT: SetAccent(value, index); break;
+    case SETTING_PATTERN_STEP: SetPatternStep(index / PATTERN_STEPS, index % PATTERN_STEPS, value); break;
+    case SETTING_PATTERN_LENGTH: SetPatternLength(index, value); break;
+    case SETTING_CONFIG_UPDATE: SetConfigUpdate(value); break;
+    case SETTING_MAP_CC: MapCC(value & 0xff, value >> 8, channel); break;
+    case SETTING_LEARN_CC: LearnCC(value); break;
+    case SETTING_RUNNING_STATUS: SetRunningStatus(value); break;
+    case SETTING_CLOCK_OUTPUT: SetClockOutput(value ? clockGenerator : NULL); break;
+    case SETTING_PANIC: Panic(); break;
+  }
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetRunningStatus(bool runningStatus)
+{
+  RecordSetting(SETTING_RUNNING_STATUS, 0, runningStatus);
+  _runningStatus = runningStatus;
+  _midiOutStatus = 0; // (next message: with status)
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetClockOutput(ClockGenerator* clockGenerator)
+{
+  RecordSetting(SETTING_CLOCK_OUTPUT, 0, clockGenerator != NULL);
+  if (_clockOut != NULL) {
+    if (_clockOutStarted) WriteMidiOut(MidiStop);
+    _clockOut->stop();
+  }
+  _clockOutStarted = false;
+  _clockOut = clockGenerator;
+  if (_clockOut != NULL) {
+    _clockOut->setQuarterNoteLength(_config->delayMs * 4 * 1000);
+    if (!_midiSync) _clockOut->start(0);
+  }
+}
+
+ARP_TEMPLATE void ARP_ENGINE::SetTimingStats(TimingStats* noteOnTiming, TimingStats* noteOffTiming,
+  TimingStats* clockOutTiming)
+{
+  _noteOnTiming = noteOnTiming;
+  _noteOffTiming = noteOffTiming;
+  _clockOutTiming = clockOutTiming;
+}
+
+ARP_TEMPLATE void ARP_ENGINE::KeepEarliest(ulong& next, ulong at)
+{
+  if ((long)(at - next) < 0) next = at;
+}
+
+ARP_TEMPLATE ulong ARP_ENGINE::NextEventAt(ulong latest)
+{
+  ulong next = latest;
+  EventQueue::Event event;
+  if ((_parametersPending && ParametersDue()) || (ConfigPending() && !RetiredConfigInUse())) return _now;
+  if (_isEnabled && _chords) {
+    for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+      if (_lanes[channel].chordPending) KeepEarliest(next, _lanes[channel].chordAt);
+    }
+  }
+  if (!_midiSync) {
+    KeepEarliest(next, _nextBeatEventAt);
+    if (_isEnabled) {
+      for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+        Lane& lane = _lanes[channel];
+        if (!IsArpeggiating(lane)) continue;
+        KeepEarliest(next, lane.nextOnEventAt);
+        if (lane.nextOffEventAt > 0) KeepEarliest(next, lane.nextOffEventAt);
+      }
+      if (_events.peek(event)) KeepEarliest(next, event.time);
+    }
+  }
+  else if (_transport == TRANSPORT_RUNNING && _pulsePeriodX256 > 0) {
+    // Events are due at ticks, which only advance with the clock
+    // (or, while freewheeling, the estimated tempo): estimate their
+    // times. (Waking early is harmless, the events just aren't due.)
+    if (!_clockFreewheel) {
+      // clock dropout check
+      KeepEarliest(next, _lastPulseAt + (_pulsePeriodX256 * CLOCK_DROPOUT_PULSES >> 8) + 1);
+    }
+    ulong nextTick = _nextBeatEventAtTick;
+    if (_isEnabled) {
+      for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+        Lane& lane = _lanes[channel];
+        if (!IsArpeggiating(lane)) continue;
+        if ((long)(lane.nextOnEventAtTick - nextTick) < 0) nextTick = lane.nextOnEventAtTick;
+        if (lane.nextOffEventAtTick > 0 && (long)(lane.nextOffEventAtTick - nextTick) < 0) {
+          nextTick = lane.nextOffEventAtTick;
+        }
+      }
+      if (_events.peek(event) && (long)(event.time - nextTick) < 0) nextTick = event.time;
+    }
+    KeepEarliest(next, TickTime(nextTick));
+  }
+  return next;
+}
+
+ARP_TEMPLATE bool ARP_ENGINE::IsIdle()
+{
+  for (int channel = 0; channel < CHANNEL_COUNT; channel++) {
+    if (_lanes[channel].noteCount > 0 || _lanes[channel].keyCount > 0) return false;
+  }
+  return true;
+}
+
+ARP_TEMPLATE bool ARP_ENGINE::IsStopped()
+{
+  if (!IsIdle()) return false;
+  if (_midiSync) return _transport != TRANSPORT_RUNNING;
+  return !_clockOutStarted;
 }
 
 // int ArpEngine::GetBeatDelayMs()
 // {
 //   // TODO: add MIDI sync support
 //   return _delayMs;
-// }
\ No newline at end of file
+// }
+
+// Instantiation used by this firmware. (For other port types, e.g.
+// mock ports on a host, include this file and instantiate there.)
+template class BasicArpEngine<ArpMidiPort, ArpMidiPort>;
\ No newline at end of file
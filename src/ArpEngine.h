@@ -8,16 +8,41 @@ lars@ahlzen.com
 
 #include <Arduino.h>
 #include <stdint.h>
+#include <atomic>
 #include "common.h"
+#include "MidiCapture.h"
+#include "TimingStats.h"
+#include "EventQueue.h"
+#include "ClockGenerator.h"
+#ifdef USE_TINYUSB
+#include <Adafruit_TinyUSB.h>
+#endif
 
 
-class ArpEngine
+// The engine is a template over its port types, so that all port
+// I/O (several calls per MIDI byte) is resolved at compile time
+// and can be inlined, instead of going through virtual Stream calls.
+// Ports can be any concrete MIDI byte stream class (e.g. SerialUART
+// for DIN MIDI, Adafruit_USBD_MIDI for USB MIDI, MidiLoopback or a
+// mock port). Note that calls are bound to the given class, so it
+// must be the actual (most derived) class of the port.
+//
+// ArpEngine (below) is the instantiation used by this firmware.
+
+template <
+   class MidiInPort = decltype(Serial1),
+   class MidiOutPort = decltype(Serial1),
+   class SyncPort = decltype(Serial2),
+   class DebugPort = decltype(Serial)>
+class BasicArpEngine
 {
 public:
-   ArpEngine(
-      HardwareSerial* midiPort,
-      HardwareSerial* syncPort,
-      HardwareSerial* debugPort = NULL);
+   // In and out may be the same port. The sync port is optional.
+   BasicArpEngine(
+      MidiInPort* midiInPort,
+      MidiOutPort* midiOutPort,
+      SyncPort* syncPort,
+      DebugPort* debugPort = NULL);
 
 public:
    // Constants
@@ -25,6 +50,8 @@ public:
    static const int MAX_TEMPO = 300; // bpm
    static const int MIN_GATE = 0; // %
    static const int MAX_GATE = 100; // %
+   static const int DEFAULT_CHORD_WINDOW_MS = 15; // (keys this close together make one chord)
+   static const int MAX_CHORD_WINDOW_MS = 50;
 
    // Arpeggiator mode
    static const int MODE_UP = 0;
@@ -37,37 +64,191 @@ public:
    // static const int MODE_RANDOM2 = 5; // random: pick new note AND octave each time
    // static const int MODE_COUNT = 6; 
 
-   // Note length (for MIDI sync mode)
-   static const int LENGTH_WHOLE = 0;
-   static const int LENGTH_HALF = 1;
-   static const int LENGTH_THIRD = 2; // 1/4 triplet
-   static const int LENGTH_QUARTER = 3;
-   static const int LENGTH_SIXTH = 4; // 1/8 triplet
-   static const int LENGTH_EIGHTH = 5;
-   static const int LENGTH_TWELVTH = 6; // 1/16 triplet
-   static const int LENGTH_SIXTEENTH = 7;
-   static const int LENGTH_TWENTYFOURTH = 8; // 1/32 triplet
-   static const int LENGTH_THIRTYSECOND = 9;
-   static const int LENGTH_COUNT = 10;
+   // Note divisions (for MIDI sync mode, selected with the tempo
+   // setting): straight, dotted, triplet and quintuplet values
+   // from 1/1 down to 1/64, longest first (see SetTempo)
+   static const int DIVISION_COUNT = 20;
    
    // Velocity mode
    static const int VEL_EACH = 0; // use each note's velocity value
    static const int VEL_SAME = 1; // use same velocity value (first note's) for all
    static const int VEL_MAX = 2; // use max value of all notes in chord
-   static const int VEL_DECR = 3; // decrease velocity throughout arp
+   static const int VEL_DECR = 3; // decrease velocity throughout arp (max, with the decay shape)
    static const int VEL_COUNT = 4;
 
+   // Velocity curves (applied to the velocity picked by the mode)
+   static const int VEL_CURVE_LINEAR = 0;
+   static const int VEL_CURVE_SOFT = 1; // louder low velocities
+   static const int VEL_CURVE_HARD = 2; // softer low velocities
+   static const int VEL_CURVE_FIXED = 3; // same velocity for all notes
+   static const int VEL_CURVE_COUNT = 4;
+
+   // Velocity shapes (over each cycle of the arpeggio, reaching their
+   // depth after VEL_SHAPE_STEPS steps)
+   static const int VEL_SHAPE_FLAT = 0;
+   static const int VEL_SHAPE_DECAY = 1; // softer each step
+   static const int VEL_SHAPE_RAMP = 2; // louder each step
+   static const int VEL_SHAPE_COUNT = 3;
+   static const int VEL_SHAPE_STEPS = 16;
+
+   // Accent patterns (louder steps, on the groove's 16 step cycle)
+   static const int ACCENT_NONE = 0;
+   static const int ACCENT_BEATS = 1; // every 4th step
+   static const int ACCENT_OFFBEATS = 2; // every 4th step, from the 3rd
+   static const int ACCENT_CLAVE = 3; // 3+3+2 steps
+   static const int ACCENT_COUNT = 4;
+   static const int MAX_ACCENT = 63; // (velocity added)
+
+   // Patterns: a value per step, each pattern with its own length, so
+   // they go around against the notes (and each other) polymetrically
+   static const int PATTERN_OCTAVE = 0; // octaves added: -MAX_PATTERN_OCTAVES..MAX_PATTERN_OCTAVES
+   static const int PATTERN_VELOCITY = 1; // velocity added: -MAX_PATTERN_VELOCITY..MAX_PATTERN_VELOCITY
+   static const int PATTERN_GATE = 2; // gate (%, 0 = the gate setting)
+   static const int PATTERN_TRIGGER = 3; // TRIGGER_PLAY etc.
+   static const int PATTERN_COUNT = 4;
+   static const int PATTERN_STEPS = 16; // (max length)
+   static const int MAX_PATTERN_OCTAVES = 3;
+   static const int MAX_PATTERN_VELOCITY = 63;
+   static const int TRIGGER_PLAY = 0;
+   static const int TRIGGER_REST = 1; // no note
+   static const int TRIGGER_TIE = 2; // previous note sounds on (a rest, if there's none)
+   static const int TRIGGER_COUNT = 3;
+
+   // Swing (% of a pair of steps taken by the first one)
+   static const int MIN_SWING = 50; // straight
+   static const int MAX_SWING = 75;
+
+   // Groove templates (per-step timing and velocity offsets,
+   // repeating every GROOVE_STEPS steps)
+   static const int GROOVE_STRAIGHT = 0;
+   static const int GROOVE_ACCENT = 1; // accented beats
+   static const int GROOVE_LAID_BACK = 2; // late, soft off-beats
+   static const int GROOVE_HUMANIZE = 3; // small irregularities
+   static const int GROOVE_COUNT = 4;
+   static const int GROOVE_STEPS = 16;
+
+   // Ratchets (notes per step, evenly spaced within the step)
+   static const int MIN_RATCHET = 1; // off
+   static const int MAX_RATCHET = 8;
+
+   // What to do when the external MIDI clock drops out
+   static const int CLOCK_LOSS_FREEWHEEL = 0; // keep playing at last measured tempo
+   static const int CLOCK_LOSS_STOP = 1; // silence and wait for clock to return
+
+   // MIDI channels (one arpeggiator lane each)
+   static const int CHANNEL_COUNT = 16;
+   static const int ALL_CHANNELS = -1;
+
+   static const int MAX_RANGE = 4; // extra octaves
+
+   // When setting changes take effect (see SetConfigUpdate)
+   static const int CONFIG_AT_STEP = 0; // together, at each lane's next step
+   static const int CONFIG_IMMEDIATE = 1; // each one right away
+
+   // SysEx configuration messages: F0 7D 41 <command> <data> F7
+   // (see README for the data formats)
+   static const byte SYSEX_MANUFACTURER_ID = 0x7d; // non-commercial
+   static const byte SYSEX_DEVICE_ID = 0x41;
+   static const byte SYSEX_PARAMETERS = 0x01; // <parameters> <checksum>
+   static const byte SYSEX_REQUEST_PARAMETERS = 0x02;
+   static const byte SYSEX_PRESET = 0x03; // <preset> <parameters> <checksum>
+   static const byte SYSEX_REQUEST_PRESET = 0x04; // <preset>
+   static const byte SYSEX_RECALL_PRESET = 0x05; // <preset>
+   static const byte SYSEX_STORE_PRESET = 0x06; // <preset>
+   static const byte SYSEX_MAP_CC = 0x07; // <channel (7F: all)> <controller> <mapping>
+   static const byte SYSEX_LEARN_CC = 0x08; // <mapping>
+   static const byte SYSEX_PATTERN = 0x09; // <pattern> <length> <values> (octave, velocity: +40h)
+
+   // CC remote control: parameters that can be mapped to a controller
+   // (per MIDI channel). Mode, range and velocity mode are set for
+   // the channel the CC is received on, the others for all channels.
+   static const int CC_NONE = 0; // not mapped
+   static const int CC_TEMPO = 1;
+   static const int CC_GATE = 2;
+   static const int CC_MODE = 3;
+   static const int CC_RANGE = 4;
+   static const int CC_HOLD = 5;
+   static const int CC_VELOCITY_MODE = 6;
+   static const int CC_VELOCITY_CURVE = 7;
+   static const int CC_FIXED_VELOCITY = 8;
+   static const int CC_VELOCITY_SHAPE = 9;
+   static const int CC_VELOCITY_DEPTH = 10;
+   static const int CC_ACCENT = 11;
+   static const int CC_ACCENT_AMOUNT = 12;
+   static const int CC_CHORD_WINDOW = 13;
+   static const int CC_PARAMETER_COUNT = 14;
+   static const int CC_CONSUME = 0x40; // (mapping flag) not passed through
+
+   // Settings changes, as recorded in a capture (see StartCapture):
+   // the setter's argument is the value, and its channel (0xff: all
+   // channels) or second argument the index
+   static const int SETTING_ENABLED = 1;
+   static const int SETTING_HOLD = 2;
+   static const int SETTING_CHORDS = 3;
+   static const int SETTING_CHORD_WINDOW = 4;
+   static const int SETTING_TEMPO = 5;
+   static const int SETTING_MIDI_SYNC = 6;
+   static const int SETTING_GATE = 7;
+   static const int SETTING_MODE = 8; // (index: channel)
+   static const int SETTING_VELOCITY_MODE = 9; // (index: channel)
+   static const int SETTING_RANGE = 10; // (index: channel)
+   static const int SETTING_CLOCK_LOSS_MODE = 11;
+   static const int SETTING_SWING = 12;
+   static const int SETTING_GROOVE = 13;
+   static const int SETTING_RATCHET = 14; // (index: channel)
+   static const int SETTING_RATCHET_DECAY = 15;
+   static const int SETTING_VELOCITY_CURVE = 16; // (index: fixed velocity)
+   static const int SETTING_VELOCITY_SHAPE = 17; // (index: depth)
+   static const int SETTING_ACCENT = 18; // (index: amount)
+   static const int SETTING_PATTERN_STEP = 19; // (index: pattern * PATTERN_STEPS + step)
+   static const int SETTING_PATTERN_LENGTH = 20; // (index: pattern)
+   static const int SETTING_CONFIG_UPDATE = 21;
+   static const int SETTING_MAP_CC = 22; // (index: channel, value: controller | mapping << 8)
+   static const int SETTING_LEARN_CC = 23;
+   static const int SETTING_RUNNING_STATUS = 24;
+   static const int SETTING_CLOCK_OUTPUT = 25; // (value: 1 = on)
+   static const int SETTING_PANIC = 26;
+
+   // All parameters (per-channel settings as set for all channels),
+   // e.g. for a preset. Encoded (7-bit) as PARAMETER_BYTES bytes.
+   struct Parameters
+   {
+      bool sync;
+      bool enabled;
+      bool hold;
+      int mode;
+      int range;
+      int velocityMode;
+      int tempo;
+      int gate;
+      int swing;
+      int groove;
+      int ratchet;
+      int ratchetDecay;
+      int clockLossMode;
+   };
+   static const int PARAMETER_BYTES = 11;
+
 private: // Configuration
-   HardwareSerial* _midiPort;
-   HardwareSerial* _syncPort;
-   HardwareSerial* _debugPort;
+   MidiInPort* _midiInPort;
+   MidiOutPort* _midiOutPort;
+   SyncPort* _syncPort;
+   DebugPort* _debugPort;
+   MidiCapture* _capture = NULL;
+   bool _settingNested = false; // in a setter called by another (not recorded)
+   bool _settingRecorded = false; // since the last Run() recorded
+   bool _runRecorded = false; // this Run() call
+   bool _runActive = false; // this Run() call read input or sent output
+   ulong _runSkippedMs = 0; // before this Run() call
+   TimingStats* _noteOnTiming = NULL;
+   TimingStats* _noteOffTiming = NULL;
+   TimingStats* _clockOutTiming = NULL;
+   ClockGenerator* _clockOut = NULL;
    bool _isEnabled = false;
    bool _hold = false;
-   int _mode = MODE_UP; // arp mode
-   int _range = 0; // range (number of *extra* octaves)
-   int _velMode = VEL_EACH; // velocity mode
-   uint _tempo = 100; // 30..300 (BPM)
-   uint _gate = 100; // 0..100 (%)
+   bool _chords = false; // chords mode: only arpeggiate 2 or more keys
+   ulong _chordWindowMs = DEFAULT_CHORD_WINDOW_MS;
+   bool _runningStatus = false;
 
 private: // Internal arpeggiator state
 
@@ -83,43 +264,176 @@ private: // Internal arpeggiator state
    static const int MIDI_WAITING_FOR_STATUS_OR_DATA1 = 0;
    static const int MIDI_WAITING_FOR_DATA2 = 1;
    static const int MIDI_IN_SYSEX = 2;
+   static const int SYNC_WAITING_FOR_STATUS = 0;
+   static const int SYNC_WAITING_FOR_SPP_LSB = 1;
+   static const int SYNC_WAITING_FOR_SPP_MSB = 2;
+
+   // External transport state (MIDI sync)
+   static const int TRANSPORT_STOPPED = 0; // after Stop: position held
+   static const int TRANSPORT_ARMED = 1; // after Start/Continue: waiting for first clock
+   static const int TRANSPORT_RUNNING = 2;
 
    // timing and sync
 
    bool _midiSync = false; // true: MIDI sync mode, false: internal sync (tempo)
 
    // For internal tempo sync
-   ulong _delayMs = 150; // 1/tempo (time between beats)
-   ulong _delayMsGate = 150; // gate length
-   ulong _nextOnEventAt = 0;
-   ulong _nextOffEventAt = 0;
    ulong _nextBeatEventAt = 0; // onBeat event timer
+   bool _clockOutStarted = false; // MIDI Start sent (arpeggio playing)
 
    // For external MIDI sync
    // 1 MIDI beat = a 16th note = 6 clock pulses
+   // Events are scheduled in ticks (fractions of a clock pulse), so
+   // that any division can be played. 240 ticks per pulse makes
+   // dotted, triplet and quintuplet values down to 1/64 exact.
+   // (Ticks wrap after about 100 hours at 120 BPM.)
+   static const ulong TICKS_PER_PULSE = 240;
    ulong _lastPulseAt = 0; // timestamp of last MIDI clock pulse
    ulong _pulseCounter = 0; // current MIDI pulse counter
-   ulong _noteIntervalPulses = 12; // delay between notes, in clock pulses
-   ulong _gateLengthPulses = 12; // gate length, in clock pulses
-   ulong _nextOnEventAtPulse = 0; 
-   ulong _nextOffEventAtPulse = 0;
-   ulong _nextBeatEventAtPulse = 0; // onBeat event timer
+   ulong _tick = 0; // current position in ticks (interpolated between pulses)
+   ulong _nextBeatEventAtTick = 0; // onBeat event timer
    bool _snapToBeat = true; // snap notes to nearest beat on MIDI clock
+   int _transport = TRANSPORT_RUNNING; // running until told otherwise (clock-only sources)
+   bool _holdNextPulse = true; // next clock lands on _pulseCounter (first clock, after Start/SPP)
+
+   // Clock dropout detection
+   static const int CLOCK_DROPOUT_PULSES = 3; // missing pulses before clock is considered lost
+   static const ulong MAX_PULSE_PERIOD_MS = 250; // longer gaps are not used for tempo estimate
+   int _clockLossMode = CLOCK_LOSS_FREEWHEEL;
+   ulong _pulsePeriodX256 = 0; // measured clock period (ms * 256), 0 = unknown
+   bool _clockFreewheel = false; // true: clock lost, running on estimated tempo
+   bool _clockStopped = false; // true: clock lost, stopped until it's back (CLOCK_LOSS_STOP)
+   ulong _freewheelFromPulse = 0; // _pulseCounter at last received clock
+
+   // Ratchet repeats (all notes of a step after the first) are
+   // queued when the step starts, and sent from the queue
+   EventQueue _events;
+
+private: // Arpeggio settings (double-buffered)
+
+   // Settings that shape the arpeggio, with the values derived from
+   // them. Setters write the shadow copy, and post each change (copy
+   // it to _posted), which Run() then publishes: copies to the spare
+   // one, which becomes the active one (_config).
+   // Each lane plays a step with the copy that was active when the
+   // step started (see ConfigOf), so a step never sees a partly
+   // applied change, and the copy published before (_retired) is kept
+   // until no lane is still in a step started with it.
+   struct LaneConfig
+   {
+      int8_t mode = MODE_UP; // arp mode
+      int8_t range = 0; // range (number of *extra* octaves)
+      int8_t velMode = VEL_EACH; // velocity mode
+      int8_t ratchet = MIN_RATCHET; // notes per step
+   };
+   struct Config
+   {
+      uint tempo = 100; // 30..300 (BPM)
+      uint gate = 100; // 0..100 (%)
+      uint swing = MIN_SWING; // (% of a pair of steps)
+      int groove = GROOVE_STRAIGHT;
+      uint ratchetDecay = 80; // velocity of each repeat (% of previous)
+      int velocityCurve = VEL_CURVE_LINEAR;
+      uint fixedVelocity = 100; // (fixed curve)
+      int velocityShape = VEL_SHAPE_FLAT;
+      uint velocityDepth = 50; // % (of velocity taken off at the softest step)
+      int accent = ACCENT_NONE;
+      uint accentAmount = 20; // velocity added on accented steps
+      LaneConfig lanes[CHANNEL_COUNT]; // (per MIDI channel)
+
+      // Derived
+      ulong delayMs = 150; // 1/tempo (time between beats)
+      ulong delayMsGate = 150; // gate length
+      ulong noteIntervalTicks = 12 * TICKS_PER_PULSE; // delay between notes (MIDI sync)
+      ulong gateLengthTicks = 12 * TICKS_PER_PULSE; // gate length (MIDI sync)
+
+      // Groove: swing and template, precomputed as an offset per step
+      // in the current scheduler's units (ms, or ticks in MIDI sync
+      // mode) whenever the step length changes, so applying it is a
+      // lookup
+      int16_t grooveOffsets[GROOVE_STEPS] = {};
+      int8_t grooveVelocities[GROOVE_STEPS] = {}; // (including accents)
+
+      // Velocity: curve and shape tables, precomputed whenever they
+      // change, so each note's velocity takes two lookups
+      byte velocityCurveTable[128];
+      uint8_t velocityGains[VEL_SHAPE_COUNT][VEL_SHAPE_STEPS]; // (x/128)
+
+      // Patterns: their steps packed in one block (a row each, 0 = no
+      // change), read at each lane's own position
+      int8_t patterns[PATTERN_COUNT][PATTERN_STEPS] = {};
+      uint8_t patternLengths[PATTERN_COUNT] = {}; // (0 = off)
+   };
+   static const int CONFIG_COPIES = 5;
+   Config _configs[CONFIG_COPIES];
+   Config* _config = &_configs[0]; // active (latest published)
+   Config* _retired = &_configs[1]; // published before (may still be in use by lanes)
+   Config* _spare = &_configs[2];
+   Config* _shadow = &_configs[3]; // latest settings (the setters' own)
+   Config* _posted = &_configs[4]; // latest complete change (shared with Run())
+   // Posts are counted (odd while one is being copied), so that Run()
+   // can take a copy while a setter may be posting on another core (a
+   // sequence lock): the copy taken is only kept if the count was even
+   // and unchanged throughout. Both copies are made with atomic loads
+   // and stores (see CopyConfig), ordered by the count's.
+   std::atomic<uint32_t> _postedCount { 0 };
+   uint32_t _publishedCount = 0;
+   int _configUpdate = CONFIG_AT_STEP;
+
+private: // Arpeggiator lanes
+
+   // Each MIDI channel is arpeggiated independently, in its own lane
+   // (note list, settings and playback state). All lanes share the
+   // clock/scheduler and MIDI output. Kept compact so that all 16
+   // lanes fit comfortably in RAM.
+   struct Lane
+   {
+      // State (settings are in the LaneConfig)
+      byte channel = 0; // MIDI channel (in and out)
+      byte currentNoteNumber = 0; // note currently playing
+      byte currentVelocity = 0; // current note velocity (certain vel modes only)
+      byte maxVelocity = 0; // max velocity played in this chord
+      int8_t currentNoteIndex = 0; // index in list of note currently playing
+      int8_t currentOctave = 0; // current octave (range)
+      int8_t lastNoteIndex = 0; // used to avoid repeated notes in RAND mode
+      int8_t lastOctave = 0;
+      int8_t currentDirection = DIR_UP;
+      int8_t noteCount = 0; // # notes in current arpeggio (or chord)
+      int8_t keyCount = 0; // # keys down (same as noteCount, except in hold mode)
+      bool firstNotePending = false; // first note waits for next step (or transport)
+      uint8_t velocityStep = 0; // steps into the arpeggio's cycle (for the velocity shape)
+      uint8_t patternSteps[PATTERN_COUNT] = {}; // current step of each pattern
+      int8_t trigger = TRIGGER_PLAY; // current step's (TIE only when a note is tied)
+      bool tied = false; // current note sounds on into the next step (no off scheduled)
+      bool chordPending = false; // chords mode: keys settling (chord captured, or let go of) until chordAt
+      bool scheduled = false; // schedule below has been set by playing, so its grid can be joined
+      uint8_t config = 0; // settings copy in use (_configs index, see ConfigOf)
+      uint8_t grooveStep = 0; // groove step of the next on event
+      int16_t grooveOffset = 0; // groove offset included in the next on event
+
+      // Schedule
+      ulong nextOnEventAt = 0;
+      ulong nextOffEventAt = 0;
+      ulong nextOnEventAtTick = 0;
+      ulong nextOffEventAtTick = 0;
+      ulong chordAt = 0; // end of the chord window (ms)
 
-   int _currentNoteNumber = 0; // note currently playing
-   int _currentVelocity = 0; // current note velocity (certain vel modes only)
-   int _maxVelocity = 0; // max velocity played in this chord
-   int _currentNoteIndex = 0; // index in list of note currently playing
-   int _currentOctave = 0; // current octave (range)
-   int _lastNoteIndex = 0; // used to avoid repeated notes in RAND mode
-   int _lastOctave = 0;
-   int _currentDirection = DIR_UP;
-   int _noteCount = 0; // # notes in current arpeggio (or chord)
-   int _keyCount = 0; // # keys down (same as noteCount, except in hold mode)
-   byte _noteNumbers[MAX_NOTES]; // note values (ordered by time played)
-   byte _noteNumbersSorted[MAX_NOTES]; // note values (sorted, low->high)
-   byte _noteVelocities[MAX_NOTES]; // note velocities (same order as noteNumbers)
-   byte _noteVelocitiesSorted[MAX_NOTES]; // note velocities (same order as noteNumbersSorted)
+      byte noteNumbers[MAX_NOTES]; // note values (ordered by time played)
+      byte noteNumbersSorted[MAX_NOTES]; // note values (sorted, low->high)
+      byte noteVelocities[MAX_NOTES]; // note velocities (same order as noteNumbers)
+      byte noteVelocitiesSorted[MAX_NOTES]; // note velocities (same order as noteNumbersSorted)
+   };
+   static const unsigned int LANE_BUDGET_BYTES = 128;
+   static_assert(sizeof(Lane) <= LANE_BUDGET_BYTES || sizeof(ulong) > 4, // (on the target)
+      "Lane exceeds its memory budget");
+
+   Lane _lanes[CHANNEL_COUNT];
+   // (a step of ratchets: the first note's off, and each repeat's on and off)
+   static_assert(EventQueue::SIZE >= CHANNEL_COUNT * (2 * MAX_RATCHET - 1),
+      "Event queue can't hold a step of ratchets on every lane");
+
+   // Notes currently sounding on the output (1 bit per note)
+   uint32_t _soundingNotes[CHANNEL_COUNT][4] = {};
 
 private: // MIDI input state
    byte _midiStatus = 0; // last MIDI status: 0x80 - 0xf0
@@ -127,31 +441,131 @@ private: // MIDI input state
    byte _midiData1 = 0;
    byte _midiData2 = 0;
    byte _midiState = MIDI_WAITING_FOR_STATUS_OR_DATA1;
+   bool _sysExInterrupted = false; // SysEx pass-through was cut short
+
+private: // SysEx configuration
+   // Incoming SysEx is held back until its header shows whether it's
+   // ours. Ours is collected here (and not passed through), anything
+   // else is passed through as usual.
+   static const int SYSEX_HEADER_LENGTH = 2; // manufacturer, device
+   static const int SYSEX_DATA_SIZE = 3 + PATTERN_STEPS; // command and data (longest message)
+   byte _sysExData[SYSEX_DATA_SIZE];
+   byte _sysExLength = 0; // bytes received after F0
+   bool _sysExForward = false; // not ours: passing through
+
+   // Parameters received are applied together (all of them: sync,
+   // hold and enabled too), on the next step
+   Parameters _pendingParameters;
+   bool _parametersPending = false;
+   ulong _parametersReceivedAt = 0;
+
+private: // CC remote control
+   // Mapping (parameter and flags) of each controller, by channel
+   byte _ccMappings[CHANNEL_COUNT][128] = {};
+   bool _ccLearning = false; // next CC received gets _ccLearnMapping
+   byte _ccLearnMapping = CC_NONE;
+
+private: // MIDI output state
+   // Output during Run() is collected here and written in one go at
+   // the end (or when full), so events that coincide go out back to
+   // back, with a single write
+   static const unsigned int MIDI_OUT_BUFFER_SIZE = 64;
+   byte _midiOutBuffer[MIDI_OUT_BUFFER_SIZE];
+   unsigned int _midiOutLength = 0;
+   bool _midiOutBatch = false; // in Run(): collecting output
+   bool _midiOutEnded = false; // a message was completed (for onMidiOut)
+   byte _midiOutStatus = 0; // running status (0 = none)
+
+private: // Sync input state
+   byte _syncState = SYNC_WAITING_FOR_STATUS;
+   byte _syncData1 = 0;
 
 private: // Note data list processing
-   void FillGap(byte index, byte* list);
-   void MakeGap(byte index, byte* list);
-   byte FindInList(byte value, byte* list);
-   void AddNote(byte noteNumber, byte noteVelocity);
-   void RemoveNote(byte noteNumber);
+   void FillGap(Lane& lane, byte index, byte* list);
+   void MakeGap(Lane& lane, byte index, byte* list);
+   byte FindInList(Lane& lane, byte value, byte* list);
+   void AddNote(Lane& lane, byte noteNumber, byte noteVelocity);
+   void RemoveNote(Lane& lane, byte noteNumber);
+
+private: // Capture
+   void RecordSetting(int setting, int index, int value);
+   void RecordRun();
 
 private: // MIDI output
-   void SendNoteOn(byte noteNumber, byte noteVelocity);
-   void SendNoteOff(byte noteNumber);
+   void WriteMidiOut(byte data);
+   void EndMidiOut();
+   void FlushMidiOut();
+   void InterruptSysEx();
+   void SendNoteOn(byte channel, byte noteNumber, byte noteVelocity);
+   void SendNoteOff(byte channel, byte noteNumber);
+   void SendControlChange(byte channel, byte controller, byte value);
    void ForwardMidiData(byte data);
    void ForwardMidiData2Byte();
    void ForwardMidiData3Byte();
 
+private: // SysEx configuration
+   void HandleSysExData(byte data);
+   void EndSysEx(bool complete);
+   void PassSysExThrough();
+   void HandleSysExMessage();
+   void SendSysEx(byte command, int preset, const byte* parameters);
+   void QueueParameters(const Parameters& parameters);
+   bool ParametersDue();
+   void ApplyPendingParameters();
+
+private: // Arpeggio settings
+   Config& ShadowConfig();
+   void ConfigChanged();
+   static void CopyConfig(Config* to, const Config* from);
+   template <class T> T LatestSetting(T Config::* setting);
+   bool ConfigPending();
+   bool PublishConfig(bool allLanes = false);
+   bool RetiredConfigInUse();
+   bool InStep(Lane& lane);
+   const Config& ConfigOf(Lane& lane);
+
+private: // Active note tracking
+   void SetSounding(byte channel, byte noteNumber, bool sounding);
+   bool IsSounding(byte channel, byte noteNumber);
+   void ReleaseChannel(byte channel);
+
 private: // MIDI input
    void HandleNoteOn();
    void HandleNoteOff();
+   void HandleControlChange();
+   void SetControlledParameter(int parameter, byte channel, byte value);
 
 private: // Arpeggiator logic
    void HandleMidiData(byte data); // data from MIDI in port
    void HandleSyncData(byte data); // data from sync MIDI in port
-   void InitArpeggio();
-   void HandleArpeggiatorOffEvent();
-   void HandleArpeggiatorOnEvent();
+   void HandleClockPulse();
+   void RunClockWatchdog();
+   void StartClockOutput(ulong firstPulseAt);
+   void RunClockOutput();
+   void PauseArpeggio();
+   void SetSongPosition(ulong pulse);
+   ulong CurrentTick();
+   ulong NextGridTick(ulong tick);
+   ulong TickTime(ulong tick);
+   int JoinGrid(ulong position, ulong interval, ulong nextStep);
+   void UpdateGroove(Config& config);
+   void UpdateVelocity(Config& config);
+   byte ShapeVelocity(Lane& lane, byte velocity);
+   int PatternValue(Lane& lane, int pattern);
+   int NextPatternValue(Lane& lane, int pattern);
+   void AdvancePatterns(Lane& lane);
+   byte PatternNote(Lane& lane, int noteNumber);
+   ulong GrooveStepAt(Lane& lane, int step, ulong position);
+   byte GrooveVelocity(Lane& lane, byte velocity);
+   ulong ScheduleRatchets(Lane& lane, ulong start, ulong nextOn, ulong gateLength, byte velocity);
+   void RunEventQueue();
+   void KeepEarliest(ulong& next, ulong at);
+   void InitArpeggio(Lane& lane);
+   bool IsArpeggiating(Lane& lane);
+   void PlayHeldNotes(Lane& lane);
+   void RunLane(Lane& lane);
+   void HandleArpeggiatorOffEvent(Lane& lane);
+   void HandleArpeggiatorOnEvent(Lane& lane);
 
 private: // For debugging
    template <class T> void Print(T t);
@@ -159,8 +573,8 @@ private: // For debugging
    template <class T> void PrintLn(T t);
    template <class T> void PrintLn(T t, int format);
    void PrintList(byte* list, int length);
-   void PrintNoteList();
-   void PrintEventSchedule();
+   void PrintNoteList(Lane& lane);
+   void PrintEventSchedule(Lane& lane);
 
 public:
    // Call frequently (e.g. in inner loop)
@@ -168,15 +582,121 @@ public:
 
    void SetEnabled(bool enabled);
    void SetHold(bool hold);
+   void SetChords(bool chords);
+   void SetChordWindow(int ms); // 0..MAX_CHORD_WINDOW_MS
    void SetTempo(int tempo); // 30-300 (BPM)
    void SetMidiSync(bool midiSyncEnabled);
    void SetGate(int gateLength); // 0..100 (%)
-   void SetMode(int mode);
-   void SetVelocityMode(int velocityMode);
-   void SetRange(int octaves); // 0..
+   // (per channel, or all channels by default)
+   void SetMode(int mode, int channel = ALL_CHANNELS);
+   void SetVelocityMode(int velocityMode, int channel = ALL_CHANNELS);
+   void SetRange(int octaves, int channel = ALL_CHANNELS); // 0..
+   void SetClockLossMode(int clockLossMode);
+   void SetSwing(int swing); // 50..75 (%)
+   void SetGroove(int groove);
+   void SetRatchet(int notesPerStep, int channel = ALL_CHANNELS); // 1..8
+   void SetRatchetDecay(int percent); // 0..100 (% velocity kept per repeat)
+   void SetVelocityCurve(int curve, int fixedVelocity = 100); // fixed: 1..127
+   void SetVelocityShape(int shape, int depth = 50); // 0..100 (% taken off)
+   void SetAccent(int pattern, int amount = 20); // 0..63 (velocity added)
+   // Patterns (see PATTERN_OCTAVE etc.): a step's value, and the
+   // pattern's length (0..PATTERN_STEPS, 0 = off)
+   void SetPatternStep(int pattern, int step, int value);
+   void SetPatternLength(int pattern, int length);
+
+   // Changes to the settings above (except the enabled, hold, MIDI
+   // sync and clock loss modes) take effect together, on each lane
+   // from its next step, by default (CONFIG_AT_STEP), or right away
+   // (CONFIG_IMMEDIATE). On lanes not playing, they always do.
+   // With CONFIG_AT_STEP, these setters may be called from another
+   // core (or thread) than Run(), as long as it's the only one
+   // calling them.
+   void SetConfigUpdate(int update);
+
+   // Maps a controller (CC number) to a parameter (CC_TEMPO etc.,
+   // optionally | CC_CONSUME; CC_NONE = unmapped), on the specified
+   // channel or all channels. Values 0..127 cover the parameter's
+   // range. Unmapped and non-consumed CCs are passed through.
+   void MapCC(int controller, int mapping, int channel = ALL_CHANNELS);
+
+   // MIDI learn: maps the next CC received (on its channel)
+   void LearnCC(int mapping);
+
+   // All parameters at once (sync first, enabled last)
+   void GetParameters(Parameters& parameters);
+   void SetParameters(const Parameters& parameters);
+
+   // To/from PARAMETER_BYTES 7-bit bytes. Decode returns false
+   // (and leaves parameters undefined) if any value is out of range.
+   static void EncodeParameters(const Parameters& parameters, byte* data);
+   static bool DecodeParameters(const byte* data, Parameters& parameters);
+
+   // Ends all sounding notes (and held arpeggios), then sends
+   // All Notes Off and All Sound Off on all channels
+   void Panic();
+
+   // Records all MIDI in/out traffic, Run() calls and settings
+   // changes to the specified capture (NULL = off)
+   void SetCapture(MidiCapture* capture);
+
+   // Starts the capture, with all current settings, so that it can
+   // be replayed on a fresh engine (see MidiCapture): with
+   // ReplaySetting for the settings changes, and clockGenerator for
+   // the clock output. It's replayed exactly if it was started with
+   // nothing playing for at least a step, in internal tempo mode (in
+   // MIDI sync mode the clock position isn't recorded), and between
+   // input messages (sent with their status). While capturing, the
+   // setters have to be called on Run()'s core.
+   void StartCapture();
+   void ReplaySetting(int setting, int index, int value, ClockGenerator* clockGenerator = NULL);
+
+   // Leaves out the status byte of channel messages that repeat the
+   // previous one (off by default). For serial (DIN) MIDI: USB MIDI
+   // packets always carry the full message.
+   void SetRunningStatus(bool runningStatus);
+
+   // Sends MIDI clock on the MIDI output, from the internal tempo
+   // (not in MIDI sync mode), timed by the specified generator
+   // (NULL = off). Start is sent with the first note of an
+   // arpeggio, on pulse 0, and Stop when no arpeggio is playing.
+   void SetClockOutput(ClockGenerator* clockGenerator);
+
+   // Records the timing error of every arpeggiator note on/off
+   // (vs. the ideal grid: the internal tempo, or the received
+   // clock in MIDI sync mode) and MIDI clock output pulse to the
+   // specified stats (NULL = off)
+   void SetTimingStats(TimingStats* noteOnTiming, TimingStats* noteOffTiming,
+      TimingStats* clockOutTiming = NULL);
+
+   // true if nothing is playing (e.g. for deferring slow work)
+   bool IsIdle();
+
+   // true if idle, and no MIDI clock transport is running (the
+   // host's, in MIDI sync mode, or our own clock output's): e.g.
+   // for deferring work that stalls the CPU for longer
+   bool IsStopped();
+
+   // Time (ms) at which Run() next has something scheduled to do,
+   // or latest if nothing is due before then (e.g. for sleeping
+   // until then). MIDI input may of course arrive at any time.
+   ulong NextEventAt(ulong latest);
    
    // event handlers
    void (*onMidiIn)() = NULL; // called on any MIDI in event
-   void (*onMidiOut)() = NULL; // called on any MIDI out event
+   void (*onMidiOut)() = NULL; // called on any MIDI out event (once per Run)
    void (*onBeat)() = NULL; // called once per beat, e.g. for tempo blink
-};
\ No newline at end of file
+   void (*onParameters)() = NULL; // called when SysEx or a CC has changed the parameters
+
+   // Preset storage (for SysEx), PARAMETER_BYTES of encoded
+   // parameters per preset. Load returns false if there's none.
+   bool (*onLoadPreset)(int preset, byte* data) = NULL;
+   void (*onStorePreset)(int preset, const byte* data) = NULL;
+};
+
+// Port types used by this firmware
+#ifdef USE_TINYUSB
+typedef Adafruit_USBD_MIDI ArpMidiPort; // USB MIDI
+#else
+typedef decltype(Serial1) ArpMidiPort; // DIN MIDI (UART)
+#endif
+typedef BasicArpEngine<ArpMidiPort, ArpMidiPort> ArpEngine;
\ No newline at end of file
@@ -61,4 +61,9 @@ void Button::scan(unsigned long currentTime)
       }
    }
    _pinStatus = newPinStatus;
+}
+
+bool Button::isPressed()
+{
+   return _pinStatus;
 }
\ No newline at end of file
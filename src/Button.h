@@ -29,6 +29,12 @@ public:
    // Call frequently (in inner loop)
    void scan(unsigned long currentTime);
 
+   // true while the button is down (as of the last scan). Until
+   // it's released, scan() must keep being called every ms or so,
+   // for debouncing and held events. (A released button only
+   // needs scanning on the next pin change.)
+   bool isPressed();
+
    // Event handlers
 
    // Triggered when the button is pressed
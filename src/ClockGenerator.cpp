@@ -0,0 +1,95 @@
+#include <Arduino.h>
+#include "ClockGenerator.h"
+
+ClockGenerator::ClockGenerator()
+{
+    _alarm = 0;
+    _nextAtUs = 0;
+    _periodUs = 0;
+    _periodRemainder = 0;
+    _periodError = 0;
+    _quarterUs = 600000; // 100 BPM
+    _pulseInBeat = 0;
+    _dueCount = 0;
+    _takenCount = 0;
+}
+
+// (in interrupt context)
+int64_t ClockGenerator::onAlarm(alarm_id_t, void* user)
+{
+    ClockGenerator* generator = (ClockGenerator*)user;
+    generator->addPulse(generator->_nextAtUs);
+    uint32_t period = generator->nextPeriod();
+    generator->_nextAtUs += period;
+    return -(int64_t)period; // (< 0: relative to when this pulse was due, not to now)
+}
+
+// Length of the period after the pulse just added
+uint32_t ClockGenerator::nextPeriod()
+{
+    if (_pulseInBeat == 0) {
+        // new beat: pick up any tempo change
+        uint32_t quarterUs = _quarterUs;
+        _periodUs = quarterUs / PULSES_PER_QUARTER;
+        _periodRemainder = quarterUs % PULSES_PER_QUARTER;
+    }
+    _pulseInBeat = (_pulseInBeat + 1) % PULSES_PER_BEAT;
+
+    uint32_t period = _periodUs;
+    _periodError += _periodRemainder;
+    if (_periodError >= PULSES_PER_QUARTER) {
+        _periodError -= PULSES_PER_QUARTER;
+        period++;
+    }
+    return period;
+}
+
+void ClockGenerator::addPulse(uint32_t dueAtUs)
+{
+    _dueAt[_dueCount % HISTORY] = dueAtUs;
+    _dueCount = _dueCount + 1;
+}
+
+void ClockGenerator::setQuarterNoteLength(unsigned long us)
+{
+    _quarterUs = us;
+}
+
+void ClockGenerator::start(unsigned long delayUs)
+{
+    stop();
+    _pulseInBeat = 0;
+    _periodError = 0;
+    _nextAtUs = micros() + delayUs;
+    if (delayUs == 0) {
+        // first pulse is due right away
+        addPulse(_nextAtUs);
+        delayUs = nextPeriod();
+        _nextAtUs += delayUs;
+    }
+    _alarm = add_alarm_in_us(delayUs, onAlarm, this, true);
+}
+
+void ClockGenerator::stop()
+{
+    if (_alarm > 0) cancel_alarm(_alarm);
+    _alarm = 0;
+    _takenCount = _dueCount;
+}
+
+bool ClockGenerator::isRunning()
+{
+    return _alarm > 0;
+}
+
+bool ClockGenerator::takePulse(unsigned long& dueAtUs)
+{
+    uint32_t dueCount = _dueCount;
+    if (_takenCount == dueCount) return false;
+    // (if the loop has fallen far behind, the pulses are still
+    // all sent, but only the most recent due times are known)
+    uint32_t pulse = (dueCount - _takenCount > HISTORY) ? dueCount - HISTORY : _takenCount;
+    dueAtUs = _dueAt[pulse % HISTORY];
+    _takenCount++;
+    return true;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <Arduino.h>
+#include <pico/time.h>
+
+// MIDI clock (24 pulses per quarter note) timebase, for sending
+// clock from the internal tempo.
+//
+// Pulses are timed by a hardware alarm, each one relative to when
+// the previous one was due (not to when the loop got around to
+// it), so they don't drift, whatever the load. The alarm only
+// counts the pulse and its due time; the byte itself is sent by
+// the main loop (takePulse), since the MIDI output can't be used
+// from an interrupt.
+//
+// Periods are whole microseconds, alternating so that every 24
+// pulses add up to exactly one quarter note.
+
+class ClockGenerator
+{
+public:
+    static const unsigned int PULSES_PER_QUARTER = 24;
+    static const unsigned int PULSES_PER_BEAT = 6; // MIDI beat (16th note)
+
+private:
+    static const unsigned int HISTORY = 16; // due times kept (power of 2)
+
+    alarm_id_t _alarm;
+    uint32_t _nextAtUs; // due time of the next pulse
+
+    // Pulse period (whole us, plus a fraction in 1/24ths)
+    uint32_t _periodUs;
+    uint32_t _periodRemainder;
+    uint32_t _periodError;
+    volatile uint32_t _quarterUs; // requested quarter note length
+    uint32_t _pulseInBeat;
+
+    // Written by the alarm, read by takePulse()
+    volatile uint32_t _dueCount;
+    volatile uint32_t _dueAt[HISTORY];
+    uint32_t _takenCount;
+
+    static int64_t onAlarm(alarm_id_t id, void* user);
+    uint32_t nextPeriod();
+    void addPulse(uint32_t dueAtUs);
+
+public:
+    ClockGenerator();
+
+    // Sets the tempo. A change takes effect on the next MIDI
+    // beat (like the arpeggiator's own step length does).
+    void setQuarterNoteLength(unsigned long us);
+
+    // Starts (or restarts, from pulse 0) with the first pulse
+    // due after delayUs. Pulses not yet taken are dropped.
+    void start(unsigned long delayUs);
+    void stop();
+    bool isRunning();
+
+    // Takes the next pulse that's due (if any) and its due time,
+    // in micros() time. Returns false if no pulse is due.
+    bool takePulse(unsigned long& dueAtUs);
+};
@@ -0,0 +1,43 @@
+#include <Arduino.h>
+#include "CycleCounter.h"
+
+CycleCounter::CycleCounter(const char* name)
+{
+    _name = name;
+    reset();
+}
+
+void CycleCounter::add(uint32_t cycles)
+{
+    _count++;
+    _total += cycles;
+    if (cycles < _min) _min = cycles;
+    if (cycles > _max) _max = cycles;
+}
+
+uint32_t CycleCounter::getCount()
+{
+    return _count;
+}
+
+void CycleCounter::reset()
+{
+    _count = 0;
+    _min = UINT32_MAX;
+    _max = 0;
+    _total = 0;
+}
+
+void CycleCounter::print(Print& out)
+{
+    out.print("cycles,");
+    out.print(_name);
+    out.print(',');
+    out.print(_count);
+    out.print(',');
+    out.print(_count > 0 ? _min : 0);
+    out.print(',');
+    out.print(_count > 0 ? (uint32_t)(_total / _count) : 0);
+    out.print(',');
+    out.println(_max);
+}
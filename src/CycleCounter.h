@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <Arduino.h>
+
+// Accumulates CPU cycle counts for a section of code
+// (min/avg/max over all runs since the last reset),
+// for profiling on the target.
+//
+// Usage:
+//   uint32_t start = CycleCounter::now();
+//   ... code to measure ...
+//   counter.add(CycleCounter::now() - start);
+
+class CycleCounter
+{
+private:
+    const char* _name;
+    uint32_t _count;
+    uint32_t _min;
+    uint32_t _max;
+    uint64_t _total;
+
+public:
+    CycleCounter(const char* name);
+
+    // Current cycle count (wraps around)
+    static inline uint32_t now() { return rp2040.getCycleCount(); }
+
+    void add(uint32_t cycles);
+    void reset();
+
+    uint32_t getCount(); // (runs since the last reset)
+
+    // Prints one machine readable line:
+    // "cycles,<name>,<count>,<min>,<avg>,<max>"
+    void print(Print& out);
+};
@@ -0,0 +1,92 @@
+#include <Arduino.h>
+#include "EventQueue.h"
+
+EventQueue::EventQueue()
+{
+    _count = 0;
+}
+
+bool EventQueue::isBefore(const Event& a, const Event& b)
+{
+    long difference = (long)(a.time - b.time); // (wraps)
+    if (difference != 0) return difference < 0;
+    return a.velocity == 0 && b.velocity != 0; // note-offs first
+}
+
+void EventQueue::siftUp(unsigned int index)
+{
+    while (index > 0) {
+        unsigned int parent = (index - 1) / 2;
+        if (!isBefore(_events[index], _events[parent])) break;
+        Event event = _events[index];
+        _events[index] = _events[parent];
+        _events[parent] = event;
+        index = parent;
+    }
+}
+
+void EventQueue::siftDown(unsigned int index)
+{
+    while (true) {
+        unsigned int first = index;
+        unsigned int left = 2 * index + 1;
+        unsigned int right = left + 1;
+        if (left < _count && isBefore(_events[left], _events[first])) first = left;
+        if (right < _count && isBefore(_events[right], _events[first])) first = right;
+        if (first == index) break;
+        Event event = _events[index];
+        _events[index] = _events[first];
+        _events[first] = event;
+        index = first;
+    }
+}
+
+bool EventQueue::push(const Event& event)
+{
+    if (_count == SIZE) return false;
+    _events[_count] = event;
+    siftUp(_count);
+    _count++;
+    return true;
+}
+
+bool EventQueue::pop(unsigned long now, Event& event)
+{
+    if (_count == 0 || (long)(now - _events[0].time) < 0) return false;
+    event = _events[0];
+    _count--;
+    if (_count > 0) {
+        _events[0] = _events[_count];
+        siftDown(0);
+    }
+    return true;
+}
+
+bool EventQueue::peek(Event& event)
+{
+    if (_count == 0) return false;
+    event = _events[0];
+    return true;
+}
+
+bool EventQueue::cancel(uint8_t channel)
+{
+    unsigned int kept = 0;
+    for (unsigned int i = 0; i < _count; i++) {
+        if (_events[i].channel != channel) _events[kept++] = _events[i];
+    }
+    if (kept == _count) return false;
+    _count = kept;
+    for (unsigned int i = _count / 2; i-- > 0; ) siftDown(i); // re-heapify
+    return true;
+}
+
+void EventQueue::clear()
+{
+    _count = 0;
+}
+
+unsigned int EventQueue::count()
+{
+    return _count;
+}
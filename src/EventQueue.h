@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <Arduino.h>
+
+// Timed note events waiting to be sent (e.g. ratchet repeats),
+// kept as a binary min-heap on their due time, so that a burst of
+// events can be queued at once and the earliest one is always at
+// hand. Times are in the caller's units (ms or ticks) and may
+// wrap around. Of events due at the same time, note-offs come
+// first (so a note can end and restart on the same beat).
+
+class EventQueue
+{
+public:
+    static const unsigned int SIZE = 256;
+
+    struct Event
+    {
+        unsigned long time;
+        uint8_t channel;
+        uint8_t noteNumber;
+        uint8_t velocity; // 0 = note off
+    };
+
+private:
+    Event _events[SIZE];
+    unsigned int _count;
+
+    bool isBefore(const Event& a, const Event& b);
+    void siftUp(unsigned int index);
+    void siftDown(unsigned int index);
+
+public:
+    EventQueue();
+
+    // Returns false (and drops the event) if the queue is full
+    bool push(const Event& event);
+
+    // Removes the earliest event into 'event' if it's due
+    // at 'now' (or earlier). Returns false if none is due.
+    bool pop(unsigned long now, Event& event);
+
+    // Copies the earliest event into 'event' (without removing
+    // it). Returns false if the queue is empty.
+    bool peek(Event& event);
+
+    // Drops all events for the specified channel, and
+    // returns true if there were any
+    bool cancel(uint8_t channel);
+    void clear();
+
+    unsigned int count();
+};
@@ -17,6 +17,12 @@ void LedFlasher::run(unsigned long currentTime)
     }
 }
 
+unsigned long LedFlasher::nextEventAt(unsigned long latest)
+{
+    if (_ledStatus && _offTime < latest) return _offTime;
+    return latest;
+}
+
 void LedFlasher::flash(unsigned long currentTime)
 {
     this->flash(currentTime, _defaultDurationMs);
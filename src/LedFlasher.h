@@ -20,6 +20,10 @@ public:
     // call frequently (in inner loop)
     void run(unsigned long currentTime);
 
+    // Time at which run() next has something to do (turn the
+    // LED off), or latest if nothing is due before then
+    unsigned long nextEventAt(unsigned long latest);
+
     // call to turn LED on
     void flash(unsigned long currentTime);
     void flash(unsigned long currentTime, unsigned int durationMs);
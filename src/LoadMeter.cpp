@@ -0,0 +1,48 @@
+#include <Arduino.h>
+#include "LoadMeter.h"
+
+LoadMeter::LoadMeter()
+{
+    reset(0);
+}
+
+void LoadMeter::addSleep(uint32_t sleptUs)
+{
+    _idleUs += sleptUs;
+    _sleepCount++;
+}
+
+void LoadMeter::addWake(uint32_t latencyUs)
+{
+    _wakeCount++;
+    _totalLatencyUs += latencyUs;
+    if (latencyUs > _maxLatencyUs) _maxLatencyUs = latencyUs;
+}
+
+void LoadMeter::reset(uint64_t currentTimeUs)
+{
+    _startUs = currentTimeUs;
+    _idleUs = 0;
+    _sleepCount = 0;
+    _wakeCount = 0;
+    _totalLatencyUs = 0;
+    _maxLatencyUs = 0;
+}
+
+void LoadMeter::print(Print& out, uint64_t currentTimeUs)
+{
+    uint64_t elapsedUs = currentTimeUs - _startUs;
+    float idle = elapsedUs > 0 ? 100.0f * _idleUs / elapsedUs : 0.0f;
+    out.print("load,");
+    out.print(100.0f - idle, 1);
+    out.print(',');
+    out.print(idle, 1);
+    out.print(',');
+    out.print(_sleepCount);
+    out.print(',');
+    out.print(_wakeCount);
+    out.print(',');
+    out.print(_wakeCount > 0 ? (float)_totalLatencyUs / _wakeCount : 0.0f, 1);
+    out.print(',');
+    out.println(_maxLatencyUs);
+}
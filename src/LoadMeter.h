@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <Arduino.h>
+
+// Accounts for the main loop's time: busy (running) vs. idle
+// (asleep until the next deadline or an interrupt), and the
+// wake-up latency (how late the CPU was back for a deadline).
+
+class LoadMeter
+{
+private:
+    uint64_t _startUs; // of the measurement
+    uint64_t _idleUs;
+    uint32_t _sleepCount;
+    uint32_t _wakeCount; // wake-ups at a deadline (not by an interrupt)
+    uint64_t _totalLatencyUs;
+    uint32_t _maxLatencyUs;
+
+public:
+    LoadMeter();
+
+    void addSleep(uint32_t sleptUs);
+    void addWake(uint32_t latencyUs);
+    void reset(uint64_t currentTimeUs);
+
+    // Prints one machine readable line:
+    // "load,<busy %>,<idle %>,<sleeps>,<wakes>,<avg latency>,<max latency>"
+    // (latencies in us)
+    void print(Print& out, uint64_t currentTimeUs);
+};
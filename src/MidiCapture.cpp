@@ -0,0 +1,187 @@
+#include <Arduino.h>
+#include "MidiCapture.h"
+
+MidiCapture::MidiCapture()
+{
+    _head = 0;
+    _tail = 0;
+    _lastRecordAt = 0;
+    _isCapturing = false;
+    _dropped = false;
+}
+
+void MidiCapture::start(unsigned long currentTime)
+{
+    _head = 0;
+    _tail = 0;
+    _lastRecordAt = currentTime;
+    _isCapturing = true;
+    _dropped = false;
+}
+
+void MidiCapture::stop()
+{
+    _isCapturing = false;
+}
+
+bool MidiCapture::isCapturing()
+{
+    return _isCapturing;
+}
+
+bool MidiCapture::isComplete()
+{
+    return !_dropped;
+}
+
+unsigned int MidiCapture::used()
+{
+    return (_head - _tail) & (BUFFER_SIZE-1);
+}
+
+// Length (in bytes) of the record with the specified header and data
+// byte (the byte after the header and time)
+unsigned int MidiCapture::recordLength(uint8_t header, uint8_t data)
+{
+    unsigned int length = 2;
+    if ((header & 0x3f) == DELTA_EXTENDED) length += 2;
+    if ((header >> 6) == SOURCE_EVENT) {
+        if (data == EVENT_RUN) length += 2;
+        else if (data == EVENT_SETTING) length += 4;
+    }
+    return length;
+}
+
+void MidiCapture::put(uint8_t data)
+{
+    _buffer[_head] = data;
+    _head = (_head + 1) & (BUFFER_SIZE-1);
+}
+
+// Returns the time since the previous record (long gaps split
+// off into time-only records)
+unsigned long MidiCapture::advance(unsigned long currentTime)
+{
+    static const uint8_t timeOnly = EVENT_TIME;
+    unsigned long delta = currentTime - _lastRecordAt;
+    _lastRecordAt = currentTime;
+    while (delta > MAX_DELTA) {
+        append(SOURCE_EVENT, MAX_DELTA, &timeOnly, 1);
+        delta -= MAX_DELTA;
+    }
+    return delta;
+}
+
+// Appends a record: data (the MIDI byte or event, then the event's
+// data), length bytes long
+void MidiCapture::append(uint8_t source, unsigned long delta, const uint8_t* data, unsigned int length)
+{
+    uint8_t header = source << 6;
+    unsigned int recordLength = (delta >= DELTA_EXTENDED ? 3 : 1) + length;
+
+    // Make room (drop oldest records)
+    while (BUFFER_SIZE - 1 - used() < recordLength) {
+        unsigned int tailHeader = _tail;
+        unsigned int tailData = (_tail + ((_buffer[_tail] & 0x3f) == DELTA_EXTENDED ? 3 : 1)) & (BUFFER_SIZE-1);
+        _tail = (_tail + MidiCapture::recordLength(_buffer[tailHeader], _buffer[tailData])) & (BUFFER_SIZE-1);
+        _dropped = true;
+    }
+
+    if (delta >= DELTA_EXTENDED) {
+        put(header | DELTA_EXTENDED);
+        put(delta & 0xff);
+        put(delta >> 8);
+    }
+    else {
+        put(header | delta);
+    }
+    for (unsigned int i = 0; i < length; i++) put(data[i]);
+}
+
+void MidiCapture::record(uint8_t source, uint8_t data, unsigned long currentTime)
+{
+    if (!_isCapturing) return;
+    append(source, advance(currentTime), &data, 1);
+}
+
+void MidiCapture::recordRun(unsigned long skippedMs, unsigned long currentTime)
+{
+    if (!_isCapturing) return;
+    if (skippedMs > 0x7fff) skippedMs = 0x7fff;
+    uint8_t data[] = { EVENT_RUN, (uint8_t)(skippedMs & 0xff), (uint8_t)(skippedMs >> 8) };
+    append(SOURCE_EVENT, advance(currentTime), data, sizeof(data));
+}
+
+void MidiCapture::recordSetting(uint8_t setting, uint8_t index, int value, unsigned long currentTime)
+{
+    if (!_isCapturing) return;
+    uint16_t bits = (uint16_t)(int16_t)value;
+    uint8_t data[] = { EVENT_SETTING, setting, index, (uint8_t)(bits & 0xff), (uint8_t)(bits >> 8) };
+    append(SOURCE_EVENT, advance(currentTime), data, sizeof(data));
+}
+
+unsigned int MidiCapture::read(uint8_t* data, unsigned int size)
+{
+    unsigned int length = used();
+    if (length > size) length = size;
+    unsigned int position = _tail;
+    for (unsigned int i = 0; i < length; i++) {
+        data[i] = _buffer[position];
+        position = (position + 1) & (BUFFER_SIZE-1);
+    }
+    return length;
+}
+
+bool MidiCapture::decode(const uint8_t* capture, unsigned int length, unsigned int& position,
+    Record& record)
+{
+    if (position + 2 > length) return false;
+    uint8_t header = capture[position];
+    unsigned int dataAt = position + 1;
+    unsigned long delta = header & 0x3f;
+    if (delta == DELTA_EXTENDED) {
+        if (position + 4 > length) return false;
+        delta = capture[position+1] | (capture[position+2] << 8);
+        dataAt += 2;
+    }
+    unsigned int next = position + recordLength(header, capture[dataAt]);
+    if (next > length) return false;
+
+    record.time += delta;
+    record.source = header >> 6;
+    record.data = capture[dataAt];
+    record.setting = 0;
+    record.index = 0;
+    record.value = 0;
+    if (record.source == SOURCE_EVENT) {
+        const uint8_t* event = capture + dataAt + 1;
+        if (record.data == EVENT_RUN) {
+            record.value = (int16_t)(event[0] | (event[1] << 8));
+        }
+        else if (record.data == EVENT_SETTING) {
+            record.setting = event[0];
+            record.index = event[1];
+            record.value = (int16_t)(event[2] | (event[3] << 8));
+        }
+    }
+    position = next;
+    return true;
+}
+
+void MidiCapture::dump(Print& out)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned int length = used();
+    out.print("# MIDI capture v2, ");
+    out.print(length);
+    out.println(_dropped ? " bytes, oldest dropped" : " bytes");
+    unsigned int position = _tail;
+    for (unsigned int i = 0; i < length; i++) {
+        uint8_t data = _buffer[position];
+        position = (position + 1) & (BUFFER_SIZE-1);
+        out.print(hex[data >> 4]);
+        out.print(hex[data & 0x0f]);
+        if ((i & 31) == 31 || i == length-1) out.println();
+    }
+    out.println("# end");
+}
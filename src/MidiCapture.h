@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stdint.h>
+#include <Arduino.h>
+
+// Records timestamped MIDI traffic (MIDI In, Sync In and
+// arpeggiator output), the engine's Run() calls and its settings
+// changes into a RAM ring buffer, for reproducing timing bugs.
+// When the buffer is full the oldest records are dropped.
+//
+// Input bytes are recorded with the engine timestamp at which
+// the engine read them, and the engine starts a capture with its
+// current settings (see ArpEngine::StartCapture), so a capture can
+// be replayed on a fresh engine: for each record in order,
+//   - Run: call Run(t) at the record's time (after calling it for
+//     each ms up to the ms skipped), with the input records that
+//     follow it available on its ports,
+//   - setting change: call ReplaySetting (after Run() was called
+//     at the record's time),
+// and call Run(t) for every other ms. The output then matches the
+// recorded output byte for byte, except for the MIDI clock pulses
+// sent from the internal tempo (timed by a hardware alarm, in us),
+// and in Random mode (which isn't deterministic). The capture has
+// to be complete (see dump), and started as StartCapture describes.
+//
+// Binary format (version 2). A sequence of records:
+//
+//   header [delta_lo delta_hi] data [event data]
+//
+//   header bits 7-6: source
+//      0 = MIDI In, 1 = Sync In, 2 = MIDI Out, 3 = event
+//   header bits 5-0: time since the previous record, in ms
+//      (0-62), or 63: time follows as 16-bit little-endian
+//   data: the MIDI byte (sources 0-2), or the event (source 3):
+//      0 = time only (used for long gaps)
+//      1 = Run() that read input, followed a settings change or a
+//          gap, or repeated the ms of one that read input or sent
+//          output, followed by: <skipped_lo> <skipped_hi> (ms
+//          without a Run() call before it)
+//      2 = setting change, followed by: <setting> <index>
+//          <value_lo> <value_hi> (signed; see ArpEngine::SETTING_TEMPO
+//          etc. and ReplaySetting)
+//
+// The time of the first record is relative to the start of the
+// capture (or, if the oldest records were dropped, to an unknown
+// earlier point).
+//
+// Text dump format (as written by dump()):
+//
+//   # MIDI capture v2, <n> bytes[, oldest dropped]
+//   <hex bytes, 32 per line>
+//   # end
+
+class MidiCapture
+{
+public:
+    static const uint8_t SOURCE_MIDI_IN = 0;
+    static const uint8_t SOURCE_SYNC_IN = 1;
+    static const uint8_t SOURCE_MIDI_OUT = 2;
+    static const uint8_t SOURCE_EVENT = 3;
+
+    static const uint8_t EVENT_TIME = 0;
+    static const uint8_t EVENT_RUN = 1;
+    static const uint8_t EVENT_SETTING = 2;
+
+    // A decoded record
+    struct Record
+    {
+        unsigned long time; // (ms since the start of the capture)
+        uint8_t source;
+        uint8_t data; // MIDI byte, or event
+        uint8_t setting; // (setting change)
+        uint8_t index;
+        int16_t value; // (setting change, or ms skipped before a Run)
+    };
+
+private:
+    static const unsigned int BUFFER_SIZE = 16384; // power of 2
+    static const uint8_t DELTA_EXTENDED = 63;
+    static const unsigned long MAX_DELTA = 65535;
+
+    uint8_t _buffer[BUFFER_SIZE];
+    unsigned int _head; // next write position
+    unsigned int _tail; // oldest record
+    unsigned long _lastRecordAt;
+    bool _isCapturing;
+    bool _dropped; // oldest records dropped (to make room)
+
+    unsigned int used();
+    static unsigned int recordLength(uint8_t header, uint8_t data);
+    void put(uint8_t data);
+    unsigned long advance(unsigned long currentTime);
+    void append(uint8_t source, unsigned long delta, const uint8_t* data, unsigned int length);
+
+public:
+    MidiCapture();
+
+    void start(unsigned long currentTime); // clears previous capture
+    void stop();
+    bool isCapturing();
+
+    // Called by the engine for every byte in/out
+    void record(uint8_t source, uint8_t data, unsigned long currentTime);
+
+    // Called by the engine for Run() calls and settings changes
+    // (see above)
+    void recordRun(unsigned long skippedMs, unsigned long currentTime);
+    void recordSetting(uint8_t setting, uint8_t index, int value, unsigned long currentTime);
+
+    // true if the capture is complete (no records dropped)
+    bool isComplete();
+
+    // Copies the capture (binary format, oldest record first), up
+    // to size bytes. Returns the number of bytes copied.
+    unsigned int read(uint8_t* data, unsigned int size);
+
+    // Decodes the record at position in a capture (as read, or
+    // parsed from a dump), and moves position past it. The time of
+    // record (start with 0) is advanced by the record's. Returns
+    // false at the end (or on a truncated record).
+    static bool decode(const uint8_t* capture, unsigned int length, unsigned int& position,
+        Record& record);
+
+    // Writes the capture as text (see above)
+    void dump(Print& out);
+};
@@ -0,0 +1,41 @@
+#include <Arduino.h>
+#include "MidiLoopback.h"
+
+MidiLoopback::MidiLoopback()
+{
+    _head = 0;
+    _tail = 0;
+}
+
+int MidiLoopback::available() {
+    return (_head - _tail) & (BUFFER_SIZE-1);
+}
+
+int MidiLoopback::read() {
+    if (_head == _tail) return -1; // empty
+    uint8_t data = _buffer[_tail];
+    _tail = (_tail + 1) & (BUFFER_SIZE-1);
+    return data;
+}
+
+int MidiLoopback::peek() {
+    if (_head == _tail) return -1; // empty
+    return _buffer[_tail];
+}
+
+int MidiLoopback::availableForWrite() {
+    return BUFFER_SIZE - 1 - available();
+}
+
+size_t MidiLoopback::write(uint8_t data) {
+    unsigned int next = (_head + 1) & (BUFFER_SIZE-1);
+    if (next == _tail) return 0; // full
+    _buffer[_head] = data;
+    _head = next;
+    return 1;
+}
+
+void MidiLoopback::clear() {
+    _head = 0;
+    _tail = 0;
+}
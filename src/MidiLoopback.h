@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <Arduino.h>
+
+// In-memory MIDI port: bytes written to it can be read
+// back from it (FIFO). Can be used in place of a serial
+// port, e.g. to route the output of one ArpEngine to the
+// input of another, or to feed/capture MIDI data without
+// any hardware.
+
+class MidiLoopback : public Stream
+{
+private:
+    static const unsigned int BUFFER_SIZE = 256; // power of 2
+
+    uint8_t _buffer[BUFFER_SIZE];
+    unsigned int _head; // next write position
+    unsigned int _tail; // next read position
+
+public:
+    MidiLoopback();
+
+    // Stream
+    int available() override;
+    int read() override;
+    int peek() override;
+    int availableForWrite() override;
+
+    // Print
+    // (bytes are dropped if the buffer is full)
+    size_t write(uint8_t data) override;
+    using Print::write;
+
+    // Discards any unread data
+    void clear();
+};
@@ -0,0 +1,264 @@
+#include <Arduino.h>
+#include <string.h>
+#include <hardware/flash.h>
+#include <hardware/sync.h>
+#include "Settings.h"
+
+// Start of the flash sectors used (provided by the linker script):
+// the filesystem area, and the sector reserved for EEPROM emulation
+extern uint8_t _FS_start[];
+extern uint8_t _EEPROM_start[];
+
+Settings::Settings(unsigned long saveDelayMs)
+{
+    _saveDelayMs = saveDelayMs;
+    memset(&_values, 0, sizeof(_values));
+    _hasValues = false;
+    _dirty = false;
+    memset(_presets, 0, sizeof(_presets));
+    _presetsStored = 0;
+    _presetsDirty = 0;
+    _changedAt = 0;
+    _sector = SECTOR_COUNT - 1;
+    _generation = 0;
+    _nextSlot = RECORD_COUNT; // (no log yet: the first write starts one)
+}
+
+const uint8_t* Settings::sectorStart(unsigned int sector)
+{
+    return sector == 0 ? _FS_start : _EEPROM_start;
+}
+
+const Settings::Record* Settings::recordAt(unsigned int sector, unsigned int slot)
+{
+    // flash is memory mapped (XIP) for reading
+    return (const Record*)(sectorStart(sector) + slot * RECORD_SIZE);
+}
+
+// (values or preset record)
+bool Settings::isValid(const Record* record)
+{
+    if (record->magic == RECORD_MAGIC) {
+        if (record->version != RECORD_VERSION) return false;
+    }
+    else if (record->magic == PRESET_MAGIC) {
+        const PresetRecord* preset = (const PresetRecord*)record;
+        if (preset->version != PRESET_VERSION) return false;
+        if (preset->index >= PRESET_COUNT) return false;
+    }
+    else return false;
+    return sumOf(record) == 0;
+}
+
+bool Settings::isValidHeader(const Record* record)
+{
+    const Header* header = (const Header*)record;
+    return header->magic == HEADER_MAGIC && header->version == HEADER_VERSION &&
+        sumOf(record) == 0;
+}
+
+// Sum of all bytes of a record
+uint8_t Settings::sumOf(const void* record)
+{
+    const uint8_t* bytes = (const uint8_t*)record;
+    uint8_t sum = 0;
+    for (unsigned int i = 0; i < RECORD_SIZE; i++) sum += bytes[i];
+    return sum;
+}
+
+bool Settings::isErased(const Record* record)
+{
+    const uint8_t* bytes = (const uint8_t*)record;
+    for (unsigned int i = 0; i < RECORD_SIZE; i++) {
+        if (bytes[i] != 0xff) return false;
+    }
+    return true;
+}
+
+bool Settings::load(Values& values)
+{
+    // The active sector is the one with a valid header of the
+    // latest generation (both are valid if power was lost just
+    // before the old one was cleared). If neither has one, the
+    // log is one left by older firmware, in the EEPROM sector,
+    // without a header: it's read, and the next write compacts it.
+    unsigned int firstSlot = 0;
+    for (unsigned int sector = 0; sector < SECTOR_COUNT; sector++) {
+        if (!isValidHeader(recordAt(sector, 0))) continue;
+        uint32_t generation = ((const Header*)recordAt(sector, 0))->generation;
+        if (firstSlot == 0 || (int32_t)(generation - _generation) > 0) {
+            _sector = sector;
+            _generation = generation;
+            firstSlot = 1;
+        }
+    }
+
+    // Records are appended in order: the first erased slot
+    // ends the log. Invalid (torn) records are skipped.
+    const Record* last = NULL;
+    unsigned int slot = firstSlot;
+    while (slot < RECORD_COUNT && !isErased(recordAt(_sector, slot))) {
+        const Record* record = recordAt(_sector, slot);
+        if (isValid(record)) {
+            if (record->magic == RECORD_MAGIC) last = record;
+            else {
+                const PresetRecord* preset = (const PresetRecord*)record;
+                memcpy(_presets[preset->index], preset->data, PRESET_SIZE);
+                _presetsStored |= 1 << preset->index;
+            }
+        }
+        slot++;
+    }
+    _nextSlot = firstSlot > 0 ? slot : RECORD_COUNT;
+
+    if (last == NULL) return false;
+    _hasValues = true;
+    _values.sync = last->sync;
+    _values.enabled = last->enabled;
+    _values.hold = last->hold;
+    _values.mode = last->mode;
+    _values.range = last->range;
+    _values.velocityMode = last->velocityMode;
+    _values.chords = last->chords;
+    values = _values;
+    return true;
+}
+
+void Settings::set(const Values& values, unsigned long currentTime)
+{
+    if (memcmp(&values, &_values, sizeof(Values)) == 0) return;
+    _values = values;
+    _hasValues = true;
+    _dirty = true;
+    _changedAt = currentTime;
+}
+
+bool Settings::loadPreset(unsigned int index, uint8_t* data)
+{
+    if (index >= PRESET_COUNT || !(_presetsStored & (1 << index))) return false;
+    memcpy(data, _presets[index], PRESET_SIZE);
+    return true;
+}
+
+void Settings::setPreset(unsigned int index, const uint8_t* data, unsigned long currentTime)
+{
+    if (index >= PRESET_COUNT) return;
+    memcpy(_presets[index], data, PRESET_SIZE);
+    _presetsStored |= 1 << index;
+    _presetsDirty |= 1 << index;
+    _changedAt = currentTime;
+}
+
+void Settings::run(unsigned long currentTime, bool idle, bool stopped)
+{
+    if ((_dirty || _presetsDirty) && idle && currentTime - _changedAt >= _saveDelayMs) {
+        if (write(stopped)) {
+            _dirty = false;
+            _presetsDirty = 0;
+        }
+    }
+}
+
+// Programs a record (RECORD_SIZE bytes) into a slot
+void Settings::program(unsigned int sector, unsigned int slot, const void* record)
+{
+    uint32_t sectorOffset = (uint32_t)((uintptr_t)sectorStart(sector) - XIP_BASE);
+    // Flash is programmed a full page at a time, but
+    // programming 0xff leaves the existing bits alone, so
+    // only the new record is actually written.
+    uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0xff, sizeof(page));
+    uint32_t offset = slot * RECORD_SIZE;
+    memcpy(page + offset % FLASH_PAGE_SIZE, record, RECORD_SIZE);
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_program(sectorOffset + offset - offset % FLASH_PAGE_SIZE,
+        page, FLASH_PAGE_SIZE);
+    restore_interrupts(ints);
+}
+
+void Settings::erase(unsigned int sector)
+{
+    uint32_t sectorOffset = (uint32_t)((uintptr_t)sectorStart(sector) - XIP_BASE);
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_erase(sectorOffset, SECTOR_SIZE);
+    restore_interrupts(ints);
+}
+
+// Appends the changed values and presets to the log in the
+// specified sector
+void Settings::writeRecords(unsigned int sector)
+{
+    if (_dirty) {
+        Record record;
+        memset(&record, 0, sizeof(record));
+        record.magic = RECORD_MAGIC;
+        record.version = RECORD_VERSION;
+        record.sync = _values.sync;
+        record.enabled = _values.enabled;
+        record.hold = _values.hold;
+        record.mode = _values.mode;
+        record.range = _values.range;
+        record.velocityMode = _values.velocityMode;
+        record.chords = _values.chords;
+        record.checksum = -sumOf(&record);
+        program(sector, _nextSlot++, &record);
+    }
+
+    for (unsigned int index = 0; index < PRESET_COUNT; index++) {
+        if (!(_presetsDirty & (1 << index))) continue;
+        PresetRecord record;
+        record.magic = PRESET_MAGIC;
+        record.version = PRESET_VERSION;
+        record.index = index;
+        memcpy(record.data, _presets[index], PRESET_SIZE);
+        record.checksum = 0;
+        record.checksum = -sumOf(&record);
+        program(sector, _nextSlot++, &record);
+    }
+}
+
+// Starts a new log in the other sector, with everything in it
+void Settings::compact()
+{
+    unsigned int sector = (_sector + 1) % SECTOR_COUNT;
+    erase(sector);
+    _nextSlot = 1;
+    _dirty = _hasValues;
+    _presetsDirty = _presetsStored;
+    writeRecords(sector);
+
+    // The new log is complete: its header makes it the active one...
+    Header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = HEADER_MAGIC;
+    header.version = HEADER_VERSION;
+    header.generation = _generation + 1;
+    header.checksum = -sumOf(&header);
+    program(sector, 0, &header);
+
+    // ... and the old one's is cleared (programmed to all zeros)
+    memset(&header, 0, sizeof(header));
+    program(_sector, 0, &header);
+
+    _sector = sector;
+    _generation++;
+}
+
+// Writes the changed values and presets. Returns false if the log
+// is full, and compacting it has to wait (until stopped).
+bool Settings::write(bool stopped)
+{
+    unsigned int count = _dirty ? 1 : 0;
+    for (unsigned int i = 0; i < PRESET_COUNT; i++) {
+        if (_presetsDirty & (1 << i)) count++;
+    }
+
+    if (_nextSlot + count > RECORD_COUNT) {
+        if (!stopped) return false;
+        compact(); // (writes everything)
+    }
+    else {
+        writeRecords(_sector);
+    }
+    return true;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <stdint.h>
+
+// Persistent panel settings, stored in two flash sectors at the
+// end of flash: the one reserved for EEPROM emulation, and the
+// (one sector) filesystem area just before it (see platformio.ini).
+//
+// The active sector is used as an append-only log of small,
+// checksummed records: each save programs one new record after
+// the last one. On startup the last valid record wins, so a
+// record torn by a power loss is simply skipped.
+//
+// When the log is full, it's compacted into the other sector:
+// that one is erased, the current values and presets are
+// written to it, and only then its header (with a generation
+// count, one up on the old sector's) makes it the active one.
+// The old sector's header is then cleared. Whenever power is
+// lost, one sector still holds a complete log.
+//
+// Saves are debounced, and only happen while the caller
+// reports that it's idle, since programming/erasing flash
+// stalls the CPU (no code can run from flash meanwhile).
+// Compacting, which erases a sector (interrupts stay off for
+// tens of ms), waits until the caller reports that it's
+// stopped as well (e.g. no MIDI clock transport running).
+//
+// Stored presets (opaque data, e.g. a full parameter set)
+// share the log, as records of their own, with the last valid
+// record for each preset winning.
+
+class Settings
+{
+public:
+    static const unsigned int PRESET_COUNT = 8;
+    static const unsigned int PRESET_SIZE = 12; // bytes per preset
+
+    // Stored values
+    struct Values
+    {
+        bool sync;
+        bool enabled;
+        bool hold;
+        uint8_t mode;
+        uint8_t range;
+        uint8_t velocityMode;
+        bool chords;
+    };
+
+private:
+    static const uint8_t RECORD_MAGIC = 0xa5;
+    static const uint8_t RECORD_VERSION = 1; // bump when Values changes
+    static const uint8_t PRESET_MAGIC = 0xa6;
+    static const uint8_t PRESET_VERSION = 1;
+    static const uint8_t HEADER_MAGIC = 0xa7;
+    static const uint8_t HEADER_VERSION = 1;
+
+    // On-flash record. Erased flash reads as 0xff, so
+    // a slot with magic == 0xff has never been written.
+    struct Record
+    {
+        uint8_t magic;
+        uint8_t version;
+        uint8_t sync;
+        uint8_t enabled;
+        uint8_t hold;
+        uint8_t mode;
+        uint8_t range;
+        uint8_t velocityMode;
+        uint8_t chords; // (was reserved: 0 in older records)
+        uint8_t reserved[6];
+        uint8_t checksum; // makes the sum of all bytes 0
+    };
+
+    struct PresetRecord
+    {
+        uint8_t magic;
+        uint8_t version;
+        uint8_t index;
+        uint8_t data[PRESET_SIZE];
+        uint8_t checksum;
+    };
+
+    // First slot of a sector (the log follows it)
+    struct Header
+    {
+        uint8_t magic;
+        uint8_t version;
+        uint8_t reserved[2];
+        uint32_t generation; // (the higher one is the active sector)
+        uint8_t reserved2[7];
+        uint8_t checksum;
+    };
+
+    static const unsigned int RECORD_SIZE = sizeof(Record); // 16
+    static_assert(sizeof(PresetRecord) == RECORD_SIZE, "Records must be the same size");
+    static_assert(sizeof(Header) == RECORD_SIZE, "Records must be the same size");
+    static const unsigned int SECTOR_SIZE = 4096;
+    static const unsigned int SECTOR_COUNT = 2;
+    static const unsigned int RECORD_COUNT = SECTOR_SIZE / RECORD_SIZE; // (including the header)
+
+    unsigned long _saveDelayMs;
+
+    Values _values;
+    bool _hasValues; // (loaded or set)
+    bool _dirty;
+    uint8_t _presets[PRESET_COUNT][PRESET_SIZE];
+    uint32_t _presetsStored; // 1 bit per preset
+    uint32_t _presetsDirty; // 1 bit per preset
+    unsigned long _changedAt; // timestamp of last change
+    unsigned int _sector; // active sector
+    uint32_t _generation; // (of the active sector)
+    unsigned int _nextSlot; // where the next record goes
+
+    const uint8_t* sectorStart(unsigned int sector);
+    const Record* recordAt(unsigned int sector, unsigned int slot);
+    bool isValid(const Record* record);
+    bool isValidHeader(const Record* record);
+    bool isErased(const Record* record);
+    uint8_t sumOf(const void* record);
+    void program(unsigned int sector, unsigned int slot, const void* record);
+    void erase(unsigned int sector);
+    void writeRecords(unsigned int sector);
+    void compact();
+    bool write(bool stopped);
+
+public:
+    Settings(unsigned long saveDelayMs);
+
+    // Restores the last saved values (and reads the presets).
+    // Returns false (and leaves values untouched) if no valid
+    // values are stored.
+    bool load(Values& values);
+
+    // Call whenever a setting changes. Values are written
+    // once they've been left unchanged for saveDelayMs.
+    void set(const Values& values, unsigned long currentTime);
+
+    // Copies a stored preset (PRESET_SIZE bytes) into data.
+    // Returns false if the preset has never been stored.
+    bool loadPreset(unsigned int index, uint8_t* data);
+
+    // Stores a preset (written to flash like values, see set())
+    void setPreset(unsigned int index, const uint8_t* data, unsigned long currentTime);
+
+    // Call frequently (in inner loop). Only writes to flash
+    // if idle is true, and only compacts the log (erasing a
+    // sector) if stopped is true as well.
+    void run(unsigned long currentTime, bool idle, bool stopped);
+};
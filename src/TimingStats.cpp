@@ -0,0 +1,71 @@
+#include <Arduino.h>
+#include "TimingStats.h"
+
+TimingStats::TimingStats(const char* name, unsigned long p99LimitMs, unsigned long maxLimitMs,
+    unsigned long missThresholdMs)
+{
+    _name = name;
+    _p99LimitMs = p99LimitMs;
+    _maxLimitMs = maxLimitMs;
+    _missThresholdMs = missThresholdMs;
+    reset();
+}
+
+void TimingStats::record(long errorMs)
+{
+    unsigned long error = errorMs < 0 ? -errorMs : errorMs;
+    _buckets[error < BUCKET_COUNT ? error : BUCKET_COUNT-1]++;
+    _count++;
+    _totalMs += error;
+    if (error > _maxMs) _maxMs = error;
+    if (error > _missThresholdMs) _missCount++;
+}
+
+void TimingStats::reset()
+{
+    for (unsigned int i = 0; i < BUCKET_COUNT; i++) _buckets[i] = 0;
+    _count = 0;
+    _totalMs = 0;
+    _maxMs = 0;
+    _missCount = 0;
+}
+
+// Smallest error that at least 99% of the events were within
+// (in the last bucket, the max error)
+unsigned long TimingStats::p99()
+{
+    uint32_t needed = _count - _count/100; // 99%, rounded up
+    uint32_t sum = 0;
+    for (unsigned int i = 0; i < BUCKET_COUNT-1; i++) {
+        sum += _buckets[i];
+        if (sum >= needed) return i;
+    }
+    return _maxMs;
+}
+
+uint32_t TimingStats::misses()
+{
+    return _missCount;
+}
+
+bool TimingStats::isWithinLimits()
+{
+    return p99() <= _p99LimitMs && _maxMs <= _maxLimitMs;
+}
+
+void TimingStats::print(Print& out)
+{
+    out.print("timing,");
+    out.print(_name);
+    out.print(',');
+    out.print(_count);
+    out.print(',');
+    out.print(_count > 0 ? (float)_totalMs / _count : 0.0f, 2);
+    out.print(',');
+    out.print(p99());
+    out.print(',');
+    out.print(_maxMs);
+    out.print(',');
+    out.print(_missCount);
+    out.println(isWithinLimits() ? ",ok" : ",FAIL");
+}
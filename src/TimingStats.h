@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <Arduino.h>
+
+// Collects the timing error of arpeggiator output events
+// (time at which the event was sent, minus the time at which
+// it was due on the ideal musical grid), as a histogram with
+// 1 ms buckets, so mean, 99th percentile and max error can be
+// reported on the target, under real load.
+//
+// Each instance has error limits (p99 and max); print()
+// reports whether they were exceeded, so a timing
+// regression shows up as a FAIL line. Events off by more
+// than the miss threshold are also counted as deadline
+// misses (e.g. the loop was stalled).
+
+class TimingStats
+{
+private:
+    static const unsigned int BUCKET_COUNT = 32; // last bucket: >= 31 ms
+
+    const char* _name;
+    unsigned long _p99LimitMs;
+    unsigned long _maxLimitMs;
+    unsigned long _missThresholdMs;
+    uint32_t _buckets[BUCKET_COUNT];
+    uint32_t _count;
+    uint64_t _totalMs;
+    unsigned long _maxMs;
+    uint32_t _missCount;
+
+public:
+    TimingStats(const char* name, unsigned long p99LimitMs, unsigned long maxLimitMs,
+        unsigned long missThresholdMs);
+
+    // Error in ms (early or late)
+    void record(long errorMs);
+    void reset();
+
+    unsigned long p99();
+    uint32_t misses();
+    bool isWithinLimits();
+
+    // Prints one machine readable line:
+    // "timing,<name>,<count>,<mean>,<p99>,<max>,<misses>,<ok|FAIL>"
+    void print(Print& out);
+};
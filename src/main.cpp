@@ -1,8 +1,19 @@
 #include <Arduino.h>
+#include <pico/time.h>
+#include <hardware/watchdog.h>
+#ifdef USE_TINYUSB
+#include <Adafruit_TinyUSB.h>
+#endif
 #include "Potentiometer.h"
 #include "Button.h"
 #include "LedFlasher.h"
 #include "ArpEngine.h"
+#include "Settings.h"
+#include "MidiCapture.h"
+#include "CycleCounter.h"
+#include "TimingStats.h"
+#include "ClockGenerator.h"
+#include "LoadMeter.h"
 
 // Serial pins
 static const int MIDI_IN_PIN = 1;
@@ -19,8 +30,8 @@ static const int GATE_ADC_CHANNEL = A0;
 static const int SYNC_PIN = 22;
 static const int MODE_PIN = 9;
 static const int OCT_PIN = 14;
-static const int ONOFF_PIN = 8;
-static const int HOLD_PIN = 2; // press: hold on/off, hold: chords mode
+static const int ONOFF_PIN = 8; // press: on/off, hold: chords mode
+static const int HOLD_PIN = 2;
 
 // LED pins
 static const int MIDI_IN_LED_PIN = LED_BUILTIN;
@@ -79,23 +90,34 @@ static const int HOLD_LED_PIN = 14;
 // Constants
 static const int BUTTON_DEBOUNCE_MS = 30;
 static const int BUTTON_HELD_MS = 700;
+static const int SETTINGS_SAVE_DELAY_MS = 2000;
+static const int TIMING_P99_LIMIT_MS = 1; // output timing error limits
+static const int TIMING_MAX_LIMIT_MS = 5;
+static const int DEADLINE_MISS_MS = 2; // events later than this count as missed
+static const int WATCHDOG_TIMEOUT_MS = 2000; // (> worst case flash write or capture dump)
+static const int POT_SCAN_MS = 16; // while sleeping between passes:
+static const int POT_SAMPLES_PER_SCAN = 16; // (~1 sample per ms, as when not)
 
 // state
 ulong now; // current synchronized timestamp (ms)
 bool sync = false;
 bool enabled = false;
 bool hold = false;
+bool chords = false; // chords mode (only arpeggiate 2 or more keys)
 int oct = 0; // extra octaves
 int type = ArpEngine::MODE_UP;
+int velMode = ArpEngine::VEL_EACH;
 int tempo = 100;
 int gate = 100;
 int status_led = false;
+bool idleSleep = true; // sleep between loop passes until something's due
+ulong nextPotScanAt = 0;
 
 
 ////////// I/O
 
 Button syncButton = Button(SYNC_PIN, BUTTON_DEBOUNCE_MS);
-Button modeButton = Button(MODE_PIN, BUTTON_DEBOUNCE_MS);
+Button modeButton = Button(MODE_PIN, BUTTON_DEBOUNCE_MS, BUTTON_HELD_MS);
 Button octButton = Button(OCT_PIN, BUTTON_DEBOUNCE_MS);
 Button onOffButton = Button(ONOFF_PIN, BUTTON_DEBOUNCE_MS, BUTTON_HELD_MS);
 Button holdButton = Button(HOLD_PIN, BUTTON_DEBOUNCE_MS);
@@ -108,7 +130,39 @@ Potentiometer tempoPot = Potentiometer(TEMPO_ADC_CHANNEL,
 Potentiometer gatePot = Potentiometer(GATE_ADC_CHANNEL,
   30, 990, ArpEngine::MIN_GATE, ArpEngine::MAX_GATE);
 
-ArpEngine arpEngine = ArpEngine(&Serial1, &Serial2, &Serial);
+#ifdef USE_TINYUSB
+// USB MIDI build: notes in/out over USB (e.g. to/from a DAW),
+// external sync from the MIDI Sync In port
+Adafruit_USBD_MIDI usbMidi;
+ArpEngine arpEngine = ArpEngine(&usbMidi, &usbMidi, &Serial2, &Serial);
+#else
+ArpEngine arpEngine = ArpEngine(&Serial1, &Serial1, &Serial2, &Serial);
+#endif
+
+Settings settings = Settings(SETTINGS_SAVE_DELAY_MS);
+
+MidiCapture midiCapture;
+
+// MIDI clock output (internal tempo)
+ClockGenerator midiClock;
+
+// Loop profiling (cycle counts per section, see 'p' debug command)
+CycleCounter buttonsCycles = CycleCounter("buttons");
+CycleCounter potsCycles = CycleCounter("pots");
+CycleCounter ledsCycles = CycleCounter("leds");
+CycleCounter engineCycles = CycleCounter("engine");
+CycleCounter loopCycles = CycleCounter("loop");
+
+// Idle/busy time and wake-up latency (see 'l' debug command)
+LoadMeter loadMeter;
+
+// Output timing accuracy (see 't' debug command)
+TimingStats noteOnTiming = TimingStats("note_on",
+  TIMING_P99_LIMIT_MS, TIMING_MAX_LIMIT_MS, DEADLINE_MISS_MS);
+TimingStats noteOffTiming = TimingStats("note_off",
+  TIMING_P99_LIMIT_MS, TIMING_MAX_LIMIT_MS, DEADLINE_MISS_MS);
+TimingStats clockOutTiming = TimingStats("clock_out",
+  TIMING_P99_LIMIT_MS, TIMING_MAX_LIMIT_MS, DEADLINE_MISS_MS);
 
 
 ////////// Helpers
@@ -128,6 +182,92 @@ void setOctLed(int pin) {
   digitalWrite(OCT5_LED_PIN, LOW);
   digitalWrite(pin, HIGH);
 }
+void showMode() {
+  switch (type) {
+    case ArpEngine::MODE_UP: setModeLed(MODE_UP_LED_PIN); break;
+    case ArpEngine::MODE_DOWN: setModeLed(MODE_DOWN_LED_PIN); break;
+    case ArpEngine::MODE_UP_DOWN: setModeLed(MODE_UP_DOWN_LED_PIN); break;
+    case ArpEngine::MODE_RANDOM: setModeLed(MODE_RANDOM_LED_PIN); break;
+  }
+}
+void showVelocityMode() { // (on the mode LEDs, while the mode button is held)
+  static const int pins[ArpEngine::VEL_COUNT] = {
+    MODE_UP_LED_PIN, MODE_DOWN_LED_PIN, MODE_UP_DOWN_LED_PIN, MODE_RANDOM_LED_PIN
+  };
+  setModeLed(pins[velMode]);
+}
+void showOct() {
+  switch (oct) {
+    case 0: setOctLed(OCT1_LED_PIN); break;
+    case 1: setOctLed(OCT2_LED_PIN); break;
+    case 2: setOctLed(OCT3_LED_PIN); break;
+    case 3: setOctLed(OCT4_LED_PIN); break;
+    case 4: setOctLed(OCT5_LED_PIN); break;
+  }
+}
+
+// Sleeps until the next scheduled event (engine, LEDs, pot scan,
+// or button debouncing while one is down), or until an interrupt
+// (MIDI/USB data, a button edge, the MIDI clock alarm) comes first
+void sleepUntilNextEvent() {
+  if (Serial.available() > 0) return; // (more debug commands)
+  if (syncButton.isPressed() || modeButton.isPressed() || octButton.isPressed() ||
+      onOffButton.isPressed() || holdButton.isPressed()) return;
+  ulong deadline = arpEngine.NextEventAt(nextPotScanAt);
+  deadline = tempoLed.nextEventAt(deadline);
+  deadline = midiInLed.nextEventAt(deadline);
+
+  // (deadline is on the millis() timeline: 1 ms = 1000 us since boot)
+  uint64_t sleepStart = time_us_64();
+  long sleepMs = (long)(deadline - (ulong)(sleepStart / 1000));
+  if (sleepMs <= 0) return;
+  uint64_t deadlineUs = (sleepStart / 1000 + sleepMs) * 1000;
+  // (an interrupt taken just before this sets the event register,
+  // so it returns right away instead of sleeping through it)
+  best_effort_wfe_or_timeout(from_us_since_boot(deadlineUs));
+  uint64_t wokeAt = time_us_64();
+  loadMeter.addSleep(wokeAt - sleepStart);
+  if (wokeAt >= deadlineUs) loadMeter.addWake(wokeAt - deadlineUs);
+}
+
+// Queues current state for saving (written to flash when idle)
+void saveSettings() {
+  Settings::Values values;
+  values.sync = sync;
+  values.enabled = enabled;
+  values.hold = hold;
+  values.mode = type;
+  values.range = oct;
+  values.velocityMode = velMode;
+  values.chords = chords;
+  settings.set(values, now);
+}
+
+// Restores state saved by a previous session (if any). In a safe
+// start, the arpeggiator stays off, whatever was saved.
+void restoreSettings(bool safeStart) {
+  Settings::Values values;
+  if (!settings.load(values)) {
+    Serial.println("No saved settings");
+    return;
+  }
+  sync = values.sync;
+  enabled = values.enabled && !safeStart;
+  hold = values.hold;
+  chords = values.chords;
+  if (values.mode < ArpEngine::MODE_COUNT) type = values.mode;
+  if (values.range <= ArpEngine::MAX_RANGE) oct = values.range;
+  if (values.velocityMode < ArpEngine::VEL_COUNT) velMode = values.velocityMode;
+
+  arpEngine.SetMidiSync(sync);
+  arpEngine.SetMode(type);
+  arpEngine.SetRange(oct);
+  arpEngine.SetVelocityMode(velMode);
+  arpEngine.SetChords(chords);
+  if (hold) arpEngine.SetHold(hold);
+  if (enabled) arpEngine.SetEnabled(enabled);
+  saveSettings(); // in sync with what was loaded (nothing to write, unless overridden)
+}
 
 
 ////////// Event handlers
@@ -136,30 +276,33 @@ void syncButtonDown() {
   sync = ! sync;
   digitalWrite(SYNC_LED_PIN, sync);
   arpEngine.SetMidiSync(sync);
+  saveSettings();
   Serial.println(sync ? "Sync: On" : "Sync: Off");
 }
-void modeButtonDown() {
+void modeButtonUpNotHeld() {
   if (++type >= ArpEngine::MODE_COUNT) type = 0;
   arpEngine.SetMode(type);
-  switch (type) {
-    case ArpEngine::MODE_UP: setModeLed(MODE_UP_LED_PIN); break;
-    case ArpEngine::MODE_DOWN: setModeLed(MODE_DOWN_LED_PIN); break;
-    case ArpEngine::MODE_UP_DOWN: setModeLed(MODE_UP_DOWN_LED_PIN); break;
-    case ArpEngine::MODE_RANDOM: setModeLed(MODE_RANDOM_LED_PIN); break;
-  }
+  showMode();
+  saveSettings();
   Serial.print("Mode: ");
   Serial.println(type);
 }
+void modeButtonHeld() {
+  if (++velMode >= ArpEngine::VEL_COUNT) velMode = 0;
+  arpEngine.SetVelocityMode(velMode);
+  showVelocityMode();
+  saveSettings();
+  Serial.print("Velocity mode: ");
+  Serial.println(velMode);
+}
+void modeButtonUp() {
+  showMode();
+}
 void octButtonDown() {
-  if (++oct > 4) oct = 0;
-  switch (oct) {
-    case 0: setOctLed(OCT1_LED_PIN); break;
-    case 1: setOctLed(OCT2_LED_PIN); break;
-    case 2: setOctLed(OCT3_LED_PIN); break;
-    case 3: setOctLed(OCT4_LED_PIN); break;
-    case 4: setOctLed(OCT5_LED_PIN); break;
-  }
+  if (++oct > ArpEngine::MAX_RANGE) oct = 0;
+  showOct();
   arpEngine.SetRange(oct);
+  saveSettings();
   Serial.print("Oct: ");
   Serial.println(oct);
 }
@@ -169,17 +312,76 @@ void onOffButtonUpNotHeld() {
   enabled = ! enabled;
   digitalWrite(ONOFF_LED_PIN, enabled);
   arpEngine.SetEnabled(enabled);
+  saveSettings();
   Serial.println(enabled ? "On" : "Off");
 }
 void onOffButtonHeld() {
-  // TODO: toggle chords mode
+  chords = ! chords;
+  digitalWrite(CHORDS_LED_PIN, chords);
+  arpEngine.SetChords(chords);
+  saveSettings();
+  Serial.println(chords ? "Chords: On" : "Chords: Off");
 }
 void holdButtonDown() {
   hold = ! hold;
   digitalWrite(HOLD_LED_PIN, hold);
   arpEngine.SetHold(hold);
+  saveSettings();
   Serial.println(hold ? "Hold: On" : "Hold: Off");
 }
+// Single character commands on the USB serial (debug) port
+void handleDebugCommand(int command) {
+  switch (command) {
+    case 'c': // start capture
+      arpEngine.StartCapture();
+      Serial.println("Capture started");
+      break;
+    case 's': // stop capture
+      midiCapture.stop();
+      Serial.println("Capture stopped");
+      break;
+    case 'd': // dump capture
+      midiCapture.dump(Serial);
+      break;
+    case 'p': // print (and reset) loop profile
+      Serial.print("# cycles,name,count,min,avg,max @ ");
+      Serial.print(rp2040.f_cpu());
+      Serial.println(" Hz");
+      buttonsCycles.print(Serial);
+      potsCycles.print(Serial);
+      ledsCycles.print(Serial);
+      engineCycles.print(Serial);
+      loopCycles.print(Serial);
+      buttonsCycles.reset();
+      potsCycles.reset();
+      ledsCycles.reset();
+      engineCycles.reset();
+      loopCycles.reset();
+      break;
+    case 't': // print (and reset) output timing errors
+      Serial.println("# timing,name,count,mean,p99,max (ms),misses,result");
+      noteOnTiming.print(Serial);
+      noteOffTiming.print(Serial);
+      clockOutTiming.print(Serial);
+      noteOnTiming.reset();
+      noteOffTiming.reset();
+      clockOutTiming.reset();
+      break;
+    case 'l': // print (and reset) CPU load
+      Serial.println("# load,busy %,idle %,sleeps,wakes,avg latency,max latency (us)");
+      loadMeter.print(Serial, time_us_64());
+      loadMeter.reset(time_us_64());
+      break;
+    case 'i': // toggle idle sleep
+      idleSleep = !idleSleep;
+      loadMeter.reset(time_us_64());
+      Serial.println(idleSleep ? "Idle sleep: On" : "Idle sleep: Off");
+      break;
+  }
+}
+void wakeUp() {
+  // (nothing to do: any interrupt ends the sleep)
+}
 void onMidiIn() {
   midiInLed.flash(now);
 }
@@ -187,12 +389,53 @@ void onBeat() {
   tempoLed.flash(now);
 }
 
+// Parameters set by SysEx: the panel follows (until a knob
+// is turned, tempo and gate are then the engine's own)
+void onParameters() {
+  ArpEngine::Parameters parameters;
+  arpEngine.GetParameters(parameters);
+  sync = parameters.sync;
+  enabled = parameters.enabled;
+  hold = parameters.hold;
+  type = parameters.mode;
+  oct = parameters.range;
+  velMode = parameters.velocityMode;
+  tempo = parameters.tempo;
+  gate = parameters.gate;
+  digitalWrite(SYNC_LED_PIN, sync);
+  digitalWrite(ONOFF_LED_PIN, enabled);
+  digitalWrite(HOLD_LED_PIN, hold);
+  showMode();
+  showOct();
+  saveSettings();
+}
+
+// Presets (for SysEx) are kept with the settings
+static_assert(ArpEngine::PARAMETER_BYTES <= Settings::PRESET_SIZE, "Parameters don't fit in a preset");
+bool onLoadPreset(int preset, byte* data) {
+  uint8_t stored[Settings::PRESET_SIZE];
+  if (!settings.loadPreset(preset, stored)) return false;
+  memcpy(data, stored, ArpEngine::PARAMETER_BYTES);
+  return true;
+}
+void onStorePreset(int preset, const byte* data) {
+  uint8_t stored[Settings::PRESET_SIZE] = {};
+  memcpy(stored, data, ArpEngine::PARAMETER_BYTES);
+  settings.setPreset(preset, stored, now);
+}
+
 
 ////////// Initialization
 
 void setup() {
   now = millis();
 
+#ifdef USE_TINYUSB
+  // (before Serial, so the host enumerates both)
+  usbMidi.setStringDescriptor("MIDI Arpeggiator");
+  usbMidi.begin();
+#endif
+
   Serial.begin(115200); // rate doesn't matter for USB
   Serial.println("Starting...");
 
@@ -226,6 +469,12 @@ void setup() {
   pinMode(OCT_PIN, INPUT_PULLUP);
   pinMode(ONOFF_PIN, INPUT_PULLUP);
   pinMode(HOLD_PIN, INPUT_PULLUP);
+  // (pin changes wake the loop from idle sleep)
+  attachInterrupt(digitalPinToInterrupt(SYNC_PIN), wakeUp, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(MODE_PIN), wakeUp, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(OCT_PIN), wakeUp, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(ONOFF_PIN), wakeUp, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(HOLD_PIN), wakeUp, CHANGE);
   
   // leds
   pinMode(MIDI_IN_LED_PIN, OUTPUT);
@@ -243,12 +492,34 @@ void setup() {
   pinMode(ONOFF_LED_PIN, OUTPUT);
   pinMode(CHORDS_LED_PIN, OUTPUT);
   pinMode(HOLD_LED_PIN, OUTPUT);
-  setModeLed(MODE_UP_LED_PIN); // initial value
-  setOctLed(OCT1_LED_PIN); // initial value
+
+  // After a crash (watchdog reset), start in a safe state: with the
+  // arpeggiator off, before the restored settings can turn it on
+  bool watchdogReset = watchdog_enable_caused_reboot();
+  if (watchdogReset) Serial.println("Watchdog reset: arpeggiator off");
+
+  // restore saved settings (before the engine first runs)
+  ulong restoreStart = micros();
+  restoreSettings(watchdogReset);
+  Serial.print("Settings restored in ");
+  Serial.print(micros() - restoreStart);
+  Serial.println(" us");
+  digitalWrite(SYNC_LED_PIN, sync);
+  digitalWrite(ONOFF_LED_PIN, enabled);
+  digitalWrite(HOLD_LED_PIN, hold);
+  digitalWrite(CHORDS_LED_PIN, chords);
+  showMode();
+  showOct();
+
+  // End any notes that may have been left sounding on the
+  // connected instruments (by a crash, or the last session)
+  arpEngine.Panic();
 
   // Initialize event handlers
   syncButton.buttonDown = syncButtonDown;
-  modeButton.buttonDown = modeButtonDown;
+  modeButton.buttonUpNotHeld = modeButtonUpNotHeld;
+  modeButton.buttonHeld = modeButtonHeld;
+  modeButton.buttonUp = modeButtonUp;
   octButton.buttonDown = octButtonDown;
   onOffButton.buttonDown = onOffButtonDown;
   onOffButton.buttonUpNotHeld = onOffButtonUpNotHeld;
@@ -256,6 +527,19 @@ void setup() {
   holdButton.buttonDown = holdButtonDown;
   arpEngine.onMidiIn = onMidiIn;
   arpEngine.onBeat = onBeat;
+  arpEngine.onParameters = onParameters;
+  arpEngine.onLoadPreset = onLoadPreset;
+  arpEngine.onStorePreset = onStorePreset;
+  arpEngine.SetCapture(&midiCapture);
+  arpEngine.SetTimingStats(&noteOnTiming, &noteOffTiming, &clockOutTiming);
+  arpEngine.SetClockOutput(&midiClock);
+#ifndef USE_TINYUSB
+  arpEngine.SetRunningStatus(true); // (DIN MIDI only)
+#endif
+  loadMeter.reset(time_us_64());
+
+  // Reboot if the loop ever stops (fed at the top of the loop)
+  rp2040.wdt_begin(WATCHDOG_TIMEOUT_MS);
 }
 
 
@@ -266,6 +550,9 @@ void loop()
   // single reading to ensure everything is
   // synchronized
   now = millis();
+  rp2040.wdt_reset();
+  uint32_t loopStart = CycleCounter::now();
+  uint32_t sectionStart = loopStart;
 
   // scan buttons
   syncButton.scan(now);
@@ -273,23 +560,49 @@ void loop()
   octButton.scan(now);
   onOffButton.scan(now);
   holdButton.scan(now);
-
-  // scan pots
-  tempoPot.sample();
+  buttonsCycles.add(CycleCounter::now() - sectionStart);
+
+  // scan pots (every pass, or in bursts when sleeping between passes)
+  sectionStart = CycleCounter::now();
+  if (!idleSleep || (long)(now - nextPotScanAt) >= 0) {
+    nextPotScanAt = now + POT_SCAN_MS;
+    for (int i = 0; i < (idleSleep ? POT_SAMPLES_PER_SCAN : 1); i++) {
+      tempoPot.sample();
+      gatePot.sample();
+    }
+  }
   if (tempoPot.hasNewOutputValue()) {
     tempo = tempoPot.readOutputValue();
     arpEngine.SetTempo(tempo);
   }
-  gatePot.sample();
   if (gatePot.hasNewOutputValue()) {
     gate = gatePot.readOutputValue();
     arpEngine.SetGate(gate);
   }
+  potsCycles.add(CycleCounter::now() - sectionStart);
   
   // update blinky LEDs
+  sectionStart = CycleCounter::now();
   tempoLed.run(now);
   midiInLed.run(now);
+  ledsCycles.add(CycleCounter::now() - sectionStart);
   
   // run arpeggiator and handle MIDI input
+  sectionStart = CycleCounter::now();
   arpEngine.Run(now);
+  engineCycles.add(CycleCounter::now() - sectionStart);
+
+  // debug commands
+  if (Serial.available() > 0) {
+    handleDebugCommand(Serial.read());
+  }
+
+  // save changed settings (only while not playing, since
+  // writing to flash stalls the CPU, and only compacting the
+  // log while stopped, since erasing stalls it for longer)
+  settings.run(now, arpEngine.IsIdle(), arpEngine.IsStopped());
+
+  loopCycles.add(CycleCounter::now() - loopStart);
+
+  if (idleSleep) sleepUntilNextEvent();
 }
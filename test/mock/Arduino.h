@@ -0,0 +1,115 @@
+#pragma once
+
+// Host stand-in for the Arduino core (earlephilhower RP2040), with
+// just what the firmware modules use, for running them in the
+// native test environment. Time, pins and ports are driven by the
+// tests (see Mock.h).
+
+// (standard headers first: common.h defines byte as a macro)
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/types.h> // (ulong: the width of long, as on the target)
+#include <deque>
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define DEC 10
+#define HEX 16
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define constrain(x, low, high) ((x) < (low) ? (low) : ((x) > (high) ? (high) : (x)))
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t data) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size);
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() {}
+
+    size_t print(const char* s);
+    size_t print(char c);
+    size_t print(unsigned long n, int base = DEC);
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t print(int n, int base = DEC) { return print((long)n, base); }
+    size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t print(unsigned long long n, int base = DEC);
+    size_t print(double n, int digits = 2);
+    template <class T> size_t println(T t) { return print(t) + println(); }
+    template <class T> size_t println(T t, int format) { return print(t, format) + println(); }
+    size_t println() { return print("\r\n"); }
+};
+
+class Stream : public Print
+{
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+// Serial port: what's written is kept (sent), and what the test
+// puts in (received) is read
+class HardwareSerial : public Stream
+{
+public:
+    std::deque<uint8_t> sent;
+    std::deque<uint8_t> received;
+
+    void begin(unsigned long) {}
+    operator bool() { return true; }
+
+    int available() override { return received.size(); }
+    int read() override;
+    int peek() override { return received.empty() ? -1 : received.front(); }
+    size_t write(uint8_t data) override { sent.push_back(data); return 1; }
+    using Print::write;
+};
+
+// USB serial (debug output): printed to stdout
+class SerialUSB : public HardwareSerial
+{
+public:
+    size_t write(uint8_t data) override;
+    using Print::write;
+};
+
+extern SerialUSB Serial;
+extern HardwareSerial Serial1;
+extern HardwareSerial Serial2;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+void pinMode(int pin, int mode);
+int digitalRead(int pin);
+void digitalWrite(int pin, int value);
+int analogRead(int pin);
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+class RP2040
+{
+public:
+    // (host: time since start, in cycles at f_cpu)
+    uint32_t getCycleCount();
+    uint64_t getCycleCount64();
+    uint32_t f_cpu() { return 133000000; }
+    // (host: no watchdog)
+    void wdt_begin(uint32_t) {}
+    void wdt_reset() {}
+};
+
+extern RP2040 rp2040;
@@ -0,0 +1,86 @@
+#include <string.h>
+#include "MidiMonitor.h"
+
+MidiMonitor::MidiMonitor()
+{
+    clear();
+}
+
+void MidiMonitor::clear()
+{
+    messages.clear();
+    noteOns = 0;
+    errors = 0;
+    _status = 0;
+    _inSysEx = false;
+    _dataCount = 0;
+    memset(_sounding, 0, sizeof(_sounding));
+}
+
+void MidiMonitor::read(std::deque<uint8_t>& bytes, unsigned long time)
+{
+    while (!bytes.empty()) {
+        read(bytes.front(), time);
+        bytes.pop_front();
+    }
+}
+
+void MidiMonitor::read(uint8_t data, unsigned long time)
+{
+    if (data >= 0xf8) {
+        // Real Time: may come anywhere, leaves the running status
+        if (keep) messages.push_back({ time, data, 0, 0 });
+        return;
+    }
+    if (data & 0x80) {
+        // (System Common messages end running status: those with
+        // data take it just for the message)
+        _status = data == 0xf0 || data >= 0xf4 ? 0 : data;
+        _inSysEx = data == 0xf0;
+        _dataCount = 0;
+        if (_status == 0 && keep) messages.push_back({ time, data, 0, 0 });
+        return;
+    }
+    if (_status == 0) {
+        if (!_inSysEx) errors++;
+        return;
+    }
+    _data[_dataCount++] = data;
+    int type = _status & 0xf0;
+    int length = type == 0xc0 || type == 0xd0 || _status == 0xf1 || _status == 0xf3 ? 1 : 2;
+    if (_dataCount == length) {
+        handle(time);
+        _dataCount = 0;
+        if (_status >= 0xf0) _status = 0;
+    }
+}
+
+void MidiMonitor::handle(unsigned long time)
+{
+    int channel = _status & 0x0f;
+    uint8_t status = _status;
+    if ((status & 0xf0) == 0x90 && _data[1] == 0) status = 0x80 | channel;
+    if (keep) messages.push_back({ time, status, _data[0], _dataCount > 1 ? _data[1] : (uint8_t)0 });
+
+    if ((status & 0xf0) == 0x90) {
+        noteOns++;
+        _sounding[channel][_data[0]] = true;
+    }
+    else if ((status & 0xf0) == 0x80) {
+        _sounding[channel][_data[0]] = false;
+    }
+}
+
+bool MidiMonitor::isSounding(int channel, int note)
+{
+    return _sounding[channel][note];
+}
+
+int MidiMonitor::soundingCount()
+{
+    int count = 0;
+    for (int channel = 0; channel < 16; channel++) {
+        for (int note = 0; note < 128; note++) count += _sounding[channel][note];
+    }
+    return count;
+}
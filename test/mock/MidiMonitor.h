@@ -0,0 +1,45 @@
+#pragma once
+
+// Follows a MIDI byte stream (e.g. what the engine sent), keeping
+// track of the notes sounding, and optionally keeping the messages,
+// resolved (running status applied, note-on velocity 0 as note-off)
+
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+class MidiMonitor
+{
+public:
+    struct Message
+    {
+        unsigned long time; // (as passed to read)
+        uint8_t status;
+        uint8_t data1;
+        uint8_t data2;
+    };
+
+    bool keep = false; // keep messages (below)
+    std::vector<Message> messages;
+    int noteOns = 0;
+    int errors = 0; // stray data bytes (no status, not in a SysEx)
+
+    MidiMonitor();
+
+    // Consumes the bytes
+    void read(std::deque<uint8_t>& bytes, unsigned long time = 0);
+    void read(uint8_t data, unsigned long time = 0);
+
+    bool isSounding(int channel, int note);
+    int soundingCount();
+    void clear();
+
+private:
+    uint8_t _status;
+    bool _inSysEx;
+    uint8_t _data[2];
+    int _dataCount;
+    bool _sounding[16][128];
+
+    void handle(unsigned long time);
+};
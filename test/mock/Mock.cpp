@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <chrono>
+#include <Arduino.h>
+#include <hardware/flash.h>
+#include <pico/time.h>
+#include "Mock.h"
+
+SerialUSB Serial;
+HardwareSerial Serial1;
+HardwareSerial Serial2;
+RP2040 rp2040;
+
+static uint64_t mockMicros = 0;
+static int pinLevels[32];
+static int analogValues[32];
+static bool pinLevelsSet = false;
+
+
+///////// PRINT
+
+size_t Print::write(const uint8_t* buffer, size_t size)
+{
+    for (size_t i = 0; i < size; i++) write(buffer[i]);
+    return size;
+}
+
+size_t Print::print(const char* s)
+{
+    return write((const uint8_t*)s, strlen(s));
+}
+
+size_t Print::print(char c)
+{
+    return write((uint8_t)c);
+}
+
+size_t Print::print(unsigned long long n, int base)
+{
+    char digits[65];
+    int length = 0;
+    do {
+        int digit = n % base;
+        digits[length++] = digit < 10 ? '0' + digit : 'A' + digit - 10;
+        n /= base;
+    } while (n > 0);
+    size_t written = 0;
+    while (length > 0) written += write((uint8_t)digits[--length]);
+    return written;
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+    return print((unsigned long long)n, base);
+}
+
+size_t Print::print(long n, int base)
+{
+    if (n >= 0) return print((unsigned long long)n, base);
+    return print('-') + print((unsigned long long)-(long long)n, base);
+}
+
+size_t Print::print(double n, int digits)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%.*f", digits, n);
+    return print(text);
+}
+
+int HardwareSerial::read()
+{
+    if (received.empty()) return -1;
+    int data = received.front();
+    received.pop_front();
+    return data;
+}
+
+size_t SerialUSB::write(uint8_t data)
+{
+    putchar(data);
+    return 1;
+}
+
+
+///////// TIME, PINS
+
+void mockSetMicros(uint64_t us) { mockMicros = us; }
+void mockAdvanceMicros(uint64_t us) { mockMicros += us; }
+unsigned long millis() { return (unsigned long)(mockMicros / 1000); }
+unsigned long micros() { return (unsigned long)mockMicros; }
+void delay(unsigned long ms) { mockMicros += (uint64_t)ms * 1000; }
+
+uint32_t RP2040::getCycleCount() { return (uint32_t)getCycleCount64(); }
+
+uint64_t RP2040::getCycleCount64()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return (uint64_t)ns * f_cpu() / 1000000000;
+}
+
+void pinMode(int, int) {}
+
+void mockSetPin(int pin, int level)
+{
+    if (!pinLevelsSet) {
+        for (int i = 0; i < 32; i++) pinLevels[i] = HIGH;
+        pinLevelsSet = true;
+    }
+    pinLevels[pin & 31] = level;
+}
+
+int digitalRead(int pin) { return pinLevelsSet ? pinLevels[pin & 31] : HIGH; }
+void digitalWrite(int, int) {}
+void mockSetAnalog(int pin, int value) { analogValues[pin & 31] = value; }
+int analogRead(int pin) { return analogValues[pin & 31]; }
+
+long random(long max) { return max > 0 ? rand() % max : 0; }
+long random(long min, long max) { return min + random(max - min); }
+void randomSeed(unsigned long seed) { srand(seed); }
+
+
+///////// ALARMS
+
+struct MockAlarm
+{
+    alarm_id_t id; // (0 = free)
+    uint64_t dueAt;
+    alarm_callback_t callback;
+    void* user;
+};
+static MockAlarm alarms[4];
+static alarm_id_t lastAlarmId = 0;
+static uint64_t alarmLatency = 0;
+
+void mockSetAlarmLatency(uint64_t us) { alarmLatency = us; }
+
+alarm_id_t add_alarm_in_us(uint64_t us, alarm_callback_t callback, void* user_data, bool)
+{
+    for (MockAlarm& alarm : alarms) {
+        if (alarm.id != 0) continue;
+        alarm = { ++lastAlarmId, mockMicros + us, callback, user_data };
+        return alarm.id;
+    }
+    return -1;
+}
+
+bool cancel_alarm(alarm_id_t alarm_id)
+{
+    for (MockAlarm& alarm : alarms) {
+        if (alarm.id == alarm_id) {
+            alarm.id = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+void mockRunAlarms()
+{
+    while (true) {
+        MockAlarm* due = NULL;
+        for (MockAlarm& alarm : alarms) {
+            if (alarm.id != 0 && alarm.dueAt + alarmLatency <= mockMicros && (due == NULL || alarm.dueAt < due->dueAt)) {
+                due = &alarm;
+            }
+        }
+        if (due == NULL) return;
+        uint64_t returnedAt = due->dueAt + alarmLatency;
+        int64_t next = due->callback(due->id, due->user);
+        // (< 0: relative to when it was due, > 0: to when it returned, 0: done)
+        if (next < 0) due->dueAt -= next;
+        else if (next > 0) due->dueAt = returnedAt + next;
+        else due->id = 0;
+    }
+}
+
+
+///////// FLASH
+
+alignas(4096) uint8_t _FS_start[MOCK_FLASH_SECTOR_SIZE];
+alignas(4096) uint8_t _EEPROM_start[MOCK_FLASH_SECTOR_SIZE];
+static bool flashErased = (mockFlashErase(), true); // (like new flash)
+static long flashBudget = -1; // bytes left before the power loss (-1: no limit)
+static long flashWritten = 0;
+
+uint8_t* mockFlashSector(int sector)
+{
+    return sector == 0 ? _FS_start : _EEPROM_start;
+}
+
+void mockFlashErase()
+{
+    memset(_FS_start, 0xff, MOCK_FLASH_SECTOR_SIZE);
+    memset(_EEPROM_start, 0xff, MOCK_FLASH_SECTOR_SIZE);
+}
+
+void mockFlashPowerLossAfter(long bytes)
+{
+    flashBudget = bytes;
+    flashWritten = 0;
+}
+
+long mockFlashBytesWritten()
+{
+    return flashWritten;
+}
+
+// Flash offset (from XIP_BASE) to host address, checked to be in
+// one of the sectors
+static uint8_t* flashAt(uint32_t offset, size_t count)
+{
+    uint8_t* at = (uint8_t*)XIP_BASE + (int32_t)offset;
+    for (int sector = 0; sector < 2; sector++) {
+        uint8_t* start = mockFlashSector(sector);
+        if (at >= start && at + count <= start + MOCK_FLASH_SECTOR_SIZE) return at;
+    }
+    fprintf(stderr, "flash access out of range (offset %ld)\n", (long)(int32_t)offset);
+    abort();
+}
+
+static bool flashPowered()
+{
+    if (flashBudget == 0) return false;
+    if (flashBudget > 0) flashBudget--;
+    flashWritten++;
+    return true;
+}
+
+void flash_range_erase(uint32_t flash_offs, size_t count)
+{
+    if (flash_offs % FLASH_SECTOR_SIZE != 0 || count % FLASH_SECTOR_SIZE != 0) abort();
+    uint8_t* at = flashAt(flash_offs, count);
+    for (size_t i = 0; i < count && flashPowered(); i++) at[i] = 0xff;
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t* data, size_t count)
+{
+    if (flash_offs % FLASH_PAGE_SIZE != 0 || count % FLASH_PAGE_SIZE != 0) abort();
+    uint8_t* at = flashAt(flash_offs, count);
+    for (size_t i = 0; i < count; i++) {
+        if (data[i] == 0xff) continue; // (leaves the bits alone: not counted)
+        if (!flashPowered()) return;
+        at[i] &= data[i];
+    }
+}
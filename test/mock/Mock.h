@@ -0,0 +1,32 @@
+#pragma once
+
+// Controls for the host stand-ins (Arduino core, Pico SDK), for
+// driving the firmware modules from the native tests
+
+#include <stdint.h>
+
+// Time: micros() and millis() return what's set here (initially 0)
+void mockSetMicros(uint64_t us);
+void mockAdvanceMicros(uint64_t us);
+
+// Fires the alarms that are due (at micros()). With a latency set,
+// each alarm fires (and its callback returns) that long after it's
+// due, as on a busy target (interrupts held off).
+void mockRunAlarms();
+void mockSetAlarmLatency(uint64_t us);
+
+// Pins: levels read by digitalRead() (initially HIGH), and values
+// read by analogRead() (initially 0)
+void mockSetPin(int pin, int level);
+void mockSetAnalog(int pin, int value);
+
+// Flash stand-in: two sectors (the filesystem area, then the
+// EEPROM one). Programming only clears bits, as on real flash.
+// A power loss can be simulated: after the specified number of
+// bytes have been programmed or erased, no more are (until cleared
+// with -1), leaving a write or erase cut short.
+static const unsigned int MOCK_FLASH_SECTOR_SIZE = 4096;
+uint8_t* mockFlashSector(int sector); // (0: filesystem, 1: EEPROM)
+void mockFlashErase(); // both sectors
+void mockFlashPowerLossAfter(long bytes);
+long mockFlashBytesWritten(); // (programmed or erased, since the last power loss setting)
@@ -0,0 +1,19 @@
+#pragma once
+
+// Host stand-in for the Pico SDK flash functions: programs and
+// erases the flash stand-in (see Mock.h), which is mapped at
+// XIP_BASE, like the real flash
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FLASH_PAGE_SIZE (1u << 8)
+#define FLASH_SECTOR_SIZE (1u << 12)
+
+// (the sectors Settings uses, as defined by the linker script)
+extern uint8_t _FS_start[];
+extern uint8_t _EEPROM_start[];
+#define XIP_BASE ((uintptr_t)_FS_start)
+
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, const uint8_t* data, size_t count);
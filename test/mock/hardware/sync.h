@@ -0,0 +1,8 @@
+#pragma once
+
+// Host stand-in for the Pico SDK interrupt control
+
+#include <stdint.h>
+
+static inline uint32_t save_and_disable_interrupts() { return 0; }
+static inline void restore_interrupts(uint32_t) {}
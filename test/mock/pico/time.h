@@ -0,0 +1,15 @@
+#pragma once
+
+// Host stand-in for the Pico SDK alarms: an alarm fires when the
+// test runs the ones that are due (see mockRunAlarms), in the
+// order they're due. As in the SDK, the callback returns < 0 to
+// fire again that many us after it was due, > 0 to fire again that
+// many us after it returned (now), and 0 to end the alarm.
+
+#include <stdint.h>
+
+typedef int32_t alarm_id_t;
+typedef int64_t (*alarm_callback_t)(alarm_id_t id, void* user_data);
+
+alarm_id_t add_alarm_in_us(uint64_t us, alarm_callback_t callback, void* user_data, bool fire_if_past);
+bool cancel_alarm(alarm_id_t alarm_id);
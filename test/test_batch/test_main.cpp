@@ -0,0 +1,164 @@
+// Batched output: what a Run() pass sends is collected and written to
+// the port in blocks, in the order it was produced, with no block
+// longer than the output buffer. With running status on, a channel
+// message with the same status as the last one goes out without it,
+// also with System Real Time bytes (which may come anywhere) in
+// between; other system messages end the running status, so the next
+// channel message is sent with its status again.
+
+#include <vector>
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "ArpEngine.h"
+#include "ArpEngine.cpp" // (for the engine with the port below)
+
+// A serial port that also keeps the size of each write (1 for a
+// single byte)
+class BatchPort : public HardwareSerial
+{
+public:
+    std::vector<size_t> writes;
+
+    size_t write(uint8_t data) override
+    {
+        writes.push_back(1);
+        return HardwareSerial::write(data);
+    }
+
+    size_t write(const uint8_t* buffer, size_t size) override
+    {
+        writes.push_back(size);
+        sent.insert(sent.end(), buffer, buffer + size);
+        return size;
+    }
+};
+
+template class BasicArpEngine<BatchPort, BatchPort>;
+typedef BasicArpEngine<BatchPort, BatchPort> BatchEngine;
+
+static const unsigned int BUFFER_SIZE = 64; // (MIDI_OUT_BUFFER_SIZE)
+
+static BatchPort port;
+static ulong now;
+static int midiOutCalls;
+
+static void countMidiOut() { midiOutCalls++; }
+
+void setUp(void)
+{
+    port = BatchPort();
+    Serial2.received.clear();
+    now = 0;
+    midiOutCalls = 0;
+}
+
+void tearDown(void) {}
+
+// Runs one pass, and returns what it sent
+static std::vector<uint8_t> runPass(BatchEngine& engine)
+{
+    port.sent.clear();
+    port.writes.clear();
+    mockSetMicros(now * 1000ULL);
+    engine.Run(now++);
+    return std::vector<uint8_t>(port.sent.begin(), port.sent.end());
+}
+
+static void receive(const std::vector<uint8_t>& data)
+{
+    port.received.insert(port.received.end(), data.begin(), data.end());
+}
+
+static void assertSent(const std::vector<uint8_t>& expected, const std::vector<uint8_t>& sent)
+{
+    TEST_ASSERT_EQUAL((int)expected.size(), (int)sent.size());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), sent.data(), expected.size());
+}
+
+// Repeated statuses are left out, within a pass and from one pass to
+// the next; a new status is sent as usual. Off, every message has its
+// status.
+void test_running_status(void)
+{
+    BatchEngine engine(&port, &port, &Serial2, NULL);
+    engine.SetRunningStatus(true);
+    receive({ 0xb0, 20, 1, 0xb0, 21, 2, 0xb1, 20, 3, 0xb1, 21, 4 }); // (CCs: passed through)
+    assertSent({ 0xb0, 20, 1, 21, 2, 0xb1, 20, 3, 21, 4 }, runPass(engine));
+    receive({ 0xb1, 22, 5 });
+    assertSent({ 22, 5 }, runPass(engine));
+
+    engine.SetRunningStatus(false);
+    receive({ 0xb1, 23, 6, 0xb1, 24, 7 });
+    assertSent({ 0xb1, 23, 6, 0xb1, 24, 7 }, runPass(engine));
+}
+
+// A real-time byte between (or inside) channel messages keeps the
+// running status: the status is still left out after it
+void test_real_time_keeps_running_status(void)
+{
+    BatchEngine engine(&port, &port, &Serial2, NULL);
+    engine.SetRunningStatus(true);
+    receive({ 0xb0, 20, 1, 0xf8, 0xb0, 21, 2, 0xb0, 22, 0xfe, 3 });
+    assertSent({ 0xb0, 20, 1, 0xf8, 21, 2, 0xfe, 22, 3 }, runPass(engine));
+    receive({ 0xf8 });
+    runPass(engine);
+    receive({ 0xb0, 23, 4 });
+    assertSent({ 23, 4 }, runPass(engine));
+}
+
+// System common and exclusive messages end the running status: the
+// next channel message is sent with its status
+void test_system_messages_end_running_status(void)
+{
+    BatchEngine engine(&port, &port, &Serial2, NULL);
+    engine.SetRunningStatus(true);
+    receive({ 0xb0, 20, 1, 0xf6, 0xb0, 21, 2 }); // (Tune Request)
+    assertSent({ 0xb0, 20, 1, 0xf6, 0xb0, 21, 2 }, runPass(engine));
+    receive({ 0xf0, 0x7e, 0x7f, 0x06, 0x01, 0xf7, 0xb0, 22, 3 }); // (SysEx, not ours)
+    assertSent({ 0xf0, 0x7e, 0x7f, 0x06, 0x01, 0xf7, 0xb0, 22, 3 }, runPass(engine));
+}
+
+// A pass's output goes out in one write, if it fits the buffer, and
+// otherwise in full buffers and the rest, in order; onMidiOut is
+// called once for the pass
+void test_batch_flushed_at_its_limit(void)
+{
+    BatchEngine engine(&port, &port, &Serial2, NULL);
+    engine.onMidiOut = countMidiOut;
+    receive({ 0xb0, 20, 1, 0xb1, 21, 2 });
+    runPass(engine);
+    TEST_ASSERT_EQUAL(1, (int)port.writes.size());
+    TEST_ASSERT_EQUAL(6, (int)port.writes[0]);
+    TEST_ASSERT_EQUAL(1, midiOutCalls);
+
+    std::vector<uint8_t> messages;
+    for (int i = 0; i < 50; i++) { // (150 bytes)
+        messages.push_back(0xb0 | (i % 2));
+        messages.push_back(20 + i);
+        messages.push_back(i);
+    }
+    receive(messages);
+    midiOutCalls = 0;
+    assertSent(messages, runPass(engine));
+    TEST_ASSERT_EQUAL(3, (int)port.writes.size());
+    TEST_ASSERT_EQUAL(BUFFER_SIZE, port.writes[0]);
+    TEST_ASSERT_EQUAL(BUFFER_SIZE, port.writes[1]);
+    TEST_ASSERT_EQUAL(150 - 2 * BUFFER_SIZE, port.writes[2]);
+    TEST_ASSERT_EQUAL(1, midiOutCalls);
+
+    // (and nothing written by a pass with nothing to send)
+    runPass(engine);
+    TEST_ASSERT_EQUAL(0, (int)port.writes.size());
+    TEST_ASSERT_EQUAL(1, midiOutCalls);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_running_status);
+    RUN_TEST(test_real_time_keeps_running_status);
+    RUN_TEST(test_system_messages_end_running_status);
+    RUN_TEST(test_batch_flushed_at_its_limit);
+    return UNITY_END();
+}
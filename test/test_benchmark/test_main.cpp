@@ -0,0 +1,529 @@
+// Benchmarks: the cost of the engine's hot paths and the panel
+// inputs, in cycles (on the host, the time taken at the RP2040's
+// clock rate, see the mock getCycleCount), printed as CycleCounter
+// "cycles,<name>,<count>,<min>,<avg>,<max>" lines. Paths inside the
+// engine are timed through Run(), with the input that takes them.
+//
+// Built without the sanitizers and optimized, in its own
+// environment: pio test -e native_benchmark
+// (On the Pico, the same counters time the main loop's sections,
+// see main.cpp.)
+
+#include <stdio.h>
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "CycleCounter.h"
+#include "Potentiometer.h"
+#include "Button.h"
+#include "LedFlasher.h"
+#include "Settings.h"
+#include "MidiLoopback.h"
+#include "TimingStats.h"
+#include "ArpEngine.h"
+#include "ArpEngine.cpp" // (for the engine with other port types, below)
+
+static const int REPEATS = 2000;
+
+static const int CHORD_SIZES[] = { 2, 4, 8, 16, 20 }; // (up to MAX_NOTES)
+
+void setUp(void)
+{
+    Serial1.received.clear();
+    Serial1.sent.clear();
+    Serial2.received.clear();
+    mockSetMicros(0);
+}
+
+void tearDown(void) {}
+
+static void sendMessage(byte status, byte data1, byte data2)
+{
+    Serial1.received.push_back(status);
+    Serial1.received.push_back(data1);
+    Serial1.received.push_back(data2);
+}
+
+// Times one Run() (at now), handling what's been received
+static uint32_t timeRun(ArpEngine& engine, ulong now)
+{
+    mockSetMicros(now * 1000ULL);
+    uint32_t start = CycleCounter::now();
+    engine.Run(now);
+    uint32_t cycles = CycleCounter::now() - start;
+    Serial1.sent.clear();
+    return cycles;
+}
+
+// A port holding the bytes to be read, and only summing up what's
+// written (no containers), so that the cost of the calls shows
+class BenchPort : public Stream
+{
+private:
+    byte _received[64];
+    int _receivedLength = 0;
+    int _readPosition = 0;
+
+public:
+    uint32_t sentSum = 0;
+
+    void receive(const byte* data, int length)
+    {
+        memcpy(_received, data, length);
+        _receivedLength = length;
+        _readPosition = 0;
+    }
+
+    int available() override { return _receivedLength - _readPosition; }
+    int read() override { return _readPosition < _receivedLength ? _received[_readPosition++] : -1; }
+    int peek() override { return _readPosition < _receivedLength ? _received[_readPosition] : -1; }
+    size_t write(uint8_t data) override { sentSum += data; return 1; }
+    size_t write(const uint8_t* buffer, size_t size) override
+    {
+        for (size_t i = 0; i < size; i++) sentSum += buffer[i];
+        return size;
+    }
+};
+
+// Any port through a Stream pointer: every call is virtual, as it
+// was before the engine became a template over its port types
+class StreamPort
+{
+private:
+    Stream* _stream;
+
+public:
+    StreamPort(Stream* stream) : _stream(stream) {}
+
+    int available() { return _stream->available(); }
+    int read() { return _stream->read(); }
+    size_t write(uint8_t data) { return _stream->write(data); }
+    size_t write(const uint8_t* buffer, size_t size) { return _stream->write(buffer, size); }
+};
+
+template class BasicArpEngine<BenchPort, BenchPort, BenchPort>;
+template class BasicArpEngine<StreamPort, StreamPort, StreamPort>;
+template class BasicArpEngine<BenchPort, MidiLoopback, BenchPort>;
+template class BasicArpEngine<MidiLoopback, BenchPort, BenchPort>;
+
+static bool sentNoteOn()
+{
+    for (size_t i = 0; i < Serial1.sent.size(); i++) {
+        if ((Serial1.sent[i] & 0xf0) == 0x90) return true;
+    }
+    return false;
+}
+
+// HandleMidiData, per byte: notes and CCs passed through
+void test_midi_data(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    CycleCounter counter("midiData");
+    for (int i = 0; i < REPEATS; i++) {
+        byte note = 36 + i % 48;
+        sendMessage(0x90, note, 100);
+        counter.add(timeRun(engine, i) / 3);
+        sendMessage(0xb0, 1, i & 0x7f);
+        counter.add(timeRun(engine, i) / 3);
+        sendMessage(0x80, note, 0);
+        counter.add(timeRun(engine, i) / 3);
+    }
+    counter.print(Serial);
+    TEST_ASSERT_EQUAL(3 * REPEATS, counter.getCount());
+}
+
+// AddNote and RemoveNote (with the note-on/off around them), by
+// chord size: the last key of the chord pressed and released
+void test_add_remove_note(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.SetEnabled(true);
+    for (size_t size = 0; size < sizeof(CHORD_SIZES) / sizeof(CHORD_SIZES[0]); size++) {
+        int notes = CHORD_SIZES[size];
+        char addName[16], removeName[16];
+        snprintf(addName, sizeof(addName), "addNote/%d", notes);
+        snprintf(removeName, sizeof(removeName), "removeNote/%d", notes);
+        CycleCounter add(addName), remove(removeName);
+        for (int i = 0; i < REPEATS / 10; i++) {
+            // (the chord's keys in a different order each time)
+            for (int note = 0; note < notes - 1; note++) sendMessage(0x90, 40 + (note * 7 + i) % 48, 100);
+            timeRun(engine, i);
+            sendMessage(0x90, 90, 100);
+            add.add(timeRun(engine, i));
+            sendMessage(0x80, 90, 0);
+            remove.add(timeRun(engine, i));
+            for (int note = 0; note < notes - 1; note++) sendMessage(0x80, 40 + (note * 7 + i) % 48, 0);
+            timeRun(engine, i);
+        }
+        add.print(Serial);
+        remove.print(Serial);
+        TEST_ASSERT_EQUAL(REPEATS / 10, add.getCount());
+    }
+}
+
+// HandleArpeggiatorOnEvent, per mode and velocity mode: the Run()s
+// that play a step of a 4-note chord over 2 octaves
+void test_arpeggiator_on_event(void)
+{
+    for (int mode = 0; mode < ArpEngine::MODE_COUNT; mode++) {
+        for (int velocityMode = 0; velocityMode < ArpEngine::VEL_COUNT; velocityMode++) {
+            ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+            engine.SetTempo(ArpEngine::MAX_TEMPO);
+            engine.SetMode(mode);
+            engine.SetVelocityMode(velocityMode);
+            engine.SetRange(1);
+            engine.SetEnabled(true);
+            static const byte chord[] = { 60, 64, 67, 71 };
+            for (size_t note = 0; note < sizeof(chord); note++) sendMessage(0x90, chord[note], 80 + note * 10);
+
+            char name[24];
+            snprintf(name, sizeof(name), "onEvent/%d/%d", mode, velocityMode);
+            CycleCounter counter(name);
+            for (ulong now = 0; counter.getCount() < REPEATS / 10; now++) {
+                mockSetMicros(now * 1000ULL);
+                uint32_t start = CycleCounter::now();
+                engine.Run(now);
+                uint32_t cycles = CycleCounter::now() - start;
+                if (now > 0 && sentNoteOn()) counter.add(cycles); // (not the first, with the chord)
+                Serial1.sent.clear();
+            }
+            counter.print(Serial);
+        }
+    }
+}
+
+void test_potentiometer_sample(void)
+{
+    Potentiometer pot(26, 0, 1023, ArpEngine::MIN_TEMPO, ArpEngine::MAX_TEMPO);
+    CycleCounter counter("potSample");
+    for (int i = 0; i < REPEATS * 10; i++) {
+        mockSetAnalog(26, (i / 64 * 37) % 1024); // (a new value for each set of samples)
+        uint32_t start = CycleCounter::now();
+        pot.sample();
+        counter.add(CycleCounter::now() - start);
+        if (pot.hasNewOutputValue()) pot.readOutputValue();
+    }
+    counter.print(Serial);
+    TEST_ASSERT_EQUAL(REPEATS * 10, counter.getCount());
+}
+
+static int buttonEvents;
+static void countButtonEvent() { buttonEvents++; }
+
+void test_button_scan(void)
+{
+    Button button(2, 20, 500);
+    button.buttonDown = countButtonEvent;
+    button.buttonUp = countButtonEvent;
+    button.buttonHeld = countButtonEvent;
+    buttonEvents = 0;
+    CycleCounter counter("buttonScan");
+    for (int i = 0; i < REPEATS * 10; i++) {
+        mockSetPin(2, (i / 700) % 2 ? LOW : HIGH); // (pressed, held, released)
+        uint32_t start = CycleCounter::now();
+        button.scan(i);
+        counter.add(CycleCounter::now() - start);
+    }
+    mockSetPin(2, HIGH);
+    counter.print(Serial);
+    TEST_ASSERT_EQUAL(REPEATS * 10, counter.getCount());
+    TEST_ASSERT_TRUE(buttonEvents > 0);
+}
+
+// Run(), as the lanes arpeggiating (a 4-note chord each, on their
+// own channels) go from 1 to 16: every Run() over a second, and the
+// ones that play a step
+void test_run_lanes(void)
+{
+    for (int lanes = 1; lanes <= 16; lanes++) {
+        ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+        engine.SetTempo(ArpEngine::MAX_TEMPO);
+        engine.SetGate(50);
+        engine.SetRange(1);
+        engine.SetEnabled(true);
+        for (int channel = 0; channel < lanes; channel++) {
+            static const byte chord[] = { 48, 55, 60, 64 };
+            for (size_t note = 0; note < sizeof(chord); note++) sendMessage(0x90 + channel, chord[note], 100);
+        }
+        timeRun(engine, 0);
+
+        char runName[16], stepName[16];
+        snprintf(runName, sizeof(runName), "run/%d", lanes);
+        snprintf(stepName, sizeof(stepName), "runStep/%d", lanes);
+        CycleCounter run(runName), step(stepName);
+        for (ulong now = 1; now <= 1000; now++) {
+            mockSetMicros(now * 1000ULL);
+            uint32_t start = CycleCounter::now();
+            engine.Run(now);
+            uint32_t cycles = CycleCounter::now() - start;
+            run.add(cycles);
+            if (sentNoteOn()) step.add(cycles);
+            Serial1.sent.clear();
+        }
+        run.print(Serial);
+        step.print(Serial);
+        TEST_ASSERT_TRUE(step.getCount() > 0);
+    }
+}
+
+// Cycles per note message (in, passed through or arpeggiated, and
+// out), with the engine bound to the port class, or to Stream
+template <class Engine, class Port>
+static void benchmarkPorts(const char* name, Port* port, BenchPort& benchPort, bool enabled)
+{
+    Engine engine(port, port, NULL);
+    engine.SetTempo(ArpEngine::MAX_TEMPO);
+    engine.SetEnabled(enabled);
+    CycleCounter counter(name);
+    static const byte notes[] = {
+        0x90, 60, 100, 0x90, 64, 100, 0x90, 67, 100, 0x80, 60, 0, 0x80, 64, 0, 0x80, 67, 0,
+    };
+    static const int MESSAGES = sizeof(notes) / 3;
+    for (int i = 0; i < (enabled ? REPEATS * 5 : REPEATS); i++) {
+        // (arpeggiating: the chord is held down, and each Run() that
+        // sends a note timed, with the messages received before it)
+        ulong now = enabled ? i : 0;
+        if (!enabled || i == 0) benchPort.receive(notes, enabled ? sizeof(notes) / 2 : sizeof(notes));
+        uint32_t sentSum = benchPort.sentSum;
+        mockSetMicros(now * 1000ULL);
+        uint32_t start = CycleCounter::now();
+        engine.Run(now);
+        uint32_t cycles = CycleCounter::now() - start;
+        if (enabled && i > 0 && benchPort.sentSum != sentSum) counter.add(cycles);
+        else if (!enabled) counter.add(cycles / MESSAGES);
+    }
+    counter.print(Serial);
+    TEST_ASSERT_TRUE(counter.getCount() > 0);
+}
+
+void test_port_calls(void)
+{
+    BenchPort benchPort;
+    StreamPort streamPort(&benchPort);
+    typedef BasicArpEngine<BenchPort, BenchPort, BenchPort> TemplatedEngine;
+    typedef BasicArpEngine<StreamPort, StreamPort, StreamPort> StreamEngine;
+    benchmarkPorts<TemplatedEngine>("passThrough/templated", &benchPort, benchPort, false);
+    benchmarkPorts<StreamEngine>("passThrough/stream", &streamPort, benchPort, false);
+    benchmarkPorts<TemplatedEngine>("arpeggio/templated", &benchPort, benchPort, true);
+    benchmarkPorts<StreamEngine>("arpeggio/stream", &streamPort, benchPort, true);
+}
+
+// Two engines chained through a MidiLoopback, the first one's output
+// read by the second in the same loop pass (as main.cpp would run
+// them): the cycles per byte through the loopback, and per pass of
+// both engines for a message passed through, or an arpeggio step
+// played by the first one. Every message is through both in the pass
+// it came in (no added latency), and nothing is left in the loopback.
+void test_loopback(void)
+{
+    MidiLoopback loopback;
+    CycleCounter bytes("loopback/byte");
+    for (int i = 0; i < REPEATS; i++) {
+        uint32_t start = CycleCounter::now();
+        loopback.write(0x90);
+        loopback.write(i & 0x7f);
+        loopback.write(100);
+        while (loopback.available() > 0) loopback.read();
+        bytes.add((CycleCounter::now() - start) / 3);
+    }
+    bytes.print(Serial);
+
+    for (int enabled = 0; enabled <= 1; enabled++) {
+        BenchPort in, out;
+        BasicArpEngine<BenchPort, MidiLoopback, BenchPort> first(&in, &loopback, NULL);
+        BasicArpEngine<MidiLoopback, BenchPort, BenchPort> second(&loopback, &out, NULL);
+        first.SetTempo(ArpEngine::MAX_TEMPO);
+        first.SetEnabled(enabled);
+        static const byte chord[] = { 0x90, 60, 100, 0x90, 64, 100, 0x90, 67, 100 };
+        CycleCounter counter(enabled ? "loopback/arpeggio" : "loopback/passThrough");
+        int delayed = 0;
+        for (ulong now = 0; counter.getCount() < REPEATS; now++) {
+            if (!enabled) {
+                static const byte cc[] = { 0xb0, 1, 0 };
+                in.receive(cc, sizeof(cc));
+            }
+            else if (now == 0) in.receive(chord, sizeof(chord));
+            uint32_t sentSum = out.sentSum;
+            mockSetMicros(now * 1000ULL);
+            uint32_t start = CycleCounter::now();
+            first.Run(now);
+            bool written = loopback.available() > 0;
+            second.Run(now);
+            uint32_t cycles = CycleCounter::now() - start;
+            if (written && out.sentSum == sentSum) delayed++;
+            if (now > 0 && out.sentSum != sentSum) counter.add(cycles);
+            TEST_ASSERT_EQUAL(0, loopback.available());
+        }
+        counter.print(Serial);
+        TEST_ASSERT_EQUAL(0, delayed);
+    }
+}
+
+// Idle sleep (see sleepUntilNextEvent in main.cpp): the loop sleeps
+// until NextEventAt(), and the pass it wakes for sends what's due.
+// The cycles taken to work out the deadline before each sleep, and
+// from waking to the output due written (the engine's share of
+// the wake-up latency, on top of the CPU's own), as the lanes
+// arpeggiating (ratcheting, at the top tempo) go from 1 to 16. Woken
+// only at the deadlines, every note must still go out in the ms it's
+// due, with a fraction of the passes of stepping every ms.
+void test_wake(void)
+{
+    static const int LANE_COUNTS[] = { 1, 4, 16 };
+    static const ulong DURATION_MS = 10000;
+    for (size_t i = 0; i < sizeof(LANE_COUNTS) / sizeof(LANE_COUNTS[0]); i++) {
+        int lanes = LANE_COUNTS[i];
+        ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+        TimingStats noteOnTiming("note_on", 0, 0, 1), noteOffTiming("note_off", 0, 0, 1);
+        engine.SetTimingStats(&noteOnTiming, &noteOffTiming, NULL);
+        engine.SetTempo(ArpEngine::MAX_TEMPO);
+        engine.SetGate(50);
+        engine.SetRatchet(2);
+        engine.SetEnabled(true);
+        for (int channel = 0; channel < lanes; channel++) {
+            static const byte chord[] = { 48, 55, 60, 64 };
+            for (size_t note = 0; note < sizeof(chord); note++) sendMessage(0x90 + channel, chord[note], 100);
+        }
+        timeRun(engine, 0);
+
+        char deadlineName[24], wakeName[16];
+        snprintf(deadlineName, sizeof(deadlineName), "nextEventAt/%d", lanes);
+        snprintf(wakeName, sizeof(wakeName), "wake/%d", lanes);
+        CycleCounter deadline(deadlineName), wake(wakeName);
+        ulong passes = 0;
+        for (ulong now = 0; now < DURATION_MS; passes++) {
+            uint32_t start = CycleCounter::now();
+            ulong next = engine.NextEventAt(now + 1000);
+            deadline.add(CycleCounter::now() - start);
+            now = (long)(next - now) > 0 ? next : now + 1; // (due now: the next ms, as the loop would)
+            mockSetMicros(now * 1000ULL);
+            start = CycleCounter::now();
+            engine.Run(now);
+            wake.add(CycleCounter::now() - start);
+            Serial1.sent.clear();
+        }
+        deadline.print(Serial);
+        wake.print(Serial);
+        noteOnTiming.print(Serial);
+        noteOffTiming.print(Serial);
+        TEST_ASSERT_TRUE(noteOnTiming.isWithinLimits());
+        TEST_ASSERT_TRUE(noteOffTiming.isWithinLimits());
+        TEST_ASSERT_TRUE(passes < DURATION_MS / 4);
+    }
+}
+
+// The whole loop() body, as in main.cpp (with idle sleep: a pass
+// for each deadline, the pots sampled in bursts), through a session:
+// an arpeggio played while the pots are turned, then the keys let go
+// and the panel settings changed, and saved once the engine is idle.
+// The cycles per pass (the watchdog fed in each one), by what the
+// pass did. (A save's flash stall isn't included: on the host,
+// programming the flash is a copy.)
+static const ulong POT_SCAN_MS = 16; // (as in main.cpp)
+static const int POT_SAMPLES_PER_SCAN = 16;
+
+static LedFlasher tempoLed(20, 40);
+static LedFlasher midiInLed(25, 20);
+static ulong loopNow;
+
+static void flashTempoLed() { tempoLed.flash(loopNow); }
+static void flashMidiInLed() { midiInLed.flash(loopNow); }
+
+void test_loop(void)
+{
+    static const ulong PLAYING_MS = 5000;
+    static const ulong DURATION_MS = 15000;
+    mockFlashPowerLossAfter(-1);
+    mockFlashErase();
+    Button buttons[] = { Button(15, 30), Button(16, 30, 700), Button(17, 30), Button(18, 30, 700), Button(19, 30) };
+    Potentiometer tempoPot(26, 30, 990, ArpEngine::MIN_TEMPO, ArpEngine::MAX_TEMPO);
+    Potentiometer gatePot(27, 30, 990, ArpEngine::MIN_GATE, ArpEngine::MAX_GATE);
+    Settings settings(2000);
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.onBeat = flashTempoLed;
+    engine.onMidiIn = flashMidiInLed;
+    engine.SetEnabled(true);
+    static const byte chord[] = { 48, 55, 60, 64 };
+    for (size_t note = 0; note < sizeof(chord); note++) sendMessage(0x90, chord[note], 100);
+
+    CycleCounter idle("loop/idle"), potBurst("loop/potBurst"), step("loop/step"), save("loop/save"),
+        all("loop/all");
+    Settings::Values values = {};
+    ulong nextPotScanAt = 0, nextSettingAt = PLAYING_MS + 500;
+    bool released = false;
+    for (ulong now = 0; now < DURATION_MS; ) {
+        // (the session)
+        mockSetAnalog(26, now < PLAYING_MS ? (now / 100 * 37) % 1024 : 512);
+        mockSetAnalog(27, now < PLAYING_MS ? (now / 150 * 53) % 1024 : 512);
+        if (now >= PLAYING_MS && !released) {
+            for (size_t note = 0; note < sizeof(chord); note++) sendMessage(0x80, chord[note], 0);
+            released = true;
+        }
+        if (now >= nextSettingAt) {
+            values.mode = (values.mode + 1) % ArpEngine::MODE_COUNT;
+            engine.SetMode(values.mode);
+            settings.set(values, now);
+            nextSettingAt = now + 3000;
+        }
+
+        loopNow = now;
+        mockSetMicros(now * 1000ULL);
+        long flashWritten = mockFlashBytesWritten();
+        bool sampled = false;
+        uint32_t start = CycleCounter::now();
+        rp2040.wdt_reset();
+        for (Button& button : buttons) button.scan(now);
+        if ((long)(now - nextPotScanAt) >= 0) {
+            nextPotScanAt = now + POT_SCAN_MS;
+            for (int i = 0; i < POT_SAMPLES_PER_SCAN; i++) {
+                tempoPot.sample();
+                gatePot.sample();
+            }
+            sampled = true;
+        }
+        if (tempoPot.hasNewOutputValue()) engine.SetTempo(tempoPot.readOutputValue());
+        if (gatePot.hasNewOutputValue()) engine.SetGate(gatePot.readOutputValue());
+        tempoLed.run(now);
+        midiInLed.run(now);
+        engine.Run(now);
+        settings.run(now, engine.IsIdle(), engine.IsStopped());
+        uint32_t cycles = CycleCounter::now() - start;
+
+        all.add(cycles);
+        if (mockFlashBytesWritten() != flashWritten) save.add(cycles);
+        else if (sentNoteOn()) step.add(cycles);
+        else if (sampled) potBurst.add(cycles);
+        else idle.add(cycles);
+        Serial1.sent.clear();
+
+        // (asleep until the next deadline, as sleepUntilNextEvent)
+        ulong next = engine.NextEventAt(nextPotScanAt);
+        next = tempoLed.nextEventAt(next);
+        next = midiInLed.nextEventAt(next);
+        now = (long)(next - now) > 0 ? next : now + 1;
+    }
+    idle.print(Serial);
+    potBurst.print(Serial);
+    step.print(Serial);
+    save.print(Serial);
+    all.print(Serial);
+    TEST_ASSERT_TRUE(step.getCount() > 0);
+    TEST_ASSERT_TRUE(potBurst.getCount() > 0);
+    TEST_ASSERT_EQUAL(3, save.getCount());
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_midi_data);
+    RUN_TEST(test_add_remove_note);
+    RUN_TEST(test_arpeggiator_on_event);
+    RUN_TEST(test_potentiometer_sample);
+    RUN_TEST(test_button_scan);
+    RUN_TEST(test_port_calls);
+    RUN_TEST(test_loopback);
+    RUN_TEST(test_run_lanes);
+    RUN_TEST(test_wake);
+    RUN_TEST(test_loop);
+    return UNITY_END();
+}
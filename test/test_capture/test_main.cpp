@@ -0,0 +1,364 @@
+// Capture and replay: an engine plays keys, CCs and settings changes
+// (made between Run() calls, as the panel does) with a capture started
+// part way through, from loop passes of varying length; the capture is
+// dumped as text, parsed back and replayed on a fresh engine, as
+// described in MidiCapture.h. The replayed output must match the
+// original byte for byte, at the same times (except for the clock
+// pulses, timed by the alarm). The binary format itself is checked
+// too: long gaps, and dropping the oldest records when full.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "MidiCapture.h"
+#include "ClockGenerator.h"
+#include "ArpEngine.h"
+
+static const unsigned long START = 5000; // capture started (ms)
+static const unsigned long REPLAY_START = 1000; // (replayed at other times)
+
+struct Output
+{
+    unsigned long time; // (ms since the start)
+    uint8_t data;
+};
+
+static MidiCapture capture;
+static uint32_t seed;
+
+static uint32_t randomValue(uint32_t max)
+{
+    seed = seed * 1664525 + 1013904223;
+    return (seed >> 8) % (max + 1);
+}
+
+void setUp(void)
+{
+    Serial1.received.clear();
+    Serial1.sent.clear();
+    Serial2.received.clear();
+    seed = 1;
+}
+
+void tearDown(void) {}
+
+// Takes what the engine sent (but the clock pulses), at time
+static void takeOutput(std::vector<Output>& output, unsigned long time)
+{
+    for (uint8_t data : Serial1.sent) {
+        if (data != 0xf8) output.push_back({ time, data });
+    }
+    Serial1.sent.clear();
+}
+
+static void runAt(ArpEngine& engine, unsigned long now)
+{
+    mockSetMicros(now * 1000ULL);
+    mockRunAlarms();
+    engine.Run(now);
+}
+
+// A settings change, as made from the panel (or the serial port)
+static void changeSetting(ArpEngine& engine, uint32_t which)
+{
+    switch (which) {
+    case 0: engine.SetTempo(60 + randomValue(180)); break;
+    case 1: engine.SetGate(10 + randomValue(90)); break;
+    case 2: engine.SetMode(randomValue(2), randomValue(1) ? ArpEngine::ALL_CHANNELS : 2); break;
+    case 3: engine.SetRange(randomValue(2)); break;
+    case 4: engine.SetHold(randomValue(1)); break;
+    case 5: engine.SetChords(randomValue(1)); break;
+    case 6: engine.SetSwing(50 + randomValue(25)); break;
+    case 7: engine.SetRatchet(1 + randomValue(3), 2); break;
+    case 8: engine.SetPatternStep(ArpEngine::PATTERN_VELOCITY, randomValue(3), (int)randomValue(40) - 20); break;
+    case 9: engine.SetVelocityShape(randomValue(2), randomValue(100)); break;
+    case 10: engine.SetGroove(randomValue(3)); break;
+    case 11: engine.Panic(); break;
+    }
+}
+
+// Plays on the engine from START until end (ms), with loop passes of
+// 0-1 ms (now and then 2-3 ms, or a stall), with keys and CCs coming in, and
+// settings changes between passes. Returns the output from START.
+static void play(ArpEngine& engine, unsigned long end, std::vector<Output>& output)
+{
+    unsigned long now = START, ranAt = START; // (the capture started after a Run() at START)
+    while (now < end) {
+        uint32_t event = randomValue(999);
+        if (event < 40) {
+            // a key on channel 1 or 3 (down, or up if already down)
+            static bool down[2][12];
+            int lane = randomValue(1), key = randomValue(11);
+            Serial1.received.push_back((down[lane][key] ? 0x80 : 0x90) | (lane * 2));
+            Serial1.received.push_back(60 + key);
+            Serial1.received.push_back(40 + randomValue(87));
+            down[lane][key] = !down[lane][key];
+        }
+        else if (event < 45) {
+            // CC 74 (mapped to the gate), or 1 (passed through)
+            Serial1.received.push_back(0xb0);
+            Serial1.received.push_back(randomValue(1) ? 74 : 1);
+            Serial1.received.push_back(randomValue(127));
+        }
+        else if (event < 52) {
+            changeSetting(engine, randomValue(11));
+            takeOutput(output, ranAt - START);
+        }
+        runAt(engine, now);
+        takeOutput(output, now - START);
+        ranAt = now;
+        now += event < 900 ? randomValue(1) : event < 997 ? 2 + randomValue(1) : 20 + randomValue(200);
+    }
+    engine.SetEnabled(false); // (last: the end of the capture)
+    takeOutput(output, ranAt - START);
+}
+
+// Parses a capture dumped as text
+static std::vector<uint8_t> parseDump(const std::string& text)
+{
+    std::vector<uint8_t> bytes;
+    size_t position = 0;
+    while (position < text.size()) {
+        size_t end = text.find("\r\n", position);
+        std::string line = text.substr(position, end - position);
+        position = end + 2;
+        if (line[0] == '#') continue;
+        for (size_t i = 0; i + 1 < line.size(); i += 2) {
+            bytes.push_back(strtol(line.substr(i, 2).c_str(), NULL, 16));
+        }
+    }
+    return bytes;
+}
+
+// Replays the capture on a fresh engine (as described in MidiCapture.h),
+// returning its output
+static void replay(const std::vector<uint8_t>& bytes, std::vector<Output>& output,
+    std::vector<Output>& captured)
+{
+    mockSetMicros(REPLAY_START * 1000ULL);
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    ClockGenerator generator;
+    long ranUntil = -1;
+    bool runPending = false;
+    unsigned long pendingRunAt = 0;
+    MidiCapture::Record record = {};
+    unsigned int position = 0;
+    while (true) {
+        bool more = MidiCapture::decode(bytes.data(), bytes.size(), position, record);
+        bool isInput = more && (record.source == MidiCapture::SOURCE_MIDI_IN ||
+            record.source == MidiCapture::SOURCE_SYNC_IN);
+        if (more && record.source == MidiCapture::SOURCE_MIDI_OUT) {
+            if (record.data != 0xf8) captured.push_back({ record.time, record.data });
+            continue;
+        }
+        if (more && record.source == MidiCapture::SOURCE_EVENT && record.data == MidiCapture::EVENT_TIME) continue;
+        if (isInput) {
+            TEST_ASSERT_TRUE(runPending); // (recorded with the Run() that read it)
+            TEST_ASSERT_EQUAL(pendingRunAt, record.time);
+            HardwareSerial& port = record.source == MidiCapture::SOURCE_MIDI_IN ? Serial1 : Serial2;
+            port.received.push_back(record.data);
+            continue;
+        }
+
+        // a Run() call, a setting change or the end: the pending
+        // Run() first, and one for every ms up to it
+        if (runPending) {
+            runAt(engine, REPLAY_START + pendingRunAt);
+            takeOutput(output, pendingRunAt);
+            TEST_ASSERT_EQUAL(0, Serial1.received.size() + Serial2.received.size());
+            runPending = false;
+        }
+        if (!more) break;
+        long runUntil = record.time;
+        if (record.data == MidiCapture::EVENT_RUN) runUntil = (long)record.time - record.value - 1;
+        while (ranUntil < runUntil) {
+            ranUntil++;
+            runAt(engine, REPLAY_START + ranUntil);
+            takeOutput(output, ranUntil);
+        }
+        if (record.data == MidiCapture::EVENT_RUN) {
+            if ((long)record.time > ranUntil) ranUntil = record.time;
+            runPending = true;
+            pendingRunAt = record.time;
+        }
+        else {
+            engine.ReplaySetting(record.setting, record.index, record.value, &generator);
+            takeOutput(output, record.time);
+        }
+    }
+    TEST_ASSERT_EQUAL(bytes.size(), position); // (all of it decoded)
+    generator.stop();
+}
+
+static void assertSameOutput(const std::vector<Output>& expected, const std::vector<Output>& actual)
+{
+    size_t length = std::min(expected.size(), actual.size());
+    for (size_t i = 0; i < length; i++) {
+        if (expected[i].time != actual[i].time || expected[i].data != actual[i].data) {
+            printf("output %zu: expected %02x at %lu ms, got %02x at %lu ms\n", i,
+                expected[i].data, expected[i].time, actual[i].data, actual[i].time);
+        }
+        TEST_ASSERT_EQUAL(expected[i].time, actual[i].time);
+        TEST_ASSERT_EQUAL(expected[i].data, actual[i].data);
+    }
+    TEST_ASSERT_EQUAL(expected.size(), actual.size());
+}
+
+void test_replay(void)
+{
+    // Settings changed, and an arpeggio played, before the capture
+    mockSetMicros(100 * 1000ULL);
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    ClockGenerator generator;
+    engine.SetCapture(&capture);
+    engine.SetClockOutput(&generator);
+    engine.SetRunningStatus(true);
+    engine.SetTempo(137);
+    engine.SetGate(60);
+    engine.SetMode(ArpEngine::MODE_UP_DOWN, 2);
+    engine.SetRange(1);
+    engine.SetVelocityCurve(ArpEngine::VEL_CURVE_SOFT);
+    engine.SetAccent(ArpEngine::ACCENT_BEATS, 30);
+    engine.SetPatternStep(ArpEngine::PATTERN_OCTAVE, 1, 1);
+    engine.SetPatternLength(ArpEngine::PATTERN_OCTAVE, 3);
+    engine.SetPatternLength(ArpEngine::PATTERN_VELOCITY, 4);
+    engine.MapCC(74, ArpEngine::CC_GATE | ArpEngine::CC_CONSUME);
+    engine.SetChordWindow(10);
+    engine.SetEnabled(true);
+    static const uint8_t chord[] = { 0x90, 60, 100, 64, 100, 67, 100 };
+    static const uint8_t release[] = { 0x80, 60, 0, 64, 0, 67, 0 };
+    Serial1.received.insert(Serial1.received.end(), chord, chord + sizeof(chord));
+    for (unsigned long now = 100; now <= START; now++) {
+        if (now == 2000) Serial1.received.insert(Serial1.received.end(), release, release + sizeof(release));
+        runAt(engine, now);
+    }
+    Serial1.sent.clear();
+
+    engine.StartCapture();
+    std::vector<Output> played;
+    play(engine, START + 8000, played);
+    capture.stop();
+    generator.stop();
+
+    // Dumped and parsed back: the same as read
+    HardwareSerial dumpPort;
+    capture.dump(dumpPort);
+    std::string text(dumpPort.sent.begin(), dumpPort.sent.end());
+    TEST_ASSERT_EQUAL(0, text.find("# MIDI capture v2, "));
+    TEST_ASSERT_TRUE(text.find("dropped") == std::string::npos);
+    TEST_ASSERT_TRUE(capture.isComplete());
+    std::vector<uint8_t> bytes = parseDump(text);
+    std::vector<uint8_t> read(bytes.size() + 1);
+    TEST_ASSERT_EQUAL(bytes.size(), capture.read(read.data(), read.size()));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(bytes.data(), read.data(), bytes.size());
+    printf("capture: %zu bytes, %zu bytes out\n", bytes.size(), played.size());
+
+    std::vector<Output> replayed, captured;
+    replay(bytes, replayed, captured);
+    TEST_ASSERT_TRUE(played.size() > 1000);
+    assertSameOutput(played, captured);
+    assertSameOutput(played, replayed);
+}
+
+// Records decode to what was recorded, at the times recorded, across
+// gaps too long for a record's time (split into time-only records)
+void test_records(void)
+{
+    capture.start(1000);
+    capture.recordSetting(ArpEngine::SETTING_TEMPO, 0, 120, 1000);
+    capture.recordRun(3, 1004);
+    capture.record(MidiCapture::SOURCE_MIDI_IN, 0x90, 1004);
+    capture.record(MidiCapture::SOURCE_MIDI_OUT, 0xf8, 1100);
+    capture.recordSetting(ArpEngine::SETTING_PATTERN_STEP, 17, -20, 1100 + 200000);
+    capture.record(MidiCapture::SOURCE_SYNC_IN, 0xfa, 1100 + 200000 + 63);
+    capture.stop();
+    capture.record(MidiCapture::SOURCE_MIDI_IN, 0x80, 500000); // (not recorded)
+
+    uint8_t bytes[64];
+    unsigned int length = capture.read(bytes, sizeof(bytes));
+    MidiCapture::Record record = {};
+    unsigned int position = 0;
+    TEST_ASSERT_TRUE(MidiCapture::decode(bytes, length, position, record));
+    TEST_ASSERT_EQUAL(0, record.time);
+    TEST_ASSERT_EQUAL(MidiCapture::SOURCE_EVENT, record.source);
+    TEST_ASSERT_EQUAL(MidiCapture::EVENT_SETTING, record.data);
+    TEST_ASSERT_EQUAL(ArpEngine::SETTING_TEMPO, record.setting);
+    TEST_ASSERT_EQUAL(120, record.value);
+    TEST_ASSERT_TRUE(MidiCapture::decode(bytes, length, position, record));
+    TEST_ASSERT_EQUAL(4, record.time);
+    TEST_ASSERT_EQUAL(MidiCapture::EVENT_RUN, record.data);
+    TEST_ASSERT_EQUAL(3, record.value);
+    TEST_ASSERT_TRUE(MidiCapture::decode(bytes, length, position, record));
+    TEST_ASSERT_EQUAL(4, record.time);
+    TEST_ASSERT_EQUAL(MidiCapture::SOURCE_MIDI_IN, record.source);
+    TEST_ASSERT_EQUAL(0x90, record.data);
+    TEST_ASSERT_TRUE(MidiCapture::decode(bytes, length, position, record));
+    TEST_ASSERT_EQUAL(100, record.time);
+    TEST_ASSERT_EQUAL(MidiCapture::SOURCE_MIDI_OUT, record.source);
+    TEST_ASSERT_EQUAL(0xf8, record.data);
+    do {
+        TEST_ASSERT_TRUE(MidiCapture::decode(bytes, length, position, record));
+    } while (record.source == MidiCapture::SOURCE_EVENT && record.data == MidiCapture::EVENT_TIME);
+    TEST_ASSERT_EQUAL(100 + 200000, record.time);
+    TEST_ASSERT_EQUAL(ArpEngine::SETTING_PATTERN_STEP, record.setting);
+    TEST_ASSERT_EQUAL(17, record.index);
+    TEST_ASSERT_EQUAL(-20, record.value);
+    TEST_ASSERT_TRUE(MidiCapture::decode(bytes, length, position, record));
+    TEST_ASSERT_EQUAL(100 + 200000 + 63, record.time); // (extended time)
+    TEST_ASSERT_EQUAL(MidiCapture::SOURCE_SYNC_IN, record.source);
+    TEST_ASSERT_EQUAL(0xfa, record.data);
+    TEST_ASSERT_FALSE(MidiCapture::decode(bytes, length, position, record));
+    TEST_ASSERT_EQUAL(length, position);
+    position = 0;
+    TEST_ASSERT_FALSE(MidiCapture::decode(bytes, 5, position, record)); // (truncated)
+    TEST_ASSERT_EQUAL(0, position);
+}
+
+// Full: the oldest records are dropped, whole, so what's left decodes
+// from its start to its end, with the latest record last
+void test_oldest_dropped(void)
+{
+    capture.start(0);
+    unsigned long time = 0;
+    for (int i = 0; i < 10000; i++) {
+        if (i % 3 == 0) capture.recordSetting(ArpEngine::SETTING_GATE, 0, i, time);
+        else if (i % 3 == 1) capture.recordRun(i % 50, time);
+        else capture.record(MidiCapture::SOURCE_MIDI_OUT, i & 0x7f, time);
+        time += i % 70;
+    }
+    capture.recordSetting(ArpEngine::SETTING_TEMPO, 0, 123, time);
+    TEST_ASSERT_FALSE(capture.isComplete());
+    HardwareSerial dumpPort;
+    capture.dump(dumpPort);
+    std::string text(dumpPort.sent.begin(), dumpPort.sent.end());
+    TEST_ASSERT_TRUE(text.find("bytes, oldest dropped\r\n") != std::string::npos);
+
+    static uint8_t bytes[16384];
+    unsigned int length = capture.read(bytes, sizeof(bytes));
+    TEST_ASSERT_TRUE(length > 16384 - 8);
+    MidiCapture::Record record = {};
+    unsigned int position = 0, records = 0;
+    while (MidiCapture::decode(bytes, length, position, record)) records++;
+    TEST_ASSERT_EQUAL(length, position);
+    TEST_ASSERT_EQUAL(ArpEngine::SETTING_TEMPO, record.setting);
+    TEST_ASSERT_EQUAL(123, record.value);
+    TEST_ASSERT_TRUE(records > 2000);
+
+    capture.start(0); // (starts over)
+    TEST_ASSERT_TRUE(capture.isComplete());
+    TEST_ASSERT_EQUAL(0, capture.read(bytes, sizeof(bytes)));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_replay);
+    RUN_TEST(test_records);
+    RUN_TEST(test_oldest_dropped);
+    return UNITY_END();
+}
@@ -0,0 +1,220 @@
+// CC remote control: controllers mapped to parameters (directly, or
+// learned from the next CC received) set them across their range, on
+// the channel they're mapped on. Mapped CCs are passed through unless
+// mapped to be consumed; unmapped ones always are. Parameters set in
+// pairs (a velocity curve and its fixed velocity) keep each other.
+
+#include <vector>
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "MidiMonitor.h"
+#include "ArpEngine.h"
+
+static MidiMonitor out;
+static ulong now;
+
+void setUp(void)
+{
+    Serial1.received.clear();
+    Serial1.sent.clear();
+    Serial2.received.clear();
+    out = MidiMonitor();
+    out.keep = true;
+    now = 0;
+}
+
+void tearDown(void) {}
+
+static void runUntil(ArpEngine& engine, ulong end)
+{
+    for (; now < end; now++) {
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+        out.read(Serial1.sent, now);
+    }
+}
+
+// Sends a CC, and runs a pass to take it in
+static void sendCC(ArpEngine& engine, int channel, int controller, int value)
+{
+    Serial1.received.push_back(0xb0 | channel);
+    Serial1.received.push_back(controller);
+    Serial1.received.push_back(value);
+    runUntil(engine, now + 1);
+}
+
+static ArpEngine::Parameters currentParameters(ArpEngine& engine)
+{
+    ArpEngine::Parameters parameters;
+    engine.GetParameters(parameters);
+    return parameters;
+}
+
+// The number of CCs passed through (since the message index from)
+static int ccsPassedFrom(size_t from, int controller)
+{
+    int count = 0;
+    for (size_t i = from; i < out.messages.size(); i++) {
+        if ((out.messages[i].status & 0xf0) == 0xb0 && out.messages[i].data1 == controller) count++;
+    }
+    return count;
+}
+
+// A mapped CC sets its parameter over its full range, and is still
+// passed through
+void test_mapped_cc_sets_parameter(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.MapCC(20, ArpEngine::CC_TEMPO);
+    engine.MapCC(21, ArpEngine::CC_GATE);
+    sendCC(engine, 0, 20, 0);
+    TEST_ASSERT_EQUAL(ArpEngine::MIN_TEMPO, currentParameters(engine).tempo);
+    sendCC(engine, 5, 20, 127); // (on any channel)
+    TEST_ASSERT_EQUAL(ArpEngine::MAX_TEMPO, currentParameters(engine).tempo);
+    sendCC(engine, 0, 20, 64);
+    TEST_ASSERT_EQUAL(ArpEngine::MIN_TEMPO + 64 * (ArpEngine::MAX_TEMPO - ArpEngine::MIN_TEMPO) / 127,
+        currentParameters(engine).tempo);
+    sendCC(engine, 0, 21, 127);
+    TEST_ASSERT_EQUAL(ArpEngine::MAX_GATE, currentParameters(engine).gate);
+    TEST_ASSERT_EQUAL(3, ccsPassedFrom(0, 20));
+    TEST_ASSERT_EQUAL(1, ccsPassedFrom(0, 21));
+}
+
+// Mapped to be consumed, a CC sets its parameter but isn't passed
+// through; an unmapped one is, and changes nothing
+void test_consumed_and_unmapped_ccs(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.MapCC(21, ArpEngine::CC_GATE | ArpEngine::CC_CONSUME);
+    ArpEngine::Parameters before = currentParameters(engine);
+    sendCC(engine, 0, 21, 0);
+    TEST_ASSERT_EQUAL(ArpEngine::MIN_GATE, currentParameters(engine).gate);
+    TEST_ASSERT_EQUAL(0, ccsPassedFrom(0, 21));
+
+    sendCC(engine, 0, 22, 0);
+    sendCC(engine, 0, 22, 127);
+    TEST_ASSERT_EQUAL(2, ccsPassedFrom(0, 22));
+    ArpEngine::Parameters after = currentParameters(engine);
+    TEST_ASSERT_EQUAL(before.tempo, after.tempo);
+    TEST_ASSERT_EQUAL(before.mode, after.mode);
+    TEST_ASSERT_EQUAL(before.hold, after.hold);
+
+    // (and unmapped again, it's passed through, and no longer sets the gate)
+    engine.MapCC(21, ArpEngine::CC_NONE);
+    sendCC(engine, 0, 21, 127);
+    TEST_ASSERT_EQUAL(ArpEngine::MIN_GATE, currentParameters(engine).gate);
+    TEST_ASSERT_EQUAL(1, ccsPassedFrom(0, 21));
+}
+
+// Learn maps the next CC received, on its own channel only; the CC
+// learned from is applied (and consumed, if so mapped) too. Learn is
+// also reached by SysEx.
+void test_learn(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    static const uint8_t learnHold[] = {
+        0xf0, ArpEngine::SYSEX_MANUFACTURER_ID, ArpEngine::SYSEX_DEVICE_ID,
+        ArpEngine::SYSEX_LEARN_CC, ArpEngine::CC_HOLD | ArpEngine::CC_CONSUME, 0xf7,
+    };
+    Serial1.received.insert(Serial1.received.end(), learnHold, learnHold + sizeof(learnHold));
+    runUntil(engine, 2);
+    TEST_ASSERT_FALSE(currentParameters(engine).hold);
+
+    sendCC(engine, 3, 30, 127);
+    TEST_ASSERT_TRUE(currentParameters(engine).hold);
+    sendCC(engine, 3, 30, 0);
+    TEST_ASSERT_FALSE(currentParameters(engine).hold);
+    TEST_ASSERT_EQUAL(0, ccsPassedFrom(0, 30));
+
+    sendCC(engine, 4, 30, 127); // (another channel: not mapped)
+    TEST_ASSERT_FALSE(currentParameters(engine).hold);
+    TEST_ASSERT_EQUAL(1, ccsPassedFrom(0, 30));
+
+    // (learning once maps only the one CC)
+    sendCC(engine, 3, 31, 127);
+    TEST_ASSERT_FALSE(currentParameters(engine).hold);
+    TEST_ASSERT_EQUAL(1, ccsPassedFrom(0, 31));
+}
+
+// Mapped on one channel, a CC sets that channel's mode only
+void test_channel_mapping(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.MapCC(40, ArpEngine::CC_MODE, 2);
+    sendCC(engine, 0, 40, 127);
+    TEST_ASSERT_EQUAL(ArpEngine::MODE_UP, currentParameters(engine).mode);
+
+    // (channel 2 arpeggiates down, channel 0 still up)
+    sendCC(engine, 2, 40, 127 * ArpEngine::MODE_DOWN / ArpEngine::MODE_COUNT + 1);
+    TEST_ASSERT_EQUAL(ArpEngine::MODE_UP, currentParameters(engine).mode);
+    engine.SetTempo(120);
+    engine.SetEnabled(true);
+    for (int channel = 0; channel <= 2; channel += 2) {
+        static const uint8_t notes[] = { 60, 64, 67 };
+        for (uint8_t note : notes) {
+            Serial1.received.push_back(0x90 | channel);
+            Serial1.received.push_back(note);
+            Serial1.received.push_back(100);
+        }
+    }
+    size_t from = out.messages.size();
+    runUntil(engine, now + 3 * 125);
+    // (the first note plays as the keys come in: the arpeggio's order
+    // shows from the next two)
+    std::vector<uint8_t> notes[16];
+    for (size_t i = from; i < out.messages.size(); i++) {
+        MidiMonitor::Message& message = out.messages[i];
+        if ((message.status & 0xf0) == 0x90) notes[message.status & 0x0f].push_back(message.data1);
+    }
+    TEST_ASSERT_EQUAL(3, (int)notes[0].size());
+    TEST_ASSERT_EQUAL(3, (int)notes[2].size());
+    TEST_ASSERT_TRUE(notes[0][2] > notes[0][1]);
+    TEST_ASSERT_TRUE(notes[2][2] < notes[2][1]);
+}
+
+// The curve and fixed velocity are set together: each CC keeps the
+// other's latest value
+void test_paired_parameters(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.MapCC(50, ArpEngine::CC_VELOCITY_CURVE);
+    engine.MapCC(51, ArpEngine::CC_FIXED_VELOCITY);
+    sendCC(engine, 0, 50, 127); // (fixed)
+    sendCC(engine, 0, 51, 40);
+    engine.SetTempo(120);
+    engine.SetEnabled(true);
+    static const uint8_t chord[] = { 0x90, 60, 100, 64, 110, 67, 120 };
+    Serial1.received.insert(Serial1.received.end(), chord, chord + sizeof(chord));
+    size_t from = out.messages.size();
+    runUntil(engine, now + 500);
+    ulong changedAt = now;
+    sendCC(engine, 0, 51, 90);
+    runUntil(engine, now + 500);
+    int before = 0, after = 0;
+    for (size_t i = from; i < out.messages.size(); i++) {
+        MidiMonitor::Message& message = out.messages[i];
+        if ((message.status & 0xf0) != 0x90) continue;
+        if (message.time <= changedAt) {
+            TEST_ASSERT_EQUAL(40, message.data2);
+            before++;
+        }
+        else if (message.time > changedAt + 125) { // (from the next step)
+            TEST_ASSERT_EQUAL(90, message.data2);
+            after++;
+        }
+    }
+    TEST_ASSERT_GREATER_OR_EQUAL(3, before);
+    TEST_ASSERT_GREATER_OR_EQUAL(3, after);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_mapped_cc_sets_parameter);
+    RUN_TEST(test_consumed_and_unmapped_ccs);
+    RUN_TEST(test_learn);
+    RUN_TEST(test_channel_mapping);
+    RUN_TEST(test_paired_parameters);
+    return UNITY_END();
+}
@@ -0,0 +1,191 @@
+// Chord changes: keys added to or taken from a running arpeggio,
+// and chords changed legato or detached, keep the arpeggio's rhythm
+// (note-ons stay on the step grid, none added or dropped) and its
+// position (the next step plays the next note of the new chord).
+
+#include <vector>
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "MidiMonitor.h"
+#include "ArpEngine.h"
+
+static const int TEMPO = 120;
+static const ulong STEP_MS = (60000 / 4) / TEMPO; // (125 ms)
+
+static MidiMonitor out;
+static ulong now;
+
+void setUp(void)
+{
+    Serial1.received.clear();
+    Serial1.sent.clear();
+    Serial2.received.clear();
+    out = MidiMonitor();
+    out.keep = true;
+    now = 0;
+}
+
+void tearDown(void) {}
+
+static void runUntil(ArpEngine& engine, ulong end)
+{
+    for (; now < end; now++) {
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+        out.read(Serial1.sent, now);
+    }
+}
+
+static void press(int note)
+{
+    static const uint8_t velocity = 100;
+    Serial1.received.push_back(0x90);
+    Serial1.received.push_back(note);
+    Serial1.received.push_back(velocity);
+}
+
+static void release(int note)
+{
+    Serial1.received.push_back(0x80);
+    Serial1.received.push_back(note);
+    Serial1.received.push_back(0);
+}
+
+static void startArpeggio(ArpEngine& engine, int mode)
+{
+    engine.SetTempo(TEMPO);
+    engine.SetMode(mode);
+    engine.SetGate(50);
+    engine.SetEnabled(true);
+}
+
+struct NoteOn
+{
+    ulong time;
+    int note;
+};
+
+static std::vector<NoteOn> noteOnsFrom(ulong from)
+{
+    std::vector<NoteOn> noteOns;
+    for (size_t i = 0; i < out.messages.size(); i++) {
+        MidiMonitor::Message& message = out.messages[i];
+        if ((message.status & 0xf0) == 0x90 && message.time >= from) {
+            NoteOn noteOn = { message.time, message.data1 };
+            noteOns.push_back(noteOn);
+        }
+    }
+    return noteOns;
+}
+
+// Returns the number of note-ons from the time from that aren't on
+// the step grid from the time origin
+static int offGridCount(ulong from, ulong origin)
+{
+    int count = 0;
+    std::vector<NoteOn> noteOns = noteOnsFrom(from);
+    for (size_t i = 0; i < noteOns.size(); i++) {
+        if ((noteOns[i].time - origin) % STEP_MS != 0) count++;
+    }
+    return count;
+}
+
+void test_keys_added_and_taken_legato(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startArpeggio(engine, ArpEngine::MODE_UP);
+    runUntil(engine, 100);
+    press(60); press(64); press(67);
+    runUntil(engine, 100 + 4 * STEP_MS + 30); // (60 64 67 60 64: into 64's step)
+    press(62);
+    runUntil(engine, 100 + 7 * STEP_MS + 30); // (67 60 62)
+    release(64);
+    runUntil(engine, 100 + 10 * STEP_MS + 30); // (67 60 62)
+    release(60); release(62); press(72); // (legato: 67 held)
+    runUntil(engine, 100 + 13 * STEP_MS + 30); // (67 72 67)
+
+    static const int expected[] = { 60, 64, 67, 60, 64, 67, 60, 62, 67, 60, 62, 67, 72, 67 };
+    std::vector<NoteOn> noteOns = noteOnsFrom(0);
+    TEST_ASSERT_EQUAL(sizeof(expected) / sizeof(expected[0]), noteOns.size());
+    for (size_t i = 0; i < noteOns.size(); i++) {
+        TEST_ASSERT_EQUAL(100 + i * STEP_MS, noteOns[i].time);
+        TEST_ASSERT_EQUAL(expected[i], noteOns[i].note);
+    }
+}
+
+void test_current_note_taken(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startArpeggio(engine, ArpEngine::MODE_UP_DOWN);
+    runUntil(engine, 100);
+    press(60); press(64); press(67); press(72);
+    runUntil(engine, 100 + 4 * STEP_MS + 30); // (60 64 67 72 67: going down, on 67)
+    release(67);
+    runUntil(engine, 100 + 8 * STEP_MS + 30); // (64 60 64 72: on down from it)
+
+    static const int expected[] = { 60, 64, 67, 72, 67, 64, 60, 64, 72 };
+    std::vector<NoteOn> noteOns = noteOnsFrom(0);
+    TEST_ASSERT_EQUAL(sizeof(expected) / sizeof(expected[0]), noteOns.size());
+    for (size_t i = 0; i < noteOns.size(); i++) {
+        TEST_ASSERT_EQUAL(expected[i], noteOns[i].note);
+    }
+    TEST_ASSERT_EQUAL(0, offGridCount(0, 100));
+}
+
+// All keys up, and a new chord within a step: the arpeggio joins its
+// running grid (a key hit a little late plays right away, and one hit
+// early waits for the step)
+void test_detached_chord_changes(void)
+{
+    for (int mode = 0; mode < ArpEngine::MODE_COUNT; mode++) {
+        setUp();
+        ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+        startArpeggio(engine, mode);
+        runUntil(engine, 100);
+        press(60); press(64); press(67);
+        runUntil(engine, 100 + 3 * STEP_MS + 70);
+        release(60); release(64); release(67);
+        runUntil(engine, 100 + 4 * STEP_MS + 20); // (late)
+        press(62); press(65); press(69);
+        runUntil(engine, 100 + 7 * STEP_MS + 70);
+        release(62); release(65); release(69);
+        runUntil(engine, 100 + 8 * STEP_MS - 20); // (early)
+        press(60); press(64); press(67);
+        runUntil(engine, 100 + 11 * STEP_MS + 70);
+
+        std::vector<NoteOn> noteOns = noteOnsFrom(0);
+        TEST_ASSERT_EQUAL(12, noteOns.size());
+        TEST_ASSERT_EQUAL(100 + 4 * STEP_MS + 20, noteOns[4].time); // (the late chord's first note)
+        TEST_ASSERT_EQUAL(1, offGridCount(0, 100)); // (only that one)
+        TEST_ASSERT_EQUAL(100 + 8 * STEP_MS, noteOns[8].time); // (the early chord's first note)
+    }
+}
+
+// An arpeggio started just after power up (within a step of time 0)
+// starts its own grid, rather than joining one at time 0
+void test_first_arpeggio_starts_its_own_grid(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startArpeggio(engine, ArpEngine::MODE_UP);
+    engine.SetRatchet(2);
+    runUntil(engine, 40);
+    press(60); press(64);
+    runUntil(engine, 40 + 3 * STEP_MS);
+
+    std::vector<NoteOn> noteOns = noteOnsFrom(0);
+    TEST_ASSERT_EQUAL(6, noteOns.size()); // (2 per step)
+    for (size_t i = 0; i < noteOns.size(); i++) {
+        TEST_ASSERT_EQUAL(40 + i * STEP_MS / 2, noteOns[i].time);
+    }
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_keys_added_and_taken_legato);
+    RUN_TEST(test_current_note_taken);
+    RUN_TEST(test_detached_chord_changes);
+    RUN_TEST(test_first_arpeggio_starts_its_own_grid);
+    return UNITY_END();
+}
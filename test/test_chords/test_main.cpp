@@ -0,0 +1,195 @@
+// Chords mode latency: single keys should play with no added delay,
+// and a chord (its keys rolled within the capture window) should
+// start its arpeggio on the full voicing, one window after its first
+// key. The latency added (from the key press to the note sent, or to
+// the arpeggio's first note) is collected per window, and printed as
+// "timing,..." lines.
+
+#include <stdio.h>
+#include <vector>
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "MidiMonitor.h"
+#include "TimingStats.h"
+#include "ArpEngine.h"
+
+static const int WINDOWS[] = { 5, ArpEngine::DEFAULT_CHORD_WINDOW_MS, ArpEngine::MAX_CHORD_WINDOW_MS };
+static const int TRIALS = 100;
+
+static uint32_t seed;
+static MidiMonitor out;
+static ulong now;
+
+static int randomInt(int max)
+{
+    seed = seed * 1664525 + 1013904223;
+    return (seed >> 16) % max;
+}
+
+void setUp(void)
+{
+    Serial1.received.clear();
+    Serial1.sent.clear();
+    Serial2.received.clear();
+    out = MidiMonitor();
+    out.keep = true;
+    now = 0;
+    seed = 1;
+}
+
+void tearDown(void) {}
+
+static void runUntil(ArpEngine& engine, ulong end)
+{
+    for (; now < end; now++) {
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+        out.read(Serial1.sent, now);
+    }
+}
+
+static void sendNote(bool on, int note)
+{
+    Serial1.received.push_back(on ? 0x90 : 0x80);
+    Serial1.received.push_back(note);
+    Serial1.received.push_back(on ? 100 : 0);
+}
+
+// The note-ons sent from the message index from
+static std::vector<MidiMonitor::Message> noteOnsFrom(size_t from)
+{
+    std::vector<MidiMonitor::Message> noteOns;
+    for (size_t i = from; i < out.messages.size(); i++) {
+        if ((out.messages[i].status & 0xf0) == 0x90) noteOns.push_back(out.messages[i]);
+    }
+    return noteOns;
+}
+
+static void startChordsMode(ArpEngine& engine, int window)
+{
+    engine.SetTempo(120);
+    engine.SetChords(true);
+    engine.SetChordWindow(window);
+    engine.SetEnabled(true);
+}
+
+void test_single_keys(void)
+{
+    for (int window : WINDOWS) {
+        setUp();
+        ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+        startChordsMode(engine, window);
+        char name[24];
+        snprintf(name, sizeof(name), "single-%d", window);
+        TimingStats latency(name, 0, 0, 1);
+        runUntil(engine, 100);
+        for (int trial = 0; trial < TRIALS; trial++) {
+            size_t from = out.messages.size();
+            ulong pressedAt = now;
+            int note = 48 + randomInt(24);
+            sendNote(true, note);
+            runUntil(engine, now + 20 + randomInt(300));
+            sendNote(false, note);
+            runUntil(engine, now + 20 + randomInt(100));
+
+            std::vector<MidiMonitor::Message> noteOns = noteOnsFrom(from);
+            TEST_ASSERT_EQUAL(1, noteOns.size()); // (as it is)
+            TEST_ASSERT_EQUAL(note, noteOns[0].data1);
+            latency.record(noteOns[0].time - pressedAt);
+        }
+        latency.print(Serial);
+        TEST_ASSERT_TRUE(latency.isWithinLimits());
+    }
+}
+
+// Chords of 2 to 5 keys, in any order, the last within the window
+void test_rolled_chords(void)
+{
+    for (int window : WINDOWS) {
+        setUp();
+        ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+        startChordsMode(engine, window);
+        char name[24], lastName[24];
+        snprintf(name, sizeof(name), "chord-%d", window);
+        snprintf(lastName, sizeof(lastName), "chord-last-key-%d", window);
+        TimingStats latency(name, window, window, window + 1);
+        TimingStats lastKeyLatency(lastName, window, window, window + 1);
+        runUntil(engine, 100);
+        for (int trial = 0; trial < TRIALS; trial++) {
+            size_t from = out.messages.size();
+            int keys = 2 + randomInt(4);
+            int notes[5];
+            int lowest = 127;
+            for (int key = 0; key < keys; key++) {
+                notes[key] = 48 + key * 4 + randomInt(3);
+                if (notes[key] < lowest) lowest = notes[key];
+            }
+            for (int key = keys - 1; key > 0; key--) { // (shuffled)
+                int other = randomInt(key + 1);
+                int note = notes[key];
+                notes[key] = notes[other];
+                notes[other] = note;
+            }
+
+            // (rolled: the keys spread over up to the window)
+            ulong firstKeyAt = now, lastKeyAt = now;
+            for (int key = 0; key < keys; key++) {
+                if (key > 0) {
+                    runUntil(engine, firstKeyAt + randomInt(window) * key / (keys - 1));
+                    lastKeyAt = now;
+                }
+                sendNote(true, notes[key]);
+            }
+            runUntil(engine, firstKeyAt + window + 300);
+
+            // the first key sounds while the chord's captured, then
+            // the arpeggio starts on the full chord's lowest note
+            std::vector<MidiMonitor::Message> noteOns = noteOnsFrom(from);
+            TEST_ASSERT_TRUE(noteOns.size() >= 2);
+            TEST_ASSERT_EQUAL(notes[0], noteOns[0].data1);
+            TEST_ASSERT_EQUAL(firstKeyAt, noteOns[0].time);
+            TEST_ASSERT_EQUAL(lowest, noteOns[1].data1);
+            latency.record(noteOns[1].time - firstKeyAt);
+            lastKeyLatency.record(noteOns[1].time - lastKeyAt);
+
+            // (then a pause: a chord played within a step of the last
+            // arpeggio joins its rhythm, so waits for its step)
+            for (int key = 0; key < keys; key++) sendNote(false, notes[key]);
+            runUntil(engine, now + 200 + randomInt(200));
+            TEST_ASSERT_EQUAL(0, out.soundingCount());
+        }
+        latency.print(Serial);
+        lastKeyLatency.print(Serial);
+        TEST_ASSERT_TRUE(latency.isWithinLimits());
+        TEST_ASSERT_TRUE(lastKeyLatency.isWithinLimits());
+    }
+}
+
+// A key joining one held for longer than the window: the window runs
+// from the joining key
+void test_key_joining_a_held_key(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startChordsMode(engine, ArpEngine::DEFAULT_CHORD_WINDOW_MS);
+    runUntil(engine, 100);
+    sendNote(true, 64);
+    runUntil(engine, 300);
+    sendNote(true, 60);
+    runUntil(engine, 600);
+
+    std::vector<MidiMonitor::Message> noteOns = noteOnsFrom(0);
+    TEST_ASSERT_TRUE(noteOns.size() >= 2);
+    TEST_ASSERT_EQUAL(100, noteOns[0].time); // (the held key, as it is)
+    TEST_ASSERT_EQUAL(300 + ArpEngine::DEFAULT_CHORD_WINDOW_MS, noteOns[1].time);
+    TEST_ASSERT_EQUAL(60, noteOns[1].data1);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_single_keys);
+    RUN_TEST(test_rolled_chords);
+    RUN_TEST(test_key_joining_a_held_key);
+    return UNITY_END();
+}
@@ -0,0 +1,249 @@
+// Clock loss: a MIDI clock that drops out (cable pulled, or the
+// device stopped without Stop) and comes back. Freewheeling, the
+// arpeggio should keep its steps going at the measured tempo and
+// pick the clock up again without a phase jump, and stopping, it
+// should end its note and go on with the clock once it's back.
+
+#include <vector>
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "MidiMonitor.h"
+#include "ArpEngine.h"
+
+static const ulong PULSE_MS = 20; // (125 BPM)
+static const int TEMPO_SIXTEENTHS = 180; // (in MIDI sync mode: 1/16 notes)
+static const ulong STEP_MS = 6 * PULSE_MS;
+static const ulong START_AT = 100;
+static const ulong DROPOUT_MS = 3 * PULSE_MS; // (missing pulses before the clock is lost)
+
+// The clock: pulses every PULSE_MS from Start, while connected
+// (the device goes on counting while it's not)
+struct Clock
+{
+    bool connected = true;
+    ulong nextPulseAt = START_AT;
+
+    void run(ulong now)
+    {
+        if (now == START_AT) Serial2.received.push_back(0xfa);
+        if (now < nextPulseAt) return;
+        if (connected) Serial2.received.push_back(0xf8);
+        nextPulseAt += PULSE_MS;
+    }
+};
+
+static Clock clock_;
+static MidiMonitor out;
+static ulong now;
+static int maxSounding;
+
+void setUp(void)
+{
+    Serial1.received.clear();
+    Serial1.sent.clear();
+    Serial2.received.clear();
+    clock_ = Clock();
+    out = MidiMonitor();
+    out.keep = true;
+    now = 0;
+    maxSounding = 0;
+}
+
+void tearDown(void) {}
+
+static void runUntil(ArpEngine& engine, ulong end)
+{
+    for (; now < end; now++) {
+        clock_.run(now);
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+        out.read(Serial1.sent, now);
+        if (out.soundingCount() > maxSounding) maxSounding = out.soundingCount();
+    }
+}
+
+static void startArpeggio(ArpEngine& engine, int clockLossMode)
+{
+    engine.SetMidiSync(true);
+    engine.SetTempo(TEMPO_SIXTEENTHS);
+    engine.SetGate(50);
+    engine.SetClockLossMode(clockLossMode);
+    engine.SetEnabled(true);
+    static const uint8_t chord[] = { 0x90, 60, 100, 64, 100, 67, 100 };
+    Serial1.received.insert(Serial1.received.end(), chord, chord + sizeof(chord));
+}
+
+// The times of the note-ons sent between from and to
+static std::vector<ulong> noteOnTimes(ulong from, ulong to)
+{
+    std::vector<ulong> times;
+    for (size_t i = 0; i < out.messages.size(); i++) {
+        MidiMonitor::Message& message = out.messages[i];
+        if ((message.status & 0xf0) == 0x90 && message.time >= from && message.time < to) {
+            times.push_back(message.time);
+        }
+    }
+    return times;
+}
+
+// Returns the largest distance (ms) of a note-on between from and to
+// from the step grid (from Start, with the specified phase shift)
+static long maxGridError(ulong from, ulong to, ulong shift = 0)
+{
+    long maxError = 0;
+    std::vector<ulong> times = noteOnTimes(from, to);
+    for (size_t i = 0; i < times.size(); i++) {
+        long offset = (long)((times[i] - START_AT - shift) % STEP_MS);
+        long error = MIN(offset, (long)STEP_MS - offset);
+        if (error > maxError) maxError = error;
+    }
+    return maxError;
+}
+
+// Returns the number of steps between from and to without a note-on
+// (or with more than one)
+static int missedSteps(ulong from, ulong to)
+{
+    int missed = 0;
+    std::vector<ulong> times = noteOnTimes(from, to);
+    for (size_t i = 1; i < times.size(); i++) {
+        ulong interval = times[i] - times[i - 1];
+        if (interval < STEP_MS - STEP_MS / 4 || interval > STEP_MS + STEP_MS / 4) missed++;
+    }
+    return missed;
+}
+
+// Returns the number of note-offs sent for notes not sounding
+static int strayNoteOffs()
+{
+    int count = 0;
+    bool sounding[16][128] = {};
+    for (size_t i = 0; i < out.messages.size(); i++) {
+        MidiMonitor::Message& message = out.messages[i];
+        bool noteOn = (message.status & 0xf0) == 0x90;
+        if (!noteOn && (message.status & 0xf0) != 0x80) continue;
+        bool& note = sounding[message.status & 0x0f][message.data1];
+        if (!noteOn && !note) count++;
+        note = noteOn;
+    }
+    return count;
+}
+
+void test_steady_clock(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startArpeggio(engine, ArpEngine::CLOCK_LOSS_FREEWHEEL);
+    runUntil(engine, 3000);
+    TEST_ASSERT_GREATER_OR_EQUAL(24, (int)noteOnTimes(START_AT, 3000).size());
+    TEST_ASSERT_EQUAL(0, maxGridError(START_AT, 3000));
+    TEST_ASSERT_EQUAL(0, missedSteps(START_AT, 3000));
+}
+
+void test_freewheel_through_dropout(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startArpeggio(engine, ArpEngine::CLOCK_LOSS_FREEWHEEL);
+    runUntil(engine, 1010);
+    clock_.connected = false;
+    runUntil(engine, 2510);
+    clock_.connected = true; // (back, in phase)
+    runUntil(engine, 4000);
+
+    // the steps go on through the dropout, at the measured tempo,
+    // and there's no jump when the clock is back
+    TEST_ASSERT_GREATER_OR_EQUAL(12, (int)noteOnTimes(1010, 2510).size());
+    TEST_ASSERT_LESS_OR_EQUAL(1, maxGridError(START_AT, 4000));
+    TEST_ASSERT_EQUAL(0, missedSteps(START_AT, 4000));
+    TEST_ASSERT_LESS_OR_EQUAL(1, maxSounding);
+    TEST_ASSERT_EQUAL(0, strayNoteOffs());
+}
+
+void test_freewheel_recovers_from_phase_shift(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startArpeggio(engine, ArpEngine::CLOCK_LOSS_FREEWHEEL);
+    runUntil(engine, 1010);
+    clock_.connected = false;
+    runUntil(engine, 2510);
+    clock_.nextPulseAt += 7; // (back, a little late)
+    clock_.connected = true;
+    runUntil(engine, 4000);
+
+    // no step doubled or skipped, and locked to the clock again
+    TEST_ASSERT_EQUAL(0, missedSteps(START_AT, 4000));
+    TEST_ASSERT_LESS_OR_EQUAL(1, maxGridError(3000, 4000, 7));
+    TEST_ASSERT_LESS_OR_EQUAL(1, maxSounding);
+}
+
+void test_freewheel_ran_ahead(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startArpeggio(engine, ArpEngine::CLOCK_LOSS_FREEWHEEL);
+    runUntil(engine, 1010);
+    clock_.connected = false;
+    runUntil(engine, 2500);
+    clock_.nextPulseAt += 9; // (back almost half a pulse late, just after a step played early)
+    clock_.connected = true;
+    runUntil(engine, 4000);
+
+    // the count follows the clock back, so the steps land on its
+    // grid from the next one on, none repeated and with no offset
+    std::vector<ulong> times = noteOnTimes(2400, 4000);
+    TEST_ASSERT_EQUAL(0, missedSteps(START_AT, 4000));
+    TEST_ASSERT_EQUAL(0, maxGridError(times[1], 4000, 9));
+    TEST_ASSERT_LESS_OR_EQUAL(1, maxSounding);
+}
+
+void test_stop_on_dropout(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startArpeggio(engine, ArpEngine::CLOCK_LOSS_STOP);
+    engine.SetGate(100); // (a note always sounding)
+    runUntil(engine, 950);
+    TEST_ASSERT_EQUAL(1, out.soundingCount());
+    clock_.connected = false;
+
+    // silent within a few pulses, until the clock is back
+    runUntil(engine, 950 + DROPOUT_MS + PULSE_MS);
+    TEST_ASSERT_EQUAL(0, out.soundingCount());
+    runUntil(engine, 2500);
+    TEST_ASSERT_EQUAL(0, (int)noteOnTimes(950, 2500).size());
+    TEST_ASSERT_EQUAL(0, out.soundingCount());
+
+    clock_.connected = true;
+    runUntil(engine, 4000);
+    std::vector<ulong> times = noteOnTimes(2500, 4000);
+    TEST_ASSERT_GREATER_OR_EQUAL(10, (int)times.size());
+    TEST_ASSERT_LESS_OR_EQUAL(2500 + STEP_MS, times[0]); // (going again within a step)
+    TEST_ASSERT_EQUAL(0, missedSteps(times[0], 4000));
+    TEST_ASSERT_EQUAL(0, maxGridError(times[0], 4000)); // (on the clock's grid: counted through the dropout)
+    TEST_ASSERT_LESS_OR_EQUAL(1, maxSounding);
+    TEST_ASSERT_EQUAL(0, strayNoteOffs());
+}
+
+void test_stop_on_dropout_between_notes(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startArpeggio(engine, ArpEngine::CLOCK_LOSS_STOP);
+    runUntil(engine, 1015); // (the last note already ended)
+    TEST_ASSERT_EQUAL(0, out.soundingCount());
+    clock_.connected = false;
+    runUntil(engine, 2500);
+    clock_.connected = true;
+    runUntil(engine, 4000);
+    TEST_ASSERT_GREATER_OR_EQUAL(10, (int)noteOnTimes(2500, 4000).size());
+    TEST_ASSERT_EQUAL(0, strayNoteOffs()); // (nothing more to end)
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_steady_clock);
+    RUN_TEST(test_freewheel_through_dropout);
+    RUN_TEST(test_freewheel_recovers_from_phase_shift);
+    RUN_TEST(test_freewheel_ran_ahead);
+    RUN_TEST(test_stop_on_dropout);
+    RUN_TEST(test_stop_on_dropout_between_notes);
+    return UNITY_END();
+}
@@ -0,0 +1,186 @@
+// MIDI clock output: the clock sent from the internal tempo, with its
+// pulses timed by the ClockGenerator's alarm and sent by Run(), called
+// after loop passes of random length (as under load), at tempos from 30
+// to 300 BPM. Each pulse is compared with the ideal 24 ppqn grid from
+// pulse 0: it should go out on the first pass after it's due (never
+// early, none dropped) and not drift, however long it runs. The error
+// is printed per tempo as "clock_out,<tempo>,<max pass us>,<pulses>,
+// <p99 us>,<max us>,<last us>" lines, and the engine's own figures as
+// "timing,..." lines.
+
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "TimingStats.h"
+#include "ClockGenerator.h"
+#include "ArpEngine.h"
+
+static const int TEMPOS[] = { 30, 47, 60, 90, 120, 150, 173, 199, 240, 277, 300 };
+static const unsigned long START_US = 100000;
+
+static uint32_t seed;
+
+static unsigned long randomPassUs(unsigned long maxUs)
+{
+    seed = seed * 1664525 + 1013904223;
+    return (seed >> 8) % (maxUs + 1);
+}
+
+void setUp(void)
+{
+    Serial1.received.clear();
+    Serial1.sent.clear();
+    Serial2.received.clear();
+    seed = 1;
+}
+
+void tearDown(void) {}
+
+// Plays a chord at the tempo for the specified number of loop passes,
+// of up to maxPassUs each, and checks the clock sent against the grid
+static void playClock(int tempo, int passes, unsigned long maxPassUs, TimingStats& stats)
+{
+    setUp();
+    mockSetMicros(START_US);
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    ClockGenerator generator;
+    engine.SetClockOutput(&generator);
+    engine.SetTimingStats(NULL, NULL, &stats);
+    engine.SetTempo(tempo);
+    engine.SetEnabled(true);
+    static const uint8_t chord[] = { 0x90, 60, 100, 64, 100, 67, 100 };
+    Serial1.received.insert(Serial1.received.end(), chord, chord + sizeof(chord));
+
+    // (the clock follows the step length, in whole ms)
+    double pulseUs = (15000 / tempo) * 4 * 1000.0 / ClockGenerator::PULSES_PER_QUARTER;
+    unsigned long us = START_US, lastRunUs = 0, startUs = 0;
+    long pulses = -1; // (until Start)
+    std::vector<long> errors;
+    for (int pass = 0; pass < passes; pass++) {
+        mockSetMicros(us);
+        mockRunAlarms();
+        engine.Run(us / 1000);
+        for (size_t i = 0; i < Serial1.sent.size(); i++) {
+            if (Serial1.sent[i] == 0xfa) {
+                TEST_ASSERT_EQUAL(-1, pulses); // (started once)
+                startUs = us; // (pulse 0 is due with the first note)
+                pulses = 0;
+            }
+            else if (Serial1.sent[i] == 0xf8) {
+                if (pulses < 0) continue; // (the clock runs while stopped, too)
+                errors.push_back(lround(us - (startUs + pulses * pulseUs)));
+                pulses++;
+            }
+        }
+        Serial1.sent.clear();
+        lastRunUs = us;
+        us += randomPassUs(maxPassUs);
+    }
+    generator.stop();
+
+    // every pulse sent on the first pass after it was due, so none
+    // dropped either
+    TEST_ASSERT_EQUAL(START_US, startUs);
+    TEST_ASSERT_INT_WITHIN(1, (long)((lastRunUs - startUs) / pulseUs) + 1, pulses);
+    std::vector<long> sorted = errors;
+    std::sort(sorted.begin(), sorted.end());
+    TEST_ASSERT_TRUE(sorted.front() >= -1); // (due times are whole us)
+    TEST_ASSERT_TRUE(sorted.back() <= (long)maxPassUs);
+    printf("clock_out,%d,%lu,%ld,%ld,%ld,%ld\n", tempo, maxPassUs, pulses,
+        sorted[sorted.size() * 99 / 100], sorted.back(), errors.back());
+}
+
+static void sweep(int passes, unsigned long maxPassUs, const char* name, unsigned long limitMs)
+{
+    TimingStats stats(name, limitMs, limitMs, limitMs + 1);
+    for (int tempo : TEMPOS) playClock(tempo, passes, maxPassUs, stats);
+    stats.print(Serial);
+    TEST_ASSERT_TRUE(stats.isWithinLimits());
+}
+
+void test_clock_with_short_passes(void)
+{
+    sweep(400000, 100, "clock_out-100us", 0); // (20 s)
+}
+
+void test_clock_with_long_passes(void)
+{
+    sweep(100000, 2000, "clock_out-2ms", 2); // (100 s)
+}
+
+// The generator on its own: the due times add up to exactly a quarter
+// note every 24 pulses, and a tempo change takes effect on the next
+// MIDI beat
+void test_generator_due_times(void)
+{
+    static const unsigned long QUARTER_US = 1276595; // (47 BPM: not a whole us per pulse)
+    static const unsigned long NEW_QUARTER_US = 500000;
+    mockSetMicros(START_US);
+    ClockGenerator generator;
+    generator.setQuarterNoteLength(QUARTER_US);
+    generator.start(0);
+    static const long CHANGED_AT_PULSE = 64 * 24 + 2; // (within a beat)
+    static const long NEW_BEAT_PULSE = 64 * 24 + 6;
+    unsigned long us = START_US, dueAtUs;
+    unsigned long newBeatAt = START_US + (unsigned long)((uint64_t)NEW_BEAT_PULSE * QUARTER_US / 24);
+    long pulse = 0;
+    while (pulse < NEW_BEAT_PULSE + 4 * 24) {
+        mockSetMicros(us += 1000);
+        mockRunAlarms();
+        while (generator.takePulse(dueAtUs)) {
+            if (pulse <= NEW_BEAT_PULSE) {
+                TEST_ASSERT_INT_WITHIN(1, (long)(START_US + (uint64_t)pulse * QUARTER_US / 24), (long)dueAtUs);
+                if (pulse % 24 == 0) TEST_ASSERT_EQUAL(START_US + pulse / 24 * QUARTER_US, dueAtUs); // (exact)
+            }
+            else {
+                TEST_ASSERT_INT_WITHIN(2, (long)(newBeatAt + (pulse - NEW_BEAT_PULSE) * NEW_QUARTER_US / 24), (long)dueAtUs);
+            }
+            if (pulse == CHANGED_AT_PULSE) generator.setQuarterNoteLength(NEW_QUARTER_US);
+            pulse++;
+        }
+    }
+    generator.stop();
+}
+
+// The alarm held off (as by other interrupts) by up to 200 us: each
+// pulse fires late, but the next is still timed from when this one
+// was due, so the lateness doesn't add up
+void test_generator_with_alarm_latency(void)
+{
+    static const unsigned long QUARTER_US = 200000; // (300 BPM)
+    static const unsigned long STEP_US = 25;
+    static const long PULSES = 32 * 24;
+    mockSetMicros(START_US);
+    ClockGenerator generator;
+    generator.setQuarterNoteLength(QUARTER_US);
+    generator.start(0);
+    unsigned long us = START_US, dueAtUs;
+    long pulse = 0, maxLateUs = 0;
+    while (pulse < PULSES) {
+        mockSetAlarmLatency(randomPassUs(200));
+        mockSetMicros(us += STEP_US);
+        mockRunAlarms();
+        while (generator.takePulse(dueAtUs)) {
+            TEST_ASSERT_INT_WITHIN(1, (long)(START_US + (uint64_t)pulse * QUARTER_US / 24), (long)dueAtUs);
+            long lateUs = (long)(us - (START_US + (uint64_t)pulse * QUARTER_US / 24));
+            if (lateUs > maxLateUs) maxLateUs = lateUs;
+            pulse++;
+        }
+    }
+    generator.stop();
+    mockSetAlarmLatency(0);
+    TEST_ASSERT_TRUE(maxLateUs <= (long)(200 + STEP_US));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_clock_with_short_passes);
+    RUN_TEST(test_clock_with_long_passes);
+    RUN_TEST(test_generator_due_times);
+    RUN_TEST(test_generator_with_alarm_latency);
+    return UNITY_END();
+}
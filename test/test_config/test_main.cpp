@@ -0,0 +1,207 @@
+// Settings changes: with CONFIG_AT_STEP, a change takes effect on
+// each lane at its next step, never in the middle of one, and the
+// setters can be called from another thread (or core) than Run().
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "MidiMonitor.h"
+#include "ArpEngine.h"
+
+static MidiMonitor out;
+static ulong now;
+
+void setUp(void)
+{
+    Serial1.received.clear();
+    Serial1.sent.clear();
+    Serial2.received.clear();
+    out = MidiMonitor();
+    out.keep = true;
+    now = 0;
+}
+
+void tearDown(void) {}
+
+static void runUntil(ArpEngine& engine, ulong end)
+{
+    for (; now < end; now++) {
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+        out.read(Serial1.sent, now);
+    }
+}
+
+static void pressChord(int channel, int root)
+{
+    const uint8_t chord[] = { (uint8_t)(0x90 | channel), (uint8_t)root, 100, (uint8_t)(root + 4), 100,
+        (uint8_t)(root + 7), 100 };
+    Serial1.received.insert(Serial1.received.end(), chord, chord + sizeof(chord));
+}
+
+struct Note
+{
+    ulong on, off;
+    int note;
+};
+
+// The notes played on a channel (off: 0 if still sounding)
+static std::vector<Note> notesOn(int channel)
+{
+    std::vector<Note> notes;
+    for (size_t i = 0; i < out.messages.size(); i++) {
+        MidiMonitor::Message& message = out.messages[i];
+        if ((message.status & 0x0f) != channel) continue;
+        if ((message.status & 0xf0) == 0x90) {
+            Note note = { message.time, 0, message.data1 };
+            notes.push_back(note);
+        }
+        else if ((message.status & 0xf0) == 0x80) {
+            for (size_t n = 0; n < notes.size(); n++) {
+                if (notes[n].note == message.data1 && notes[n].off == 0) notes[n].off = message.time;
+            }
+        }
+    }
+    return notes;
+}
+
+void test_change_waits_for_the_step(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.SetTempo(60); // (250 ms steps)
+    engine.SetGate(50);
+    engine.SetEnabled(true);
+    runUntil(engine, 100);
+    pressChord(0, 60);
+    runUntil(engine, 400); // (in the second step)
+    engine.SetTempo(200); // (75 ms steps)
+    engine.SetGate(20);
+    runUntil(engine, 900);
+
+    // the second step plays out as it started, the third is new
+    static const ulong expectedOn[] = { 100, 350, 600, 675, 750, 825 };
+    static const ulong expectedLength[] = { 125, 125, 15, 15, 15, 15 };
+    std::vector<Note> notes = notesOn(0);
+    TEST_ASSERT_EQUAL(sizeof(expectedOn) / sizeof(expectedOn[0]), notes.size());
+    for (size_t i = 0; i < notes.size(); i++) {
+        TEST_ASSERT_EQUAL(expectedOn[i], notes[i].on);
+        TEST_ASSERT_EQUAL(expectedLength[i], notes[i].off - notes[i].on);
+    }
+}
+
+void test_lanes_change_at_their_own_steps(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.SetTempo(60);
+    engine.SetGate(50);
+    engine.SetEnabled(true);
+    runUntil(engine, 100);
+    pressChord(0, 60);
+    runUntil(engine, 200);
+    pressChord(1, 48); // (a step later than channel 0)
+    runUntil(engine, 400);
+    engine.SetGate(20);
+    runUntil(engine, 1000);
+
+    std::vector<Note> lane0 = notesOn(0), lane1 = notesOn(1);
+    TEST_ASSERT_EQUAL(125, lane0[1].off - lane0[1].on); // (its step at 350: as it started)
+    TEST_ASSERT_EQUAL(600, lane0[2].on);
+    TEST_ASSERT_EQUAL(50, lane0[2].off - lane0[2].on);
+    TEST_ASSERT_EQUAL(450, lane1[1].on);
+    TEST_ASSERT_EQUAL(50, lane1[1].off - lane1[1].on); // (its next step, at 450)
+}
+
+// In chords mode, a single key held plays as it is: there's no step
+// for a change to wait for
+void test_published_with_a_single_key_held(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.SetChords(true);
+    engine.SetEnabled(true);
+    runUntil(engine, 100);
+    static const uint8_t key[] = { 0x90, 60, 100 };
+    Serial1.received.insert(Serial1.received.end(), key, key + sizeof(key));
+    runUntil(engine, 200);
+    engine.SetTempo(200);
+    runUntil(engine, 210);
+    TEST_ASSERT_TRUE(engine.NextEventAt(now + 1000) > now); // (nothing left to do)
+
+    // and a chord then plays with it
+    static const uint8_t keys[] = { 0x90, 64, 100, 67, 100 };
+    Serial1.received.insert(Serial1.received.end(), keys, keys + sizeof(keys));
+    runUntil(engine, 600);
+    std::vector<Note> notes = notesOn(0);
+    TEST_ASSERT_TRUE(notes.size() >= 4);
+    TEST_ASSERT_EQUAL(75, notes[3].on - notes[2].on);
+}
+
+// A writer thread changes the settings (each setter on its own) as
+// fast as it can, while Run() plays arpeggios on three channels.
+// Each step is played with settings as one of the setters left them:
+// its length, gate and octave are from the same ones.
+void test_concurrent_writer(void)
+{
+    static const int TEMPOS[] = { 200, 60 }; // (75 and 250 ms steps)
+    static const int GATES[] = { 20, 90 };
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.SetTempo(TEMPOS[0]);
+    engine.SetGate(GATES[0]);
+    engine.SetEnabled(true);
+    for (int channel = 0; channel < 3; channel++) pressChord(channel, 48 + channel * 12);
+
+    std::atomic<bool> done(false);
+    std::atomic<long> changes(0);
+    std::thread writer([&]() {
+        uint32_t seed = 1;
+        while (!done) {
+            seed = seed * 1664525 + 1013904223;
+            int value = seed >> 16;
+            switch (value % 4) {
+            case 0: engine.SetTempo(TEMPOS[(value >> 4) & 1]); break;
+            case 1: engine.SetGate(GATES[(value >> 4) & 1]); break;
+            case 2: engine.SetRange((value >> 4) & 1, (value >> 5) % 3); break;
+            case 3: engine.SetMode((value >> 4) % ArpEngine::MODE_COUNT, (value >> 6) % 3); break;
+            }
+            changes++;
+        }
+    });
+    runUntil(engine, 20000);
+    done = true;
+    writer.join();
+
+    for (int channel = 0; channel < 3; channel++) {
+        int root = 48 + channel * 12;
+        std::vector<Note> notes = notesOn(channel);
+        TEST_ASSERT_TRUE(notes.size() > 80);
+        for (size_t i = 0; i + 1 < notes.size(); i++) {
+            // (a chord note, or an octave above it: range 0 or 1)
+            int interval = notes[i].note - root;
+            TEST_ASSERT_TRUE(interval % 12 == 0 || interval % 12 == 4 || interval % 12 == 7);
+            TEST_ASSERT_TRUE(interval >= 0 && interval < 24);
+
+            // (the length of the step, and the gate of one of the tempos)
+            long step = notes[i + 1].on - notes[i].on;
+            long length = notes[i].off - notes[i].on;
+            TEST_ASSERT_TRUE(step == 75 || step == 250);
+            TEST_ASSERT_TRUE(labs(length - step * GATES[0] / 100) <= 1 || labs(length - step * GATES[1] / 100) <= 1);
+        }
+    }
+    char text[40];
+    snprintf(text, sizeof(text), "%ld changes", (long)changes);
+    TEST_MESSAGE(text);
+    TEST_ASSERT_TRUE(changes > 1000);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_change_waits_for_the_step);
+    RUN_TEST(test_lanes_change_at_their_own_steps);
+    RUN_TEST(test_published_with_a_single_key_held);
+    RUN_TEST(test_concurrent_writer);
+    return UNITY_END();
+}
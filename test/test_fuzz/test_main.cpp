@@ -0,0 +1,268 @@
+// Fuzzing: the engine driven by arbitrary MIDI in, sync and
+// parameter changes, checking that its output stays well formed
+// and that every note it starts is ended. Out of bounds accesses
+// and undefined behavior are caught by the sanitizers (see the
+// native environment in platformio.ini).
+//
+// As a test (pio test -e native -f test_fuzz), it runs a fixed set
+// of pseudo-random inputs. For fuzzing for hours, build it as a
+// libFuzzer target instead (clang):
+//
+//   clang++ -std=gnu++17 -O1 -g -DFUZZING -fsanitize=fuzzer,address,undefined
+//     -Isrc -Itest/mock test/test_fuzz/test_main.cpp test/mock/*.cpp
+//     $(ls src/*.cpp | grep -v main.cpp) -o fuzz_arp
+//   ./fuzz_arp -max_len=4096 corpus/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "MidiMonitor.h"
+#include "ArpEngine.h"
+
+#ifdef FUZZING
+#define CHECK(condition, message) \
+    do { if (!(condition)) { fprintf(stderr, "%s\n", message); abort(); } } while (0)
+#else
+#include <unity.h>
+#define CHECK(condition, message) TEST_ASSERT_TRUE_MESSAGE(condition, message)
+#endif
+
+static byte presets[4][ArpEngine::PARAMETER_BYTES];
+static bool presetsStored[4];
+
+static bool loadPreset(int preset, byte* data)
+{
+    if (preset >= 4 || !presetsStored[preset]) return false;
+    memcpy(data, presets[preset], ArpEngine::PARAMETER_BYTES);
+    return true;
+}
+
+static void storePreset(int preset, const byte* data)
+{
+    if (preset >= 4) return;
+    memcpy(presets[preset], data, ArpEngine::PARAMETER_BYTES);
+    presetsStored[preset] = true;
+}
+
+// Reads the input, a byte at a time (0 once it's used up)
+class Input
+{
+public:
+    Input(const uint8_t* data, size_t size) : _data(data), _size(size), _at(0) {}
+    bool more() { return _at < _size; }
+    uint8_t next() { return _at < _size ? _data[_at++] : 0; }
+
+private:
+    const uint8_t* _data;
+    size_t _size;
+    size_t _at;
+};
+
+static void writeSysEx(Input& input)
+{
+    HardwareSerial& in = Serial1;
+    in.received.push_back(0xf0);
+    in.received.push_back((uint8_t)ArpEngine::SYSEX_MANUFACTURER_ID);
+    in.received.push_back((uint8_t)ArpEngine::SYSEX_DEVICE_ID);
+    uint8_t kind = input.next();
+    if (kind % 4 == 0) {
+        // a valid parameter set (from the next bytes)
+        ArpEngine::Parameters parameters;
+        parameters.sync = input.next() & 1;
+        parameters.enabled = input.next() & 1;
+        parameters.hold = input.next() & 1;
+        parameters.mode = input.next() % ArpEngine::MODE_COUNT;
+        parameters.range = input.next() % (ArpEngine::MAX_RANGE + 1);
+        parameters.velocityMode = input.next() % ArpEngine::VEL_COUNT;
+        parameters.tempo = ArpEngine::MIN_TEMPO + input.next() % (ArpEngine::MAX_TEMPO - ArpEngine::MIN_TEMPO + 1);
+        parameters.gate = input.next() % (ArpEngine::MAX_GATE + 1);
+        parameters.swing = ArpEngine::MIN_SWING + input.next() % (ArpEngine::MAX_SWING - ArpEngine::MIN_SWING + 1);
+        parameters.groove = input.next() % ArpEngine::GROOVE_COUNT;
+        parameters.ratchet = ArpEngine::MIN_RATCHET + input.next() % ArpEngine::MAX_RATCHET;
+        parameters.ratchetDecay = input.next() % 101;
+        parameters.clockLossMode = input.next() & 1;
+        byte data[ArpEngine::PARAMETER_BYTES];
+        ArpEngine::EncodeParameters(parameters, data);
+        byte sum = 0;
+        in.received.push_back((uint8_t)ArpEngine::SYSEX_PARAMETERS);
+        for (int i = 0; i < ArpEngine::PARAMETER_BYTES; i++) {
+            in.received.push_back(data[i]);
+            sum += data[i];
+        }
+        in.received.push_back(-sum & 0x7f);
+    }
+    else {
+        // any command (e.g. presets, patterns, CC mappings), with
+        // whatever data follows
+        int length = input.next() % 24;
+        for (int i = 0; i < length; i++) in.received.push_back(input.next() & 0x7f);
+    }
+    if (kind & 0x80) in.received.push_back(0xf7); // (else: cut short)
+}
+
+static void setParameter(ArpEngine& engine, Input& input)
+{
+    uint8_t value = input.next();
+    int channel = value & 0x80 ? ArpEngine::ALL_CHANNELS : value % 3;
+    switch (input.next() % 22) {
+    case 0: engine.SetEnabled(value & 1); break;
+    case 1: engine.SetHold(value & 1); break;
+    case 2: engine.SetChords(value & 1); break;
+    case 3: engine.SetChordWindow(value % (ArpEngine::MAX_CHORD_WINDOW_MS + 1)); break;
+    case 4: engine.SetTempo(ArpEngine::MIN_TEMPO + value); break;
+    case 5: engine.SetMidiSync(value & 1); break;
+    case 6: engine.SetGate(value % (ArpEngine::MAX_GATE + 1)); break;
+    case 7: engine.SetMode(value % ArpEngine::MODE_COUNT, channel); break;
+    case 8: engine.SetVelocityMode(value % ArpEngine::VEL_COUNT, channel); break;
+    case 9: engine.SetRange(value % (ArpEngine::MAX_RANGE + 1), channel); break;
+    case 10: engine.SetClockLossMode(value & 1); break;
+    case 11: engine.SetSwing(ArpEngine::MIN_SWING + value % 26); break;
+    case 12: engine.SetGroove(value % ArpEngine::GROOVE_COUNT); break;
+    case 13: engine.SetRatchet(ArpEngine::MIN_RATCHET + value % ArpEngine::MAX_RATCHET, channel); break;
+    case 14: engine.SetRatchetDecay(value % 101); break;
+    case 15: engine.SetVelocityCurve(value % ArpEngine::VEL_CURVE_COUNT, 1 + input.next() % 127); break;
+    case 16: engine.SetVelocityShape(value % ArpEngine::VEL_SHAPE_COUNT, input.next() % 101); break;
+    case 17: engine.SetAccent(value % ArpEngine::ACCENT_COUNT, input.next() % (ArpEngine::MAX_ACCENT + 1)); break;
+    case 18: engine.SetPatternStep(value % ArpEngine::PATTERN_COUNT, input.next() % ArpEngine::PATTERN_STEPS,
+        (int)(input.next() % 9) - 4); break;
+    case 19: engine.SetPatternLength(value % ArpEngine::PATTERN_COUNT, input.next() % (ArpEngine::PATTERN_STEPS + 1)); break;
+    case 20: engine.SetConfigUpdate(value & 1); break;
+    case 21: engine.MapCC(input.next() & 0x7f, value % ArpEngine::CC_PARAMETER_COUNT | (value & 0x40), channel); break;
+    }
+}
+
+static void fuzzOne(const uint8_t* data, size_t size)
+{
+    Serial1.received.clear();
+    Serial1.sent.clear();
+    Serial2.received.clear();
+    memset(presetsStored, 0, sizeof(presetsStored));
+    ulong now = 1000;
+    mockSetMicros(now * 1000ULL);
+
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.onLoadPreset = loadPreset;
+    engine.onStorePreset = storePreset;
+    MidiMonitor out;
+    Input input(data, size);
+
+    engine.SetRunningStatus(input.next() & 1);
+    while (input.more()) {
+        uint8_t op = input.next();
+        switch (op % 10) {
+        case 0: case 1: case 2:
+            // notes, mostly on a few channels (for chords)
+            Serial1.received.push_back((op & 0x10 ? 0x80 : 0x90) | (op >> 5) % 3);
+            Serial1.received.push_back(input.next() & 0x7f);
+            Serial1.received.push_back(input.next() & 0x7f);
+            break;
+        case 3:
+            // any bytes at all
+            for (int i = op >> 6; i >= 0; i--) Serial1.received.push_back(input.next());
+            break;
+        case 4: {
+            static const uint8_t sync[] = { 0xf8, 0xf8, 0xf8, 0xf8, 0xfa, 0xfb, 0xfc, 0xf2 };
+            uint8_t status = sync[(op >> 4) % 8];
+            Serial2.received.push_back(status);
+            if (status == 0xf2) {
+                Serial2.received.push_back(input.next() & 0x7f);
+                Serial2.received.push_back(input.next() & 0x7f);
+            }
+            if (op & 0x80) Serial2.received.push_back(input.next()); // (stray)
+            break;
+        }
+        case 5:
+            Serial1.received.push_back(0xb0 | (op >> 5) % 3);
+            Serial1.received.push_back(input.next() & 0x7f);
+            Serial1.received.push_back(input.next() & 0x7f);
+            break;
+        case 6: writeSysEx(input); break;
+        case 7: setParameter(engine, input); break;
+        case 8: now += input.next() % 64; break;
+        case 9: if (op == 0xff) engine.Panic(); break;
+        }
+        now += op & 1;
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+        out.read(Serial1.sent);
+        CHECK(out.errors == 0, "stray data byte sent");
+    }
+
+    // (the rest of the input first)
+    while (!Serial1.received.empty() || !Serial2.received.empty()) {
+        mockSetMicros(++now * 1000ULL);
+        engine.Run(now);
+    }
+
+    // All keys up, hold off: no note may be left sounding
+    Serial1.received.push_back(0xf7);
+    engine.SetHold(false);
+    for (int channel = 0; channel < 16; channel++) {
+        for (int note = 0; note < 128; note++) {
+            Serial1.received.push_back(0x80 | channel);
+            Serial1.received.push_back(note);
+            Serial1.received.push_back(0);
+        }
+    }
+    for (int i = 0; i < 500; i++) {
+        mockSetMicros(++now * 1000ULL);
+        engine.Run(now);
+    }
+    out.read(Serial1.sent);
+    CHECK(out.soundingCount() == 0, "note left sounding after all keys were released");
+    CHECK(engine.IsIdle(), "not idle after all keys were released");
+    CHECK(out.errors == 0, "stray data byte sent");
+}
+
+#ifdef FUZZING
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    fuzzOne(data, size);
+    return 0;
+}
+
+#else
+
+void setUp() {}
+void tearDown() {}
+
+// Pseudo-random inputs (a fixed sequence)
+void test_random_inputs()
+{
+    static uint8_t data[4096];
+    uint32_t seed = 1;
+    for (int run = 0; run < 200; run++) {
+        size_t size = 64 + run * 20;
+        for (size_t i = 0; i < size; i++) {
+            seed = seed * 1664525 + 1013904223;
+            data[i] = seed >> 24;
+        }
+        fuzzOne(data, size);
+    }
+}
+
+// Stray note-offs, and notes ending in the middle of a message
+void test_stray_and_cut_messages()
+{
+    static const uint8_t data[] = {
+        7, 2, 1, // (enabled)
+        0x10, 60, 0, 0x10, 61, 0, 0, 60, 100, 0, 64, 100, 8, 200, // off, off, on, on, time
+        0x10, 64, 0, 0x10, 64, 0, 0x10, 64, 0, 8, 200, // off, repeated
+        0x03, 0x90, 0xc3, 0x45, 0x43, 60, 0x43, 60, 90, 8, 100, // any bytes: cut, running status
+        6, 0x80, 3, 0x05, 1, // SysEx: recall preset 1 (empty)
+        0, 67, 100, 3, 0xf0, 0, 1, 2, 3, 0x43, 0xf7, 0x80, 1, 8, 250, // SysEx interrupted
+    };
+    fuzzOne(data, sizeof(data));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_random_inputs);
+    RUN_TEST(test_stray_and_cut_messages);
+    return UNITY_END();
+}
+
+#endif
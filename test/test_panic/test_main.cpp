@@ -0,0 +1,300 @@
+// Panic: after any sequence of input and setting changes, Panic()
+// (or a System Reset received) must leave no note sounding, with a
+// note-off for each note sounded, then All Notes Off and All Sound
+// Off on every channel. Called in the middle of Run(), the output
+// collected so far goes out first, so nothing sounded before the
+// panic comes after its note-offs. Nothing the lanes were in the
+// middle of (a chord settling, a tied note) outlasts the panic.
+
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "MidiMonitor.h"
+#include "ArpEngine.h"
+
+static const int CC_ALL_SOUND_OFF = 120;
+static const int CC_ALL_NOTES_OFF = 123;
+
+static uint32_t seed;
+
+static uint8_t randomByte()
+{
+    seed = seed * 1664525 + 1013904223;
+    return seed >> 24;
+}
+
+void setUp(void)
+{
+    Serial1.received.clear();
+    Serial1.sent.clear();
+    Serial2.received.clear();
+    seed = 1;
+}
+
+void tearDown(void) {}
+
+// Returns the index of the first message of the panic (the first
+// All Notes Off or All Sound Off), or -1
+static int panicStart(MidiMonitor& out, size_t from)
+{
+    for (size_t i = from; i < out.messages.size(); i++) {
+        MidiMonitor::Message& message = out.messages[i];
+        if ((message.status & 0xf0) == 0xb0 &&
+            (message.data1 == CC_ALL_NOTES_OFF || message.data1 == CC_ALL_SOUND_OFF)) return i;
+    }
+    return -1;
+}
+
+// Returns the number of channels that got both All Notes Off and All
+// Sound Off from the message index from, with nothing else after them
+static int channelsSilenced(MidiMonitor& out, size_t from)
+{
+    bool notesOff[16] = {}, soundOff[16] = {};
+    for (size_t i = from; i < out.messages.size(); i++) {
+        MidiMonitor::Message& message = out.messages[i];
+        if ((message.status & 0xf0) != 0xb0) return 0;
+        if (message.data1 == CC_ALL_NOTES_OFF) notesOff[message.status & 0x0f] = true;
+        if (message.data1 == CC_ALL_SOUND_OFF) soundOff[message.status & 0x0f] = true;
+    }
+    int count = 0;
+    for (int channel = 0; channel < 16; channel++) {
+        if (notesOff[channel] && soundOff[channel]) count++;
+    }
+    return count;
+}
+
+// Plays a pseudo-random sequence of notes (on any channel, with keys
+// left down), setting changes and time, then panics (by call or by
+// System Reset). Returns the notes left sounding after it (checking
+// that the panic ended with its CCs, on all channels).
+static int playThenPanic(int length, bool systemReset)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    MidiMonitor out;
+    out.keep = true;
+    ulong now = 1000;
+    for (int i = 0; i < length; i++) {
+        uint8_t op = randomByte(), value = randomByte();
+        int channel = op >> 4;
+        switch (op % 8) {
+        case 0: case 1: case 2:
+            Serial1.received.push_back((value & 0x80 ? 0x90 : 0x80) | channel);
+            Serial1.received.push_back(randomByte() & 0x7f);
+            Serial1.received.push_back(randomByte() & 0x7f);
+            break;
+        case 3: engine.SetEnabled(value & 1); break;
+        case 4: engine.SetHold(value & 1); break;
+        case 5:
+            switch (value % 6) {
+            case 0: engine.SetMode(randomByte() % ArpEngine::MODE_COUNT, channel); break;
+            case 1: engine.SetRange(randomByte() % (ArpEngine::MAX_RANGE + 1), channel); break;
+            case 2: engine.SetChords(randomByte() & 1); break;
+            case 3: engine.SetRatchet(ArpEngine::MIN_RATCHET + randomByte() % ArpEngine::MAX_RATCHET, channel); break;
+            case 4: engine.SetGate(randomByte() % (ArpEngine::MAX_GATE + 1)); break;
+            case 5: engine.SetPatternLength(ArpEngine::PATTERN_TRIGGER, randomByte() % 5); break;
+            }
+            break;
+        case 6: case 7: now += value % 50; break;
+        }
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+        out.read(Serial1.sent, now);
+    }
+
+    size_t panicAt = out.messages.size();
+    if (systemReset) {
+        Serial1.received.push_back(0xff);
+        mockSetMicros(++now * 1000ULL);
+        engine.Run(now);
+    }
+    else {
+        engine.Panic();
+    }
+    out.read(Serial1.sent, now);
+    int sounding = out.soundingCount();
+    int ccsAt = panicStart(out, panicAt);
+    if (ccsAt < 0 || channelsSilenced(out, ccsAt) != 16) return -1;
+
+    // and none after it, with keys still down
+    for (int i = 0; i < 500; i++) {
+        mockSetMicros(++now * 1000ULL);
+        engine.Run(now);
+    }
+    out.read(Serial1.sent, now);
+    return sounding + out.soundingCount();
+}
+
+void test_panic_ends_every_note(void)
+{
+    for (int run = 0; run < 150; run++) {
+        int sounding = playThenPanic(20 + run * 4, false);
+        TEST_ASSERT_EQUAL_MESSAGE(0, sounding, "note sounding after Panic()");
+    }
+}
+
+void test_system_reset_ends_every_note(void)
+{
+    for (int run = 0; run < 150; run++) {
+        int sounding = playThenPanic(20 + run * 4, true);
+        TEST_ASSERT_EQUAL_MESSAGE(0, sounding, "note sounding after System Reset");
+    }
+}
+
+// A note passed through, then a System Reset, in one Run()
+void test_reset_after_output_in_the_same_run(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    MidiMonitor out;
+    out.keep = true;
+    static const uint8_t input[] = { 0x91, 60, 100, 0xff };
+    Serial1.received.insert(Serial1.received.end(), input, input + sizeof(input));
+    engine.Run(0);
+    out.read(Serial1.sent);
+
+    TEST_ASSERT_EQUAL(0, out.soundingCount());
+    // the note, the reset (passed through), then the note's note-off
+    TEST_ASSERT_EQUAL_HEX8(0x91, out.messages[0].status);
+    TEST_ASSERT_EQUAL(60, out.messages[0].data1);
+    TEST_ASSERT_EQUAL_HEX8(0xff, out.messages[1].status);
+    TEST_ASSERT_EQUAL_HEX8(0x81, out.messages[2].status);
+    TEST_ASSERT_EQUAL(60, out.messages[2].data1);
+    TEST_ASSERT_EQUAL(3, panicStart(out, 0));
+    TEST_ASSERT_EQUAL(16, channelsSilenced(out, 3));
+}
+
+// An arpeggio step played, then a System Reset, in one Run()
+void test_reset_after_step_in_the_same_run(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.SetTempo(150); // (100 ms steps)
+    engine.SetEnabled(true);
+    MidiMonitor out;
+    out.keep = true;
+    static const uint8_t chord[] = { 0x90, 60, 100, 64, 100, 67, 100 };
+    Serial1.received.insert(Serial1.received.end(), chord, chord + sizeof(chord));
+    for (ulong now = 0; now < 100; now++) {
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+    }
+    out.read(Serial1.sent);
+    size_t stepAt = out.messages.size();
+
+    Serial1.received.push_back(0xff);
+    mockSetMicros(100000);
+    engine.Run(100); // (the second step's due)
+    out.read(Serial1.sent, 100);
+
+    TEST_ASSERT_EQUAL(0, out.soundingCount());
+    int ccsAt = panicStart(out, stepAt);
+    TEST_ASSERT_TRUE(ccsAt > (int)stepAt);
+    int stepNoteOns = 0;
+    for (int i = stepAt; i < ccsAt; i++) {
+        TEST_ASSERT_NOT_EQUAL(0xb0, out.messages[i].status & 0xf0); // (notes first)
+        if ((out.messages[i].status & 0xf0) == 0x90) stepNoteOns++;
+    }
+    TEST_ASSERT_EQUAL(1, stepNoteOns);
+    TEST_ASSERT_EQUAL(16, channelsSilenced(out, ccsAt));
+}
+
+// Keys settling into a chord (chords mode) when the panic comes: the
+// chord is forgotten, with no wake-up left for it, and nothing played
+// when it would have settled
+void test_panic_while_chord_settles(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.SetTempo(ArpEngine::MIN_TEMPO); // (500 ms steps)
+    engine.SetChords(true);
+    engine.SetEnabled(true);
+    MidiMonitor out;
+    out.keep = true;
+    ulong now;
+    for (now = 0; now < 100; now++) {
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+    }
+    static const uint8_t chord[] = { 0x90, 60, 100, 64, 100 };
+    Serial1.received.insert(Serial1.received.end(), chord, chord + sizeof(chord));
+    mockSetMicros(now * 1000ULL);
+    engine.Run(now);
+    TEST_ASSERT_EQUAL(now + ArpEngine::DEFAULT_CHORD_WINDOW_MS, engine.NextEventAt(now + 300));
+
+    engine.Panic();
+    TEST_ASSERT_EQUAL(now + 300, engine.NextEventAt(now + 300));
+    out.read(Serial1.sent, now);
+    size_t panicEnd = out.messages.size();
+    for (now++; now < 200; now++) {
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+    }
+    out.read(Serial1.sent, now);
+    TEST_ASSERT_EQUAL(panicEnd, out.messages.size());
+    TEST_ASSERT_EQUAL(0, out.soundingCount());
+}
+
+// A note tied into the next step when the panic comes: it's ended,
+// and the next arpeggio's notes (each tied over a step) each end
+// once, after their own tie and gate
+void test_panic_while_tied(void)
+{
+    static const ulong STEP_MS = 100; // (150 BPM)
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.SetTempo(150);
+    engine.SetGate(50);
+    engine.SetPatternStep(ArpEngine::PATTERN_TRIGGER, 0, ArpEngine::TRIGGER_PLAY);
+    engine.SetPatternStep(ArpEngine::PATTERN_TRIGGER, 1, ArpEngine::TRIGGER_TIE);
+    engine.SetPatternLength(ArpEngine::PATTERN_TRIGGER, 2);
+    engine.SetEnabled(true);
+    MidiMonitor out;
+    out.keep = true;
+    static const uint8_t key[] = { 0x90, 60, 100 };
+    Serial1.received.insert(Serial1.received.end(), key, key + sizeof(key));
+    ulong now;
+    for (now = 0; now < 3 * STEP_MS + STEP_MS / 2; now++) { // (into a tied step)
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+    }
+    out.read(Serial1.sent, now);
+    TEST_ASSERT_EQUAL(1, out.soundingCount());
+    engine.Panic();
+    out.read(Serial1.sent, now);
+    TEST_ASSERT_EQUAL(0, out.soundingCount());
+
+    static const uint8_t keyAgain[] = { 0x80, 60, 0, 0x90, 60, 100 };
+    Serial1.received.insert(Serial1.received.end(), keyAgain, keyAgain + sizeof(keyAgain));
+    size_t from = out.messages.size();
+    ulong end = now + 6 * STEP_MS;
+    for (; now < end; now++) {
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+        out.read(Serial1.sent, now);
+    }
+    int noteOns = 0;
+    ulong onAt = 0;
+    bool sounding = false;
+    for (size_t i = from; i < out.messages.size(); i++) {
+        MidiMonitor::Message& message = out.messages[i];
+        if ((message.status & 0xf0) == 0x90) {
+            onAt = message.time;
+            sounding = true;
+            noteOns++;
+        }
+        else if ((message.status & 0xf0) == 0x80) {
+            TEST_ASSERT_TRUE(sounding); // (no note-off without its note)
+            TEST_ASSERT_EQUAL(STEP_MS + STEP_MS / 2, message.time - onAt);
+            sounding = false;
+        }
+    }
+    TEST_ASSERT_EQUAL(3, noteOns);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_panic_ends_every_note);
+    RUN_TEST(test_system_reset_ends_every_note);
+    RUN_TEST(test_reset_after_output_in_the_same_run);
+    RUN_TEST(test_reset_after_step_in_the_same_run);
+    RUN_TEST(test_panic_while_chord_settles);
+    RUN_TEST(test_panic_while_tied);
+    return UNITY_END();
+}
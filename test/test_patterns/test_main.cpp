@@ -0,0 +1,188 @@
+// Pattern lanes: octave, velocity, gate and trigger values changing
+// the arpeggio step by step, each lane with its own length, so they go
+// around against each other (polymetrically). A single key is played,
+// so each step's note shows the lanes' values only. The lanes start
+// over with each new arpeggio, and can be set by SysEx.
+
+#include <vector>
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "MidiMonitor.h"
+#include "ArpEngine.h"
+
+static const ulong STEP_MS = 125; // (120 BPM, 1/16 notes)
+static const ulong GATE_MS = STEP_MS / 2;
+
+static MidiMonitor out;
+static ulong now;
+
+void setUp(void)
+{
+    Serial1.received.clear();
+    Serial1.sent.clear();
+    Serial2.received.clear();
+    out = MidiMonitor();
+    out.keep = true;
+    now = 0;
+}
+
+void tearDown(void) {}
+
+static void runUntil(ArpEngine& engine, ulong end)
+{
+    for (; now < end; now++) {
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+        out.read(Serial1.sent, now);
+    }
+}
+
+static void setPattern(ArpEngine& engine, int pattern, const int* values, int length)
+{
+    for (int step = 0; step < length; step++) engine.SetPatternStep(pattern, step, values[step]);
+    engine.SetPatternLength(pattern, length);
+}
+
+// Plays key 60 (velocity 100) from now, for the specified number of
+// steps, and returns the note-ons and note-offs
+static std::vector<MidiMonitor::Message> playKey(ArpEngine& engine, int steps)
+{
+    engine.SetTempo(120);
+    engine.SetGate(50);
+    engine.SetEnabled(true);
+    static const uint8_t key[] = { 0x90, 60, 100 };
+    Serial1.received.insert(Serial1.received.end(), key, key + sizeof(key));
+    size_t from = out.messages.size();
+    runUntil(engine, now + steps * STEP_MS);
+    return std::vector<MidiMonitor::Message>(out.messages.begin() + from, out.messages.end());
+}
+
+static std::vector<MidiMonitor::Message> noteOnsOf(const std::vector<MidiMonitor::Message>& messages)
+{
+    std::vector<MidiMonitor::Message> noteOns;
+    for (const MidiMonitor::Message& message : messages) {
+        if ((message.status & 0xf0) == 0x90) noteOns.push_back(message);
+    }
+    return noteOns;
+}
+
+// A 3-step octave lane against a 4-step velocity lane: the notes go
+// through all 12 combinations before repeating
+void test_polymetric_lanes(void)
+{
+    static const int octaves[] = { 0, 1, -1 };
+    static const int velocities[] = { 0, 10, -10, 20 };
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    setPattern(engine, ArpEngine::PATTERN_OCTAVE, octaves, 3);
+    setPattern(engine, ArpEngine::PATTERN_VELOCITY, velocities, 4);
+    std::vector<MidiMonitor::Message> noteOns = noteOnsOf(playKey(engine, 24));
+    TEST_ASSERT_EQUAL(24, (int)noteOns.size());
+    for (int step = 0; step < 24; step++) {
+        TEST_ASSERT_EQUAL(noteOns[0].time + step * STEP_MS, noteOns[step].time);
+        TEST_ASSERT_EQUAL(60 + 12 * octaves[step % 3], noteOns[step].data1);
+        TEST_ASSERT_EQUAL(100 + velocities[step % 4], noteOns[step].data2);
+    }
+}
+
+// A gate lane sets each step's note length (0: the gate setting)
+void test_gate_lane(void)
+{
+    static const int gates[] = { 25, 0, 100 };
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    setPattern(engine, ArpEngine::PATTERN_GATE, gates, 3);
+    std::vector<MidiMonitor::Message> messages = playKey(engine, 12);
+    ulong onAt = 0;
+    int step = 0;
+    for (MidiMonitor::Message& message : messages) {
+        if ((message.status & 0xf0) == 0x90) onAt = message.time;
+        else if ((message.status & 0xf0) == 0x80) {
+            ulong expected = gates[step % 3] == 0 ? GATE_MS : STEP_MS * gates[step % 3] / 100;
+            TEST_ASSERT_EQUAL(expected, message.time - onAt);
+            step++;
+        }
+    }
+    TEST_ASSERT_GREATER_OR_EQUAL(11, step);
+}
+
+// A trigger lane of play, tie, rest, play: the first note sounds on
+// through the tied step (ending after its gate), the rest is silent,
+// and the last step plays as usual
+void test_rests_and_ties(void)
+{
+    static const int triggers[] = {
+        ArpEngine::TRIGGER_PLAY, ArpEngine::TRIGGER_TIE, ArpEngine::TRIGGER_REST, ArpEngine::TRIGGER_PLAY,
+    };
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    setPattern(engine, ArpEngine::PATTERN_TRIGGER, triggers, 4);
+    std::vector<MidiMonitor::Message> messages = playKey(engine, 16);
+    std::vector<MidiMonitor::Message> noteOns = noteOnsOf(messages);
+    TEST_ASSERT_EQUAL(8, (int)noteOns.size());
+    ulong start = noteOns[0].time;
+    for (size_t i = 0; i < noteOns.size(); i++) {
+        ulong step = (i / 2) * 4 + (i % 2 ? 3 : 0);
+        TEST_ASSERT_EQUAL(start + step * STEP_MS, noteOns[i].time);
+    }
+    ulong onAt = 0;
+    for (MidiMonitor::Message& message : messages) {
+        if ((message.status & 0xf0) == 0x90) onAt = message.time;
+        else if ((message.status & 0xf0) == 0x80) {
+            bool tied = (onAt - start) / STEP_MS % 4 == 0;
+            TEST_ASSERT_EQUAL(tied ? STEP_MS + GATE_MS : GATE_MS, message.time - onAt);
+        }
+    }
+}
+
+// A new arpeggio starts the lanes over, from their first step
+void test_lanes_restart(void)
+{
+    static const int octaves[] = { 0, 1, 2 };
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    setPattern(engine, ArpEngine::PATTERN_OCTAVE, octaves, 3);
+    std::vector<MidiMonitor::Message> noteOns = noteOnsOf(playKey(engine, 5)); // (the lane on its 2nd step)
+    TEST_ASSERT_EQUAL(72, noteOns[4].data1);
+    static const uint8_t release[] = { 0x80, 60, 0 };
+    Serial1.received.insert(Serial1.received.end(), release, release + sizeof(release));
+    runUntil(engine, now + STEP_MS);
+
+    noteOns = noteOnsOf(playKey(engine, 3));
+    TEST_ASSERT_EQUAL(3, (int)noteOns.size());
+    for (int step = 0; step < 3; step++) TEST_ASSERT_EQUAL(60 + 12 * octaves[step], noteOns[step].data1);
+}
+
+// Set by SysEx (octave and velocity values offset by 40h), a lane
+// plays as set directly; a message whose length doesn't match its
+// step count is ignored
+void test_sysex_pattern(void)
+{
+    static const int octaves[] = { 0, 1, -1 };
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    static const uint8_t message[] = {
+        0xf0, ArpEngine::SYSEX_MANUFACTURER_ID, ArpEngine::SYSEX_DEVICE_ID, ArpEngine::SYSEX_PATTERN,
+        ArpEngine::PATTERN_OCTAVE, 3, 0x40, 0x41, 0x3f, 0xf7,
+    };
+    static const uint8_t wrongLength[] = {
+        0xf0, ArpEngine::SYSEX_MANUFACTURER_ID, ArpEngine::SYSEX_DEVICE_ID, ArpEngine::SYSEX_PATTERN,
+        ArpEngine::PATTERN_VELOCITY, 4, 0x7f, 0x7f, 0x7f, 0xf7,
+    };
+    Serial1.received.insert(Serial1.received.end(), message, message + sizeof(message));
+    Serial1.received.insert(Serial1.received.end(), wrongLength, wrongLength + sizeof(wrongLength));
+    runUntil(engine, 2);
+    std::vector<MidiMonitor::Message> noteOns = noteOnsOf(playKey(engine, 6));
+    TEST_ASSERT_EQUAL(6, (int)noteOns.size());
+    for (int step = 0; step < 6; step++) {
+        TEST_ASSERT_EQUAL(60 + 12 * octaves[step % 3], noteOns[step].data1);
+        TEST_ASSERT_EQUAL(100, noteOns[step].data2);
+    }
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_polymetric_lanes);
+    RUN_TEST(test_gate_lane);
+    RUN_TEST(test_rests_and_ties);
+    RUN_TEST(test_lanes_restart);
+    RUN_TEST(test_sysex_pattern);
+    return UNITY_END();
+}
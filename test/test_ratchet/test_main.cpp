@@ -0,0 +1,214 @@
+// Ratchets: each step split into evenly spaced repeats, each softer
+// by the decay, sent from the EventQueue. The queue on its own keeps
+// its events in time order (note-offs first, across the time
+// wrapping around), and a full queue turns events away without
+// losing any it holds. At the top tempo, with every lane ratcheting
+// 8 times (the queue near full), every repeat is sent on time, and
+// none is left sounding.
+
+#include <stdlib.h>
+#include <vector>
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "MidiMonitor.h"
+#include "EventQueue.h"
+#include "ArpEngine.h"
+
+static MidiMonitor out;
+static ulong now;
+static uint32_t seed;
+
+static uint32_t randomNumber()
+{
+    seed = seed * 1664525 + 1013904223;
+    return seed >> 8;
+}
+
+void setUp(void)
+{
+    Serial1.received.clear();
+    Serial1.sent.clear();
+    Serial2.received.clear();
+    out = MidiMonitor();
+    out.keep = true;
+    now = 0;
+    seed = 1;
+}
+
+void tearDown(void) {}
+
+static void runUntil(ArpEngine& engine, ulong end)
+{
+    for (; now < end; now++) {
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+        out.read(Serial1.sent, now);
+    }
+}
+
+static void sendChord(int channel, int velocity)
+{
+    static const int notes[] = { 60, 64, 67 };
+    for (int note : notes) {
+        Serial1.received.push_back(0x90 | channel);
+        Serial1.received.push_back(note);
+        Serial1.received.push_back(velocity);
+    }
+}
+
+static void releaseChord(int channel)
+{
+    static const int notes[] = { 60, 64, 67 };
+    for (int note : notes) {
+        Serial1.received.push_back(0x80 | channel);
+        Serial1.received.push_back(note);
+        Serial1.received.push_back(0);
+    }
+}
+
+// Events pushed in random order (times wrapping around) come out in
+// time order, note-offs ahead of note-ons due at the same time, and
+// only once due
+void test_queue_order(void)
+{
+    static const unsigned long BASE = 0xffffff00UL; // (wraps after 256)
+    EventQueue queue;
+    for (unsigned int i = 0; i < EventQueue::SIZE; i++) {
+        unsigned long time = BASE + randomNumber() % 512;
+        TEST_ASSERT_TRUE(queue.push({ time, (uint8_t)(i % 16), 60, (uint8_t)(randomNumber() % 2 ? 100 : 0) }));
+    }
+    EventQueue::Event event, last = {};
+    TEST_ASSERT_FALSE(queue.pop(BASE - 1, event));
+    unsigned int popped = 0;
+    for (unsigned long time = BASE; popped < EventQueue::SIZE; time++) {
+        while (queue.pop(time, event)) {
+            TEST_ASSERT_TRUE((long)(time - event.time) >= 0);
+            if (popped > 0) {
+                long order = (long)(event.time - last.time);
+                TEST_ASSERT_TRUE(order >= 0);
+                if (order == 0) TEST_ASSERT_FALSE(last.velocity > 0 && event.velocity == 0);
+            }
+            last = event;
+            popped++;
+        }
+        TEST_ASSERT_TRUE(time - BASE < 512);
+    }
+    TEST_ASSERT_EQUAL(0, queue.count());
+}
+
+// Full, the queue turns events away (even earlier ones), and still
+// gives out all it holds, in order; cancelling a channel makes room
+void test_queue_overflow(void)
+{
+    EventQueue queue;
+    for (unsigned int i = 0; i < EventQueue::SIZE; i++) {
+        TEST_ASSERT_TRUE(queue.push({ 1000 + i, (uint8_t)(i % 16), 60, 100 }));
+    }
+    TEST_ASSERT_FALSE(queue.push({ 0, 0, 61, 100 }));
+    TEST_ASSERT_FALSE(queue.push({ 5000, 0, 61, 0 }));
+    TEST_ASSERT_EQUAL(EventQueue::SIZE, queue.count());
+
+    EventQueue::Event event;
+    TEST_ASSERT_TRUE(queue.peek(event));
+    TEST_ASSERT_EQUAL(1000, event.time);
+    TEST_ASSERT_TRUE(queue.cancel(3));
+    TEST_ASSERT_EQUAL(EventQueue::SIZE - EventQueue::SIZE / 16, queue.count());
+    TEST_ASSERT_TRUE(queue.push({ 999, 3, 61, 100 }));
+    TEST_ASSERT_TRUE(queue.pop(999, event));
+    TEST_ASSERT_EQUAL(999, event.time);
+    unsigned long last = 0;
+    unsigned int popped = 0;
+    while (queue.pop(2000, event)) {
+        TEST_ASSERT_TRUE(event.time > last);
+        TEST_ASSERT_NOT_EQUAL(3, event.channel);
+        last = event.time;
+        popped++;
+    }
+    TEST_ASSERT_EQUAL(EventQueue::SIZE - EventQueue::SIZE / 16, popped);
+}
+
+// Four repeats a step, a quarter of a step apart, each with 70% of
+// the last one's velocity, each ending after the gate
+void test_spacing_and_decay(void)
+{
+    static const ulong STEP_MS = 125; // (120 BPM)
+    static const ulong SPACING_MS = STEP_MS / 4;
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.SetTempo(120);
+    engine.SetGate(50);
+    engine.SetRatchet(4);
+    engine.SetRatchetDecay(70);
+    engine.SetEnabled(true);
+    sendChord(0, 100);
+    runUntil(engine, 8 * STEP_MS);
+
+    std::vector<MidiMonitor::Message> noteOns;
+    ulong onAt[128] = {};
+    int offs = 0;
+    for (MidiMonitor::Message& message : out.messages) {
+        if ((message.status & 0xf0) == 0x90) {
+            noteOns.push_back(message);
+            onAt[message.data1] = message.time;
+        }
+        else if ((message.status & 0xf0) == 0x80) {
+            TEST_ASSERT_EQUAL(SPACING_MS / 2, message.time - onAt[message.data1]);
+            offs++;
+        }
+    }
+    TEST_ASSERT_EQUAL(8 * 4, (int)noteOns.size());
+    TEST_ASSERT_GREATER_OR_EQUAL(8 * 4 - 1, offs);
+    ulong firstStep = noteOns[0].time;
+    for (size_t i = 0; i < noteOns.size(); i++) {
+        int step = i / 4, repeat = i % 4;
+        TEST_ASSERT_EQUAL(firstStep + step * STEP_MS + repeat * SPACING_MS, noteOns[i].time);
+        TEST_ASSERT_EQUAL(noteOns[i - repeat].data1, noteOns[i].data1); // (the step's note)
+        int velocity = 100;
+        for (int r = 0; r < repeat; r++) velocity = velocity * 70 / 100;
+        TEST_ASSERT_EQUAL(velocity, noteOns[i].data2);
+    }
+}
+
+// Every lane ratcheting 8 times at 300 BPM, at a full gate: 15 events
+// queued on each lane each step (240 of 256). Each lane gets all its
+// repeats, evenly spaced, and none is left sounding after the keys
+// are let go
+void test_burst_at_max_tempo(void)
+{
+    static const ulong STEP_MS = 50; // (300 BPM)
+    static const int STEPS = 40;
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.SetTempo(ArpEngine::MAX_TEMPO);
+    engine.SetGate(100);
+    engine.SetRatchet(ArpEngine::MAX_RATCHET);
+    engine.SetRatchetDecay(100);
+    engine.SetEnabled(true);
+    for (int channel = 0; channel < 16; channel++) sendChord(channel, 100);
+    runUntil(engine, STEPS * STEP_MS);
+    for (int channel = 0; channel < 16; channel++) releaseChord(channel);
+    runUntil(engine, now + 2 * STEP_MS);
+    TEST_ASSERT_EQUAL(0, out.soundingCount());
+    TEST_ASSERT_EQUAL(0, out.errors);
+
+    for (int channel = 0; channel < 16; channel++) {
+        std::vector<ulong> times;
+        for (MidiMonitor::Message& message : out.messages) {
+            if (message.status == (0x90 | channel)) times.push_back(message.time);
+        }
+        TEST_ASSERT_GREATER_OR_EQUAL((STEPS - 1) * ArpEngine::MAX_RATCHET, (int)times.size());
+        for (size_t i = 1; i < times.size(); i++) {
+            if (i % ArpEngine::MAX_RATCHET == 0) TEST_ASSERT_EQUAL(STEP_MS, times[i] - times[i - ArpEngine::MAX_RATCHET]);
+            else TEST_ASSERT_EQUAL(STEP_MS / ArpEngine::MAX_RATCHET, times[i] - times[i - 1]);
+        }
+    }
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_queue_order);
+    RUN_TEST(test_queue_overflow);
+    RUN_TEST(test_spacing_and_decay);
+    RUN_TEST(test_burst_at_max_tempo);
+    return UNITY_END();
+}
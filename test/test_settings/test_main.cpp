@@ -0,0 +1,251 @@
+// Settings: flash log round trip, compaction into the other sector,
+// and recovery from a power loss at any point while writing
+
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "Settings.h"
+
+static const unsigned int SECTOR_SIZE = MOCK_FLASH_SECTOR_SIZE;
+
+static Settings::Values valuesWithMode(uint8_t mode)
+{
+    Settings::Values values;
+    memset(&values, 0, sizeof(values));
+    values.sync = true;
+    values.mode = mode;
+    values.range = 2;
+    values.chords = true;
+    return values;
+}
+
+static void presetData(uint8_t* data, int index, int version)
+{
+    for (unsigned int i = 0; i < Settings::PRESET_SIZE; i++) data[i] = index * 16 + version + i;
+}
+
+// Saves (set and written right away)
+static void save(Settings& settings, uint8_t mode)
+{
+    settings.set(valuesWithMode(mode), 0);
+    settings.run(0, true, true);
+}
+
+static bool restore(Settings::Values& values)
+{
+    Settings settings(0);
+    return settings.load(values);
+}
+
+void setUp()
+{
+    mockFlashPowerLossAfter(-1);
+    mockFlashErase();
+}
+
+void tearDown() {}
+
+void test_nothing_stored()
+{
+    Settings::Values values;
+    TEST_ASSERT_FALSE(restore(values));
+}
+
+void test_values_and_presets_round_trip()
+{
+    Settings settings(0);
+    Settings::Values values;
+    TEST_ASSERT_FALSE(settings.load(values));
+    uint8_t data[Settings::PRESET_SIZE];
+    presetData(data, 3, 1);
+    settings.setPreset(3, data, 0);
+    save(settings, 2);
+
+    Settings restored(0);
+    TEST_ASSERT_TRUE(restored.load(values));
+    TEST_ASSERT_EQUAL(2, values.mode);
+    TEST_ASSERT_TRUE(values.chords);
+    uint8_t loaded[Settings::PRESET_SIZE];
+    TEST_ASSERT_TRUE(restored.loadPreset(3, loaded));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data, loaded, Settings::PRESET_SIZE);
+    TEST_ASSERT_FALSE(restored.loadPreset(4, loaded));
+}
+
+void test_waits_until_idle_and_delay()
+{
+    Settings settings(1000);
+    settings.set(valuesWithMode(0), 0);
+    settings.run(1000, true, true); // (starts a log)
+    settings.set(valuesWithMode(1), 5000);
+    settings.run(5500, true, true); // (too soon)
+    settings.run(7000, false, false); // (not idle)
+    Settings::Values values;
+    TEST_ASSERT_TRUE(restore(values));
+    TEST_ASSERT_EQUAL(0, values.mode);
+    settings.run(7000, true, false);
+    TEST_ASSERT_TRUE(restore(values));
+    TEST_ASSERT_EQUAL(1, values.mode);
+}
+
+// Many saves: the log fills up, and is compacted into the other
+// sector (only while stopped)
+void test_compacts_into_other_sector()
+{
+    Settings settings(0);
+    uint8_t data[Settings::PRESET_SIZE];
+    for (int index = 0; index < (int)Settings::PRESET_COUNT; index++) {
+        presetData(data, index, 1);
+        settings.setPreset(index, data, 0);
+    }
+    int mode = 0;
+    for (int i = 0; i < 600; i++) save(settings, mode++ % 4);
+
+    // full, and not stopped: held back
+    for (;;) {
+        mockFlashPowerLossAfter(-1);
+        settings.set(valuesWithMode(mode++ % 4), 0);
+        settings.run(0, true, false);
+        if (mockFlashBytesWritten() == 0) break;
+    }
+    Settings::Values values;
+    TEST_ASSERT_TRUE(restore(values));
+    TEST_ASSERT_NOT_EQUAL((mode - 1) % 4, values.mode);
+
+    settings.run(0, true, true);
+    TEST_ASSERT_TRUE(restore(values));
+    TEST_ASSERT_EQUAL((mode - 1) % 4, values.mode);
+    Settings restored(0);
+    restored.load(values);
+    for (int index = 0; index < (int)Settings::PRESET_COUNT; index++) {
+        uint8_t loaded[Settings::PRESET_SIZE];
+        presetData(data, index, 1);
+        TEST_ASSERT_TRUE(restored.loadPreset(index, loaded));
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(data, loaded, Settings::PRESET_SIZE);
+    }
+}
+
+// A power loss at every point of a save that compacts the log:
+// after it, the old or the new values and presets are restored
+// (never none), and saving works again
+void test_power_loss_while_compacting()
+{
+    // A full log, after a compaction or two
+    Settings settings(0);
+    uint8_t data[Settings::PRESET_SIZE];
+    for (int index = 0; index < (int)Settings::PRESET_COUNT; index++) {
+        presetData(data, index, 1);
+        settings.setPreset(index, data, 0);
+    }
+    int count = 0;
+    for (int i = 0; i < 300; i++) save(settings, count++ % 3);
+    for (;;) {
+        mockFlashPowerLossAfter(-1);
+        settings.set(valuesWithMode(count++ % 3), 0);
+        settings.run(0, true, false);
+        if (mockFlashBytesWritten() == 0) break; // (full)
+    }
+    Settings::Values values;
+    Settings full(0);
+    TEST_ASSERT_TRUE(full.load(values));
+    uint8_t oldMode = values.mode;
+    uint8_t snapshot[2][SECTOR_SIZE];
+    memcpy(snapshot[0], mockFlashSector(0), SECTOR_SIZE);
+    memcpy(snapshot[1], mockFlashSector(1), SECTOR_SIZE);
+
+    // The save (new values and a changed preset), cut short at each point
+    long total = -1;
+    for (long cut = 0; total < 0 || cut <= total; cut++) {
+        memcpy(mockFlashSector(0), snapshot[0], SECTOR_SIZE);
+        memcpy(mockFlashSector(1), snapshot[1], SECTOR_SIZE);
+        Settings saving(0);
+        saving.load(values);
+        presetData(data, 5, 2);
+        saving.setPreset(5, data, 0);
+        saving.set(valuesWithMode(3), 0);
+        mockFlashPowerLossAfter(total < 0 ? -1 : cut);
+        saving.run(0, true, true);
+        if (total < 0) {
+            total = mockFlashBytesWritten(); // (first pass: not cut, just measured)
+            TEST_ASSERT_GREATER_THAN(SECTOR_SIZE, total);
+            cut = -1;
+            continue;
+        }
+        mockFlashPowerLossAfter(-1);
+
+        Settings restored(0);
+        TEST_ASSERT_TRUE_MESSAGE(restored.load(values), "values lost");
+        bool saved = values.mode == 3;
+        TEST_ASSERT_TRUE_MESSAGE(saved || values.mode == oldMode, "values corrupted");
+        uint8_t loaded[Settings::PRESET_SIZE];
+        for (int index = 0; index < (int)Settings::PRESET_COUNT; index++) {
+            TEST_ASSERT_TRUE_MESSAGE(restored.loadPreset(index, loaded), "preset lost");
+            presetData(data, index, index == 5 && saved ? 2 : 1);
+            TEST_ASSERT_EQUAL_UINT8_ARRAY_MESSAGE(data, loaded, Settings::PRESET_SIZE, "preset corrupted");
+        }
+
+        // (and it can be saved again)
+        restored.set(valuesWithMode(0), 0);
+        restored.run(0, true, true);
+        TEST_ASSERT_TRUE(restore(values));
+        TEST_ASSERT_EQUAL_MESSAGE(0, values.mode, "not saved after recovery");
+    }
+}
+
+// A record torn by a power loss is skipped (the one before wins)
+void test_torn_record_skipped()
+{
+    Settings settings(0);
+    save(settings, 1); // (compacts: starts a log)
+    save(settings, 2);
+    for (long cut = 1; cut < 16; cut++) {
+        mockFlashPowerLossAfter(cut);
+        save(settings, 3);
+        mockFlashPowerLossAfter(-1);
+        Settings::Values values;
+        TEST_ASSERT_TRUE(restore(values));
+        TEST_ASSERT_EQUAL(2, values.mode);
+        Settings reloaded(0); // (and the next one goes after it)
+        reloaded.load(values);
+        save(reloaded, 2);
+        TEST_ASSERT_TRUE(restore(values));
+        TEST_ASSERT_EQUAL(2, values.mode);
+        settings.load(values);
+    }
+}
+
+// A log written by older firmware (in the EEPROM sector, without
+// a header) is read, and moved into a new log on the next save
+void test_reads_older_log()
+{
+    uint8_t record[16] = { 0xa5, 1, 1, 0, 1, 2, 3, 1, 0 };
+    uint8_t sum = 0;
+    for (int i = 0; i < 15; i++) sum += record[i];
+    record[15] = -sum;
+    memcpy(mockFlashSector(1), record, sizeof(record));
+    memcpy(mockFlashSector(1) + 16, record, sizeof(record));
+
+    Settings settings(0);
+    Settings::Values values;
+    TEST_ASSERT_TRUE(settings.load(values));
+    TEST_ASSERT_EQUAL(2, values.mode);
+    TEST_ASSERT_EQUAL(3, values.range);
+    TEST_ASSERT_TRUE(values.hold);
+
+    save(settings, 0);
+    TEST_ASSERT_TRUE(restore(values));
+    TEST_ASSERT_EQUAL(0, values.mode);
+    TEST_ASSERT_EQUAL(0xa7, mockFlashSector(0)[0]); // (new log, with a header)
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_nothing_stored);
+    RUN_TEST(test_values_and_presets_round_trip);
+    RUN_TEST(test_waits_until_idle_and_delay);
+    RUN_TEST(test_compacts_into_other_sector);
+    RUN_TEST(test_power_loss_while_compacting);
+    RUN_TEST(test_torn_record_skipped);
+    RUN_TEST(test_reads_older_log);
+    return UNITY_END();
+}
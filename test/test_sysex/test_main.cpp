@@ -0,0 +1,239 @@
+// SysEx configuration: parameter sets sent to MIDI In (F0 7D 41 ...
+// F7) are parsed and applied, and can be read back; sets with a bad
+// checksum or out-of-range values are ignored, and other SysEx passes
+// through. A set received while the arpeggio plays takes effect as a
+// whole on its next step, the hold and enabled modes included, so the
+// steps stay on their grid.
+
+#include <vector>
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "MidiMonitor.h"
+#include "ArpEngine.h"
+
+static const ulong STEP_MS = 125; // (120 BPM, 1/16 notes)
+
+static MidiMonitor out;
+static std::vector<uint8_t> sent; // (the bytes, SysEx included)
+static ulong now;
+
+void setUp(void)
+{
+    Serial1.received.clear();
+    Serial1.sent.clear();
+    Serial2.received.clear();
+    out = MidiMonitor();
+    out.keep = true;
+    sent.clear();
+    now = 0;
+}
+
+void tearDown(void) {}
+
+static void runUntil(ArpEngine& engine, ulong end)
+{
+    for (; now < end; now++) {
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+        sent.insert(sent.end(), Serial1.sent.begin(), Serial1.sent.end());
+        out.read(Serial1.sent, now);
+    }
+}
+
+static ArpEngine::Parameters currentParameters(ArpEngine& engine)
+{
+    ArpEngine::Parameters parameters;
+    engine.GetParameters(parameters);
+    return parameters;
+}
+
+// Sends a message with the command and data, and its checksum (made
+// wrong if so specified)
+static void sendSysEx(uint8_t command, const uint8_t* data, int length, bool badChecksum = false)
+{
+    uint8_t sum = 0;
+    const uint8_t header[] = { 0xf0, ArpEngine::SYSEX_MANUFACTURER_ID, ArpEngine::SYSEX_DEVICE_ID, command };
+    Serial1.received.insert(Serial1.received.end(), header, header + sizeof(header));
+    for (int i = 0; i < length; i++) {
+        Serial1.received.push_back(data[i]);
+        sum += data[i];
+    }
+    Serial1.received.push_back((-sum + (badChecksum ? 1 : 0)) & 0x7f);
+    Serial1.received.push_back(0xf7);
+}
+
+static void sendParameters(const ArpEngine::Parameters& parameters, bool badChecksum = false)
+{
+    uint8_t data[ArpEngine::PARAMETER_BYTES];
+    ArpEngine::EncodeParameters(parameters, data);
+    sendSysEx(ArpEngine::SYSEX_PARAMETERS, data, sizeof(data), badChecksum);
+}
+
+static void assertParametersEqual(const ArpEngine::Parameters& expected, const ArpEngine::Parameters& actual)
+{
+    uint8_t expectedData[ArpEngine::PARAMETER_BYTES], actualData[ArpEngine::PARAMETER_BYTES];
+    ArpEngine::EncodeParameters(expected, expectedData);
+    ArpEngine::EncodeParameters(actual, actualData);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expectedData, actualData, ArpEngine::PARAMETER_BYTES);
+}
+
+// The note-on times from the message index from
+static std::vector<ulong> noteOnTimesFrom(size_t from)
+{
+    std::vector<ulong> times;
+    for (size_t i = from; i < out.messages.size(); i++) {
+        if ((out.messages[i].status & 0xf0) == 0x90) times.push_back(out.messages[i].time);
+    }
+    return times;
+}
+
+static void startArpeggio(ArpEngine& engine)
+{
+    engine.SetTempo(120);
+    engine.SetGate(50);
+    engine.SetEnabled(true);
+    static const uint8_t chord[] = { 0x90, 60, 100, 64, 100, 67, 100 };
+    Serial1.received.insert(Serial1.received.end(), chord, chord + sizeof(chord));
+}
+
+// A set received while stopped is applied right away (on the pass
+// after the one that reads it), and read back as sent
+void test_parameters_set_and_requested(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    runUntil(engine, 10);
+    ArpEngine::Parameters parameters = currentParameters(engine);
+    parameters.mode = ArpEngine::MODE_DOWN;
+    parameters.range = 2;
+    parameters.tempo = 173; // (two 7-bit bytes)
+    parameters.gate = 30;
+    parameters.swing = 60;
+    parameters.ratchet = 3;
+    parameters.hold = true;
+    sendParameters(parameters);
+    runUntil(engine, 12);
+    assertParametersEqual(parameters, currentParameters(engine));
+    TEST_ASSERT_EQUAL(0, (int)sent.size()); // (not passed through)
+
+    sendSysEx(ArpEngine::SYSEX_REQUEST_PARAMETERS, NULL, 0);
+    runUntil(engine, 13);
+    uint8_t data[ArpEngine::PARAMETER_BYTES];
+    ArpEngine::EncodeParameters(parameters, data);
+    uint8_t sum = 0;
+    for (int i = 0; i < ArpEngine::PARAMETER_BYTES; i++) sum += data[i];
+    std::vector<uint8_t> expected = { 0xf0, ArpEngine::SYSEX_MANUFACTURER_ID, ArpEngine::SYSEX_DEVICE_ID,
+        ArpEngine::SYSEX_PARAMETERS };
+    expected.insert(expected.end(), data, data + sizeof(data));
+    expected.push_back(-sum & 0x7f);
+    expected.push_back(0xf7);
+    TEST_ASSERT_EQUAL((int)expected.size(), (int)sent.size());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), sent.data(), expected.size());
+}
+
+// Sets with a bad checksum, out-of-range values or the wrong length
+// change nothing, and SysEx that isn't ours is passed through as it is
+void test_bad_messages_ignored(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    runUntil(engine, 10);
+    ArpEngine::Parameters before = currentParameters(engine);
+    ArpEngine::Parameters parameters = before;
+    parameters.mode = ArpEngine::MODE_RANDOM;
+    parameters.gate = 20;
+
+    sendParameters(parameters, true);
+    runUntil(engine, 20);
+    assertParametersEqual(before, currentParameters(engine));
+
+    uint8_t data[ArpEngine::PARAMETER_BYTES];
+    ArpEngine::EncodeParameters(parameters, data);
+    data[1] = ArpEngine::MODE_COUNT; // (out of range, with a good checksum)
+    sendSysEx(ArpEngine::SYSEX_PARAMETERS, data, sizeof(data));
+    sendSysEx(ArpEngine::SYSEX_PARAMETERS, data + 1, sizeof(data) - 1); // (short)
+    runUntil(engine, 30);
+    assertParametersEqual(before, currentParameters(engine));
+    TEST_ASSERT_EQUAL(0, (int)sent.size());
+
+    static const uint8_t other[] = { 0xf0, 0x7e, 0x7f, 0x06, 0x01, 0xf7 }; // (identity request)
+    Serial1.received.insert(Serial1.received.end(), other, other + sizeof(other));
+    runUntil(engine, 31);
+    TEST_ASSERT_EQUAL((int)sizeof(other), (int)sent.size());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(other, sent.data(), sizeof(other));
+
+    // (and a good one still works after them)
+    sendParameters(parameters);
+    runUntil(engine, 33);
+    assertParametersEqual(parameters, currentParameters(engine));
+}
+
+// Received mid-step, a set (hold on, a new mode and gate) waits for
+// the next step, and then takes effect all at once: the steps go on on
+// the same grid
+void test_applied_at_the_step(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startArpeggio(engine);
+    runUntil(engine, 1010); // (into a step)
+    std::vector<ulong> steps = noteOnTimesFrom(0);
+    TEST_ASSERT_GREATER_OR_EQUAL(7, (int)steps.size());
+    ulong firstStep = steps[0];
+    ulong nextStep = steps.back() + STEP_MS;
+    runUntil(engine, nextStep - STEP_MS / 2); // (mid-step)
+
+    ArpEngine::Parameters before = currentParameters(engine);
+    ArpEngine::Parameters parameters = before;
+    parameters.hold = true;
+    parameters.mode = ArpEngine::MODE_DOWN;
+    parameters.gate = 80;
+    sendParameters(parameters);
+    runUntil(engine, nextStep);
+    assertParametersEqual(before, currentParameters(engine)); // (none yet: hold neither)
+
+    size_t appliedFrom = out.messages.size();
+    runUntil(engine, nextStep + 1);
+    assertParametersEqual(parameters, currentParameters(engine));
+    runUntil(engine, nextStep + 8 * STEP_MS);
+    std::vector<ulong> after = noteOnTimesFrom(appliedFrom);
+    TEST_ASSERT_EQUAL(8, (int)after.size());
+    for (size_t i = 0; i < after.size(); i++) {
+        TEST_ASSERT_EQUAL(0, (int)((after[i] - firstStep) % STEP_MS));
+    }
+    TEST_ASSERT_EQUAL(nextStep, after[0]);
+}
+
+// Turning the arpeggio off by SysEx also waits for the next step: the
+// chord then sounds from it, not from when the message came in
+void test_disabled_at_the_step(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startArpeggio(engine);
+    runUntil(engine, 1010); // (into a step)
+    ulong nextStep = noteOnTimesFrom(0).back() + STEP_MS;
+    runUntil(engine, nextStep - STEP_MS / 2);
+
+    ArpEngine::Parameters parameters = currentParameters(engine);
+    parameters.enabled = false;
+    sendParameters(parameters);
+    size_t sentFrom = out.messages.size();
+    runUntil(engine, nextStep);
+    TEST_ASSERT_TRUE(currentParameters(engine).enabled);
+    TEST_ASSERT_EQUAL(0, (int)noteOnTimesFrom(sentFrom).size());
+
+    runUntil(engine, nextStep + 2 * STEP_MS);
+    TEST_ASSERT_FALSE(currentParameters(engine).enabled);
+    std::vector<ulong> chord = noteOnTimesFrom(sentFrom);
+    TEST_ASSERT_EQUAL(3, (int)chord.size());
+    for (size_t i = 0; i < chord.size(); i++) TEST_ASSERT_EQUAL(nextStep, chord[i]);
+    TEST_ASSERT_EQUAL(3, out.soundingCount());
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_parameters_set_and_requested);
+    RUN_TEST(test_bad_messages_ignored);
+    RUN_TEST(test_applied_at_the_step);
+    RUN_TEST(test_disabled_at_the_step);
+    return UNITY_END();
+}
@@ -0,0 +1,282 @@
+// Output timing: every note-on and note-off the engine sends is
+// compared with the ideal musical grid, sweeping tempo (or note
+// division, in MIDI sync mode), gate, mode and range, with the
+// internal tempo, a steady MIDI clock and a jittery one, and then
+// swing and groove, whose steps should land at their offsets from
+// the grid (as in the templates below). Errors are collected per
+// sync source (mean, p99 and max, printed as "timing,..." lines),
+// and the test fails when they're over the limits below.
+
+#include <math.h>
+#include <stdio.h>
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "MidiMonitor.h"
+#include "TimingStats.h"
+#include "ArpEngine.h"
+
+static const int STEPS = 16; // (played per setting)
+static const int JITTER_MS = 2; // jittery clock: each pulse up to this early or late
+
+// Limits (ms). Run() is called every ms, so with the internal
+// tempo, events should be on time, to the ms (the gate length is
+// rounded down to it). With a MIDI clock, an event between pulses
+// is placed by the measured clock period, and a jittery clock moves
+// the pulses (notes on them), and the period measured from them.
+static const int INTERNAL_MEAN_MS = 1, INTERNAL_P99_MS = 1, INTERNAL_MAX_MS = 1;
+static const int CLOCK_MEAN_MS = 1, CLOCK_P99_MS = 2, CLOCK_MAX_MS = 2;
+static const int JITTER_MEAN_MS = JITTER_MS, JITTER_P99_MS = JITTER_MS + 2, JITTER_MAX_MS = JITTER_MS + 3;
+
+static const int SOURCE_INTERNAL = 0;
+static const int SOURCE_CLOCK = 1;
+static const int SOURCE_JITTERY_CLOCK = 2;
+
+// Note division (in MIDI sync mode, set by the tempo), in pulses
+// (24 per 1/4 note), 1/1 to 1/64 triplet
+static const double DIVISION_PULSES[] = {
+    96, 72, 48, 36, 32, 24, 18, 16, 12, 9, 8, 6, 4.8, 4.5, 4, 3, 2.4, 2, 1.5, 1,
+};
+
+// Groove templates' timing (% of a step), as in ArpEngine::UpdateGroove
+static const int GROOVE_TIMING[ArpEngine::GROOVE_COUNT][ArpEngine::GROOVE_STEPS] = {
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 6, 2, 10, 0, 6, 2, 10, 0, 6, 2, 10, 0, 6, 2, 10 },
+    { 0, 3, -2, 4, -3, 1, 2, -4, 1, -2, 3, 0, -3, 2, -1, 4 },
+};
+
+static uint32_t seed = 1;
+
+static int randomJitter()
+{
+    seed = seed * 1664525 + 1013904223;
+    return (int)((seed >> 16) % (2 * JITTER_MS + 1)) - JITTER_MS;
+}
+
+struct Errors
+{
+    long total;
+    int count;
+};
+
+// Offset of the step (numbered from the grid's start) from the grid,
+// in % of a step: the groove's, and every other step's swing
+static int grooveOffset(int swing, int groove, long step)
+{
+    int percent = GROOVE_TIMING[groove][step % ArpEngine::GROOVE_STEPS];
+    if (step & 1) percent += (swing - ArpEngine::MIN_SWING) * 2;
+    return constrain(percent, -45, 45);
+}
+
+// Time of the step, from the grid's start
+static double grooveStepAt(double start, double step, int swing, int groove, long n)
+{
+    return start + n * step + step * grooveOffset(swing, groove, n) / 100;
+}
+
+// The step nearest to the time (its offset taken into account: a
+// swung step can be closer to the next one on the grid)
+static long nearestStep(double time, double start, double step, int swing, int groove)
+{
+    long n = lround((time - start) / step);
+    for (long other = n - 1; other <= n + 1; other += 2) {
+        if (other < 0) continue;
+        if (fabs(time - grooveStepAt(start, step, swing, groove, other)) <
+            fabs(time - grooveStepAt(start, step, swing, groove, n))) n = other;
+    }
+    return n;
+}
+
+// Plays a chord with the specified settings, and records each event's
+// error (vs. the grid, moved by the swing and groove) in on and off.
+// Returns the number of notes played.
+static int play(int source, int tempo, int clockTempo, int gate, int mode, int range,
+    int swing, int groove, TimingStats& on, TimingStats& off, Errors& errors)
+{
+    Serial1.received.clear();
+    Serial1.sent.clear();
+    Serial2.received.clear();
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.SetTempo(tempo);
+    engine.SetGate(gate);
+    engine.SetMode(mode);
+    engine.SetRange(range);
+    engine.SetSwing(swing);
+    engine.SetGroove(groove);
+    engine.SetMidiSync(source != SOURCE_INTERNAL);
+    engine.SetEnabled(true);
+
+    // The grid: steps from the first note (internal tempo: the
+    // tempo's step length, to the ms), or from the first clock pulse
+    double step, start, pulse = 0;
+    ulong clockAt = 1500; // (Start, and the first pulse)
+    if (source == SOURCE_INTERNAL) {
+        step = (60000 / 4) / tempo;
+        start = -1; // (first note)
+    }
+    else {
+        int division = (tempo - ArpEngine::MIN_TEMPO) * 20 / (ArpEngine::MAX_TEMPO - ArpEngine::MIN_TEMPO);
+        pulse = 60000.0 / clockTempo / 24;
+        step = DIVISION_PULSES[constrain(division, 0, 19)] * pulse;
+        start = clockAt;
+    }
+    double gateLength = step * gate / 100;
+
+    MidiMonitor out;
+    out.keep = true;
+    // (the clock runs from a beat before Start, as most do)
+    int pulseCount = -24;
+    ulong pulseAt = clockAt - lround(24 * pulse);
+    ulong end = 200 + (ulong)(clockAt + step * (STEPS + 0.5));
+    for (ulong now = 0; now < end; now++) {
+        if (now == clockAt + 10) { // (into the first step)
+            static const uint8_t chord[] = { 0x90, 60, 100, 64, 100, 67, 100 };
+            Serial1.received.insert(Serial1.received.end(), chord, chord + sizeof(chord));
+        }
+        if (source != SOURCE_INTERNAL && now >= pulseAt) {
+            if (pulseCount == 0) Serial2.received.push_back(0xfa); // Start
+            Serial2.received.push_back(0xf8);
+            pulseCount++;
+            pulseAt = clockAt + lround(pulseCount * pulse) +
+                (source == SOURCE_JITTERY_CLOCK ? randomJitter() : 0);
+        }
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+        out.read(Serial1.sent, now);
+    }
+
+    // (the first note plays as the keys are pressed, late for its
+    // step, so it's left out: the grid is checked from the next one.
+    // A note ends after the gate length, or as the next one starts.)
+    double onAt[128], nextOnAt[128];
+    for (int note = 0; note < 128; note++) onAt[note] = -1;
+    int noteOns = 0;
+    for (size_t i = 0; i < out.messages.size(); i++) {
+        MidiMonitor::Message& message = out.messages[i];
+        int type = message.status & 0xf0;
+        if (type == 0x90) {
+            if (start < 0) start = message.time;
+            long n = nearestStep(message.time, start, step, swing, groove);
+            double due = grooveStepAt(start, step, swing, groove, n);
+            if (noteOns++ == 0) continue;
+            on.record(lround(message.time - due));
+            errors.total += labs(lround(message.time - due));
+            errors.count++;
+            onAt[message.data1] = due;
+            nextOnAt[message.data1] = grooveStepAt(start, step, swing, groove, n + 1);
+        }
+        else if (type == 0x80 && onAt[message.data1] >= 0) {
+            double offAt = fmin(onAt[message.data1] + gateLength, nextOnAt[message.data1]);
+            long error = lround(message.time - offAt);
+            off.record(error);
+            errors.total += labs(error);
+            errors.count++;
+        }
+    }
+    return noteOns;
+}
+
+static void sweep(int source, const char* name, int meanLimit, int p99Limit, int maxLimit)
+{
+    static const int tempos[] = { 30, 47, 60, 90, 120, 150, 173, 199, 210, 240, 277, 300 };
+    static const int clockTempos[] = { 60, 97, 120, 180 };
+    static const int gates[] = { 0, 25, 50, 99, 100 };
+    char onName[40], offName[40];
+    snprintf(onName, sizeof(onName), "%s-on", name);
+    snprintf(offName, sizeof(offName), "%s-off", name);
+    TimingStats on(onName, p99Limit, maxLimit, maxLimit);
+    TimingStats off(offName, p99Limit, maxLimit, maxLimit);
+    Errors errors = {};
+    int n = 0;
+    for (int tempo : tempos) {
+        for (int gate : gates) {
+            // (modes and ranges taken in turn)
+            int clockTempo = clockTempos[n % 4];
+            int noteOns = play(source, tempo, clockTempo, gate, n % ArpEngine::MODE_COUNT,
+                n % (ArpEngine::MAX_RANGE + 1), ArpEngine::MIN_SWING, ArpEngine::GROOVE_STRAIGHT, on, off, errors);
+            n++;
+            // (and it did play)
+            char text[100];
+            snprintf(text, sizeof(text), "tempo %d, clock %d, gate %d: %d notes", tempo, clockTempo, gate, noteOns);
+            TEST_ASSERT_GREATER_OR_EQUAL_MESSAGE(STEPS - 1, noteOns, text);
+        }
+    }
+    on.print(Serial);
+    off.print(Serial);
+    TEST_ASSERT_TRUE_MESSAGE(on.isWithinLimits(), "note-on timing over the limits");
+    TEST_ASSERT_TRUE_MESSAGE(off.isWithinLimits(), "note-off timing over the limits");
+    TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(meanLimit * errors.count, errors.total, "mean timing error over the limit");
+}
+
+// Swing and each groove template, with the internal tempo or a steady
+// clock: every step should be at its offset, to the limits above
+static void sweepGroove(int source, const char* name, int meanLimit, int p99Limit, int maxLimit)
+{
+    static const int tempos[] = { 60, 120, 199, 300 };
+    static const int swings[] = { 50, 58, 66, 75 };
+    char onName[40], offName[40];
+    snprintf(onName, sizeof(onName), "%s-on", name);
+    snprintf(offName, sizeof(offName), "%s-off", name);
+    TimingStats on(onName, p99Limit, maxLimit, maxLimit);
+    TimingStats off(offName, p99Limit, maxLimit, maxLimit);
+    Errors errors = {};
+    for (int tempo : tempos) {
+        for (int swing : swings) {
+            for (int groove = 0; groove < ArpEngine::GROOVE_COUNT; groove++) {
+                int noteOns = play(source, tempo, 120, 50, ArpEngine::MODE_UP, 1, swing, groove, on, off, errors);
+                char text[100];
+                snprintf(text, sizeof(text), "tempo %d, swing %d, groove %d: %d notes", tempo, swing, groove, noteOns);
+                TEST_ASSERT_GREATER_OR_EQUAL_MESSAGE(STEPS - 1, noteOns, text);
+            }
+        }
+    }
+    on.print(Serial);
+    off.print(Serial);
+    TEST_ASSERT_TRUE_MESSAGE(on.isWithinLimits(), "swung note-on timing over the limits");
+    TEST_ASSERT_TRUE_MESSAGE(off.isWithinLimits(), "swung note-off timing over the limits");
+    TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(meanLimit * errors.count, errors.total, "mean timing error over the limit");
+}
+
+void setUp()
+{
+    seed = 1;
+}
+
+void tearDown() {}
+
+void test_internal_tempo()
+{
+    sweep(SOURCE_INTERNAL, "internal", INTERNAL_MEAN_MS, INTERNAL_P99_MS, INTERNAL_MAX_MS);
+}
+
+void test_midi_clock()
+{
+    sweep(SOURCE_CLOCK, "clock", CLOCK_MEAN_MS, CLOCK_P99_MS, CLOCK_MAX_MS);
+}
+
+void test_jittery_midi_clock()
+{
+    sweep(SOURCE_JITTERY_CLOCK, "jittery-clock", JITTER_MEAN_MS, JITTER_P99_MS, JITTER_MAX_MS);
+}
+
+void test_groove_internal_tempo()
+{
+    sweepGroove(SOURCE_INTERNAL, "groove-internal", INTERNAL_MEAN_MS, INTERNAL_P99_MS, INTERNAL_MAX_MS);
+}
+
+void test_groove_midi_clock()
+{
+    sweepGroove(SOURCE_CLOCK, "groove-clock", CLOCK_MEAN_MS, CLOCK_P99_MS, CLOCK_MAX_MS);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_internal_tempo);
+    RUN_TEST(test_midi_clock);
+    RUN_TEST(test_jittery_midi_clock);
+    RUN_TEST(test_groove_internal_tempo);
+    RUN_TEST(test_groove_midi_clock);
+    return UNITY_END();
+}
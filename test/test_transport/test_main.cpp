@@ -0,0 +1,236 @@
+// Transport: a simulated host (DAW) sending MIDI clock, Start,
+// Stop, Continue and Song Position Pointer to the sync port, as
+// when it's played, stopped and located. The arpeggio (on a 1/8
+// note grid) should stop at once on Stop, and play on the host's
+// grid after a locate or Continue, on the same pulses as the host.
+
+#include <map>
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "MidiMonitor.h"
+#include "ArpEngine.h"
+
+static const ulong PULSE_MS = 20; // (125 BPM)
+static const int TEMPO_EIGHTHS = 140; // (in MIDI sync mode: 1/8 notes)
+static const ulong STEP_PULSES = 12;
+
+// The host: clock pulses (sent also while stopped, as many do),
+// each standing for its song position while playing
+struct Host
+{
+    bool playing = false;
+    ulong position = 0; // (pulse) of the next clock pulse
+    ulong nextPulseAt = 0;
+    std::map<ulong, ulong> positions; // time -> position, of the pulses while playing
+
+    void start()
+    {
+        Serial2.received.push_back(0xfa);
+        position = 0;
+        playing = true;
+    }
+
+    void stop()
+    {
+        Serial2.received.push_back(0xfc);
+        playing = false;
+    }
+
+    void resume()
+    {
+        Serial2.received.push_back(0xfb);
+        playing = true;
+    }
+
+    void locate(ulong midiBeats) // (16th notes)
+    {
+        Serial2.received.push_back(0xf2);
+        Serial2.received.push_back(midiBeats & 0x7f);
+        Serial2.received.push_back(midiBeats >> 7);
+        position = midiBeats * 6;
+    }
+
+    void run(ulong now)
+    {
+        if (now < nextPulseAt) return;
+        Serial2.received.push_back(0xf8);
+        if (playing) positions[now] = position++;
+        nextPulseAt += PULSE_MS;
+    }
+};
+
+static Host host;
+static MidiMonitor out;
+static ulong now;
+
+void setUp(void)
+{
+    Serial1.received.clear();
+    Serial1.sent.clear();
+    Serial2.received.clear();
+    host = Host();
+    out = MidiMonitor();
+    out.keep = true;
+    now = 0;
+}
+
+void tearDown(void) {}
+
+static void runUntil(ArpEngine& engine, ulong end)
+{
+    for (; now < end; now++) {
+        host.run(now);
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+        out.read(Serial1.sent, now);
+    }
+}
+
+static void startArpeggio(ArpEngine& engine)
+{
+    engine.SetMidiSync(true);
+    engine.SetTempo(TEMPO_EIGHTHS);
+    engine.SetGate(100);
+    engine.SetEnabled(true);
+    static const uint8_t chord[] = { 0x90, 60, 100, 64, 100, 67, 100 };
+    Serial1.received.insert(Serial1.received.end(), chord, chord + sizeof(chord));
+}
+
+// The note-ons sent since the message index from, in time order
+static std::vector<MidiMonitor::Message> noteOnsFrom(size_t from)
+{
+    std::vector<MidiMonitor::Message> noteOns;
+    for (size_t i = from; i < out.messages.size(); i++) {
+        if ((out.messages[i].status & 0xf0) == 0x90) noteOns.push_back(out.messages[i]);
+    }
+    return noteOns;
+}
+
+// Returns the number of note-ons since from that weren't sent on a
+// step's pulse (at the time the host sent it)
+static int offGridCount(size_t from)
+{
+    int count = 0;
+    std::vector<MidiMonitor::Message> noteOns = noteOnsFrom(from);
+    for (size_t i = 0; i < noteOns.size(); i++) {
+        std::map<ulong, ulong>::iterator pulse = host.positions.find(noteOns[i].time);
+        if (pulse == host.positions.end() || pulse->second % STEP_PULSES != 0) count++;
+    }
+    return count;
+}
+
+// Returns the song position (pulse) of the first note-on since from
+static long firstNotePosition(size_t from)
+{
+    std::vector<MidiMonitor::Message> noteOns = noteOnsFrom(from);
+    if (noteOns.empty()) return -1;
+    std::map<ulong, ulong>::iterator pulse = host.positions.find(noteOns[0].time);
+    return pulse == host.positions.end() ? -1 : (long)pulse->second;
+}
+
+void test_start_plays_on_the_grid(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startArpeggio(engine);
+    runUntil(engine, 100);
+    size_t startedAt = out.messages.size();
+    host.start();
+    runUntil(engine, 2000);
+    TEST_ASSERT_GREATER_THAN(6, (int)noteOnsFrom(startedAt).size());
+    TEST_ASSERT_EQUAL(0, firstNotePosition(startedAt));
+    TEST_ASSERT_EQUAL(0, offGridCount(startedAt));
+}
+
+void test_stop_ends_notes_and_holds(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startArpeggio(engine);
+    runUntil(engine, 100);
+    host.start();
+    runUntil(engine, 1010); // (into a step, its note sounding)
+    TEST_ASSERT_EQUAL(1, out.soundingCount());
+
+    host.stop();
+    runUntil(engine, now + 1);
+    TEST_ASSERT_EQUAL(0, out.soundingCount());
+    size_t stoppedAt = out.messages.size();
+    runUntil(engine, now + 1000); // (clock still running)
+    TEST_ASSERT_EQUAL(0, (int)noteOnsFrom(stoppedAt).size());
+}
+
+void test_continue_resumes_from_the_position(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startArpeggio(engine);
+    runUntil(engine, 100);
+    host.start();
+    runUntil(engine, 1010); // (stopped between steps: the next pulse is 46)
+    host.stop();
+    runUntil(engine, 1500);
+
+    size_t resumedAt = out.messages.size();
+    host.resume();
+    runUntil(engine, 3000);
+    TEST_ASSERT_GREATER_THAN(6, (int)noteOnsFrom(resumedAt).size());
+    TEST_ASSERT_EQUAL(48, firstNotePosition(resumedAt)); // (the next step, none repeated)
+    TEST_ASSERT_EQUAL(0, offGridCount(resumedAt));
+}
+
+void test_locate_while_stopped(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startArpeggio(engine);
+    runUntil(engine, 100);
+    host.start();
+    runUntil(engine, 1000);
+    host.stop();
+    runUntil(engine, 1200);
+
+    size_t locatedAt = out.messages.size();
+    host.locate(3); // (pulse 18: between steps)
+    runUntil(engine, 1300);
+    host.resume();
+    runUntil(engine, 3000);
+    TEST_ASSERT_EQUAL(24, firstNotePosition(locatedAt));
+    TEST_ASSERT_EQUAL(0, offGridCount(locatedAt));
+
+    // and back to the top
+    host.stop();
+    runUntil(engine, 3200);
+    locatedAt = out.messages.size();
+    host.locate(0);
+    host.resume();
+    runUntil(engine, 4000);
+    TEST_ASSERT_EQUAL(0, firstNotePosition(locatedAt));
+    TEST_ASSERT_EQUAL(0, offGridCount(locatedAt));
+}
+
+void test_locate_while_playing(void)
+{
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    startArpeggio(engine);
+    runUntil(engine, 100);
+    host.start();
+    runUntil(engine, 1010);
+    TEST_ASSERT_EQUAL(1, out.soundingCount());
+
+    size_t locatedAt = out.messages.size();
+    host.locate(33); // (pulse 198: between steps)
+    runUntil(engine, now + 1);
+    TEST_ASSERT_EQUAL(0, out.soundingCount()); // (the sounding note ended)
+    runUntil(engine, 3000);
+    TEST_ASSERT_EQUAL(204, firstNotePosition(locatedAt));
+    TEST_ASSERT_EQUAL(0, offGridCount(locatedAt));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_start_plays_on_the_grid);
+    RUN_TEST(test_stop_ends_notes_and_holds);
+    RUN_TEST(test_continue_resumes_from_the_position);
+    RUN_TEST(test_locate_while_stopped);
+    RUN_TEST(test_locate_while_playing);
+    return UNITY_END();
+}
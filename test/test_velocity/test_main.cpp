@@ -0,0 +1,259 @@
+// Velocity: the distribution of the velocities (and, humanized, the
+// timing) of the notes played from random input velocities, through
+// each curve, shape, accent pattern and groove. The mean and spread
+// should move as the curve or template says, and no note should fall
+// outside the curve's range or the template's limits. The figures are
+// printed as "velocity,<case>,<notes>,<mean>,<spread>,<min>,<max>"
+// lines.
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include <unity.h>
+#include <Arduino.h>
+#include "Mock.h"
+#include "MidiMonitor.h"
+#include "ArpEngine.h"
+
+static const ulong STEP_MS = 125; // (120 BPM, 1/16 notes)
+static const int CHORD[] = { 60, 64, 67 };
+static const int CHORD_NOTES = 3;
+
+static MidiMonitor out;
+static ulong now;
+static uint32_t seed;
+
+static int randomVelocity()
+{
+    seed = seed * 1664525 + 1013904223;
+    return 1 + (seed >> 8) % 127;
+}
+
+void setUp(void)
+{
+    Serial1.received.clear();
+    Serial1.sent.clear();
+    Serial2.received.clear();
+    out = MidiMonitor();
+    out.keep = true;
+    now = 0;
+    seed = 1;
+}
+
+void tearDown(void) {}
+
+static void runUntil(ArpEngine& engine, ulong end)
+{
+    for (; now < end; now++) {
+        mockSetMicros(now * 1000ULL);
+        engine.Run(now);
+        out.read(Serial1.sent, now);
+    }
+}
+
+struct Distribution
+{
+    int count = 0;
+    double mean = 0;
+    double spread = 0; // (standard deviation)
+    long min = 0;
+    long max = 0;
+};
+
+static Distribution distributionOf(const std::vector<long>& values, const char* name)
+{
+    Distribution distribution;
+    distribution.count = values.size();
+    if (values.empty()) return distribution;
+    double sum = 0, squares = 0;
+    for (long value : values) sum += value;
+    distribution.mean = sum / values.size();
+    for (long value : values) squares += (value - distribution.mean) * (value - distribution.mean);
+    distribution.spread = sqrt(squares / values.size());
+    distribution.min = *std::min_element(values.begin(), values.end());
+    distribution.max = *std::max_element(values.begin(), values.end());
+    printf("velocity,%s,%d,%.2f,%.2f,%ld,%ld\n", name, distribution.count,
+        distribution.mean, distribution.spread, distribution.min, distribution.max);
+    return distribution;
+}
+
+static void sendNote(int status, int note, int velocity)
+{
+    Serial1.received.push_back(status);
+    Serial1.received.push_back(note);
+    Serial1.received.push_back(velocity);
+}
+
+// Plays chords of random velocities, each held for a cycle of the
+// arpeggio, and returns the velocities played (as pairs: in, out)
+static std::vector<std::pair<long, long>> playRandomChords(ArpEngine& engine, int chords)
+{
+    std::vector<std::pair<long, long>> played;
+    engine.SetTempo(120);
+    engine.SetEnabled(true);
+    for (int chord = 0; chord < chords; chord++) {
+        int velocities[128] = {};
+        for (int i = 0; i < CHORD_NOTES; i++) {
+            velocities[CHORD[i]] = randomVelocity();
+            sendNote(0x90, CHORD[i], velocities[CHORD[i]]);
+        }
+        size_t from = out.messages.size();
+        runUntil(engine, now + CHORD_NOTES * STEP_MS);
+        for (int i = 0; i < CHORD_NOTES; i++) sendNote(0x80, CHORD[i], 0);
+        runUntil(engine, now + 10);
+        for (size_t i = from; i < out.messages.size(); i++) {
+            MidiMonitor::Message& message = out.messages[i];
+            if ((message.status & 0xf0) != 0x90) continue;
+            TEST_ASSERT_NOT_EQUAL(0, velocities[message.data1]);
+            played.push_back(std::make_pair((long)velocities[message.data1], (long)message.data2));
+        }
+    }
+    return played;
+}
+
+// Plays a chord (velocity 100) for the specified number of steps, and
+// returns the note-ons
+static std::vector<MidiMonitor::Message> playChord(ArpEngine& engine, int steps)
+{
+    engine.SetTempo(120);
+    engine.SetEnabled(true);
+    for (int i = 0; i < CHORD_NOTES; i++) sendNote(0x90, CHORD[i], 100);
+    size_t from = out.messages.size();
+    runUntil(engine, now + steps * STEP_MS);
+    std::vector<MidiMonitor::Message> noteOns;
+    for (size_t i = from; i < out.messages.size(); i++) {
+        if ((out.messages[i].status & 0xf0) == 0x90) noteOns.push_back(out.messages[i]);
+    }
+    TEST_ASSERT_EQUAL(steps, (int)noteOns.size());
+    return noteOns;
+}
+
+static std::vector<long> velocitiesOf(const std::vector<MidiMonitor::Message>& noteOns)
+{
+    std::vector<long> velocities;
+    for (const MidiMonitor::Message& noteOn : noteOns) velocities.push_back(noteOn.data2);
+    return velocities;
+}
+
+// Each curve maps every input velocity as its formula says: soft
+// raises the mean and narrows the spread, hard lowers the mean, fixed
+// leaves no spread at all
+void test_curves(void)
+{
+    static const char* names[ArpEngine::VEL_CURVE_COUNT] = { "linear", "soft", "hard", "fixed" };
+    Distribution distributions[ArpEngine::VEL_CURVE_COUNT];
+    for (int curve = 0; curve < ArpEngine::VEL_CURVE_COUNT; curve++) {
+        setUp();
+        ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+        engine.SetVelocityCurve(curve, 90);
+        std::vector<std::pair<long, long>> played = playRandomChords(engine, 100);
+        std::vector<long> velocities;
+        for (const std::pair<long, long>& note : played) {
+            long in = note.first, expected;
+            switch (curve) {
+                case ArpEngine::VEL_CURVE_SOFT: expected = lround(sqrt(in * 127.0)); break;
+                case ArpEngine::VEL_CURVE_HARD: expected = std::max((in * in + 63) / 127, 1L); break;
+                case ArpEngine::VEL_CURVE_FIXED: expected = 90; break;
+                default: expected = in; break;
+            }
+            TEST_ASSERT_EQUAL(expected, note.second);
+            velocities.push_back(note.second);
+        }
+        distributions[curve] = distributionOf(velocities, names[curve]);
+        TEST_ASSERT_GREATER_OR_EQUAL(100 * CHORD_NOTES, distributions[curve].count);
+        TEST_ASSERT_TRUE(distributions[curve].min >= 1 && distributions[curve].max <= 127);
+    }
+    Distribution& linear = distributions[ArpEngine::VEL_CURVE_LINEAR];
+    TEST_ASSERT_TRUE(distributions[ArpEngine::VEL_CURVE_SOFT].mean > linear.mean + 10);
+    TEST_ASSERT_TRUE(distributions[ArpEngine::VEL_CURVE_SOFT].spread < linear.spread);
+    TEST_ASSERT_TRUE(distributions[ArpEngine::VEL_CURVE_HARD].mean < linear.mean - 10);
+    TEST_ASSERT_EQUAL(90, distributions[ArpEngine::VEL_CURVE_FIXED].min);
+    TEST_ASSERT_EQUAL(90, distributions[ArpEngine::VEL_CURVE_FIXED].max);
+}
+
+// Over a cycle of the arpeggio (three notes, four octaves: 12 steps),
+// decay takes velocity off step by step, towards the depth, and ramp
+// adds it back; each cycle starts over
+void test_shapes(void)
+{
+    static const int DEPTH = 50;
+    static const int CYCLE = CHORD_NOTES * 4;
+    for (int shape = ArpEngine::VEL_SHAPE_DECAY; shape <= ArpEngine::VEL_SHAPE_RAMP; shape++) {
+        setUp();
+        ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+        engine.SetRange(3);
+        engine.SetVelocityShape(shape, DEPTH);
+        std::vector<long> velocities = velocitiesOf(playChord(engine, 3 * CYCLE));
+        Distribution distribution = distributionOf(velocities, shape == ArpEngine::VEL_SHAPE_DECAY ? "decay" : "ramp");
+        long lowest = 100 * (128 - 128 * DEPTH / 100) / 128;
+        TEST_ASSERT_TRUE(distribution.min >= lowest && distribution.max <= 100);
+        for (int step = 0; step < (int)velocities.size(); step++) {
+            int inCycle = step % CYCLE;
+            if (inCycle == 0) {
+                // (ramp starts from its lowest, decay from the top)
+                TEST_ASSERT_EQUAL(shape == ArpEngine::VEL_SHAPE_DECAY ? 100 : lowest, velocities[step]);
+                continue;
+            }
+            if (shape == ArpEngine::VEL_SHAPE_DECAY) TEST_ASSERT_TRUE(velocities[step] < velocities[step - 1]);
+            else TEST_ASSERT_TRUE(velocities[step] > velocities[step - 1]);
+        }
+    }
+}
+
+// Accents add their amount on their steps of the 16-step cycle, and
+// nothing on the others
+void test_accents(void)
+{
+    static const uint16_t patterns[] = { 0x0000, 0x1111, 0x4444, 0x4949 }; // (as in UpdateGroove)
+    static const char* names[] = { "accent-none", "accent-beats", "accent-offbeats", "accent-clave" };
+    for (int accent = 0; accent < ArpEngine::ACCENT_COUNT; accent++) {
+        setUp();
+        ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+        engine.SetVelocityCurve(ArpEngine::VEL_CURVE_FIXED, 80);
+        engine.SetAccent(accent, 30);
+        std::vector<long> velocities = velocitiesOf(playChord(engine, 64));
+        Distribution distribution = distributionOf(velocities, names[accent]);
+        int accented = 0;
+        for (int step = 0; step < (int)velocities.size(); step++) {
+            bool accentStep = (patterns[accent] >> (step % ArpEngine::GROOVE_STEPS)) & 1;
+            TEST_ASSERT_EQUAL(accentStep ? 110 : 80, velocities[step]);
+            if (accentStep) accented++;
+        }
+        TEST_ASSERT_INT_WITHIN(1, 80 * 100 + 30 * 100 * accented / 64, (long)lround(distribution.mean * 100));
+    }
+}
+
+// Humanized, velocities and step times wander a little around the
+// base velocity and the grid, by at most the template's offsets, and
+// hardly move on average
+void test_humanize(void)
+{
+    static const int STEPS = 160;
+    ArpEngine engine(&Serial1, &Serial1, &Serial2, NULL);
+    engine.SetVelocityCurve(ArpEngine::VEL_CURVE_FIXED, 80);
+    engine.SetGroove(ArpEngine::GROOVE_HUMANIZE);
+    std::vector<MidiMonitor::Message> noteOns = playChord(engine, STEPS);
+    std::vector<long> velocities = velocitiesOf(noteOns), offsets;
+    for (int step = 0; step < STEPS; step++) {
+        offsets.push_back((long)(noteOns[step].time - (noteOns[0].time + step * STEP_MS)));
+    }
+    Distribution velocity = distributionOf(velocities, "humanize");
+    Distribution timing = distributionOf(offsets, "humanize-ms");
+    TEST_ASSERT_TRUE(velocity.min >= 80 - 8 && velocity.max <= 80 + 8); // (the template's limits)
+    TEST_ASSERT_TRUE(fabs(velocity.mean - 80) < 1);
+    TEST_ASSERT_TRUE(velocity.spread > 2);
+    TEST_ASSERT_TRUE(timing.min >= -(long)STEP_MS * 4 / 100 && timing.max <= (long)STEP_MS * 4 / 100);
+    TEST_ASSERT_TRUE(fabs(timing.mean) < 1);
+    TEST_ASSERT_TRUE(timing.spread > 1);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_curves);
+    RUN_TEST(test_shapes);
+    RUN_TEST(test_accents);
+    RUN_TEST(test_humanize);
+    return UNITY_END();
+}